@@ -1,57 +1,683 @@
 #include "Buffer.h"
 
+#include <algorithm>
+#include <cstring>
+#include <limits>
 #include <memory>
+#include <thread>
+#include <tuple>
 #include <QtCore/QFile>
 #include <QtCore/QFileInfo>
+#include <QtCore/QSaveFile>
 #include <QtCore/QStringBuilder>
+#include <QtCore/QTextCodec>
+
+#ifdef Q_OS_UNIX
+#include <cerrno>
+#include <unistd.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <sys/sendfile.h>
+#endif
+
+#include "MappedFile.h"
+#include "Util/Simd.h"
+#include "Util/Utf8.h"
 
 namespace Med {
 namespace Editor {
 
-class Point::LineIteratorImpl : public LineIterator::Impl {
+namespace {
+
+// The size of the blocks initFromUtf8File() reads per thread, which grow if a line doesn't fit.
+constexpr std::size_t readBlockSize = 1 << 20;
+constexpr std::size_t parallelReadBlockSize = 4 << 20;
+// Inputs are split into chunks of at least this size, since a thread for less would cost more than it saves.
+constexpr std::size_t minChunkSize = 1 << 20;
+
+int resolveThreadCount(int threadCount) {
+  return threadCount > 0 ? threadCount : std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Calls function(index) for every index below count, each on its own thread; the first one runs on the calling thread.
+template<typename Function>
+void forEachInParallel(std::size_t count, const Function& function) {
+  std::vector<std::thread> threads;
+  for (std::size_t index = 1; index < count; ++index) threads.emplace_back(std::cref(function), index);
+  if (count > 0) function(0);
+  for (std::thread& thread : threads) thread.join();
+}
+
+// Decodes the UTF-8 in [start, end) straight into the storage of the returned string.
+QString decodeUtf8(const char* start, const char* end) {
+  const int length = Util::Utf8::utf16Length(start, end);
+  // Invalid text is left to Qt, which replaces what it can't decode.
+  if (length < 0) return QString::fromUtf8(start, end - start);
+  QString content;
+  content.resize(length);
+  Util::Utf8::decode(start, end, reinterpret_cast<char16_t*>(content.data()));
+  return content;
+}
+
+// The IANA MIB enum of UTF-8, as QTextCodec::mibEnum() returns it.
+constexpr int utf8Mib = 106;
+
+std::size_t countLines(const char* start, const char* end) {
+  return Util::Simd::countByte(start, end, '\n') + (start != end && end[-1] != '\n' ? 1 : 0);
+}
+
+bool startsWithUtf8ByteOrderMark(const char* start, const char* end) {
+  return end - start >= 3 && std::memcmp(start, "\xEF\xBB\xBF", 3) == 0;
+}
+
+// UTF-16 and UTF-32 byte order marks start with one of these.
+bool startsWithWideByteOrderMark(const char* start, const char* end) {
+  return end - start >= 2 && (std::memcmp(start, "\xFF\xFE", 2) == 0 || std::memcmp(start, "\xFE\xFF", 2) == 0 || std::memcmp(start, "\0\0", 2) == 0);
+}
+
+// How often, in characters, BufferSnapshot::save() reports its progress.
+constexpr int64_t progressInterval = 1 << 20;
+
+// Writes a new file in batches of about batchSize bytes. Ranges of mapped files are copied by the system from file to file where it can, so that unchanged text never passes through the process.
+class BatchWriter {
 public:
-  LineIteratorImpl(const Point& from) : line_(from.bufferLine_) {}
+  BatchWriter(QSaveFile* file, const std::string& filePath) : file_(file), filePath_(filePath) { batch_.reserve(batchSize); }
+
+  void write(const char* start, std::size_t size) {
+    if (batch_.size() + size > batchSize) flush();
+    if (size >= batchSize) {
+      writeOut(start, size);
+    } else {
+      batch_.append(start, size);
+    }
+  }
+  void write(const QString& text) {
+    const QByteArray encoded = text.toUtf8();
+    write(encoded.constData(), encoded.size());
+  }
+  void writeLatin1(const QByteArray& text) {
+    // ASCII is the same in UTF-8.
+    if (Util::Simd::asciiLength(text.constData(), text.constData() + text.size()) == std::size_t(text.size())) {
+      write(text.constData(), text.size());
+    } else {
+      write(QString::fromLatin1(text.constData(), text.size()));
+    }
+  }
+
+  // Writes the size bytes at start, which are in the given mapped file.
+  void copy(const MappedFile& file, const char* start, std::size_t size) {
+    // A system call per range would cost more than copying short ones.
+    if (size < minCopySize) {
+      write(start, size);
+      return;
+    }
+    flush();
+#ifdef Q_OS_LINUX
+    off_t offset = start - file.data();
+    // copy_file_range() works within a file system, and may share the blocks instead of copying them; sendfile() copies between any files. Either may be unsupported, and then the rest is written from the map.
+    while (size > 0 && copyFileRange_) {
+      const ssize_t copied = copy_file_range(file.handle(), &offset, file_->handle(), nullptr, size, 0);
+      if (copied < 0 && errno == EINTR) continue;
+      if (copied <= 0) copyFileRange_ = false;
+      else size -= copied;
+    }
+    while (size > 0 && sendFile_) {
+      const ssize_t copied = sendfile(file_->handle(), file.handle(), &offset, size);
+      if (copied < 0 && errno == EINTR) continue;
+      if (copied <= 0) sendFile_ = false;
+      else size -= copied;
+    }
+    start = file.data() + offset;
+#else
+    Q_UNUSED(file);
+#endif
+    if (size > 0) writeOut(start, size);
+  }
+
+  void flush() {
+    writeOut(batch_.data(), batch_.size());
+    batch_.clear();
+  }
 
-  const QString* get() const override { return &line_->value.content; }
+private:
+  static constexpr std::size_t batchSize = 1 << 20;
+  static constexpr std::size_t minCopySize = 64 << 10;
 
-  bool advance() override {
-    line_ = line_->adjacent(Util::DRBTreeDefs::Side::RIGHT);
-    return line_;
+  void writeOut(const char* start, std::size_t size) {
+#ifdef Q_OS_UNIX
+    // Straight to the descriptor, as the system copies move its position behind QFile's back.
+    while (size > 0) {
+      const ssize_t written = ::write(file_->handle(), start, size);
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) throw IOException("Failed to write file " + filePath_ + ".");
+      start += written;
+      size -= written;
+    }
+#else
+    if (size > 0 && file_->write(start, size) != qint64(size)) throw IOException("Failed to write file " + filePath_ + ".");
+#endif
   }
 
-  Buffer::Tree::Node* line_;
+  QSaveFile* file_;
+  const std::string& filePath_;
+  std::string batch_;
+#ifdef Q_OS_LINUX
+  bool copyFileRange_ = true;
+  bool sendFile_ = true;
+#endif
 };
 
+}  // namespace
+
 Buffer::Buffer() {}
 Buffer::~Buffer() {}
 
+const char* Buffer::findLineEnd(const char* start, const char* end, const char** next) {
+  const char* lineEnd = Util::Simd::findByte(start, end, '\n');
+  *next = lineEnd == end ? end : lineEnd + 1;
+  // As QTextStream, "\r\n" ends a line too.
+  if (lineEnd != start && lineEnd[-1] == '\r') --lineEnd;
+  return lineEnd;
+}
+
+const char* Buffer::skipUtf8ByteOrderMark(const char* start, const char* end) {
+  // As QTextStream does, a UTF-8 byte order mark isn't part of the content.
+  return startsWithUtf8ByteOrderMark(start, end) ? start + 3 : start;
+}
+
+bool Buffer::canReadAsUtf8(QFile* file) {
+  // QTextStream would otherwise also assume UTF-8 for files without a byte order mark on most systems.
+  const QByteArray start = file->peek(4);
+  return QTextCodec::codecForLocale()->mibEnum() == utf8Mib && !startsWithWideByteOrderMark(start.constData(), start.constData() + start.size());
+}
+
+bool Buffer::canMap(const MappedFile& file) {
+  return !startsWithWideByteOrderMark(file.data(), file.data() + file.size());
+}
+
+void Buffer::makeDecodedLine(Line* line, LineStart* delta, const char* start, const char* end) {
+  setUtf8Content(line, start, end);
+  *delta = {1, length(*line) + 1};
+}
+
+void Buffer::makeMappedLine(Line* line, LineStart* delta, const char* start, const char* end) {
+  const int length = Util::Utf8::utf16Length(start, end);
+  if (length >= 0) {
+    line->mapped = start;
+    line->mappedSize = end - start;
+    *delta = {1, length + 1};
+  } else {
+    // Invalid text is decoded right away, so that the line's length is that of the decoded content.
+    setContent(line, QString::fromUtf8(start, end - start));
+    *delta = {1, Buffer::length(*line) + 1};
+  }
+}
+
+void Buffer::readUtf8Blocks(QFile* file, std::size_t blockSize, const std::function<bool(const char*, const char*)>& takeLines) {
+  // The block holds the start of a line left over from the previous read, followed by what is read next.
+  std::vector<char> block(blockSize);
+  std::size_t leftOver = 0;
+  bool atStart = true;
+  while (true) {
+    if (leftOver == block.size()) block.resize(2 * block.size());
+    const qint64 read = file->read(block.data() + leftOver, block.size() - leftOver);
+    if (read < 0) throw IOException("Failed to read file " + file->fileName().toStdString() + ".");
+    const bool atEnd = read == 0;
+    const char* start = block.data();
+    const char* const end = start + leftOver + read;
+    if (atStart) start = skipUtf8ByteOrderMark(start, end);
+    atStart = false;
+    // The last line in the block may continue in the next one, unless the file has ended.
+    const char* linesEnd = end;
+    if (!atEnd) {
+      while (linesEnd != start && linesEnd[-1] != '\n') --linesEnd;
+    }
+    if (!takeLines(start, linesEnd) || atEnd) return;
+    leftOver = end - linesEnd;
+    std::memmove(block.data(), linesEnd, leftOver);
+  }
+}
+
 void Buffer::initFromStream(QTextStream* stream, const QString& name) {
+  // The lines are read in order, so instead of attaching them one by one we build the tree from all of them at once.
+  std::vector<Tree::Node*> lines;
   while (true) {
-    QString line = stream->readLine();
-    if (line.isNull()) break;
-    insertLast()->node->value.content = std::move(line);
+    QString content = stream->readLine();
+    if (content.isNull()) break;
+    Tree::Node* line = Tree::newNode();
+    line->delta = {1, content.size() + 1};
+    setContent(&line->value, std::move(content));
+    lines.push_back(line);
+  }
+  // The first line number is 1.
+  tree_.buildFrom(lines.begin(), lines.end(), {1, 0});
+  snapshotLines_.buildFrom(lines.begin(), lines.end(), [](Tree::Node* line) { return std::make_pair(SnapshotLine::of(line->value), line->delta); });
+  name_ = name;
+}
+
+template<typename MakeLine>
+void Buffer::makeLines(const char* start, const char* end, int threadCount, std::vector<Tree::Node*>* lines, const MakeLine& makeLine) {
+  // One chunk per thread, each starting at a line start.
+  const std::size_t chunkCount = std::max<std::size_t>(1, std::min<std::size_t>(threadCount, (end - start) / minChunkSize));
+  std::vector<const char*> chunkStarts{start};
+  for (std::size_t chunk = 1; chunk < chunkCount; ++chunk) {
+    const char* const lineBreak = Util::Simd::findByte(std::max(chunkStarts.back(), start + (end - start) / chunkCount * chunk), end, '\n');
+    chunkStarts.push_back(lineBreak == end ? end : lineBreak + 1);
+  }
+  chunkStarts.push_back(end);
+  if (chunkCount == 1) {
+    // A single thread can create the nodes as it goes, without counting the lines first.
+    for (const char* lineStart = start; lineStart != end;) {
+      const char* next;
+      const char* const lineEnd = findLineEnd(lineStart, end, &next);
+      Tree::Node* const line = Tree::newNode();
+      makeLine(&line->value, &line->delta, lineStart, lineEnd);
+      lines->push_back(line);
+      lineStart = next;
+    }
+    return;
   }
+  // The threads first count the lines of their chunks, so that the nodes can be created here: the pool they come from isn't thread-safe.
+  std::vector<std::size_t> lineCounts(chunkCount);
+  forEachInParallel(chunkCount, [&](std::size_t chunk) { lineCounts[chunk] = countLines(chunkStarts[chunk], chunkStarts[chunk + 1]); });
+  std::vector<std::size_t> firstLines{lines->size()};
+  for (std::size_t lineCount : lineCounts) firstLines.push_back(firstLines.back() + lineCount);
+  while (lines->size() < firstLines.back()) lines->push_back(Tree::newNode());
+  // Then each one makes the lines of its chunk. The nodes are only linked into a tree afterwards, so their deltas are independent of each other.
+  forEachInParallel(chunkCount, [&](std::size_t chunk) {
+    Tree::Node* const* line = lines->data() + firstLines[chunk];
+    for (const char* lineStart = chunkStarts[chunk]; lineStart != chunkStarts[chunk + 1];) {
+      const char* next;
+      const char* const lineEnd = findLineEnd(lineStart, chunkStarts[chunk + 1], &next);
+      makeLine(&(*line)->value, &(*line)->delta, lineStart, lineEnd);
+      ++line;
+      lineStart = next;
+    }
+  });
+}
+
+void Buffer::initFromUtf8File(QFile* file, const QString& name, int threadCount) {
+  std::vector<Tree::Node*> lines;
+  readUtf8Blocks(file, threadCount > 1 ? threadCount * parallelReadBlockSize : readBlockSize, [&](const char* start, const char* end) {
+    makeLines(start, end, threadCount, &lines, makeDecodedLine);
+    return true;
+  });
+  tree_.buildFrom(lines.begin(), lines.end(), {1, 0});
+  snapshotLines_.buildFrom(lines.begin(), lines.end(), [](Tree::Node* line) { return std::make_pair(SnapshotLine::of(line->value), line->delta); });
   name_ = name;
 }
 
+void Buffer::initFromMappedFile(std::shared_ptr<const MappedFile> file, const QString& name, int threadCount) {
+  std::vector<Tree::Node*> lines;
+  const char* const end = file->data() + file->size();
+  makeLines(skipUtf8ByteOrderMark(file->data(), end), end, threadCount, &lines, makeMappedLine);
+  tree_.buildFrom(lines.begin(), lines.end(), {1, 0});
+  snapshotLines_.buildFrom(lines.begin(), lines.end(), [](Tree::Node* line) { return std::make_pair(SnapshotLine::of(line->value), line->delta); });
+  // Reading the lines brought the whole file into memory, but only the lines that are used will be needed again.
+  file->releasePages();
+  mappedFiles_.push_back(std::move(file));
+  name_ = name;
+}
+
+void Buffer::decodeMapped(Line* line) {
+  const char* const start = line->mapped;
+  line->mapped = nullptr;
+  setUtf8Content(line, start, start + line->mappedSize);
+  line->mappedSize = 0;
+}
+
+QString Buffer::content(Line* line, int columnNumber, int count) {
+  if (line->mapped != nullptr) decodeMapped(line);
+  if (line->rope) return line->rope->mid(columnNumber, count);
+  if (line->latin1.isNull()) return line->content.mid(columnNumber, count);
+  const QByteArray part = line->latin1.mid(columnNumber, count);
+  return widen(part);
+}
+
+void Buffer::setContent(Line* line, QString content) {
+  Q_ASSERT(line->mapped == nullptr);
+  line->rope.reset();
+  if (isLatin1(QStringRef(&content))) {
+    line->latin1 = narrow(QStringRef(&content));
+    line->content = QString();
+  } else {
+    line->content = std::move(content);
+    line->latin1 = QByteArray();
+  }
+}
+
+void Buffer::setUtf8Content(Line* line, const char* start, const char* end) {
+  // ASCII, by far the most common text, is already Latin-1.
+  if (Util::Simd::asciiLength(start, end) == std::size_t(end - start)) {
+    line->latin1 = QByteArray(start, end - start);
+    line->content = QString();
+    line->rope.reset();
+  } else {
+    setContent(line, decodeUtf8(start, end));
+  }
+}
+
+void Buffer::insertContent(Line* line, int columnNumber, QStringRef text) {
+  if (line->mapped != nullptr) decodeMapped(line);
+  if (!line->rope && length(*line) + text.size() >= ropeLength) {
+    const QString content = Buffer::content(line);
+    line->rope.reset(new Rope(QStringRef(&content)));
+    line->content = QString();
+    line->latin1 = QByteArray();
+  }
+  if (line->rope) {
+    line->rope->insert(columnNumber, text);
+    return;
+  }
+  if (!line->latin1.isNull()) {
+    if (isLatin1(text)) {
+      line->latin1.insert(columnNumber, narrow(text));
+      return;
+    }
+    line->content = widen(line->latin1);
+    line->latin1 = QByteArray();
+  }
+  // Qt 5.5 and earlier don't provide QString::insert(int, QStringRef). Can be changed after Qt 5.6.
+  line->content.insert(columnNumber, text.constData(), text.size());
+}
+
+void Buffer::removeContent(Line* line, int columnNumber, int count) {
+  if (line->mapped != nullptr) decodeMapped(line);
+  if (line->rope) {
+    line->rope->remove(columnNumber, count);
+  } else if (!line->latin1.isNull()) {
+    line->latin1.remove(columnNumber, count);
+  } else {
+    line->content.remove(columnNumber, count);
+  }
+}
+
+void Buffer::truncateContent(Line* line, int columnNumber) {
+  if (line->mapped != nullptr) decodeMapped(line);
+  if (line->rope) {
+    line->rope->truncate(columnNumber);
+  } else if (!line->latin1.isNull()) {
+    line->latin1.truncate(columnNumber);
+  } else {
+    line->content.truncate(columnNumber);
+  }
+}
+
 Buffer::Tree::Iterator Buffer::line(int lineNumber) {
-  return tree_.get(lineNumber, {});
+  return tree_.get(ByLineNumber{lineNumber}, {});
 }
 
 Buffer::Tree::Iterator Buffer::insertLine(int lineNumber) {
-  auto node = new Tree::Node();
+  // The new line takes the key of the line currently at lineNumber, or that of the end of the buffer, and then its delta moves the following lines.
+  Tree::Iterator current = line(lineNumber);
+  const LineStart key = current.isValid() ? current->key : tree_.empty() ? LineStart{1, 0} : Tree::zeroKey + tree_.totalDelta();
+  Tree::Node* node = Tree::newNode();
   Util::DRBTreeDefs::OperationOptions options;
   options.repeats = true;
-  Tree::Iterator line = tree_.attach(node, lineNumber, options);
-  node->setDelta(1);
+  Tree::Iterator line = tree_.attach(node, key, options);
+  ++structureEpoch_;
+  snapshotLines_.insert(ByLineNumber{key.lineNumber}, SnapshotLine{}, {1, 1});
+  updateLineDelta(node);
   return line;
 }
 
+void Buffer::deleteLine(Tree::Node* line) {
+  snapshotLines_.erase(ByLineNumber{line->key(Util::DRBTreeDefs::Side::LEFT).lineNumber});
+  line->detach();
+  Tree::deleteNode(line);
+  ++structureEpoch_;
+}
+
+void Buffer::moveLines(int firstLineNumber, int endLineNumber, Buffer* target, int targetLineNumber) {
+  Tree movedLines;
+  Tree linesAfter;
+  tree_.split(ByLineNumber{firstLineNumber}, &movedLines);
+  movedLines.split(ByLineNumber{endLineNumber}, &linesAfter);
+  tree_.join(&linesAfter);
+  ++structureEpoch_;
+  SnapshotLines movedSnapshotLines = snapshotLines_.split(ByLineNumber{firstLineNumber});
+  snapshotLines_.join(movedSnapshotLines.split(ByLineNumber{endLineNumber}));
+  if (target == nullptr) {
+    movedLines.clear();
+    return;
+  }
+  for (const std::shared_ptr<const MappedFile>& file : mappedFiles_) {
+    if (std::find(target->mappedFiles_.begin(), target->mappedFiles_.end(), file) == target->mappedFiles_.end()) target->mappedFiles_.push_back(file);
+  }
+  Tree targetLinesAfter;
+  target->tree_.split(ByLineNumber{targetLineNumber}, &targetLinesAfter);
+  target->tree_.join(&movedLines);
+  target->tree_.join(&targetLinesAfter);
+  ++target->structureEpoch_;
+  SnapshotLines targetSnapshotLinesAfter = target->snapshotLines_.split(ByLineNumber{targetLineNumber});
+  target->snapshotLines_.join(std::move(movedSnapshotLines));
+  target->snapshotLines_.join(std::move(targetSnapshotLinesAfter));
+}
+
+void Buffer::appendLoadedLines(std::vector<LoadedLine>* lines) {
+  std::vector<Tree::Node*> nodes;
+  nodes.reserve(lines->size());
+  for (LoadedLine& loaded : *lines) {
+    Tree::Node* const node = Tree::newNode();
+    node->value = std::move(loaded.line);
+    node->delta = loaded.delta;
+    nodes.push_back(node);
+  }
+  lines->clear();
+  // The new lines are built into trees of their own, which are then joined after the existing lines.
+  Tree appended;
+  appended.buildFrom(nodes.begin(), nodes.end(), {1, 0});
+  tree_.join(&appended);
+  SnapshotLines appendedSnapshotLines{{1, 0}};
+  appendedSnapshotLines.buildFrom(nodes.begin(), nodes.end(), [](Tree::Node* line) { return std::make_pair(SnapshotLine::of(line->value), line->delta); });
+  snapshotLines_.join(std::move(appendedSnapshotLines));
+}
+
+bool Buffer::applyEdits(std::vector<Edit> edits, Undo::Recorder recorder) {
+  if (edits.empty()) return true;
+  auto before = [](const Edit& left, const Edit& right) {
+    return std::make_tuple(left.startLineNumber, left.startColumnNumber, left.endLineNumber, left.endColumnNumber) < std::make_tuple(right.startLineNumber, right.startColumnNumber, right.endLineNumber, right.endColumnNumber);
+  };
+  // Tools usually send their edits in order already.
+  if (!std::is_sorted(edits.begin(), edits.end(), before)) std::stable_sort(edits.begin(), edits.end(), before);
+  // The lines of the edits are visited in order, so finding each one is cheap. applyBatch() then takes the start lines from here rather than finding them again.
+  TempPoint line(this, 1);
+  std::pair<int, int> previousEnd(1, 0);
+  std::vector<Tree::Node*> startLines;
+  startLines.reserve(edits.size());
+  for (const Edit& edit : edits) {
+    const std::pair<int, int> start(edit.startLineNumber, edit.startColumnNumber);
+    const std::pair<int, int> end(edit.endLineNumber, edit.endColumnNumber);
+    if (start < previousEnd || end < start || end.first > lineCount() || start.second < 0) return false;
+    if (start.first != previousEnd.first) line.setLineNumber(start.first);
+    if (start.second > line.lineLength()) return false;
+    startLines.push_back(line.bufferLine_);
+    if (end.first != start.first) line.setLineNumber(end.first);
+    if (end.second > line.lineLength()) return false;
+    previousEnd = end;
+  }
+  std::vector<BatchEdit> batch;
+  batch.reserve(edits.size());
+  for (Edit& edit : edits) {
+    const int lineBreakCount = edit.text.count(QChar('\n'));
+    const int lastLineLength = edit.text.size() - (edit.text.lastIndexOf(QChar('\n')) + 1);
+    batch.push_back({std::move(edit), false, lineBreakCount, lastLineLength});
+  }
+  applyBatch(&batch, nullptr, recorder, &startLines);
+  return true;
+}
+
+void Buffer::applyBatch(std::vector<BatchEdit>* edits, Buffer* source, Undo::Recorder recorder, const std::vector<Tree::Node*>* startLines) {
+  if (edits->empty()) return;
+  // The edits that revert these ones: each replaces the text of an edit, at its position once all the edits are made, with the text it replaced. Their positions are worked out here, going forwards, as the edits below are made backwards so that the positions of the earlier ones still hold.
+  std::vector<BatchEdit> reverts(edits->size());
+  {
+    int lineShift = 0;
+    int columnShift = 0;
+    // The line where the previous edit ended, whose columns after it are shifted by columnShift.
+    int shiftedLineNumber = 0;
+    for (std::size_t index = 0; index < edits->size(); ++index) {
+      const BatchEdit& batchEdit = (*edits)[index];
+      const Edit& edit = batchEdit.edit;
+      BatchEdit& revert = reverts[index];
+      revert.edit.startLineNumber = edit.startLineNumber + lineShift;
+      revert.edit.startColumnNumber = edit.startColumnNumber + (edit.startLineNumber == shiftedLineNumber ? columnShift : 0);
+      revert.edit.endLineNumber = revert.edit.startLineNumber + batchEdit.lineBreakCount;
+      revert.edit.endColumnNumber = batchEdit.lastLineLength + (batchEdit.lineBreakCount == 0 ? revert.edit.startColumnNumber : 0);
+      revert.moved = false;
+      revert.lineBreakCount = edit.endLineNumber - edit.startLineNumber;
+      revert.lastLineLength = edit.endColumnNumber - (revert.lineBreakCount == 0 ? edit.startColumnNumber : 0);
+      lineShift += batchEdit.lineBreakCount - revert.lineBreakCount;
+      columnShift = revert.edit.endColumnNumber - edit.endColumnNumber;
+      shiftedLineNumber = edit.endLineNumber;
+    }
+  }
+
+  // Holds the replaced text that has content points in it, which is moved rather than copied so that the points go along. Texts are added at the start, separated by line breaks, so that they end up in the order of the edits.
+  std::unique_ptr<Buffer> undoBuffer;
+  // An edit can be made to the content of its line directly if it neither spans nor adds lines, and nothing in it needs to be moved.
+  auto isLineEdit = [recorder](const BatchEdit& batchEdit, Line* line) {
+    const Edit& edit = batchEdit.edit;
+    return !batchEdit.moved && batchEdit.lineBreakCount == 0 && edit.endLineNumber == edit.startLineNumber && (!recorder.undo || !Point::hasContentPointBetween(line, edit.startColumnNumber, edit.endColumnNumber));
+  };
+  // The lines changed directly, last first, whose snapshot lines are set at once by flushSnapshotLines() before the line numbers change.
+  std::vector<std::pair<int, Tree::Node*>> changedLines;
+  auto flushSnapshotLines = [this, &changedLines]() {
+    snapshotLines_.setEach(changedLines.rbegin(), changedLines.rend(), [](const std::pair<int, Tree::Node*>& line) { return ByLineNumber{line.first}; }, [](const std::pair<int, Tree::Node*>& line) { return std::make_pair(SnapshotLine::of(line.second->value), line.second->delta); });
+    changedLines.clear();
+  };
+  TempPoint line(this, edits->back().edit.startLineNumber);
+  // The lines before the start of the last edit made through points are still those in startLines. line is always moved to the start of such an edit before it's made, so it's never on a line the edit deletes.
+  int pointEditLineNumber = std::numeric_limits<int>::max();
+  for (std::size_t end = edits->size(); end > 0;) {
+    const int lineNumber = (*edits)[end - 1].edit.startLineNumber;
+    Tree::Node* node;
+    if (startLines != nullptr && lineNumber < pointEditLineNumber) {
+      node = (*startLines)[end - 1];
+    } else {
+      line.setLineNumber(lineNumber);
+      node = line.bufferLine_;
+    }
+    std::size_t start = end;
+    while (start > 0 && (*edits)[start - 1].edit.startLineNumber == lineNumber && isLineEdit((*edits)[start - 1], &node->value)) --start;
+
+    if (start < end) {
+      // The edits in [start, end) are all within the line: its new content is built at once.
+      const QString content = Buffer::content(&node->value);
+      QString newContent;
+      int length = content.size();
+      for (std::size_t index = start; index < end; ++index) length += (*edits)[index].edit.text.size() - ((*edits)[index].edit.endColumnNumber - (*edits)[index].edit.startColumnNumber);
+      newContent.reserve(length);
+      int columnNumber = 0;
+      for (std::size_t index = start; index < end; ++index) {
+        const Edit& edit = (*edits)[index].edit;
+        newContent.append(content.midRef(columnNumber, edit.startColumnNumber - columnNumber));
+        newContent.append(edit.text);
+        if (recorder.undo) reverts[index].edit.text = content.mid(edit.startColumnNumber, edit.endColumnNumber - edit.startColumnNumber);
+        columnNumber = edit.endColumnNumber;
+      }
+      newContent.append(content.midRef(columnNumber));
+      // The points are moved from the last edit back, so that the columns of the earlier ones still hold. Those in the replaced text go to its end, and then after the new text with those that follow.
+      for (std::size_t index = end; index-- > start;) {
+        const Edit& edit = (*edits)[index].edit;
+        for (PointTree::Iterator point; (point = Point::pointAtOrAfter(&node->value, edit.startColumnNumber)).isValid() && point->key < edit.endColumnNumber;) {
+          point->node->value->setColumnNumber(edit.endColumnNumber);
+        }
+        Point::shiftPoints(&node->value, edit.startColumnNumber, edit.text.size() - (edit.endColumnNumber - edit.startColumnNumber));
+      }
+      setContent(&node->value, std::move(newContent));
+      node->setDelta({1, length + 1});
+      changedLines.emplace_back(lineNumber, node);
+      end = start;
+      continue;
+    }
+
+    // Any other edit is made through points, as deleteTo() and insertBefore() do.
+    flushSnapshotLines();
+    line.setLine(node);
+    pointEditLineNumber = lineNumber;
+    BatchEdit& batchEdit = (*edits)[end - 1];
+    const Edit& edit = batchEdit.edit;
+    BatchEdit& revert = reverts[end - 1];
+    TempPoint from(line);
+    from.setColumnNumber(edit.startColumnNumber);
+    if (edit.endLineNumber != edit.startLineNumber || edit.endColumnNumber != edit.startColumnNumber) {
+      TempPoint to(from);
+      to.setLineNumber(edit.endLineNumber);
+      to.setColumnNumber(edit.endColumnNumber);
+      if (recorder.undo && (edit.endLineNumber != edit.startLineNumber || Point::hasContentPointBetween(&node->value, edit.startColumnNumber, edit.endColumnNumber))) {
+        if (undoBuffer) {
+          TempPoint(undoBuffer.get(), Point::BufferStart()).insertLineBreakBefore({});
+        } else {
+          undoBuffer = Buffer::create();
+          undoBuffer->insertLast();
+        }
+        from.moveContentBefore(to, TempPoint(undoBuffer.get(), Point::BufferStart()));
+        revert.moved = true;
+      } else {
+        if (recorder.undo) from.contentTo(to, &revert.edit.text);
+        from.moveContentBefore(to, TempPoint());
+      }
+    }
+    if (batchEdit.moved) {
+      TempPoint textStart(source, source->lineCount() - batchEdit.lineBreakCount);
+      textStart.moveContentBefore(TempPoint(source, Point::BufferEnd()), from);
+      // The line break that separated the text from the previous one.
+      if (source->lineCount() > 1) TempPoint(source, Point::BufferEnd()).deleteCharBefore({});
+    } else if (batchEdit.lineBreakCount == 0) {
+      from.insertBefore(QStringRef(&edit.text), {});
+    } else {
+      std::vector<QStringRef> lines;
+      for (int lineStart = 0;;) {
+        const int lineEnd = edit.text.indexOf(QChar('\n'), lineStart);
+        lines.push_back(edit.text.midRef(lineStart, lineEnd < 0 ? -1 : lineEnd - lineStart));
+        if (lineEnd < 0) break;
+        lineStart = lineEnd + 1;
+      }
+      from.insertBefore(lines, {});
+    }
+    --end;
+  }
+  flushSnapshotLines();
+  modified_ = true;
+  if (recorder.undo) recorder.undo->recordEdits(recorder.mode, std::move(reverts), std::move(undoBuffer));
+}
+
+BufferSnapshot Buffer::snapshot() const {
+  return BufferSnapshot(snapshotLines_, mappedFiles_);
+}
+
+namespace {
+
+// The heap memory taken by the data of a Qt string or byte array: a header and the characters, including the terminating null. Empty ones share static data.
+template<typename CharType, typename Array>
+int64_t arrayBytes(const Array& array) {
+  return array.isEmpty() ? 0 : sizeof(QArrayData) + (array.capacity() + 1) * sizeof(CharType);
+}
+
+}  // namespace
+
+MemoryStats Buffer::memoryStats() {
+  MemoryStats stats;
+  for (Tree::Entry entry : tree_) {
+    const Line& line = entry.node->value;
+    stats.lineText += arrayBytes<QChar>(line.content) + arrayBytes<char>(line.latin1) + (line.rope ? line.rope->memoryBytes() : 0);
+    stats.mappedText += line.mappedSize;
+    if (line.points) {
+      stats.points += sizeof(PointTree);
+      for (PointTree::Entry entry : *line.points) stats.points += sizeof(*entry.node->value) + sizeof(*entry.node);
+    }
+  }
+  stats.lineNodes = lineCount() * sizeof(Tree::Node);
+  stats.snapshotNodes = snapshotLines_.nodeBytes();
+  return stats;
+}
+
 std::unique_ptr<Buffer> Buffer::create() {
   return std::unique_ptr<Buffer>(new Buffer());
 }
 
-std::unique_ptr<Buffer> Buffer::open(const std::string& filePath) {
+std::unique_ptr<Buffer> Buffer::open(const std::string& filePath, int threadCount) {
   QFile file(QString::fromStdString(filePath));
   if (!file.open(QFile::ReadOnly)) {
     throw IOException("Failed to open file " + filePath + ".");
@@ -59,52 +685,179 @@ std::unique_ptr<Buffer> Buffer::open(const std::string& filePath) {
   std::unique_ptr<Buffer> buffer(new Buffer());
   buffer->filePath_ = filePath;
   QFileInfo fileInfo(file);
+  if (canReadAsUtf8(&file)) {
+    buffer->initFromUtf8File(&file, fileInfo.fileName(), resolveThreadCount(threadCount));
+    return buffer;
+  }
   QTextStream stream(&file);
   buffer->initFromStream(&stream, fileInfo.fileName());
   return buffer;
 }
 
+std::unique_ptr<Buffer> Buffer::openMapped(const std::string& filePath, int threadCount) {
+  std::shared_ptr<const MappedFile> file = MappedFile::open(filePath);
+  if (!canMap(*file)) return open(filePath, threadCount);
+  std::unique_ptr<Buffer> buffer(new Buffer());
+  buffer->filePath_ = filePath;
+  buffer->initFromMappedFile(std::move(file), QFileInfo(QString::fromStdString(filePath)).fileName(), resolveThreadCount(threadCount));
+  return buffer;
+}
+
 bool Buffer::save() {
   if (filePath_.empty()) return false;
-  QFile file(QString::fromStdString(filePath_));
-  if (!file.open(QFile::Truncate | QFile::WriteOnly | QFile::Text)) {
-    throw IOException("Failed to open file " + filePath_ + ".");
+  snapshot().save(filePath_);
+  modified_ = false;
+  return true;
+}
+
+bool BufferSnapshot::save(const std::string& filePath, const std::function<bool(int64_t)>& progress) const {
+  // Writing over the file would change the mapped lines of the buffer, and would lose the file if writing failed halfway, so a new file is written and then replaces it.
+  QSaveFile file(QString::fromStdString(filePath));
+  if (!file.open(mappedFiles_.empty() ? QFile::WriteOnly | QFile::Text : QFile::WriteOnly)) {
+    throw IOException("Failed to open file " + filePath + ".");
   }
-  QTextStream stream(&file);
-  TempPoint from(this, 0);
-  for (const QString* lineContent : from.linesForwards()) {
-    stream << *lineContent << '\n';
+  const bool complete = mappedFiles_.empty() ? saveWithTextStream(&file, progress) : saveUtf8(&file, filePath, progress);
+  if (!complete) {
+    file.cancelWriting();
+    return false;
   }
-  modified_ = false;
+  if (!file.commit()) {
+    throw IOException("Failed to write file " + filePath + ".");
+  }
+  return true;
+}
+
+bool BufferSnapshot::saveUtf8(QSaveFile* file, const std::string& filePath, const std::function<bool(int64_t)>& progress) const {
+  BatchWriter writer(file, filePath);
+  // Unchanged lines that are still next to each other in their file, with the line breaks between them, are copied as a single range.
+  const MappedFile* runFile = nullptr;
+  const char* runStart = nullptr;
+  const char* runEnd = nullptr;
+  auto endRun = [&] {
+    if (runFile != nullptr) writer.copy(*runFile, runStart, runEnd - runStart);
+    runFile = nullptr;
+  };
+  int64_t reportedOffset = 0;
+  for (Buffer::SnapshotLines::Cursor cursor = lines_.begin(); cursor.isValid(); cursor.advance()) {
+    const Buffer::SnapshotLine& line = cursor.value();
+    if (line.mapped == nullptr) {
+      endRun();
+      if (line.rope) {
+        line.rope->forEachPiece([&writer](const QByteArray& latin1, const QString& content) {
+          if (latin1.isNull()) {
+            writer.write(content);
+          } else {
+            writer.writeLatin1(latin1);
+          }
+        });
+      } else if (line.latin1.isNull()) {
+        writer.write(line.content);
+      } else {
+        writer.writeLatin1(line.latin1);
+      }
+    } else if (runFile == nullptr || line.mapped != runEnd) {
+      endRun();
+      runFile = mappedFile(line.mapped);
+      runStart = line.mapped;
+    }
+    if (line.mapped != nullptr) runEnd = line.mapped + line.mappedSize;
+    // Lines end with "\n" in the new file; other line breaks, and a missing one at the end, end the run.
+    if (runFile != nullptr && runEnd != runFile->data() + runFile->size() && *runEnd == '\n') {
+      ++runEnd;
+    } else {
+      endRun();
+      writer.write("\n", 1);
+    }
+    if (progress && cursor.key().offset - reportedOffset >= progressInterval) {
+      reportedOffset = cursor.key().offset;
+      if (!progress(reportedOffset)) return false;
+    }
+  }
+  endRun();
+  writer.flush();
+  return true;
+}
+
+bool BufferSnapshot::saveWithTextStream(QSaveFile* file, const std::function<bool(int64_t)>& progress) const {
+  QTextStream stream(file);
+  int64_t reportedOffset = 0;
+  for (Buffer::SnapshotLines::Cursor cursor = lines_.begin(); cursor.isValid(); cursor.advance()) {
+    stream << cursor.value().decoded() << '\n';
+    if (progress && cursor.key().offset - reportedOffset >= progressInterval) {
+      reportedOffset = cursor.key().offset;
+      if (!progress(reportedOffset)) return false;
+    }
+  }
+  stream.flush();
   return true;
 }
 
+const MappedFile* BufferSnapshot::mappedFile(const char* mapped) const {
+  for (const std::shared_ptr<const MappedFile>& file : mappedFiles_) {
+    if (file->contains(mapped)) return file.get();
+  }
+  Q_ASSERT(false);
+  return nullptr;
+}
+
+Buffer::SnapshotLines::Cursor BufferSnapshot::line(int lineNumber) const {
+  if (lineNumber < 1 || lineNumber > lineCount()) return {};
+  return lines_.find(Buffer::ByLineNumber{lineNumber});
+}
+
+QString BufferSnapshot::lineContent(int lineNumber) const {
+  const Buffer::SnapshotLines::Cursor cursor = line(lineNumber);
+  return cursor.isValid() ? cursor.value().decoded() : QString();
+}
+
+BufferSnapshot::LinesForwardsIterable BufferSnapshot::linesForwards(int lineNumber) const {
+  return LinesForwardsIterable(line(lineNumber));
+}
+
+int64_t BufferSnapshot::offset(int lineNumber, int columnNumber) const {
+  const Buffer::SnapshotLines::Cursor cursor = line(qBound(1, lineNumber, lineCount()));
+  if (!cursor.isValid()) return 0;
+  // The line's length is in its delta, so mapped lines don't need to be decoded.
+  return cursor.key().offset + qBound<int64_t>(0, columnNumber, cursor.delta().offset - 1);
+}
+
+void BufferSnapshot::position(int64_t offset, int* lineNumber, int* columnNumber) const {
+  offset = qBound<int64_t>(0, offset, characterCount());
+  // As in Point::setOffset(), the last line starting at or before the offset.
+  const Buffer::SnapshotLines::Cursor cursor = lines_.find(Buffer::ByOffset{offset});
+  *lineNumber = cursor.isValid() ? cursor.key().lineNumber : 1;
+  *columnNumber = cursor.isValid() ? offset - cursor.key().offset : 0;
+}
+
 Point::Point(Type type, Buffer* buffer) : type_(type), buffer_(buffer) {}
 Point::~Point() {
   setLine({}); // Removes any references to the point from the buffer, which would become dangling after destruction.
+  Buffer::PointTree::deleteNode(columnNode_);
 }
 
 void Point::setLine(Buffer::Tree::Node* newLine) {
+  if (newLine == bufferLine_) {
+    // Make sure the column number is within limits.
+    if (bufferLine_) setColumnNumber(columnNumber());
+    return;
+  }
+  lineNumberEpoch_ = 0;
   if (safe() && bufferLine_) {
-    std::vector<SafePoint*>& points = line()->points;
-    if (indexInLinePoints_ < points.size() - 1) {
-      SafePoint*& pointsEntry = points[indexInLinePoints_];
-      if (pointsEntry != this) throw new std::logic_error("Internal Error.");
-      pointsEntry = points.back();
-      pointsEntry->indexInLinePoints_ = indexInLinePoints_;
+    std::unique_ptr<Buffer::PointTree>& points = line()->points;
+    if (newLine && !newLine->value.points && !columnNode_->adjacent(Util::DRBTreeDefs::Side::LEFT) && !columnNode_->adjacent(Util::DRBTreeDefs::Side::RIGHT)) {
+      // A point alone on its line, as a cursor usually is, takes the line's points along to a line without points.
+      newLine->value.points = std::move(points);
+      bufferLine_ = newLine;
+      setColumnNumber(columnNumber());
+      return;
     }
-    points.pop_back();
+    columnNumber_ = columnNumber();
+    columnNode_->detach();
+    if (points->empty()) points.reset();
   }
   bufferLine_ = newLine;
-  if (bufferLine_) {
-    if (safe()) {
-      std::vector<SafePoint*>& points = line()->points;
-      indexInLinePoints_ = points.size();
-      points.push_back(static_cast<SafePoint*>(this));
-    }
-    // Make sure the column number is within limits.
-    setColumnNumber(columnNumber());
-  }
+  // Make sure the column number is within limits; a safe point is also added to the points of its new line.
+  if (bufferLine_) setColumnNumber(columnNumber_);
 }
 
 void Point::setBufferAndLine(Buffer* buffer, Buffer::Tree::Node* newLine) {
@@ -114,16 +867,68 @@ void Point::setBufferAndLine(Buffer* buffer, Buffer::Tree::Node* newLine) {
 
 bool Point::setColumnNumber(int columnNumber) {
   if (!bufferLine_) return false;
-  columnNumber_ = qBound(0, columnNumber, lineContent().size());
+  columnNumber = qBound(0, columnNumber, lineLength());
+  if (!safe()) {
+    columnNumber_ = columnNumber;
+    return true;
+  }
+  // The node is only detached from the line's points while setLine() moves the point to another line.
+  if (columnNode_ == nullptr) columnNode_ = Buffer::PointTree::newNode(static_cast<SafePoint*>(this));
+  std::unique_ptr<Buffer::PointTree>& points = line()->points;
+  if (columnNode_->isAttached()) {
+    if (columnNode_->key(Util::DRBTreeDefs::Side::LEFT) == columnNumber) return true;
+    columnNode_->detach();
+  } else if (!points) {
+    points.reset(new Buffer::PointTree());
+  }
+  Util::DRBTreeDefs::OperationOptions options;
+  options.repeats = true;
+  options.repeatedSide = Util::DRBTreeDefs::Side::RIGHT;
+  points->attach(columnNode_, columnNumber, options);
   return true;
 }
 
 void Point::setLineNumber(int lineNumber) {
-  setLine(buffer_->line(qBound(1, lineNumber, buffer_->lineCount() + 1))->node);
+  lineNumber = qBound(1, lineNumber, buffer_->lineCount() + 1);
+  if (!bufferLine_) {
+    setLine(buffer_->line(lineNumber)->node);
+    return;
+  }
+  // Searching from the current line only visits the nodes between both lines, which is cheap when moving to a nearby line, as when scrolling. Only line numbers are compared, so the offset of the current line, which isn't cached, can be left out of its key.
+  const Buffer::Tree::Iterator line = buffer_->tree_.getNear({{this->lineNumber(), 0}, bufferLine_}, Buffer::ByLineNumber{lineNumber}, {});
+  setLine(line->node);
+  if (line.isValid()) cacheLineNumber(line->key.lineNumber);
+}
+
+void Point::moveLines(int count) {
+  if (!bufferLine_) return;
+  Util::DRBTreeDefs::OperationOptions options;
+  options.equalOrAdjacent = true;
+  options.equalOrAdjacentSide = count < 0 ? Util::DRBTreeDefs::Side::RIGHT : Util::DRBTreeDefs::Side::LEFT;
+  // Moving doesn't need the line number, but keeps it known if it was.
+  const bool lineNumberKnown = lineNumberEpoch_ == buffer_->structureEpoch_;
+  // Keys relative to the current line, which has key zero.
+  const Buffer::Tree::Iterator line = buffer_->tree_.getNear({Buffer::Tree::zeroKey, bufferLine_}, Buffer::ByLineNumber{count}, options);
+  setLine(line->node);
+  if (lineNumberKnown) cacheLineNumber(lineNumber_ + line->key.lineNumber);
+}
+
+void Point::setOffset(int64_t offset) {
+  offset = qBound<int64_t>(0, offset, buffer_->characterCount());
+  // The point goes to the last line starting at or before the offset.
+  Util::DRBTreeDefs::OperationOptions options;
+  options.equalOrAdjacent = true;
+  Buffer::Tree::Iterator line = buffer_->tree_.get(Buffer::ByOffset{offset}, options);
+  setLine(line->node);
+  if (line.isValid()) {
+    cacheLineNumber(line->key.lineNumber);
+    setColumnNumber(offset - line->key.offset);
+  }
 }
 
 void Point::moveTo(const Point& point) {
   setLine(point.bufferLine_);
+  if (bufferLine_ && point.buffer_ == buffer_ && point.lineNumberEpoch_ == buffer_->structureEpoch_) cacheLineNumber(point.lineNumber_);
   setColumnNumber(point.columnNumber());
 }
 
@@ -133,14 +938,16 @@ bool Point::moveToLineStart() {
 
 bool Point::moveToLineEnd() {
   if (!bufferLine_) return false;
-  return setColumnNumber(lineContent().size());
+  return setColumnNumber(lineLength());
 }
 
 bool Point::moveUp() {
   if (!bufferLine_) return false;
   Buffer::Tree::Node* newLine = bufferLine_->adjacent(Util::DRBTreeDefs::Side::LEFT);
   if (!newLine) return false;
+  const bool lineNumberKnown = lineNumberEpoch_ == buffer_->structureEpoch_;
   setLine(newLine);
+  if (lineNumberKnown) cacheLineNumber(lineNumber_ - 1);
   return true;
 }
 
@@ -148,7 +955,9 @@ bool Point::moveDown() {
   if (!bufferLine_) return false;
   Buffer::Tree::Node* newLine = bufferLine_->adjacent(Util::DRBTreeDefs::Side::RIGHT);
   if (!newLine) return false;
+  const bool lineNumberKnown = lineNumberEpoch_ == buffer_->structureEpoch_;
   setLine(newLine);
+  if (lineNumberKnown) cacheLineNumber(lineNumber_ + 1);
   return true;
 }
 
@@ -159,7 +968,7 @@ bool Point::moveLeft() {
 
 bool Point::moveRight() {
   if (!bufferLine_) return false;
-  if (columnNumber() >= lineContent().size()) return moveDown() && moveToLineStart();
+  if (columnNumber() >= lineLength()) return moveDown() && moveToLineStart();
   return setColumnNumber(columnNumber() + 1);
 }
 
@@ -171,8 +980,8 @@ bool Point::contentTo(const Point& other, QString* output) const {
   for (TempPoint line(*from); line.isValid(); line.moveToStartOfNextLineOrMakeInvalid()) {
     const int start = line.sameLineAs(*from) ? from->columnNumber() : 0;
     const bool isLastLine = line.sameLineAs(*to);
-    const int end = isLastLine ? to->columnNumber() : line.lineContent().size();
-    output->append(line.lineContent().midRef(start, end - start));
+    const int end = isLastLine ? to->columnNumber() : line.lineLength();
+    output->append(Buffer::content(line.line(), start, end - start));
     if (isLastLine) break;
     output->append('\n');
   }
@@ -182,13 +991,11 @@ bool Point::contentTo(const Point& other, QString* output) const {
 bool Point::insertBefore(QStringRef text, Undo::Recorder recorder) {
   if (!bufferLine_) return false;
   const int insertionColumnNumber = columnNumber();
-  Q_ASSERT(columnNumber() <= lineContent().size());
-  // Qt 5.5 and earlier don't provide QString::insert(int, QStringRef). Can be changed after Qt 5.6.
+  Q_ASSERT(columnNumber() <= lineLength());
   TempPoint start(*this);
-  line()->content.insert(insertionColumnNumber, text.constData(), text.size());
-  for (Point* point : line()->points) {
-    if (point->columnNumber() >= insertionColumnNumber) point->setColumnNumber(point->columnNumber() + text.size());
-  }
+  Buffer::insertContent(line(), insertionColumnNumber, text);
+  buffer_->updateLineDelta(bufferLine_);
+  shiftPoints(line(), insertionColumnNumber, text.size());
   if (!safe()) setColumnNumber(insertionColumnNumber + text.size());
   if (recorder.undo) recorder.undo->recordInsertion(recorder.mode, start, *this);
   buffer_->modified_ = true;
@@ -199,31 +1006,32 @@ bool Point::insertBefore(QStringRef currentLineText, LinesToInsertIterator begin
   if (!bufferLine_) return false;
   TempPoint start(*this);
   const int insertionColumnNumber = columnNumber();
-  Q_ASSERT(insertionColumnNumber <= lineContent().size());
+  Q_ASSERT(insertionColumnNumber <= lineLength());
   int newLineNumber = lineNumber();
   for (LinesToInsertIterator textToInsert = beginLinesToInsert; textToInsert != endLinesToInsert; ++textToInsert) {
     Buffer::Tree::Node* newLine = buffer_->insertLine(++newLineNumber)->node;
-    newLine->value.content = std::move(*textToInsert);
+    Buffer::setContent(&newLine->value, std::move(*textToInsert));
+    buffer_->updateLineDelta(newLine);
   }
+  const QString content = lineContent();
   Buffer::Tree::Node* newLine = buffer_->insertLine(++newLineNumber)->node;
-  newLine->value.content = newLineText % lineContent().rightRef(lineContent().size() - insertionColumnNumber);
-  line()->content = lineContent().leftRef(insertionColumnNumber) % currentLineText;
-  // Saving reference as the loop below might move the point to a new line.
-  std::vector<SafePoint*>& points = line()->points;
+  Buffer::setContent(&newLine->value, newLineText % content.rightRef(content.size() - insertionColumnNumber));
+  buffer_->updateLineDelta(newLine);
+  Buffer::setContent(line(), content.leftRef(insertionColumnNumber) % currentLineText);
+  buffer_->updateLineDelta(bufferLine_);
+  // The points after the insertion go to the new line, which has no points yet.
   const int insertionLength = newLineText.size();
-  for (int pointIndex = 0; pointIndex < points.size();) {
-    Point* point = points[pointIndex];
-    if (point->columnNumber() >= insertionColumnNumber) {
-      point->setColumnNumber(point->columnNumber() + insertionLength - insertionColumnNumber);
-      // Removes this point from the points vector.
-      point->setLine(newLine);
-      continue;
-    }
-    ++pointIndex;
+  std::unique_ptr<Buffer::PointTree>& points = line()->points;
+  if (points) {
+    std::unique_ptr<Buffer::PointTree> movedPoints(new Buffer::PointTree());
+    points->split(insertionColumnNumber, movedPoints.get());
+    if (points->empty()) points.reset();
+    appendPoints(newLine, std::move(movedPoints), insertionLength - insertionColumnNumber);
   }
   if (!safe()) {
-    setColumnNumber(insertionLength);
+    // The column is set on the new line, as it might be past the end of this one.
     setLine(newLine);
+    setColumnNumber(insertionLength);
   }
   if (recorder.undo) recorder.undo->recordInsertion(recorder.mode, start, *this);
   buffer_->modified_ = true;
@@ -236,7 +1044,7 @@ bool Point::insertBefore(const std::vector<QStringRef>& lines, Undo::Recorder re
   if (lines.size() == 1) return insertBefore(lines.front(), recorder);
   std::vector<QString> fullLines;
   fullLines.reserve(lines.size() - 2);
-  for (auto fullLine = lines.begin() + 1; fullLine != lines.end(); ++fullLine) {
+  for (auto fullLine = lines.begin() + 1; fullLine != lines.end() - 1; ++fullLine) {
     fullLines.push_back(fullLine->toString());
   }
   return insertBefore(lines.front(), fullLines.begin(), fullLines.end(), lines.back(), recorder);
@@ -270,6 +1078,48 @@ bool Point::deleteTo(const Point& other, Undo::Recorder recorder) {
   return true;
 }
 
+Buffer::PointTree::Iterator Point::pointAtOrAfter(Buffer::Line* line, int columnNumber) {
+  if (!line->points) return {};
+  Util::DRBTreeDefs::OperationOptions options;
+  options.repeatedSide = Util::DRBTreeDefs::Side::LEFT;
+  options.equalOrAdjacent = true;
+  options.equalOrAdjacentSide = Util::DRBTreeDefs::Side::RIGHT;
+  return line->points->get(columnNumber, options);
+}
+
+void Point::shiftPoints(Buffer::Line* line, int columnNumber, int count) {
+  const Buffer::PointTree::Iterator first = pointAtOrAfter(line, columnNumber);
+  if (first.isValid()) line->points->shiftKeysFrom(first->node, count);
+}
+
+bool Point::hasContentPointBetween(Buffer::Line* line, int startColumnNumber, int endColumnNumber) {
+  const Buffer::PointTree::Iterator first = pointAtOrAfter(line, startColumnNumber + 1);
+  for (Buffer::PointTree::Node* point = first.isValid() ? first->node : nullptr; point != nullptr && point->key(Util::DRBTreeDefs::Side::LEFT) < endColumnNumber; point = point->adjacent(Util::DRBTreeDefs::Side::RIGHT)) {
+    if (point->value->type_ == Type::CONTENT) return true;
+  }
+  return false;
+}
+
+void Point::appendPoints(Buffer::Tree::Node* line, std::unique_ptr<Buffer::PointTree> points, int count) {
+  if (!points || points->empty()) return;
+  Buffer::PointTree::Node* const first = points->begin()->node;
+  points->shiftKeysFrom(first, count);
+  for (Buffer::PointTree::Cursor cursor(first); cursor.isValid(); cursor.advance()) {
+    cursor.node()->value->bufferLine_ = line;
+    cursor.node()->value->lineNumberEpoch_ = 0;
+  }
+  std::unique_ptr<Buffer::PointTree>& linePoints = line->value.points;
+  if (!linePoints) {
+    // The tree is moved as a whole; its nodes find it through its root.
+    linePoints = std::move(points);
+    return;
+  }
+  // Joining keeps the deltas of the nodes, so the key of the first appended point is given by the delta of the last point of the line.
+  Buffer::PointTree::Node* const last = linePoints->extreme(Util::DRBTreeDefs::Side::RIGHT, {})->node;
+  last->setDelta(first->key(Util::DRBTreeDefs::Side::LEFT) - last->key(Util::DRBTreeDefs::Side::LEFT));
+  linePoints->join(points.get());
+}
+
 void Point::moveToStartOfNextLineOrMakeInvalid() {
   if (moveDown()) {
     moveToLineStart();
@@ -278,111 +1128,110 @@ void Point::moveToStartOfNextLineOrMakeInvalid() {
   }
 }
 
-Buffer::Tree::Node* Point::detachLineAndMoveToStartOfNextLineOrMakeInvalid() {
-  Buffer::Tree::Node* bufferLine = bufferLine_;
-  Buffer::Tree::Node* prevLine = bufferLine->adjacent(Util::DRBTreeDefs::Side::LEFT);
-  moveToStartOfNextLineOrMakeInvalid();
-  bufferLine->detach();
-  if (prevLine) prevLine->setDelta(1);
-  return bufferLine;
-}
-
 void Point::moveContentBefore(const Point& other, const Point& target) {
   const Point* from = nullptr;
   const Point* to = nullptr;
   sortPair(this, &other, &from, &to);
-  TempPoint movingFrom(*from);
+  // from and to might be among the points moved below, so save their positions.
+  Buffer* const buffer = from->buffer_;
+  Buffer::Tree::Node* const firstLine = from->bufferLine_;
+  Buffer::Tree::Node* const lastLine = to->bufferLine_;
+  const int fromColumnNumber = from->columnNumber();
+  const int toColumnNumber = to->columnNumber();
   TempPoint movingTarget(target);
-  while (true) {
-    // We iterate over the lines in order so that we can easily move the content to the destination.
-    const bool isFirst = movingFrom.bufferLine_ == from->bufferLine_;
-    const bool isLast = movingFrom.bufferLine_ == to->bufferLine_;
-    if (isLast && to->columnNumber() == 0) {
-      // Nothing to delete from last line.
-      break;
+
+  // Moves a point from the deleted area: content points go with the content to the target, if there is one, at the given column of the given target line; other points collapse to the start of the deleted area.
+  auto moveDeletedPoint = [&](SafePoint* point, Buffer::Tree::Node* targetLine, int targetColumnNumber) {
+    if (point->type_ == Type::CONTENT && movingTarget.isValid()) {
+      point->setBufferAndLine(movingTarget.buffer_, targetLine);
+      point->setColumnNumber(targetColumnNumber);
+      return;
     }
-    if (isFirst || isLast) {
-      // The first line stays in the source buffer, so can't move it completely. The last line is merged into the first line. In either case we need to adjust the line content and move the points.
-      // We handle the last line here as it can also be the first, in case we're deleting from only one line.
-      // To update the points we need the movingTarget.columnNumber() before the insertion.
-      const int movingTargetColumnNumber = movingTarget.columnNumber();
-      if (movingTarget.isValid()) {
-        QStringRef movedContent =
-            isLast
-                ? movingFrom.lineContent().midRef(movingFrom.columnNumber(), to->columnNumber() - movingFrom.columnNumber())
-                : movingFrom.lineContent().midRef(movingFrom.columnNumber());
-        movingTarget.insertBefore(movedContent, {});
-      }
-      if (isFirst) {
-        if (isLast) {
-          from->line()->content.remove(from->columnNumber(), to->columnNumber() - from->columnNumber());
-        } else {
-          from->line()->content.truncate(from->columnNumber());
-        }
-      } else if (isLast) {
-        QStringRef joinedContent = to->lineContent().midRef(to->columnNumber());
-        from->line()->content.append(joinedContent);
-      }
-      const int toColumnNumber = to->columnNumber(); // Save as it might be updated by the loop.
-      for (int pointIndex = 0; pointIndex < movingFrom.line()->points.size();) {
-        SafePoint* point = movingFrom.line()->points[pointIndex];
-        if (isLast && point->columnNumber() >= toColumnNumber) {
-          // The point is after the deleted area.
-          point->setColumnNumber(point->columnNumber() + from->columnNumber() - toColumnNumber);
-          if (!isFirst) {
-            point->setLine(from->bufferLine_);
-            continue;
-          }
-        } else if (!isFirst || point->columnNumber() > from->columnNumber()) {
-          // The point is in the deleted area.
-          if (point->type_ == Type::CONTENT && movingTarget.isValid()) {
-            // Content points are moved to the undo buffer.
-            point->setColumnNumber(point->columnNumber() + movingTargetColumnNumber - movingFrom.columnNumber());
-            point->setBufferAndLine(movingTarget.buffer_, movingTarget.bufferLine_);
-            continue;
-          } else {
-            // Other points are moved to the point where the deleted area now collapsed.
-            point->moveTo(*from);
-            continue;
-          }
-        }
-        // Otherwise the point is before the deleted area; nothing to do.
-        ++pointIndex;
-      }
-      if (movingTarget.isValid() && !isLast) movingTarget.insertLineBreakBefore({});
-      if (isFirst) {
-        movingFrom.moveToStartOfNextLineOrMakeInvalid();
-      } else {
-        delete movingFrom.detachLineAndMoveToStartOfNextLineOrMakeInvalid();
-      }
-    } else {
-      // Not the first or the last line, so we can move the whole line, together with content points, to the movingTarget.
-      Buffer::Tree::Node* sourceLine = movingFrom.detachLineAndMoveToStartOfNextLineOrMakeInvalid();
-      for (SafePoint* point : sourceLine->value.points) {
-        if (movingTarget.isValid() && point->type_ == Type::CONTENT) {
+    if (point->bufferLine_ != firstLine) point->setLine(firstLine);
+    point->setColumnNumber(fromColumnNumber);
+  };
+
+  if (firstLine == lastLine) {
+    const int targetColumnNumber = movingTarget.columnNumber();
+    if (movingTarget.isValid()) {
+      const QString moved = Buffer::content(&firstLine->value, fromColumnNumber, toColumnNumber - fromColumnNumber);
+      movingTarget.insertBefore(QStringRef(&moved), {});
+    }
+    Buffer::removeContent(&firstLine->value, fromColumnNumber, toColumnNumber - fromColumnNumber);
+    buffer->updateLineDelta(firstLine);
+    // The points in the deleted area are moved one by one, and then those after it are shifted all at once.
+    for (Buffer::PointTree::Iterator point; (point = pointAtOrAfter(&firstLine->value, fromColumnNumber + 1)).isValid() && point->key < toColumnNumber;) {
+      moveDeletedPoint(point->node->value, movingTarget.bufferLine_, point->key + targetColumnNumber - fromColumnNumber);
+    }
+    shiftPoints(&firstLine->value, toColumnNumber, fromColumnNumber - toColumnNumber);
+    if (!safe()) setColumnNumber(fromColumnNumber);
+    return;
+  }
+
+  const int firstLineNumber = firstLine->key(Util::DRBTreeDefs::Side::LEFT).lineNumber;
+  const int lastLineNumber = lastLine->key(Util::DRBTreeDefs::Side::LEFT).lineNumber;
+
+  // The first line stays in the source buffer; the content after from is moved to the target, followed by a line break.
+  {
+    const int targetColumnNumber = movingTarget.columnNumber();
+    Buffer::Tree::Node* const targetLine = movingTarget.bufferLine_;
+    if (movingTarget.isValid()) {
+      const QString moved = Buffer::content(&firstLine->value, fromColumnNumber);
+      movingTarget.insertBefore(QStringRef(&moved), {});
+      // Before the points are moved, so that those at the end of the first line stay before the line break.
+      movingTarget.insertLineBreakBefore({});
+    }
+    for (Buffer::PointTree::Iterator point; (point = pointAtOrAfter(&firstLine->value, fromColumnNumber + 1)).isValid();) {
+      moveDeletedPoint(point->node->value, targetLine, point->key + targetColumnNumber - fromColumnNumber);
+    }
+    Buffer::truncateContent(&firstLine->value, fromColumnNumber);
+  }
+
+  // The lines between the first and the last are moved as a whole: they are split from the source tree and joined into the target tree, which takes logarithmic time regardless of their number. Only their points need to be visited.
+  if (lastLineNumber - firstLineNumber > 1) {
+    std::vector<SafePoint*> collapsedPoints;
+    for (Buffer::Tree::Node* line = firstLine->adjacent(Util::DRBTreeDefs::Side::RIGHT); line != lastLine; line = line->adjacent(Util::DRBTreeDefs::Side::RIGHT)) {
+      if (!line->value.points) continue;
+      for (Buffer::PointTree::Cursor cursor(line->value.points->begin()->node); cursor.isValid(); cursor.advance()) {
+        SafePoint* const point = cursor.node()->value;
+        if (point->type_ == Type::CONTENT && movingTarget.isValid()) {
+          // Content points stay in their line.
           // TODO: points shouldn't have a pointer to the buffer; then this wouldn't be needed.
           point->buffer_ = movingTarget.buffer_;
+          point->lineNumberEpoch_ = 0;
         } else {
-          point->moveTo(*from);
+          // Moved after the visit, which moving would disturb.
+          collapsedPoints.push_back(point);
         }
       }
-      if (movingTarget.isValid()) {
-        Util::DRBTreeDefs::OperationOptions options;
-        options.repeats = true;
-        movingTarget.buffer_->tree_.attach(sourceLine, movingTarget.lineNumber(), options);
-        sourceLine->setDelta(1);
-        movingTarget.moveToStartOfNextLineOrMakeInvalid();
-      } else {
-        delete sourceLine;
-      }
     }
-    if (isLast) break;
+    for (SafePoint* point : collapsedPoints) moveDeletedPoint(point, nullptr, 0);
+    buffer->moveLines(firstLineNumber + 1, lastLineNumber, movingTarget.isValid() ? movingTarget.buffer_ : nullptr, movingTarget.isValid() ? movingTarget.lineNumber() : 0);
   }
-  if (!safe()) moveTo(movingFrom);
-}
 
-Point::LineIterator Point::LinesForwardsIterable::begin() {
-  return {std::make_unique<LineIteratorImpl>(*from_)};
+  // The content of the last line before to is moved to the target, and the rest is joined to the first line.
+  {
+    const int targetColumnNumber = movingTarget.columnNumber();
+    if (movingTarget.isValid()) {
+      const QString moved = Buffer::content(&lastLine->value, 0, toColumnNumber);
+      movingTarget.insertBefore(QStringRef(&moved), {});
+    }
+    const QString joined = Buffer::content(&lastLine->value, toColumnNumber);
+    Buffer::insertContent(&firstLine->value, fromColumnNumber, QStringRef(&joined));
+    // The points moved to the first line below need its new length.
+    buffer->updateLineDelta(firstLine);
+    for (Buffer::PointTree::Iterator point; (point = pointAtOrAfter(&lastLine->value, 0)).isValid() && point->key < toColumnNumber;) {
+      moveDeletedPoint(point->node->value, movingTarget.bufferLine_, point->key + targetColumnNumber);
+    }
+    // The points after the deleted area follow the points left on the first line, which are all at or before from.
+    appendPoints(firstLine, std::move(lastLine->value.points), fromColumnNumber - toColumnNumber);
+    buffer->deleteLine(lastLine);
+    buffer->updateLineDelta(firstLine);
+  }
+  if (!safe()) {
+    setLine(firstLine);
+    setColumnNumber(fromColumnNumber);
+  }
 }
 
 }  // namespace Editor
@@ -1,17 +1,30 @@
 #ifndef MED_EDITOR_BUFFER_H
 #define MED_EDITOR_BUFFER_H
 
+#include <cstdint>
+#include <functional>
 #include <list>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include <QtCore/QByteArray>
+#include <QtCore/QFile>
 #include <QtCore/QString>
 #include <QtCore/QTextStream>
 
+#include "Edit.h"
+#include "Latin1.h"
+#include "MemoryStats.h"
+#include "Rope.h"
 #include "Undo.h"
+#include "Util/CountedBTree.h"
 #include "Util/DRBTree.h"
 #include "Util/IteratorHelper.h"
+#include "Util/PersistentSequence.h"
+#include "Util/PoolAllocator.h"
+
+class QSaveFile;
 
 namespace Med {
 namespace Editor {
@@ -20,39 +33,196 @@ class IOException : public std::runtime_error {
   using std::runtime_error::runtime_error;
 };
 
+class BufferSnapshot;
+class MappedFile;
 class SafePoint;
 
 class Buffer {
 public:
   static std::unique_ptr<Buffer> create();
-  static std::unique_ptr<Buffer> open(const std::string& filePath);
+  // Large UTF-8 files are split into chunks at line boundaries, which are scanned and decoded by up to threadCount threads; 0 means one per hardware thread.
+  static std::unique_ptr<Buffer> open(const std::string& filePath, int threadCount = 0);
+  // Opens a file by mapping it into memory instead of reading it. The file is expected to be UTF-8, and lines keep pointing into the map until they are changed or their content is needed as a string, so memory use grows with what is edited or displayed rather than with the file size.
+  // Files starting with a UTF-16 or UTF-32 byte order mark are read as open() does.
+  static std::unique_ptr<Buffer> openMapped(const std::string& filePath, int threadCount = 0);
 
   ~Buffer();
 
   const QString& name() { return name_; }
   const std::string& filePath() { return filePath_; }
+  // Writes the buffer to its file; see BufferSnapshot::save(). Returns false if the buffer has no file. Throws IOException if writing failed.
   bool save();
   bool modified() { return modified_; }
 
+  // Returns a read-only view of the buffer's current content, which later changes don't affect. O(1); see BufferSnapshot.
+  BufferSnapshot snapshot() const;
+
   int lineCount() const {
     // If there are no lines, totalDelta() returns 0; otherwise, it returns first line number + line count. The first line number is 1, so we subtract that.
-    return qMax(0, tree_.totalDelta() - 1);
+    return qMax(0, tree_.totalDelta().lineNumber - 1);
+  }
+
+  // Number of characters in the buffer, counting each line break as one.
+  int64_t characterCount() const {
+    // Every line is counted with a line break, including the last one.
+    return qMax<int64_t>(0, tree_.totalDelta().offset - 1);
   }
 
+  // Makes the edits, whose positions are all in the buffer as it is before any of them, in one pass, and records them as a single operation. The edits can be given in any order but must not overlap; insertions at the same position are made in the order given. Returns false, changing nothing, if an edit is out of range or overlaps another one.
+  // Points move as if each edit deleted its range and then inserted its text. Much cheaper than making the edits one by one through points: the edits within a line change its content at once, and only those that span or add lines, or would delete content points, go through Point.
+  bool applyEdits(std::vector<Edit> edits, Undo::Recorder recorder);
+
+  // The memory taken by the lines and their points; the undo and layouts members are left for the owners of those to fill in. O(N).
+  MemoryStats memoryStats();
+  // The memory reserved for the line nodes of all buffers, including freed nodes kept for reuse.
+  static int64_t reservedNodeBytes() { return Tree::Allocator::reservedBytes(); }
+
 private:
+  friend class BufferLoader;
+  friend class BufferSnapshot;
   friend class BufferTest;
+  friend class Finder;
   friend class Point;
   friend class Undo;
 
+  // The safe points of a line, keyed by their column numbers, so that inserting or deleting text shifts the columns of all the points after it in O(log P). Points at the same column are kept in the order they got there.
+  typedef Util::DRBTree<int, int, SafePoint*, Util::PoolAllocator> PointTree;
+
   struct Line {
-    std::vector<SafePoint*> points;
+    // The safe points on the line, or null if it has none. Lines without points, nearly all of them, only pay for this pointer.
+    std::unique_ptr<PointTree> points;
+    // The text of the line is kept in one of four forms, and the members for the others are null. Use content() and the functions below to read and change it.
+    // As UTF-16, if it has characters above U+00FF.
     QString content;
+    // As Latin-1, one byte per character, if it has no characters above U+00FF. Most text is ASCII, so this halves the memory taken by most lines.
+    QByteArray latin1;
+    // As the line's bytes in a mapped file, which are valid UTF-8 (see MappedFile), until its content is first needed as a string.
+    const char* mapped = nullptr;
+    int mappedSize = 0;
+    // As a rope, once the line is edited while it's at least ropeLength characters long, so that typing in a line of megabytes doesn't copy all of it every time.
+    std::unique_ptr<Rope> rope;
   };
-  typedef Util::DRBTree<int, int, Line> Tree;
+  static constexpr int ropeLength = 64 * 1024;
+
+  // The content of a line. A Latin-1 line or a rope is made into a string every time, so callers should keep the string rather than ask again. A mapped line is decoded the first time, and keeps its text from then on.
+  static QString content(Line* line) {
+    if (line->mapped != nullptr) decodeMapped(line);
+    if (line->rope) return line->rope->toString();
+    return line->latin1.isNull() ? line->content : widen(line->latin1);
+  }
+  // The count characters from the given column, or all those after it if count is negative; only they are made into a string.
+  static QString content(Line* line, int columnNumber, int count = -1);
+  // The number of characters in a line that isn't mapped.
+  static int length(const Line& line) { return line.rope ? line.rope->size() : line.latin1.isNull() ? line.content.size() : line.latin1.size(); }
+  // Change the content of a line; updateLineDelta() must be called afterwards. Latin-1 lines stay Latin-1 unless they get a wider character, and ropes stay ropes until their whole content is set.
+  static void setContent(Line* line, QString content);
+  static void insertContent(Line* line, int columnNumber, QStringRef text);
+  static void removeContent(Line* line, int columnNumber, int count);
+  static void truncateContent(Line* line, int columnNumber);
+  // Sets the content of a line from valid UTF-8.
+  static void setUtf8Content(Line* line, const char* start, const char* end);
+  static void decodeMapped(Line* line);
+
+  // The key of a line in the tree: its line number, and the offset of its first character in the buffer. Offsets count characters as QString does, and each line break as one character.
+  // The delta of a line is {1, length + 1}. Keys are ordered by both members; ByLineNumber and ByOffset search by one of them.
+  struct LineStart {
+    int lineNumber;
+    int64_t offset;
+
+    LineStart operator+(const LineStart& other) const { return {lineNumber + other.lineNumber, offset + other.offset}; }
+    LineStart operator-(const LineStart& other) const { return {lineNumber - other.lineNumber, offset - other.offset}; }
+    LineStart& operator+=(const LineStart& other) { return *this = *this + other; }
+    LineStart& operator-=(const LineStart& other) { return *this = *this - other; }
+    bool operator==(const LineStart& other) const { return lineNumber == other.lineNumber && offset == other.offset; }
+    bool operator<(const LineStart& other) const { return lineNumber != other.lineNumber ? lineNumber < other.lineNumber : offset < other.offset; }
+    bool operator>(const LineStart& other) const { return other < *this; }
+
+    friend std::string to_string(const LineStart& key) { return std::to_string(key.lineNumber) + ":" + std::to_string(key.offset); }
+  };
+
+  struct ByLineNumber {
+    int lineNumber;
+
+    friend bool operator==(const ByLineNumber& key, const LineStart& lineStart) { return key.lineNumber == lineStart.lineNumber; }
+    friend bool operator<(const ByLineNumber& key, const LineStart& lineStart) { return key.lineNumber < lineStart.lineNumber; }
+    friend bool operator<(const LineStart& lineStart, const ByLineNumber& key) { return lineStart.lineNumber < key.lineNumber; }
+  };
+
+  struct ByOffset {
+    int64_t offset;
+
+    friend bool operator==(const ByOffset& key, const LineStart& lineStart) { return key.offset == lineStart.offset; }
+    friend bool operator<(const ByOffset& key, const LineStart& lineStart) { return key.offset < lineStart.offset; }
+    friend bool operator<(const LineStart& lineStart, const ByOffset& key) { return lineStart.offset < key.offset; }
+  };
+
+  // Lines are pooled: loading a file creates one node per line, and pooling avoids a heap allocation for each and keeps neighbouring lines close in memory.
+  // Building with MED_BUFFER_BTREE defined keeps them in a counted B+-tree instead of a red-black tree, which is friendlier to caches on very large files.
+#ifdef MED_BUFFER_BTREE
+  typedef Util::CountedBTree<LineStart, LineStart, Line, Util::PoolAllocator> Tree;
+#else
+  typedef Util::DRBTree<LineStart, LineStart, Line, Util::PoolAllocator> Tree;
+#endif
+
+  // A line as kept for snapshots, in the same form as in Line.
+  struct SnapshotLine {
+    QString content;
+    QByteArray latin1;
+    const char* mapped;
+    int mappedSize;
+    // A copy of the line's rope, which shares its pieces.
+    std::shared_ptr<const Rope> rope;
+
+    static SnapshotLine of(const Line& line) { return {line.content, line.latin1, line.mapped, line.mappedSize, line.rope ? std::make_shared<const Rope>(*line.rope) : nullptr}; }
+    QString decoded() const {
+      if (mapped != nullptr) return QString::fromUtf8(mapped, mappedSize);
+      if (rope) return rope->toString();
+      return latin1.isNull() ? content : widen(latin1);
+    }
+  };
+
+  // The content of the lines, shared with the snapshots. It's kept up to date with tree_ as lines change, so taking a snapshot doesn't need to copy anything.
+  typedef Util::PersistentSequence<LineStart, SnapshotLine> SnapshotLines;
+
+  // Must be called whenever the content of a line changes, to keep the offsets of the following lines and the snapshot lines up to date. Changed lines are never mapped.
+  void updateLineDelta(Tree::Node* line) {
+    Q_ASSERT(line->value.mapped == nullptr);
+    line->setDelta({1, length(line->value) + 1});
+    snapshotLines_.set(ByLineNumber{line->key(Util::DRBTreeDefs::Side::LEFT).lineNumber}, SnapshotLine::of(line->value), line->delta);
+  }
 
   Buffer();
 
+  // Must be called on an empty buffer.
   void initFromStream(QTextStream* stream, const QString& name);
+  // Must be called on an empty buffer. Reads the file as UTF-8, in large blocks.
+  void initFromUtf8File(QFile* file, const QString& name, int threadCount);
+  // Must be called on an empty buffer.
+  void initFromMappedFile(std::shared_ptr<const MappedFile> file, const QString& name, int threadCount);
+
+  // Whether a file can be read with readUtf8Blocks(), or, once mapped, with makeMappedLine(): files with a UTF-16 or UTF-32 byte order mark, or any file if the locale's encoding isn't UTF-8, must be read with QTextStream instead.
+  static bool canReadAsUtf8(QFile* file);
+  static bool canMap(const MappedFile& file);
+  // Reads the file in blocks of about blockSize bytes, calling takeLines with the whole lines of each block, the last one possibly without a line break, until the file ends or takeLines returns false.
+  static void readUtf8Blocks(QFile* file, std::size_t blockSize, const std::function<bool(const char* start, const char* end)>& takeLines);
+  static const char* skipUtf8ByteOrderMark(const char* start, const char* end);
+  // Returns where the line starting at start ends, and sets next to where the following line starts.
+  static const char* findLineEnd(const char* start, const char* end, const char** next);
+  // Set the value and delta of a line from its UTF-8 text: decoded into its content, or pointing into the mapped file the text is in.
+  static void makeDecodedLine(Line* line, LineStart* delta, const char* start, const char* end);
+  static void makeMappedLine(Line* line, LineStart* delta, const char* start, const char* end);
+  // Creates a node for each line in [start, end), appending them to lines, and calls makeLine(&node->value, &node->delta, lineStart, lineEnd) to set each one. Large inputs are split between up to threadCount threads, so makeLine is called from several threads at once.
+  template<typename MakeLine>
+  static void makeLines(const char* start, const char* end, int threadCount, std::vector<Tree::Node*>* lines, const MakeLine& makeLine);
+
+  // A line made by a BufferLoader on its thread, which only gets a node when it's appended.
+  struct LoadedLine {
+    Line line;
+    LineStart delta;
+  };
+  // Appends the lines at the end of the buffer, leaving the vector empty. O(M + log N) for M lines.
+  void appendLoadedLines(std::vector<LoadedLine>* lines);
+
 
   Tree::Iterator line(int lineNumber);
   // TODO: better implementation for lastLine(), using extreme().
@@ -62,28 +232,75 @@ private:
   // TODO: better implementation for insertLast().
   Tree::Iterator insertLast() { return insertLine(lineCount() + 1); }
 
+  // Detaches and deletes a line, which must have no points.
+  void deleteLine(Tree::Node* line);
+
+  // Makes edits sorted by position that don't overlap, and records the edits that revert them. The text of moved edits is taken from the end of source. startLines, if not null, has the line where each edit starts, so that they aren't looked up again.
+  void applyBatch(std::vector<BatchEdit>* edits, Buffer* source, Undo::Recorder recorder, const std::vector<Tree::Node*>* startLines = nullptr);
+
+  // Moves the lines in [firstLineNumber, endLineNumber) before the line targetLineNumber of target, or deletes them if target is null. The lines must have no points, other than content points already moved to target. O(log N).
+  void moveLines(int firstLineNumber, int endLineNumber, Buffer* target, int targetLineNumber);
+
   Tree tree_;
+  // Changes whenever lines are inserted, deleted or moved, which is when the line numbers cached by points (see Point::lineNumber()) may become stale. Editing the content of lines or appending lines after the last one doesn't change it.
+  uint64_t structureEpoch_ = 1;
+  SnapshotLines snapshotLines_{{1, 0}};
+  // The files the mapped lines of this buffer point into. Lines moved from another buffer bring its files along.
+  std::vector<std::shared_ptr<const MappedFile>> mappedFiles_;
   QString name_;
   std::string filePath_;
   bool modified_ = false;
 };
 
-class Point {
+// The content of a buffer at the time it was taken, which can be read from any thread while the buffer keeps changing.
+// It shares the lines with the buffer: a change to the buffer after the snapshot copies only the O(log N) internal nodes that lead to the changed lines, and the lines themselves are implicitly shared QStrings.
+// Copying a snapshot is O(1). Different copies can be used from different threads at the same time.
+class BufferSnapshot {
 public:
-  typedef Util::IteratorHelper<const QString*> LineIterator;
+  struct LineContent {
+    QString operator()(const Buffer::SnapshotLines::Cursor& cursor) const { return cursor.value().decoded(); }
+  };
+  typedef Util::RangeHelper<Buffer::SnapshotLines::Cursor, LineContent> LinesForwardsIterable;
+
+  int lineCount() const { return qMax(0, lines_.endKey().lineNumber - 1); }
+  int64_t characterCount() const { return qMax<int64_t>(0, lines_.endKey().offset - 1); }
 
-  class LinesForwardsIterable {
-  public:
-    LineIterator begin();
-    LineIterator end() { return {nullptr}; }
+  // The content of the given line, or a null string if there is no such line. O(log N), plus decoding the line if it's mapped.
+  QString lineContent(int lineNumber) const;
+  // The contents of the lines from the given one to the end of the buffer, as in Point::linesForwards() but by value, as mapped lines are decoded as they are visited.
+  LinesForwardsIterable linesForwards(int lineNumber) const;
 
-  private:
-    friend Point;
+  // As Point::offset() and Point::setOffset(); out of range offsets are clamped to the start or end of the buffer. O(log N).
+  int64_t offset(int lineNumber, int columnNumber) const;
+  void position(int64_t offset, int* lineNumber, int* columnNumber) const;
 
-    LinesForwardsIterable(Point* from) : from_(from) {}
+  // Writes the lines to a new file that replaces filePath once it's complete. If the buffer has mapped lines, the lines are written as UTF-8 and the runs of unchanged ones are copied from their file in one piece, so the time taken grows with the changed lines rather than with the whole file; otherwise they are written in the locale's encoding.
+  // Calls progress from time to time with the number of characters written so far; if it returns false, stops and leaves the file as it was. Returns whether the file was replaced. Throws IOException if writing failed.
+  bool save(const std::string& filePath, const std::function<bool(int64_t)>& progress = {}) const;
 
-    Point* from_;
+private:
+  friend class Buffer;
+  BufferSnapshot(const Buffer::SnapshotLines& lines, const std::vector<std::shared_ptr<const MappedFile>>& mappedFiles) : lines_(lines), mappedFiles_(mappedFiles) {}
+
+  Buffer::SnapshotLines::Cursor line(int lineNumber) const;
+  bool saveUtf8(QSaveFile* file, const std::string& filePath, const std::function<bool(int64_t)>& progress) const;
+  bool saveWithTextStream(QSaveFile* file, const std::function<bool(int64_t)>& progress) const;
+  // The file a mapped line points into.
+  const MappedFile* mappedFile(const char* mapped) const;
+
+  Buffer::SnapshotLines lines_;
+  // Keeps the files of the mapped lines mapped.
+  std::vector<std::shared_ptr<const MappedFile>> mappedFiles_;
+};
+
+class Point {
+public:
+  struct LineContent {
+    QString operator()(const Buffer::Tree::Cursor& cursor) const { return Buffer::content(&cursor.node()->value); }
   };
+  typedef Util::IteratorHelper<Buffer::Tree::Cursor, LineContent> LineIterator;
+  // The buffer must not change while iterating. The lines are visited by value, as Latin-1 lines are widened to strings as they are visited.
+  typedef Util::RangeHelper<Buffer::Tree::Cursor, LineContent> LinesForwardsIterable;
 
   ~Point();
 
@@ -93,16 +310,28 @@ public:
   void reset() { setLine(nullptr); }
   void moveTo(const Point& point);
   bool setColumnNumber(int columnNumber);
+  // Moves to the given line; cheaper the closer it is to the current line.
   void setLineNumber(int lineNumber);
+  // Moves the given number of lines down (or up if negative), stopping at the first or last line. O(log d), where d is the number of lines moved.
+  void moveLines(int count);
+  // Moves to the given offset from the start of the buffer (see offset()); out of range offsets move to the start or end of the buffer. O(log N).
+  void setOffset(int64_t offset);
 
   bool sameLineAs(const Point& point) const { return bufferLine_ == point.bufferLine_; }
-  int columnNumber() const { return columnNumber_; }
+  // O(log P) for safe points, P being the number of safe points on the line.
+  int columnNumber() const { return columnNode_ != nullptr && bufferLine_ ? columnNode_->key(Util::DRBTreeDefs::Side::LEFT) : columnNumber_; }
   bool samePositionAs(const Point& point) const {
     return sameLineAs(point) && columnNumber() == point.columnNumber();
   }
+  // O(1) if no lines were inserted, deleted or moved since the line number was last known, O(log N) otherwise.
   int lineNumber() const {
-    // TODO: cache line number and only compute it if the buffer changed since last time.
-    return bufferLine_->key(Util::DRBTreeDefs::Side::LEFT);
+    if (lineNumberEpoch_ != buffer_->structureEpoch_) cacheLineNumber(bufferLine_->key(Util::DRBTreeDefs::Side::LEFT).lineNumber);
+    return lineNumber_;
+  }
+
+  // Offset of the point from the start of the buffer, in characters; see Buffer::characterCount(). O(log N).
+  int64_t offset() const {
+    return bufferLine_->key(Util::DRBTreeDefs::Side::LEFT).offset + columnNumber();
   }
 
   bool moveToLineStart();
@@ -123,7 +352,9 @@ public:
     moveToLineEnd();
   }
 
-  const QString& lineContent() const { return line()->content; }
+  QString lineContent() const { return Buffer::content(line()); }
+  // The number of characters in the line, without getting its content. O(1).
+  int lineLength() const { return bufferLine_->delta.offset - 1; }
   bool contentTo(const Point& other, QString* output) const;
 
   // Inserts the text in the current line; no line breaks inserted.
@@ -141,16 +372,16 @@ public:
 
   template<typename PointType>
   static void sortPair(typename std::remove_reference<PointType>::type* left, typename std::remove_reference<PointType>::type* right, PointType** first, PointType** second) {
-    const bool leftIsFirst = left->bufferLine_ != right->bufferLine_ ? left->lineNumber() < right->lineNumber() : left->columnNumber() < right->columnNumber();
+    const bool leftIsFirst = left->bufferLine_ != right->bufferLine_ ? Buffer::Tree::keyRelativeTo(left->bufferLine_, right->bufferLine_).lineNumber > 0 : left->columnNumber() < right->columnNumber();
     *first = leftIsFirst ? left : right;
     *second = leftIsFirst ? right : left;
   }
 
-  LinesForwardsIterable linesForwards() { return LinesForwardsIterable(this); }
+  LinesForwardsIterable linesForwards() const { return LinesForwardsIterable(Buffer::Tree::Cursor(bufferLine_)); }
 
 private:
-  class LineIteratorImpl;
-
+  friend class Buffer;
+  friend class Finder;
   friend class SafePoint;
   friend class TempPoint;
   friend class Undo;
@@ -165,8 +396,20 @@ private:
 
   void setLine(Buffer::Tree::Node* newLine);
   void setBufferAndLine(Buffer* buffer, Buffer::Tree::Node* newLine);
+  void cacheLineNumber(int lineNumber) const {
+    lineNumber_ = lineNumber;
+    lineNumberEpoch_ = buffer_->structureEpoch_;
+  }
+
+  // The first point at or after the given column of the line, if any. O(log P).
+  static Buffer::PointTree::Iterator pointAtOrAfter(Buffer::Line* line, int columnNumber);
+  // Moves the points at or after the given column of the line by count columns, which may be negative as long as they don't go before the column. O(log P).
+  static void shiftPoints(Buffer::Line* line, int columnNumber, int count);
+  // Whether there is a content point after startColumnNumber and before endColumnNumber. O(log P + the number of points between them).
+  static bool hasContentPointBetween(Buffer::Line* line, int startColumnNumber, int endColumnNumber);
+  // Moves points, which must come after those of line, to line, shifting their columns by count. O(log P) to join the points, plus updating the line of each moved point.
+  static void appendPoints(Buffer::Tree::Node* line, std::unique_ptr<Buffer::PointTree> points, int count);
 
-  Buffer::Tree::Node* detachLineAndMoveToStartOfNextLineOrMakeInvalid();
   void moveToStartOfNextLineOrMakeInvalid();
   void moveContentBefore(const Point& other, const Point& destination);
 
@@ -174,8 +417,13 @@ private:
   const Type type_;
   Buffer* buffer_ = nullptr;
   Buffer::Tree::Node* bufferLine_ = nullptr;
+  // The column of a temporary point, or of a safe point while it's not on a line.
   int columnNumber_ = 0;
-  int indexInLinePoints_ = -1;
+  // The node of a safe point in the points of its line, whose key is its column number. Created the first time the point is on a line, and kept while it moves between lines.
+  Buffer::PointTree::Node* columnNode_ = nullptr;
+  // The line number of the point, valid while lineNumberEpoch_ is the buffer's structureEpoch_, which is never 0. Moving the point to another line clears it, unless the new line number is known anyway.
+  mutable int lineNumber_ = 0;
+  mutable uint64_t lineNumberEpoch_ = 0;
 };
 
 class SafePoint : public Point {
@@ -0,0 +1,157 @@
+#include "BufferLoader.h"
+
+#include <algorithm>
+#include <iterator>
+#include <QtCore/QFileInfo>
+#include <QtCore/QTextStream>
+
+#include "MappedFile.h"
+#include "Util/Simd.h"
+
+namespace Med {
+namespace Editor {
+
+namespace {
+
+// The lines are handed over in batches of about this many bytes, which take a few milliseconds to decode, so the first screen comes quickly and the buffer isn't appended to too often.
+constexpr std::size_t blockSize = 1 << 20;
+// When reading with QTextStream, which doesn't tell how many bytes it has read, batches are counted in lines.
+constexpr std::size_t streamBatchLineCount = 10000;
+
+}  // namespace
+
+BufferLoader::BufferLoader(Buffer* buffer, const std::string& filePath, bool mapped) : buffer_(buffer), file_(QString::fromStdString(filePath)) {
+  if (mapped) {
+    mappedFile_ = MappedFile::open(filePath);
+    if (!Buffer::canMap(*mappedFile_)) mappedFile_.reset();
+  }
+  if (mappedFile_ != nullptr) {
+    fileSize_ = mappedFile_->size();
+    buffer_->mappedFiles_.push_back(mappedFile_);
+  } else {
+    if (!file_.open(QFile::ReadOnly)) throw IOException("Failed to open file " + filePath + ".");
+    fileSize_ = file_.size();
+  }
+  buffer_->filePath_ = filePath;
+  buffer_->name_ = QFileInfo(QString::fromStdString(filePath)).fileName();
+  thread_ = std::thread(&BufferLoader::load, this);
+}
+
+BufferLoader::~BufferLoader() {
+  cancel();
+  if (thread_.joinable()) thread_.join();
+  if (!finished_) buffer_->filePath_.clear();
+}
+
+int BufferLoader::appendLoadedLines() {
+  if (finished_) return 0;
+  std::vector<Buffer::LoadedLine> lines;
+  bool workerDone;
+  bool complete;
+  std::string error;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    lines.swap(loadedLines_);
+    workerDone = workerDone_;
+    complete = complete_;
+    error = error_;
+  }
+  const int count = lines.size();
+  buffer_->appendLoadedLines(&lines);
+  if (workerDone) {
+    thread_.join();
+    finished_ = true;
+    if (!complete) buffer_->filePath_.clear();
+    if (!error.empty()) throw IOException(error);
+  }
+  return count;
+}
+
+void BufferLoader::load() {
+  bool complete = false;
+  std::string error;
+  try {
+    if (mappedFile_ != nullptr) {
+      complete = loadMapped();
+    } else if (Buffer::canReadAsUtf8(&file_)) {
+      complete = loadUtf8();
+    } else {
+      complete = loadWithTextStream();
+    }
+  } catch (const IOException& exception) {
+    error = exception.what();
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  workerDone_ = true;
+  complete_ = complete;
+  error_ = error;
+}
+
+bool BufferLoader::loadMapped() {
+  const char* const fileStart = mappedFile_->data();
+  const char* const end = fileStart + mappedFile_->size();
+  std::vector<Buffer::LoadedLine> lines;
+  for (const char* start = Buffer::skipUtf8ByteOrderMark(fileStart, end); start != end;) {
+    // Blocks end after a line break.
+    const char* blockEnd = start + std::min<std::size_t>(blockSize, end - start);
+    if (blockEnd != end) {
+      blockEnd = Util::Simd::findByte(blockEnd, end, '\n');
+      if (blockEnd != end) ++blockEnd;
+    }
+    makeLines(start, blockEnd, Buffer::makeMappedLine, &lines);
+    if (!publish(&lines, blockEnd - fileStart)) return false;
+    start = blockEnd;
+  }
+  // As in Buffer::openMapped(), only the lines that are used will be needed again.
+  mappedFile_->releasePages();
+  return true;
+}
+
+bool BufferLoader::loadUtf8() {
+  std::vector<Buffer::LoadedLine> lines;
+  bool complete = true;
+  Buffer::readUtf8Blocks(&file_, blockSize, [&](const char* start, const char* end) {
+    makeLines(start, end, Buffer::makeDecodedLine, &lines);
+    complete = publish(&lines, file_.pos());
+    return complete;
+  });
+  return complete;
+}
+
+bool BufferLoader::loadWithTextStream() {
+  QTextStream stream(&file_);
+  std::vector<Buffer::LoadedLine> lines;
+  while (true) {
+    QString content = stream.readLine();
+    if (content.isNull()) break;
+    lines.emplace_back();
+    lines.back().delta = {1, content.size() + 1};
+    Buffer::setContent(&lines.back().line, std::move(content));
+    if (lines.size() == streamBatchLineCount && !publish(&lines, file_.pos())) return false;
+  }
+  return publish(&lines, fileSize_);
+}
+
+template<typename MakeLine>
+void BufferLoader::makeLines(const char* start, const char* end, const MakeLine& makeLine, std::vector<Buffer::LoadedLine>* lines) {
+  while (start != end) {
+    const char* next;
+    const char* const lineEnd = Buffer::findLineEnd(start, end, &next);
+    lines->emplace_back();
+    makeLine(&lines->back().line, &lines->back().delta, start, lineEnd);
+    start = next;
+  }
+}
+
+bool BufferLoader::publish(std::vector<Buffer::LoadedLine>* lines, int64_t loadedBytes) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::move(lines->begin(), lines->end(), std::back_inserter(loadedLines_));
+  }
+  lines->clear();
+  loadedBytes_ = loadedBytes;
+  return !cancelled_;
+}
+
+}  // namespace Editor
+}  // namespace Med
@@ -0,0 +1,79 @@
+#ifndef MED_EDITOR_BUFFERLOADER_H
+#define MED_EDITOR_BUFFERLOADER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <QtCore/QFile>
+
+#include "Buffer.h"
+
+namespace Med {
+namespace Editor {
+
+class MappedFile;
+
+// Loads a file into a buffer in the background, so that the first lines can be shown, and even edited, long before the whole file is read.
+// A worker thread reads and decodes the file, and appendLoadedLines(), called from the thread that uses the buffer, appends the lines decoded so far at the end of the buffer. Edits made in between are kept: the loaded lines always go after the last line.
+class BufferLoader {
+public:
+  // Starts loading filePath into buffer, which must be empty and must outlive the loader. With mapped, the file is mapped as in Buffer::openMapped(), otherwise read as in Buffer::open().
+  // Throws IOException if the file can't be opened.
+  BufferLoader(Buffer* buffer, const std::string& filePath, bool mapped);
+  // Cancels loading if it hasn't finished.
+  ~BufferLoader();
+
+  Buffer* buffer() { return buffer_; }
+
+  // Appends the lines decoded since the last call at the end of the buffer, and returns how many. Once the worker is done, the first call that appends its last lines makes finished() true.
+  // Throws IOException if reading the file failed; the buffer keeps the lines read until then.
+  int appendLoadedLines();
+  // True once all the lines are appended, or loading failed or was cancelled.
+  bool finished() const { return finished_; }
+
+  // Stops loading at the next block. The buffer keeps the lines loaded until then, and forgets its file so that saving it can't truncate the file.
+  void cancel() { cancelled_ = true; }
+
+  // The part of the file decoded so far, from 0 to 1.
+  double progress() const { return fileSize_ > 0 ? double(loadedBytes_) / fileSize_ : 1; }
+
+private:
+  // Run on the worker thread. Each way of loading returns whether it reached the end of the file.
+  void load();
+  bool loadMapped();
+  bool loadUtf8();
+  bool loadWithTextStream();
+  template<typename MakeLine>
+  static void makeLines(const char* start, const char* end, const MakeLine& makeLine, std::vector<Buffer::LoadedLine>* lines);
+  // Hands lines over to appendLoadedLines(). Returns false if loading was cancelled.
+  bool publish(std::vector<Buffer::LoadedLine>* lines, int64_t loadedBytes);
+
+  Buffer* const buffer_;
+  // Set when mapping, otherwise file_ is read.
+  std::shared_ptr<const MappedFile> mappedFile_;
+  QFile file_;
+  int64_t fileSize_ = 0;
+
+  std::atomic<bool> cancelled_{false};
+  std::atomic<int64_t> loadedBytes_{0};
+
+  // Shared with the worker thread.
+  std::mutex mutex_;
+  std::vector<Buffer::LoadedLine> loadedLines_;
+  bool workerDone_ = false;
+  bool complete_ = false;
+  std::string error_;
+
+  bool finished_ = false;
+  std::thread thread_;
+};
+
+}  // namespace Editor
+}  // namespace Med
+
+#endif // MED_EDITOR_BUFFERLOADER_H
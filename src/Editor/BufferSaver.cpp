@@ -0,0 +1,46 @@
+#include "BufferSaver.h"
+
+namespace Med {
+namespace Editor {
+
+BufferSaver::BufferSaver(Buffer* buffer) : buffer_(buffer), snapshot_(buffer->snapshot()), filePath_(buffer->filePath()), characterCount_(snapshot_.characterCount()) {
+  Q_ASSERT(!filePath_.empty());
+  thread_ = std::thread(&BufferSaver::save, this);
+}
+
+BufferSaver::~BufferSaver() {
+  if (thread_.joinable()) thread_.join();
+}
+
+bool BufferSaver::finished() {
+  if (finished_) return true;
+  std::string error;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!workerDone_) return false;
+    error = error_;
+  }
+  thread_.join();
+  finished_ = true;
+  if (!error.empty()) throw IOException(error);
+  return true;
+}
+
+void BufferSaver::save() {
+  std::string error;
+  try {
+    snapshot_.save(filePath_, [this](int64_t savedCharacters) {
+      savedCharacters_ = savedCharacters;
+      return true;
+    });
+    savedCharacters_ = characterCount_;
+  } catch (const IOException& exception) {
+    error = exception.what();
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  workerDone_ = true;
+  error_ = error;
+}
+
+}  // namespace Editor
+}  // namespace Med
@@ -0,0 +1,55 @@
+#ifndef MED_EDITOR_BUFFERSAVER_H
+#define MED_EDITOR_BUFFERSAVER_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "Buffer.h"
+
+namespace Med {
+namespace Editor {
+
+// Saves a buffer to its file in the background, so that saving a large file doesn't stop the user from editing it.
+// A worker thread writes a snapshot of the buffer taken when saving starts, with BufferSnapshot::save(); changes made to the buffer after that aren't saved. The buffer's modified() flag is left alone, as it may have changed since: use Undo::checkpoint() when saving starts and Undo::setUnmodified() once it's finished to track which state was saved.
+class BufferSaver {
+public:
+  // Starts saving buffer to its file, which it must have. The buffer must outlive the saver.
+  explicit BufferSaver(Buffer* buffer);
+  // Waits for the file to be written, so that a save that was started isn't lost.
+  ~BufferSaver();
+
+  Buffer* buffer() { return buffer_; }
+
+  // Whether the file is written. Throws IOException if writing it failed, from the first call that finds out; the file is then left as it was.
+  bool finished();
+
+  // The part of the snapshot written so far, from 0 to 1.
+  double progress() const { return characterCount_ > 0 ? double(savedCharacters_) / characterCount_ : 1; }
+
+private:
+  // Run on the worker thread.
+  void save();
+
+  Buffer* const buffer_;
+  const BufferSnapshot snapshot_;
+  const std::string filePath_;
+  const int64_t characterCount_;
+
+  std::atomic<int64_t> savedCharacters_{0};
+
+  // Shared with the worker thread.
+  std::mutex mutex_;
+  bool workerDone_ = false;
+  std::string error_;
+
+  bool finished_ = false;
+  std::thread thread_;
+};
+
+}  // namespace Editor
+}  // namespace Med
+
+#endif // MED_EDITOR_BUFFERSAVER_H
@@ -0,0 +1,385 @@
+#include "Buffer.h"
+
+#include <malloc.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <vector>
+
+#include <QtCore/QTemporaryFile>
+#include <QtCore/QTextStream>
+
+#include "Undo.h"
+#include "View.h"
+#include "benchmark/benchmark.h"
+
+namespace Med {
+namespace Editor {
+namespace {
+
+/** Returns the resident set size of the process, in bytes. */
+long residentBytes() {
+  long pages = 0;
+  long residentPages = 0;
+  FILE* statm = std::fopen("/proc/self/statm", "r");
+  if (statm == nullptr) return 0;
+  if (std::fscanf(statm, "%ld %ld", &pages, &residentPages) != 2) residentPages = 0;
+  std::fclose(statm);
+  return residentPages * sysconf(_SC_PAGESIZE);
+}
+
+/** A temporary file with the given number of lines of typical source code length. */
+class SyntheticFile {
+public:
+  explicit SyntheticFile(int lineCount) {
+    file_.open();
+    QTextStream stream(&file_);
+    for (int lineNumber = 1; lineNumber <= lineCount; ++lineNumber) {
+      stream << "  const int line" << QString::number(lineNumber) << " = computeSomething(alpha, beta);\n";
+    }
+    stream.flush();
+    size_ = file_.size();
+    file_.close();
+  }
+
+  std::string path() const { return file_.fileName().toStdString(); }
+  int64_t size() const { return size_; }
+
+private:
+  QTemporaryFile file_;
+  int64_t size_;
+};
+
+void BM_BufferOpen(benchmark::State& state) {
+  const int lineCount = state.range(0);
+  SyntheticFile file(lineCount);
+  for (auto _ : state) {
+    malloc_trim(0);
+    const long residentBefore = residentBytes();
+    std::unique_ptr<Buffer> buffer = Buffer::open(file.path());
+    benchmark::DoNotOptimize(buffer->lineCount());
+    state.counters["rssBytesPerLine"] = double(residentBytes() - residentBefore) / lineCount;
+  }
+  state.SetItemsProcessed(state.iterations() * lineCount);
+  state.SetBytesProcessed(state.iterations() * file.size());
+}
+BENCHMARK(BM_BufferOpen)->Arg(100000)->Arg(1000000)->Arg(5000000)->Iterations(1)->Unit(benchmark::kMillisecond);
+
+/** Like BM_BufferOpen, but mapping the file, and then changing a few lines. Resident memory should grow with the lines rather than with their content. */
+void BM_BufferOpenMapped(benchmark::State& state) {
+  const int lineCount = state.range(0);
+  SyntheticFile file(lineCount);
+  for (auto _ : state) {
+    malloc_trim(0);
+    const long residentBefore = residentBytes();
+    std::unique_ptr<Buffer> buffer = Buffer::openMapped(file.path());
+    const QString text("edit");
+    for (int lineNumber = 1; lineNumber <= lineCount; lineNumber += lineCount / 100) TempPoint(buffer.get(), lineNumber).insertBefore(QStringRef(&text), {});
+    benchmark::DoNotOptimize(buffer->lineCount());
+    state.counters["rssBytesPerLine"] = double(residentBytes() - residentBefore) / lineCount;
+  }
+  state.SetItemsProcessed(state.iterations() * lineCount);
+  state.SetBytesProcessed(state.iterations() * file.size());
+}
+BENCHMARK(BM_BufferOpenMapped)->Arg(100000)->Arg(1000000)->Arg(5000000)->Iterations(1)->Unit(benchmark::kMillisecond);
+
+/** How opening scales with the number of threads that scan and decode the file, reading it and mapping it. */
+void BM_BufferOpenThreads(benchmark::State& state) {
+  const int lineCount = state.range(0);
+  const int threadCount = state.range(1);
+  const bool mapped = state.range(2);
+  static std::unique_ptr<SyntheticFile> file;
+  if (file == nullptr) file.reset(new SyntheticFile(lineCount));
+  for (auto _ : state) {
+    std::unique_ptr<Buffer> buffer = mapped ? Buffer::openMapped(file->path(), threadCount) : Buffer::open(file->path(), threadCount);
+    benchmark::DoNotOptimize(buffer->lineCount());
+  }
+  state.SetBytesProcessed(state.iterations() * file->size());
+}
+BENCHMARK(BM_BufferOpenThreads)->ArgsProduct({{2000000}, {1, 2, 4, 8, 16}, {0, 1}})->ArgNames({"lines", "threads", "mapped"})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+/** Returns the bytes currently allocated from the heap, including blocks allocated directly with mmap. */
+long heapBytes() {
+  const struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+/** Reports the heap memory taken by each line of a buffer: its node in the line tree, its content and its share of the snapshot lines. Lines are about 60 characters long. */
+void BM_BufferHeapBytesPerLine(benchmark::State& state) {
+  const int lineCount = state.range(0);
+  SyntheticFile file(lineCount);
+  for (auto _ : state) {
+    const long heapBefore = heapBytes();
+    std::unique_ptr<Buffer> buffer = Buffer::open(file.path());
+    benchmark::DoNotOptimize(buffer->lineCount());
+    state.counters["heapBytesPerLine"] = double(heapBytes() - heapBefore) / lineCount;
+  }
+}
+BENCHMARK(BM_BufferHeapBytesPerLine)->Arg(1000000)->Iterations(1)->Unit(benchmark::kMillisecond);
+
+/** Moves a number of cursors down a line and back up, as moving with the arrow keys does. Each iteration moves every cursor twice. */
+void BM_MoveCursors(benchmark::State& state) {
+  SyntheticFile file(1000);
+  std::unique_ptr<Buffer> buffer = Buffer::open(file.path());
+  std::vector<std::unique_ptr<SafePoint>> cursors;
+  for (int index = 0; index < state.range(0); ++index) {
+    cursors.emplace_back(new SafePoint(SafePoint::Interactive(), buffer.get()));
+    cursors.back()->setLineNumber(500 + 2 * index);
+  }
+  for (auto _ : state) {
+    for (const std::unique_ptr<SafePoint>& cursor : cursors) cursor->moveDown();
+    for (const std::unique_ptr<SafePoint>& cursor : cursors) cursor->moveUp();
+  }
+  state.SetItemsProcessed(state.iterations() * 2 * cursors.size());
+}
+BENCHMARK(BM_MoveCursors)->Arg(1)->Arg(3)->Arg(10);
+
+/** Moves a cursor around the middle of a buffer of the given number of lines, and reads its line number after every move, as the status bar and the view do. Each iteration makes four moves: a line down, a page down, a page up, and a line up. */
+void BM_CursorMovement(benchmark::State& state) {
+  SyntheticFile file(state.range(0));
+  std::unique_ptr<Buffer> buffer = Buffer::open(file.path());
+  SafePoint cursor(SafePoint::Interactive(), buffer.get());
+  cursor.setLineNumber(buffer->lineCount() / 2);
+  int64_t lineNumbers = 0;
+  for (auto _ : state) {
+    cursor.moveDown();
+    lineNumbers += cursor.lineNumber();
+    cursor.moveLines(50);
+    lineNumbers += cursor.lineNumber();
+    cursor.setLineNumber(cursor.lineNumber() - 50);
+    lineNumbers += cursor.lineNumber();
+    cursor.moveUp();
+    lineNumbers += cursor.lineNumber();
+  }
+  benchmark::DoNotOptimize(lineNumbers);
+  state.SetItemsProcessed(state.iterations() * 4);
+}
+BENCHMARK(BM_CursorMovement)->Arg(1000)->Arg(10000000);
+
+/** Iterates over the lines of a buffer as saving and painting do. */
+void BM_BufferIterateLines(benchmark::State& state) {
+  const int lineCount = state.range(0);
+  SyntheticFile file(lineCount);
+  std::unique_ptr<Buffer> buffer = Buffer::open(file.path());
+  for (auto _ : state) {
+    int totalSize = 0;
+    for (const QString& lineContent : TempPoint(buffer.get(), 1).linesForwards()) totalSize += lineContent.size();
+    benchmark::DoNotOptimize(totalSize);
+  }
+  state.SetItemsProcessed(state.iterations() * lineCount);
+}
+BENCHMARK(BM_BufferIterateLines)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+/** Writes a buffer back to its file. */
+void BM_BufferSave(benchmark::State& state) {
+  const int lineCount = state.range(0);
+  SyntheticFile file(lineCount);
+  std::unique_ptr<Buffer> buffer = Buffer::open(file.path());
+  for (auto _ : state) buffer->save();
+  state.SetItemsProcessed(state.iterations() * lineCount);
+}
+BENCHMARK(BM_BufferSave)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+/** Saves a mapped buffer after changing the given number of lines, spread over the whole buffer. The unchanged lines between them are copied from the file, so the time should grow with the changed lines rather than with the file. */
+void BM_BufferSaveEdited(benchmark::State& state) {
+  const int lineCount = state.range(0);
+  const int editCount = state.range(1);
+  SyntheticFile file(lineCount);
+  std::unique_ptr<Buffer> buffer = Buffer::openMapped(file.path());
+  const QString text("edit");
+  for (int edit = 0; edit < editCount; ++edit) TempPoint(buffer.get(), 1 + int(int64_t(edit) * lineCount / editCount)).insertBefore(QStringRef(&text), {});
+  for (auto _ : state) buffer->save();
+  state.SetBytesProcessed(state.iterations() * file.size());
+}
+BENCHMARK(BM_BufferSaveEdited)->ArgsProduct({{1000000}, {0, 1, 100, 10000, 100000, 1000000}})->ArgNames({"lines", "edits"})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+/** Types a character at a time in the middle of a large buffer, breaking the line every 60 characters, as a user would. Each iteration is one key press. */
+void BM_TypeCharacters(benchmark::State& state) {
+  SyntheticFile file(state.range(0));
+  std::unique_ptr<Buffer> buffer = Buffer::open(file.path());
+  Undo undo(buffer.get());
+  SafePoint cursor(SafePoint::Interactive(), buffer.get());
+  cursor.setLineNumber(buffer->lineCount() / 2);
+  const QString character("x");
+  int columnNumber = 0;
+  for (auto _ : state) {
+    if (++columnNumber == 60) {
+      cursor.insertLineBreakBefore(undo.recorder());
+      columnNumber = 0;
+    } else {
+      cursor.insertBefore(QStringRef(&character), undo.recorder());
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_TypeCharacters)->Arg(1000)->Arg(1000000);
+
+/** Types a character and deletes it with backspace, so that every iteration is an insertion followed by a deletion of the same line. */
+void BM_TypeAndDeleteCharacters(benchmark::State& state) {
+  SyntheticFile file(state.range(0));
+  std::unique_ptr<Buffer> buffer = Buffer::open(file.path());
+  Undo undo(buffer.get());
+  SafePoint cursor(SafePoint::Interactive(), buffer.get());
+  cursor.setLineNumber(buffer->lineCount() / 2);
+  cursor.setColumnNumber(10);
+  const QString character("x");
+  for (auto _ : state) {
+    cursor.insertBefore(QStringRef(&character), undo.recorder());
+    cursor.deleteCharBefore(undo.recorder());
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_TypeAndDeleteCharacters)->Arg(1000)->Arg(1000000);
+
+/** Types a character in the middle of a single line of the given length and deletes it with backspace, as in a minified file or a log without line breaks. Nothing is recorded for undo, so that only the work on the line is measured. */
+void BM_TypeInLongLine(benchmark::State& state) {
+  QTemporaryFile file;
+  file.open();
+  const std::string line(state.range(0), 'a');
+  file.write(line.data(), line.size());
+  file.close();
+  std::unique_ptr<Buffer> buffer = Buffer::open(file.fileName().toStdString());
+  SafePoint cursor(SafePoint::Interactive(), buffer.get());
+  cursor.setLineNumber(1);
+  cursor.setColumnNumber(state.range(0) / 2);
+  const QString character("x");
+  for (auto _ : state) {
+    cursor.insertBefore(QStringRef(&character), {});
+    cursor.deleteCharBefore({});
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_TypeInLongLine)->Arg(1000)->Arg(1000000)->Arg(50000000);
+
+/** Types a character and deletes it with backspace at the start of a line holding the given number of safe points after the cursor, as markers of diagnostics or search results would be. */
+void BM_TypeBeforePoints(benchmark::State& state) {
+  SyntheticFile file(1000);
+  std::unique_ptr<Buffer> buffer = Buffer::open(file.path());
+  SafePoint cursor(SafePoint::Interactive(), buffer.get());
+  cursor.setLineNumber(buffer->lineCount() / 2);
+  cursor.setColumnNumber(2);
+  std::vector<std::unique_ptr<SafePoint>> markers;
+  for (int index = 0; index < state.range(0); ++index) {
+    markers.emplace_back(new SafePoint(SafePoint::Content(), buffer.get()));
+    markers.back()->moveTo(cursor);
+    markers.back()->setColumnNumber(3 + index % (cursor.lineLength() - 3));
+  }
+  const QString character("x");
+  for (auto _ : state) {
+    cursor.insertBefore(QStringRef(&character), {});
+    cursor.deleteCharBefore({});
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_TypeBeforePoints)->Arg(1)->Arg(100)->Arg(10000);
+
+/** Makes separate edits on different lines of a large buffer, then undoes and redoes all of them. */
+void BM_UndoRedoChain(benchmark::State& state) {
+  const int editCount = state.range(0);
+  static SyntheticFile file(100000);
+  std::unique_ptr<Buffer> buffer = Buffer::open(file.path());
+  Undo undo(buffer.get());
+  const QString word("edited");
+  for (int edit = 0; edit < editCount; ++edit) {
+    // Alternating insertions and deletions, far enough apart that they aren't merged into a single operation.
+    TempPoint point(buffer.get(), 1 + edit * 7 % (buffer->lineCount() - 1));
+    point.setColumnNumber(5);
+    if (edit % 2 == 0) {
+      point.insertBefore(QStringRef(&word), undo.recorder());
+    } else {
+      TempPoint to(buffer.get(), point.lineNumber() + 1);
+      point.deleteTo(to, undo.recorder());
+    }
+  }
+  for (auto _ : state) {
+    int undone = 0;
+    while (undo.undo(nullptr)) ++undone;
+    while (undo.redo(nullptr)) --undone;
+    if (undone != 0) state.SkipWithError("Not every undone operation was redone.");
+  }
+  state.SetItemsProcessed(state.iterations() * editCount * 2);
+}
+BENCHMARK(BM_UndoRedoChain)->Arg(10)->Arg(1000)->Unit(benchmark::kMicrosecond);
+
+/** Deletes a block of lines from the middle of a large buffer and undoes the deletion, so the lines are moved to the undo buffer and back. */
+void BM_DeleteAndUndoLines(benchmark::State& state) {
+  const int deletedLineCount = state.range(0);
+  // Shared by all runs, as buffers don't free their lines.
+  static SyntheticFile file(1000000);
+  static std::unique_ptr<Buffer> buffer = Buffer::open(file.path());
+  for (auto _ : state) {
+    // A new undo history every time, so that the points of previous iterations don't pile up.
+    Undo undo(buffer.get());
+    TempPoint from(buffer.get(), 1000);
+    from.setColumnNumber(10);
+    TempPoint to(buffer.get(), 1000 + deletedLineCount);
+    to.setColumnNumber(10);
+    from.deleteTo(to, undo.recorder());
+    undo.undo(nullptr);
+  }
+  state.SetItemsProcessed(state.iterations() * deletedLineCount);
+}
+BENCHMARK(BM_DeleteAndUndoLines)->Arg(10)->Arg(1000)->Arg(100000)->Arg(900000)->Unit(benchmark::kMicrosecond);
+
+/** Replaces a word on every tenth line of a large buffer, either one edit at a time through points or as one batch, and undoes the replacements untimed. */
+void BM_ReplaceWords(benchmark::State& state) {
+  const int editCount = state.range(0);
+  const bool batched = state.range(1) != 0;
+  static SyntheticFile file(1000000);
+  static std::unique_ptr<Buffer> buffer = Buffer::open(file.path());
+  const QString replacement("gamma_delta");
+  std::vector<Edit> edits;
+  for (int edit = 0; edit < editCount; ++edit) {
+    const int lineNumber = 1 + edit * 10;
+    const int columnNumber = TempPoint(buffer.get(), lineNumber).lineContent().indexOf(QString("alpha"));
+    edits.push_back({lineNumber, columnNumber, lineNumber, columnNumber + 5, replacement});
+  }
+  for (auto _ : state) {
+    std::unique_ptr<Undo> undo(new Undo(buffer.get()));
+    if (batched) {
+      buffer->applyEdits(edits, undo->recorder());
+    } else {
+      for (const Edit& edit : edits) {
+        TempPoint from(buffer.get(), edit.startLineNumber);
+        from.setColumnNumber(edit.startColumnNumber);
+        TempPoint to(buffer.get(), edit.endLineNumber);
+        to.setColumnNumber(edit.endColumnNumber);
+        from.deleteTo(to, undo->recorder());
+        from.insertBefore(QStringRef(&edit.text), undo->recorder());
+      }
+    }
+    state.PauseTiming();
+    while (undo->undo(nullptr)) {}
+    undo.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * editCount);
+}
+BENCHMARK(BM_ReplaceWords)->ArgsProduct({{100, 10000}, {0, 1}})->ArgNames({"edits", "batched"})->Unit(benchmark::kMicrosecond);
+
+// Typing a character with an insertion point on every 100th line of a 1M-line file, as a view does for each keystroke.
+void BM_TypeAtInsertionPoints(benchmark::State& state) {
+  static SyntheticFile file(1000000);
+  static std::unique_ptr<Buffer> buffer = Buffer::open(file.path());
+  View view(buffer.get());
+  view.insertionPoint_.setLineNumber(1);
+  for (int point = 1; point < state.range(0); ++point) {
+    TempPoint line(buffer.get(), 1 + point * 100);
+    line.setColumnNumber(10);
+    view.addInsertionPoint(line);
+  }
+  const QString text("x");
+  View::EditedLines editedLines;
+  for (auto _ : state) {
+    view.insertAtInsertionPoints(text, &editedLines);
+    state.PauseTiming();
+    view.undo_.undo(nullptr);
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_TypeAtInsertionPoints)->Arg(1)->Arg(100)->Arg(10000)->Unit(benchmark::kMicrosecond);
+
+}  // namespace
+}  // namespace Editor
+}  // namespace Med
@@ -1,7 +1,17 @@
 #include "Buffer.h"
 
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <thread>
+#include <QtCore/QTemporaryFile>
 #include <QtCore/QTextStream>
 
+#include "BufferLoader.h"
+#include "BufferSaver.h"
+#include "Undo.h"
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -15,6 +25,53 @@ protected:
     buffer.initFromStream(&stream, "test");
   }
 
+  std::vector<std::string> lines() {
+    std::vector<std::string> lines;
+    TempPoint start(&buffer, 1);
+    for (const QString& lineContent : start.linesForwards()) {
+      lines.push_back(lineContent.toStdString());
+    }
+    return lines;
+  }
+
+  // Enough lines to fill several read blocks, so that lines and "\r\n" are split between blocks, and a line longer than a block.
+  static std::string largeFileContent(std::vector<std::string>* expected, int* characterCount) {
+    std::string content = "\xEF\xBB\xBF";
+    *characterCount = 0;
+    for (int index = 0; content.size() < 3000000; ++index) {
+      std::string line = std::to_string(index) + (index % 3 == 0 ? " \xC3\xA9\xF0\x9F\x98\x80" : " ascii") + std::string(index % 50, 'x');
+      if (index == 20000) line = std::string(2500000, 'y') + "\xE2\x82\xAC";
+      if (index == 30000) line += "\xFF";
+      content += line + (index % 7 == 0 ? "\r\n" : "\n");
+      expected->push_back(index == 30000 ? QString::fromUtf8(line.data(), line.size()).toStdString() : line);
+      *characterCount += QString::fromUtf8(line.data(), line.size()).size() + 1;
+    }
+    // The last line has no line break.
+    content += "last";
+    expected->push_back("last");
+    *characterCount += 4;
+    return content;
+  }
+
+  static std::vector<std::string> linesOf(Buffer* buffer) {
+    std::vector<std::string> lines;
+    for (const QString& lineContent : TempPoint(buffer, 1).linesForwards()) lines.push_back(lineContent.toStdString());
+    return lines;
+  }
+
+  static std::string fileContent(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  }
+
+  static int64_t lineNodeSize() { return sizeof(Buffer::Tree::Node); }
+  static int64_t pointTreeSize() { return sizeof(Buffer::PointTree); }
+  static int64_t pointNodeSize() { return sizeof(Buffer::PointTree::Node); }
+
+  bool isLatin1(int lineNumber) { return !buffer.line(lineNumber)->node->value.latin1.isNull(); }
+  static bool isRope(Buffer& buffer, int lineNumber) { return buffer.line(lineNumber)->node->value.rope != nullptr; }
+  static int ropeLength() { return Buffer::ropeLength; }
+
   Buffer buffer;
 };
 
@@ -31,8 +88,8 @@ TEST_F(BufferTest, IterateFromLineNumber) {
   ASSERT_TRUE(from.isValid());
   {
     std::vector<std::string> lines;
-    for (const QString* lineContent : from.linesForwards()) {
-      lines.push_back(lineContent->trimmed().toStdString());
+    for (const QString& lineContent : from.linesForwards()) {
+      lines.push_back(lineContent.trimmed().toStdString());
     }
     EXPECT_THAT(lines,
                 testing::ElementsAre("second line",
@@ -41,8 +98,8 @@ TEST_F(BufferTest, IterateFromLineNumber) {
   }
   {
     std::vector<std::string> lines;
-    for (const QString* lineContent : from.linesForwards()) {
-      lines.push_back(lineContent->trimmed().toStdString());
+    for (const QString& lineContent : from.linesForwards()) {
+      lines.push_back(lineContent.trimmed().toStdString());
       // Breaking before reaching the end of the iterator should work.
       if (lines.size() == 2) break;
     }
@@ -52,5 +109,727 @@ TEST_F(BufferTest, IterateFromLineNumber) {
   }
 }
 
+TEST_F(BufferTest, DeleteAndUndoAcrossLines) {
+  InitBuffer("zero\none\ntwo\nthree\nfour\nfive");
+  Undo undo(&buffer);
+  SafePoint insertionPoint(SafePoint::Interactive(), &buffer);
+  SafePoint inDeletedLine(SafePoint::Interactive(), &buffer);
+  SafePoint afterDeletion(SafePoint::Interactive(), &buffer);
+  SafePoint lastLine(SafePoint::Interactive(), &buffer);
+  inDeletedLine.setLineNumber(4);
+  inDeletedLine.setColumnNumber(3);
+  afterDeletion.setLineNumber(5);
+  afterDeletion.setColumnNumber(3);
+  lastLine.setLineNumber(6);
+  insertionPoint.setLineNumber(2);
+  insertionPoint.setColumnNumber(1);
+  TempPoint to(&buffer, 5);
+  to.setColumnNumber(2);
+
+  ASSERT_TRUE(insertionPoint.deleteTo(to, undo.recorder()));
+  EXPECT_THAT(lines(), testing::ElementsAre("zero", "our", "five"));
+  EXPECT_EQ(3, buffer.lineCount());
+  EXPECT_EQ(2, inDeletedLine.lineNumber());
+  EXPECT_EQ(1, inDeletedLine.columnNumber());
+  EXPECT_EQ(2, afterDeletion.lineNumber());
+  EXPECT_EQ(2, afterDeletion.columnNumber());
+  EXPECT_EQ(3, lastLine.lineNumber());
+
+  ASSERT_TRUE(undo.undo(&insertionPoint));
+  EXPECT_THAT(lines(), testing::ElementsAre("zero", "one", "two", "three", "four", "five"));
+  EXPECT_EQ(6, buffer.lineCount());
+  EXPECT_EQ(6, lastLine.lineNumber());
+  ASSERT_TRUE(undo.redo(&insertionPoint));
+  EXPECT_THAT(lines(), testing::ElementsAre("zero", "our", "five"));
+}
+
+TEST_F(BufferTest, DeleteLineBreak) {
+  InitBuffer("ab\ncd\nef");
+  TempPoint point(&buffer, 1);
+  point.moveToLineEnd();
+  ASSERT_TRUE(point.deleteCharAfter({}));
+  EXPECT_THAT(lines(), testing::ElementsAre("abcd", "ef"));
+  point.setLineNumber(2);
+  point.moveToLineStart();
+  ASSERT_TRUE(point.deleteCharBefore({}));
+  EXPECT_THAT(lines(), testing::ElementsAre("abcdef"));
+  EXPECT_EQ(1, point.lineNumber());
+  EXPECT_EQ(4, point.columnNumber());
+}
+
+TEST_F(BufferTest, LatinLinesWidenOnlyWhenNeeded) {
+  InitBuffer("ascii\ncaf\xC3\xA9\n\xE2\x82\xAC""10");
+  EXPECT_TRUE(isLatin1(1));
+  EXPECT_TRUE(isLatin1(2));
+  EXPECT_FALSE(isLatin1(3));
+  TempPoint point(&buffer, 1);
+  point.setColumnNumber(2);
+  const QString latin1 = QString::fromUtf8("\xC3\xBC");
+  ASSERT_TRUE(point.insertBefore(QStringRef(&latin1), {}));
+  EXPECT_TRUE(isLatin1(1));
+  EXPECT_EQ(3, point.columnNumber());
+  const QString wide = QString::fromUtf8("\xF0\x9F\x98\x80");
+  ASSERT_TRUE(point.insertBefore(QStringRef(&wide), {}));
+  EXPECT_FALSE(isLatin1(1));
+  // Columns still count UTF-16 code units.
+  EXPECT_EQ(5, point.columnNumber());
+  EXPECT_EQ(8, point.lineLength());
+  point.moveToLineEnd();
+  ASSERT_TRUE(point.deleteCharAfter({}));
+  EXPECT_THAT(lines(), testing::ElementsAre("as\xC3\xBC\xF0\x9F\x98\x80""ciicaf\xC3\xA9", "\xE2\x82\xAC""10"));
+  // A line split off a wide line is narrow again if its text is Latin-1.
+  point.setLineNumber(2);
+  point.setColumnNumber(1);
+  ASSERT_TRUE(point.insertLineBreakBefore({}));
+  EXPECT_FALSE(isLatin1(2));
+  EXPECT_TRUE(isLatin1(3));
+  EXPECT_EQ("10", point.lineContent().toStdString());
+}
+
+TEST_F(BufferTest, EditLongLines) {
+  const std::string longLine = std::string(ropeLength(), 'a') + "\xE2\x82\xAC" + std::string(100, 'b');
+  QTemporaryFile file;
+  ASSERT_TRUE(file.open());
+  file.write(("first\n" + longLine + "\nlast").c_str());
+  file.close();
+  std::unique_ptr<Buffer> opened = Buffer::open(file.fileName().toStdString());
+  Undo undo(opened.get());
+  const BufferSnapshot beforeEdit = opened->snapshot();
+  // Typing in a long line makes it a rope, which snapshots share.
+  TempPoint point(opened.get(), 2);
+  point.setColumnNumber(1000);
+  const QString typed("xy");
+  ASSERT_TRUE(point.insertBefore(QStringRef(&typed), undo.recorder()));
+  EXPECT_TRUE(isRope(*opened, 2));
+  EXPECT_EQ(1002, point.columnNumber());
+  const BufferSnapshot typedSnapshot = opened->snapshot();
+  ASSERT_TRUE(point.deleteCharBefore(undo.recorder()));
+  std::string expected = longLine;
+  expected.insert(1000, "x");
+  EXPECT_EQ(expected, point.lineContent().toStdString());
+  EXPECT_EQ(QString::fromUtf8(longLine.data(), longLine.size()).size() + 1, point.lineLength());
+  // Deleting across lines joins the rest of the long line to the first one.
+  TempPoint from(opened.get(), 1);
+  from.setColumnNumber(3);
+  TempPoint to(opened.get(), 2);
+  to.setColumnNumber(5);
+  ASSERT_TRUE(from.deleteTo(to, undo.recorder()));
+  EXPECT_EQ("fir" + expected.substr(5), from.lineContent().toStdString());
+  EXPECT_EQ(longLine, beforeEdit.lineContent(2).toStdString());
+  EXPECT_EQ(longLine.substr(0, 1000) + "xy" + longLine.substr(1000), typedSnapshot.lineContent(2).toStdString());
+  ASSERT_TRUE(opened->save());
+  EXPECT_EQ("fir" + expected.substr(5) + "\nlast\n", fileContent(file.fileName().toStdString()));
+  ASSERT_TRUE(undo.undo(nullptr));
+  ASSERT_TRUE(undo.undo(nullptr));
+  ASSERT_TRUE(undo.undo(nullptr));
+  EXPECT_THAT(linesOf(opened.get()), testing::ElementsAre("first", longLine, "last"));
+}
+
+TEST_F(BufferTest, MemoryStats) {
+  InitBuffer("first line\nsecond line\nthird line");
+  const MemoryStats initial = buffer.memoryStats();
+  EXPECT_LT(3 * 10, initial.lineText);
+  EXPECT_EQ(3 * lineNodeSize(), initial.lineNodes);
+  EXPECT_LT(0, initial.snapshotNodes);
+  EXPECT_EQ(0, initial.points);
+  EXPECT_EQ(0, initial.mappedText);
+  Undo undo(&buffer);
+  EXPECT_EQ(0, undo.memoryStats().heapBytes());
+  SafePoint cursor(SafePoint::Interactive(), &buffer);
+  cursor.setLineNumber(2);
+  TempPoint end(cursor);
+  end.moveToLineEnd();
+  // The op keeps the deleted text, and a point on the buffer.
+  ASSERT_TRUE(cursor.deleteTo(end, undo.recorder()));
+  const MemoryStats edited = buffer.memoryStats();
+  // Both points are at the start of the deleted text, on the same line.
+  EXPECT_EQ(pointTreeSize() + 2 * (int64_t(sizeof(SafePoint)) + pointNodeSize()), edited.points);
+  EXPECT_GT(initial.lineText, edited.lineText);
+  EXPECT_LT(lineNodeSize(), undo.memoryStats().undo);
+}
+
+TEST_F(BufferTest, Offsets) {
+  InitBuffer("zero\none\ntwo\nthree");
+  EXPECT_EQ(18, buffer.characterCount());
+  TempPoint point(&buffer, 3);
+  point.setColumnNumber(1);
+  EXPECT_EQ(10, point.offset());
+  TempPoint lastLine(&buffer, 4);
+  EXPECT_EQ(13, lastLine.offset());
+
+  // The offset of a line break is the end of its line.
+  for (int64_t offset : {0, 4, 5, 8, 9, 13, 18}) {
+    point.setOffset(offset);
+    EXPECT_EQ(offset, point.offset());
+  }
+  point.setOffset(4);
+  EXPECT_EQ(1, point.lineNumber());
+  EXPECT_EQ(4, point.columnNumber());
+  point.setOffset(5);
+  EXPECT_EQ(2, point.lineNumber());
+  EXPECT_EQ(0, point.columnNumber());
+  point.setOffset(100);
+  EXPECT_EQ(4, point.lineNumber());
+  EXPECT_EQ(5, point.columnNumber());
+  point.setOffset(-1);
+  EXPECT_EQ(0, point.offset());
+
+  point.setOffset(6);
+  point.insertBefore(std::vector<QStringRef>{QStringRef(), QStringRef()}, {});
+  EXPECT_EQ(7, point.offset());
+  EXPECT_EQ(14, lastLine.offset());
+  EXPECT_EQ(19, buffer.characterCount());
+  TempPoint from(&buffer, 1);
+  from.setColumnNumber(2);
+  from.deleteTo(point, {});
+  EXPECT_EQ(2, from.offset());
+  EXPECT_EQ(9, lastLine.offset());
+  EXPECT_EQ(14, buffer.characterCount());
+}
+
+TEST_F(BufferTest, MoveBetweenLines) {
+  std::string content;
+  for (int lineNumber = 1; lineNumber <= 100; ++lineNumber) content += "line " + std::to_string(lineNumber) + "\n";
+  InitBuffer(content.c_str());
+  const int lineCount = buffer.lineCount();
+  TempPoint point(&buffer, 50);
+  for (int lineNumber : {51, 49, 1, 100, lineCount, 60, 2, 99}) {
+    point.setLineNumber(lineNumber);
+    EXPECT_EQ(lineNumber, point.lineNumber());
+    EXPECT_EQ("line " + std::to_string(lineNumber), point.lineContent().toStdString());
+  }
+  point.setLineNumber(0);
+  EXPECT_EQ(1, point.lineNumber());
+
+  for (int count : {0, 1, 10, -3, 50, -57}) {
+    const int lineNumber = point.lineNumber();
+    point.moveLines(count);
+    EXPECT_EQ(lineNumber + count, point.lineNumber());
+  }
+  // Stops at the first and last lines.
+  point.moveLines(-1000);
+  EXPECT_EQ(1, point.lineNumber());
+  point.moveLines(1000);
+  EXPECT_EQ(lineCount, point.lineNumber());
+
+  TempPoint other(&buffer, 3);
+  TempPoint* first;
+  TempPoint* second;
+  Point::sortPair(&point, &other, &first, &second);
+  EXPECT_EQ(&other, first);
+  EXPECT_EQ(&point, second);
+}
+
+TEST_F(BufferTest, ApplyEdits) {
+  InitBuffer("zero one two\nthree four\nfive six seven\neight");
+  Undo undo(&buffer);
+  SafePoint afterOne(SafePoint::Interactive(), &buffer);
+  afterOne.setLineNumber(1);
+  afterOne.setColumnNumber(8);
+  SafePoint inSix(SafePoint::Interactive(), &buffer);
+  inSix.setLineNumber(3);
+  inSix.setColumnNumber(6);
+  SafePoint lastLine(SafePoint::Interactive(), &buffer);
+  lastLine.setLineNumber(4);
+  lastLine.setColumnNumber(2);
+
+  // Overlapping or out of range edits change nothing.
+  EXPECT_FALSE(buffer.applyEdits({{1, 0, 1, 3, "a"}, {1, 2, 1, 4, "b"}}, undo.recorder()));
+  EXPECT_FALSE(buffer.applyEdits({{1, 0, 1, 0, "a"}, {5, 0, 5, 0, "b"}}, undo.recorder()));
+  EXPECT_FALSE(buffer.applyEdits({{4, 6, 4, 6, "b"}}, undo.recorder()));
+  EXPECT_FALSE(buffer.applyEdits({{2, 3, 1, 5, "b"}}, undo.recorder()));
+  EXPECT_THAT(lines(), testing::ElementsAre("zero one two", "three four", "five six seven", "eight"));
+
+  ASSERT_TRUE(buffer.applyEdits({{3, 5, 3, 8, "6"}, {2, 5, 3, 4, "!\n"}, {1, 5, 1, 8, "1"}, {4, 5, 4, 5, "\nnine"}, {1, 0, 1, 0, "<"}}, undo.recorder()));
+  EXPECT_THAT(lines(), testing::ElementsAre("<zero 1 two", "three!", " 6 seven", "eight", "nine"));
+  EXPECT_EQ(1, afterOne.lineNumber());
+  EXPECT_EQ(7, afterOne.columnNumber());
+  EXPECT_EQ(3, inSix.lineNumber());
+  EXPECT_EQ(2, inSix.columnNumber());
+  EXPECT_EQ(4, lastLine.lineNumber());
+  EXPECT_EQ(2, lastLine.columnNumber());
+
+  // The edits are undone and redone as one operation.
+  ASSERT_TRUE(undo.undo(nullptr));
+  EXPECT_THAT(lines(), testing::ElementsAre("zero one two", "three four", "five six seven", "eight"));
+  EXPECT_FALSE(undo.undo(nullptr));
+  ASSERT_TRUE(undo.redo(nullptr));
+  EXPECT_THAT(lines(), testing::ElementsAre("<zero 1 two", "three!", " 6 seven", "eight", "nine"));
+  EXPECT_FALSE(undo.redo(nullptr));
+}
+
+TEST_F(BufferTest, ApplyRandomEditsAndUndo) {
+  std::string content;
+  for (int lineNumber = 1; lineNumber <= 30; ++lineNumber) content += "line " + std::to_string(lineNumber) + " of text\n";
+  InitBuffer(content.c_str());
+  Undo undo(&buffer);
+  std::mt19937 random(1357);
+  auto uniform = [&random](int min, int max) { return std::uniform_int_distribution<int>(min, max)(random); };
+  const std::string alphabet = "ab\n";
+  auto randomText = [&] {
+    std::string text;
+    for (int length = uniform(0, 4); length > 0; --length) text += alphabet[uniform(0, alphabet.size() - 1)];
+    return text;
+  };
+  std::vector<std::unique_ptr<SafePoint>> points;
+  // The content after each batch, to check undoing and redoing against.
+  std::vector<std::vector<std::string>> states{lines()};
+  for (int round = 0; round < 60; ++round) {
+    const std::vector<std::string> before = lines();
+    // Offsets of the line starts, to check the edits against the same edits made to a string.
+    std::string text;
+    std::vector<int> lineOffsets;
+    for (const std::string& line : before) {
+      lineOffsets.push_back(text.size());
+      text += line + "\n";
+    }
+    text.pop_back();
+    auto randomPosition = [&] {
+      const int lineNumber = uniform(1, before.size());
+      return std::make_pair(lineNumber, uniform(0, before[lineNumber - 1].size()));
+    };
+    if (round % 4 == 3) {
+      // Content points are left along the way, and the edits that replace their text move them through the undo buffer.
+      const std::pair<int, int> position = randomPosition();
+      points.emplace_back(new SafePoint(SafePoint::Content(), &buffer));
+      points.back()->setLineNumber(position.first);
+      points.back()->setColumnNumber(position.second);
+      continue;
+    }
+    std::vector<std::pair<int, int>> positions;
+    for (int index = 2 * uniform(1, 8); index > 0; --index) positions.push_back(randomPosition());
+    std::sort(positions.begin(), positions.end());
+    std::vector<Edit> edits;
+    for (std::size_t index = 0; index < positions.size(); index += 2) {
+      // Insertions at the same position would depend on the order they are given in, which is shuffled below.
+      if (index > 0 && positions[index - 1] == positions[index + 1]) continue;
+      edits.push_back({positions[index].first, positions[index].second, positions[index + 1].first, positions[index + 1].second, QString::fromStdString(randomText())});
+    }
+    // Made to the string from the last one back, so that the offsets of the earlier ones still hold.
+    for (auto edit = edits.rbegin(); edit != edits.rend(); ++edit) {
+      const int start = lineOffsets[edit->startLineNumber - 1] + edit->startColumnNumber;
+      const int end = lineOffsets[edit->endLineNumber - 1] + edit->endColumnNumber;
+      text.replace(start, end - start, edit->text.toStdString());
+    }
+    std::shuffle(edits.begin(), edits.end(), random);
+    ASSERT_TRUE(buffer.applyEdits(edits, undo.recorder()));
+    std::vector<std::string> expected;
+    for (std::size_t start = 0;;) {
+      const std::size_t end = text.find('\n', start);
+      expected.push_back(text.substr(start, end == std::string::npos ? std::string::npos : end - start));
+      if (end == std::string::npos) break;
+      start = end + 1;
+    }
+    ASSERT_EQ(expected, lines()) << "round " << round;
+    states.push_back(expected);
+  }
+  for (std::size_t state = states.size() - 1; state > 0; --state) {
+    ASSERT_TRUE(undo.undo(nullptr));
+    ASSERT_EQ(states[state - 1], lines()) << "undoing to state " << state - 1;
+  }
+  for (std::size_t state = 1; state < states.size(); ++state) {
+    ASSERT_TRUE(undo.redo(nullptr));
+    ASSERT_EQ(states[state], lines()) << "redoing to state " << state;
+  }
+  // Points in replaced text are kept by the undo buffers of the ops that can restore it.
+  for (const auto& point : points) EXPECT_LE(point->columnNumber(), point->lineLength());
+}
+
+TEST_F(BufferTest, LineNumbersFollowLineChanges) {
+  std::string content;
+  for (int lineNumber = 1; lineNumber <= 50; ++lineNumber) content += "line " + std::to_string(lineNumber) + "\n";
+  InitBuffer(content.c_str());
+  Undo undo(&buffer);
+  std::mt19937 random(2468);
+  auto uniform = [&random](int min, int max) { return std::uniform_int_distribution<int>(min, max)(random); };
+  SafePoint cursor(SafePoint::Interactive(), &buffer);
+  SafePoint mark(SafePoint::Interactive(), &buffer);
+  cursor.setLineNumber(1);
+  mark.setLineNumber(buffer.lineCount());
+  // Moves and edits in any order, so that line numbers are asked for both when they are known and after lines were inserted, deleted, or moved to the undo buffer and back.
+  for (int step = 0; step < 1000; ++step) {
+    SafePoint& point = uniform(0, 1) == 0 ? cursor : mark;
+    switch (uniform(0, 7)) {
+      case 0: point.moveUp(); break;
+      case 1: point.moveDown(); break;
+      case 2: point.moveLines(uniform(-5, 5)); break;
+      case 3: point.setLineNumber(uniform(1, buffer.lineCount())); break;
+      case 4: point.setOffset(uniform(0, buffer.characterCount())); break;
+      case 5: point.moveTo(&point == &cursor ? mark : cursor); break;
+      case 6: ASSERT_TRUE(TempPoint(&buffer, uniform(1, buffer.lineCount())).insertLineBreakBefore(undo.recorder())); break;
+      case 7: {
+        if (buffer.lineCount() < 10) break;
+        TempPoint from(&buffer, uniform(1, buffer.lineCount()));
+        TempPoint to(from);
+        to.moveLines(uniform(1, 3));
+        ASSERT_TRUE(from.deleteTo(to, undo.recorder()));
+        // Undoing moves the lines back from the undo buffer.
+        if (uniform(0, 1) == 0) ASSERT_TRUE(undo.undo(nullptr));
+        break;
+      }
+    }
+    const BufferSnapshot snapshot = buffer.snapshot();
+    for (const SafePoint* checked : {&cursor, &mark}) {
+      int lineNumber;
+      int columnNumber;
+      snapshot.position(checked->offset(), &lineNumber, &columnNumber);
+      ASSERT_EQ(lineNumber, checked->lineNumber()) << "step " << step;
+    }
+  }
+}
+
+TEST_F(BufferTest, PointsFollowEdits) {
+  InitBuffer("zero one two\nthree four\nfive six seven\neight");
+  std::mt19937 random(4321);
+  auto uniform = [&random](int min, int max) { return std::uniform_int_distribution<int>(min, max)(random); };
+  // Many points on few lines, so that several share a column, with the positions they must have.
+  std::vector<std::unique_ptr<SafePoint>> points;
+  std::vector<std::pair<int, int>> expected;
+  for (int index = 0; index < 60; ++index) {
+    points.emplace_back(index % 2 == 0 ? new SafePoint(SafePoint::Content(), &buffer) : new SafePoint(SafePoint::Interactive(), &buffer));
+    points.back()->setLineNumber(uniform(1, buffer.lineCount()));
+    points.back()->setColumnNumber(uniform(0, points.back()->lineLength()));
+    expected.emplace_back(points.back()->lineNumber(), points.back()->columnNumber());
+  }
+  auto randomPoint = [&] {
+    TempPoint point(&buffer, uniform(1, buffer.lineCount()));
+    point.setColumnNumber(uniform(0, point.lineLength()));
+    return point;
+  };
+  const QString text("text");
+  for (int step = 0; step < 300; ++step) {
+    const int operation = uniform(0, 2);
+    TempPoint at = randomPoint();
+    const std::pair<int, int> position(at.lineNumber(), at.columnNumber());
+    if (operation == 0) {
+      ASSERT_TRUE(at.insertBefore(QStringRef(&text), {}));
+      for (std::pair<int, int>& point : expected) {
+        if (point.first == position.first && point.second >= position.second) point.second += text.size();
+      }
+    } else if (operation == 1) {
+      ASSERT_TRUE(at.insertLineBreakBefore({}));
+      for (std::pair<int, int>& point : expected) {
+        if (point.first == position.first && point.second >= position.second) {
+          point = {point.first + 1, point.second - position.second};
+        } else if (point.first > position.first) {
+          ++point.first;
+        }
+      }
+    } else {
+      // Deleting at most a few lines, so that the buffer keeps some.
+      TempPoint to = randomPoint();
+      if (std::abs(to.lineNumber() - at.lineNumber()) > 2 || buffer.lineCount() < 3) continue;
+      TempPoint* from = &at;
+      TempPoint* end = &to;
+      Point::sortPair(&at, &to, &from, &end);
+      const std::pair<int, int> start(from->lineNumber(), from->columnNumber());
+      const std::pair<int, int> stop(end->lineNumber(), end->columnNumber());
+      ASSERT_TRUE(from->deleteTo(*end, {}));
+      // Points in the deleted text collapse to its start; those after it on its last line go to the first one.
+      for (std::pair<int, int>& point : expected) {
+        if (point > start && point < stop) {
+          point = start;
+        } else if (point.first == stop.first && point >= stop) {
+          point = {start.first, start.second + point.second - stop.second};
+        } else if (point.first > stop.first) {
+          point.first -= stop.first - start.first;
+        }
+      }
+    }
+    for (std::size_t index = 0; index < points.size(); ++index) {
+      ASSERT_EQ(expected[index], std::make_pair(points[index]->lineNumber(), points[index]->columnNumber())) << "step " << step << ", point " << index;
+    }
+  }
+}
+
+TEST_F(BufferTest, SnapshotsDontSeeChanges) {
+  InitBuffer("zero\none\ntwo\nthree");
+  const BufferSnapshot initial = buffer.snapshot();
+  Undo undo(&buffer);
+  TempPoint point(&buffer, 2);
+  point.setColumnNumber(1);
+  const QString newText("new"), linesText("lines");
+  ASSERT_TRUE(point.insertBefore(std::vector<QStringRef>{QStringRef(&newText), QStringRef(&linesText), QStringRef()}, undo.recorder()));
+  TempPoint from(&buffer, 1);
+  from.setColumnNumber(2);
+  TempPoint to(&buffer, 5);
+  to.setColumnNumber(1);
+  const BufferSnapshot inserted = buffer.snapshot();
+  ASSERT_TRUE(from.deleteTo(to, undo.recorder()));
+  const BufferSnapshot deleted = buffer.snapshot();
+  EXPECT_THAT(lines(), testing::ElementsAre("zewo", "three"));
+
+  auto snapshotLines = [](const BufferSnapshot& snapshot) {
+    std::vector<std::string> lines;
+    for (const QString& lineContent : snapshot.linesForwards(1)) lines.push_back(lineContent.toStdString());
+    return lines;
+  };
+  EXPECT_THAT(snapshotLines(initial), testing::ElementsAre("zero", "one", "two", "three"));
+  EXPECT_THAT(snapshotLines(inserted), testing::ElementsAre("zero", "onew", "lines", "ne", "two", "three"));
+  EXPECT_THAT(snapshotLines(deleted), testing::ElementsAre("zewo", "three"));
+  EXPECT_EQ(4, initial.lineCount());
+  EXPECT_EQ(18, initial.characterCount());
+  EXPECT_EQ(6, inserted.lineCount());
+  EXPECT_EQ(28, inserted.characterCount());
+  EXPECT_EQ(2, deleted.lineCount());
+  EXPECT_EQ("ne", inserted.lineContent(4).toStdString());
+  EXPECT_TRUE(inserted.lineContent(7).isNull());
+
+  EXPECT_EQ(10, initial.offset(3, 1));
+  int lineNumber;
+  int columnNumber;
+  initial.position(10, &lineNumber, &columnNumber);
+  EXPECT_EQ(3, lineNumber);
+  EXPECT_EQ(1, columnNumber);
+  inserted.position(inserted.offset(4, 1), &lineNumber, &columnNumber);
+  EXPECT_EQ(4, lineNumber);
+  EXPECT_EQ(1, columnNumber);
+
+  ASSERT_TRUE(undo.undo(nullptr));
+  ASSERT_TRUE(undo.undo(nullptr));
+  EXPECT_THAT(lines(), testing::ElementsAre("zero", "one", "two", "three"));
+  EXPECT_THAT(snapshotLines(buffer.snapshot()), testing::ElementsAre("zero", "one", "two", "three"));
+  EXPECT_THAT(snapshotLines(deleted), testing::ElementsAre("zewo", "three"));
+}
+
+TEST_F(BufferTest, OpenMapped) {
+  QTemporaryFile file;
+  ASSERT_TRUE(file.open());
+  // A byte order mark, a line ending with "\r\n", non-ASCII text, invalid UTF-8 and an empty line.
+  file.write("\xEF\xBB\xBFzero\r\n\xC3\xA9t\xC3\xA9 \xF0\x9F\x98\x80\nbad \xFF\n\nfour\n");
+  file.close();
+  std::unique_ptr<Buffer> mapped = Buffer::openMapped(file.fileName().toStdString());
+  EXPECT_EQ(5, mapped->lineCount());
+  // Lengths count UTF-16 code units, and the invalid byte is replaced by one character.
+  EXPECT_EQ(4 + 1 + 6 + 1 + 5 + 1 + 0 + 1 + 4, mapped->characterCount());
+  TempPoint fourth(mapped.get(), 4);
+  EXPECT_EQ(4 + 1 + 6 + 1 + 5 + 1, fourth.offset());
+  const BufferSnapshot beforeEdit = mapped->snapshot();
+
+  std::vector<std::string> lines;
+  for (const QString& lineContent : TempPoint(mapped.get(), 1).linesForwards()) lines.push_back(lineContent.toStdString());
+  EXPECT_THAT(lines, testing::ElementsAre("zero", "\xC3\xA9t\xC3\xA9 \xF0\x9F\x98\x80", QString::fromUtf8("bad \xFF").toStdString(), "", "four"));
+
+  // Deleting lines moves them to the undo buffer still mapped, and undoing brings them back.
+  {
+    Undo undo(mapped.get());
+    TempPoint from(mapped.get(), 1);
+    from.setColumnNumber(2);
+    TempPoint to(mapped.get(), 5);
+    ASSERT_TRUE(from.deleteTo(to, undo.recorder()));
+    EXPECT_EQ("zefour", from.lineContent().toStdString());
+    ASSERT_TRUE(undo.undo(nullptr));
+    EXPECT_EQ(5, mapped->lineCount());
+    TempPoint second(mapped.get(), 2);
+    EXPECT_EQ("\xC3\xA9t\xC3\xA9 \xF0\x9F\x98\x80", second.lineContent().toStdString());
+  }
+  TempPoint last(mapped.get(), 5);
+  last.moveToLineEnd();
+  QString added(" changed");
+  ASSERT_TRUE(last.insertBefore(QStringRef(&added), {}));
+  EXPECT_EQ("four", beforeEdit.lineContent(5).toStdString());
+  EXPECT_EQ("\xC3\xA9t\xC3\xA9 \xF0\x9F\x98\x80", beforeEdit.lineContent(2).toStdString());
+
+  // Saving replaces the mapped file, which the buffer and the snapshot still read from.
+  ASSERT_TRUE(mapped->save());
+  EXPECT_EQ("four", beforeEdit.lineContent(5).toStdString());
+  std::unique_ptr<Buffer> reopened = Buffer::open(file.fileName().toStdString());
+  lines.clear();
+  for (const QString& lineContent : TempPoint(reopened.get(), 1).linesForwards()) lines.push_back(lineContent.toStdString());
+  EXPECT_THAT(lines, testing::ElementsAre("zero", "\xC3\xA9t\xC3\xA9 \xF0\x9F\x98\x80", QString::fromUtf8("bad \xFF").toStdString(), "", "four changed"));
+}
+
+TEST_F(BufferTest, OpenReadsLinesAcrossBlocks) {
+  std::vector<std::string> expected;
+  int characterCount;
+  const std::string content = largeFileContent(&expected, &characterCount);
+  QTemporaryFile file;
+  ASSERT_TRUE(file.open());
+  file.write(content.data(), content.size());
+  file.close();
+  // With several threads the file is split into chunks between lines, and mapped files are split as well.
+  for (int threadCount : {1, 3}) {
+    for (bool mapped : {false, true}) {
+      SCOPED_TRACE(testing::Message() << threadCount << " threads" << (mapped ? ", mapped" : ""));
+      std::unique_ptr<Buffer> opened = mapped ? Buffer::openMapped(file.fileName().toStdString(), threadCount) : Buffer::open(file.fileName().toStdString(), threadCount);
+      EXPECT_EQ(int(expected.size()), opened->lineCount());
+      EXPECT_EQ(characterCount, opened->characterCount());
+      EXPECT_TRUE(linesOf(opened.get()) == expected);
+      TempPoint last(opened.get(), opened->lineCount());
+      EXPECT_EQ(characterCount - 4, last.offset());
+    }
+  }
+}
+
+TEST_F(BufferTest, SaveCopiesUnchangedLines) {
+  std::vector<std::string> expected;
+  int characterCount;
+  const std::string content = largeFileContent(&expected, &characterCount);
+  QTemporaryFile file;
+  ASSERT_TRUE(file.open());
+  file.write(content.data(), content.size());
+  file.close();
+  std::unique_ptr<Buffer> mapped = Buffer::openMapped(file.fileName().toStdString());
+  auto savedContent = [&] { return fileContent(file.fileName().toStdString()); };
+  auto expectedContent = [&] {
+    std::string expected;
+    for (const std::string& line : linesOf(mapped.get())) expected += line + "\n";
+    return expected;
+  };
+  // Lines changed at the start, in the middle of runs of unchanged lines, across lines and next to the long line, and lines that are only read.
+  const QString text("changed");
+  TempPoint(mapped.get(), 1).insertBefore(QStringRef(&text), {});
+  TempPoint(mapped.get(), 5000).insertBefore(QStringRef(&text), {});
+  TempPoint from(mapped.get(), 10000);
+  from.setColumnNumber(3);
+  TempPoint to(mapped.get(), 10003);
+  from.deleteTo(to, {});
+  TempPoint(mapped.get(), 20000).insertLineBreakBefore({});
+  TempPoint(mapped.get(), 15000).lineContent();
+  ASSERT_TRUE(mapped->save());
+  EXPECT_TRUE(savedContent() == expectedContent());
+
+  // The file was replaced, and the unchanged lines are now copied from the old one.
+  TempPoint(mapped.get(), mapped->lineCount()).insertBefore(QStringRef(&text), {});
+  ASSERT_TRUE(mapped->save());
+  EXPECT_TRUE(savedContent() == expectedContent());
+}
+
+TEST_F(BufferTest, SaveInBackground) {
+  std::vector<std::string> expected;
+  int characterCount;
+  const std::string content = largeFileContent(&expected, &characterCount);
+  QTemporaryFile file;
+  ASSERT_TRUE(file.open());
+  file.write(content.data(), content.size());
+  file.close();
+  const std::string path = file.fileName().toStdString();
+  for (bool mapped : {false, true}) {
+    SCOPED_TRACE(mapped ? "mapped" : "read");
+    std::unique_ptr<Buffer> opened = mapped ? Buffer::openMapped(path) : Buffer::open(path);
+    Undo undo(opened.get());
+    const QString text("changed");
+    TempPoint(opened.get(), 2).insertBefore(QStringRef(&text), undo.recorder());
+    std::string expectedContent;
+    for (const std::string& line : linesOf(opened.get())) expectedContent += line + "\n";
+    const Undo::State savedState = undo.checkpoint();
+    BufferSaver saver(opened.get());
+    // Changes made while saving aren't saved.
+    TempPoint(opened.get(), 2).insertBefore(QStringRef(&text), undo.recorder());
+    TempPoint(opened.get(), 1).insertLineBreakBefore(undo.recorder());
+    while (!saver.finished()) std::this_thread::yield();
+    EXPECT_EQ(1.0, saver.progress());
+    EXPECT_TRUE(fileContent(path) == expectedContent);
+    // Undoing the changes made while saving comes back to the saved state.
+    undo.setUnmodified(savedState);
+    EXPECT_TRUE(undo.modified());
+    ASSERT_TRUE(undo.undo(nullptr));
+    EXPECT_TRUE(undo.modified());
+    ASSERT_TRUE(undo.undo(nullptr));
+    EXPECT_FALSE(undo.modified());
+    ASSERT_TRUE(undo.undo(nullptr));
+    EXPECT_TRUE(undo.modified());
+    ASSERT_TRUE(undo.redo(nullptr));
+    EXPECT_FALSE(undo.modified());
+  }
+}
+
+TEST_F(BufferTest, UndoTracksUnmodifiedState) {
+  InitBuffer("line");
+  Undo undo(&buffer);
+  EXPECT_TRUE(undo.modified());
+  undo.setUnmodified();
+  EXPECT_FALSE(undo.modified());
+  TempPoint point(&buffer, 1);
+  const QString character("x");
+  point.insertBefore(QStringRef(&character), undo.recorder());
+  EXPECT_TRUE(undo.modified());
+  undo.setUnmodified();
+  // Typing on from the unmodified state starts a new operation, so that undoing it comes back to the unmodified state.
+  point.insertBefore(QStringRef(&character), undo.recorder());
+  EXPECT_TRUE(undo.modified());
+  ASSERT_TRUE(undo.undo(nullptr));
+  EXPECT_FALSE(undo.modified());
+  EXPECT_EQ("xline", TempPoint(&buffer, 1).lineContent().toStdString());
+  ASSERT_TRUE(undo.redo(nullptr));
+  EXPECT_TRUE(undo.modified());
+  EXPECT_EQ("xxline", TempPoint(&buffer, 1).lineContent().toStdString());
+
+  // After a checkpoint typing starts a new operation, so the checkpoint's state can be undone to.
+  const Undo::State state = undo.checkpoint();
+  point.moveTo(Point::BufferEnd());
+  point.insertBefore(QStringRef(&character), undo.recorder());
+  point.insertBefore(QStringRef(&character), undo.recorder());
+  undo.setUnmodified(state);
+  EXPECT_TRUE(undo.modified());
+  ASSERT_TRUE(undo.undo(nullptr));
+  EXPECT_FALSE(undo.modified());
+  EXPECT_EQ("xxline", TempPoint(&buffer, 1).lineContent().toStdString());
+  ASSERT_TRUE(undo.redo(nullptr));
+  EXPECT_TRUE(undo.modified());
+  ASSERT_TRUE(undo.undo(nullptr));
+  EXPECT_FALSE(undo.modified());
+}
+
+TEST_F(BufferTest, LoadInBackground) {
+  std::vector<std::string> expected;
+  int characterCount;
+  const std::string content = largeFileContent(&expected, &characterCount);
+  QTemporaryFile file;
+  ASSERT_TRUE(file.open());
+  file.write(content.data(), content.size());
+  file.close();
+  const std::string path = file.fileName().toStdString();
+  for (bool mapped : {false, true}) {
+    SCOPED_TRACE(mapped ? "mapped" : "read");
+    std::unique_ptr<Buffer> loaded = Buffer::create();
+    BufferLoader loader(loaded.get(), path, mapped);
+    EXPECT_EQ(path, loaded->filePath());
+    // The lines loaded so far can be edited while the rest is loading.
+    bool edited = false;
+    while (!loader.finished()) {
+      loader.appendLoadedLines();
+      if (!edited && loaded->lineCount() > 0) {
+        QString added("edited ");
+        ASSERT_TRUE(TempPoint(loaded.get(), 1).insertBefore(QStringRef(&added), {}));
+        edited = true;
+      }
+      std::this_thread::yield();
+    }
+    EXPECT_EQ(1.0, loader.progress());
+    std::vector<std::string> expectedAfterEdit = expected;
+    expectedAfterEdit[0] = "edited " + expectedAfterEdit[0];
+    EXPECT_TRUE(linesOf(loaded.get()) == expectedAfterEdit);
+    EXPECT_EQ(characterCount + 7, loaded->characterCount());
+    EXPECT_EQ(loaded->lineCount(), loaded->snapshot().lineCount());
+    EXPECT_EQ(path, loaded->filePath());
+  }
+}
+
+TEST_F(BufferTest, CancelLoading) {
+  std::vector<std::string> expected;
+  int characterCount;
+  const std::string content = largeFileContent(&expected, &characterCount);
+  QTemporaryFile file;
+  ASSERT_TRUE(file.open());
+  file.write(content.data(), content.size());
+  file.close();
+  std::unique_ptr<Buffer> loaded = Buffer::create();
+  {
+    BufferLoader loader(loaded.get(), file.fileName().toStdString(), false);
+    loader.cancel();
+    while (!loader.finished()) loader.appendLoadedLines();
+  }
+  // The buffer keeps the lines loaded before cancelling.
+  const std::vector<std::string> lines = linesOf(loaded.get());
+  ASSERT_LE(lines.size(), expected.size());
+  EXPECT_TRUE(std::equal(lines.begin(), lines.end(), expected.begin()));
+  if (lines.size() < expected.size()) {
+    // Saving the lines that were loaded must not truncate the file.
+    EXPECT_EQ("", loaded->filePath());
+    EXPECT_FALSE(loaded->save());
+  }
+}
+
 }  // namespace Editor
 }  // namespace Med
@@ -1,5 +1,7 @@
 #include "Buffers.h"
 
+#include <QtCore/QFileInfo>
+
 namespace Med {
 namespace Editor {
 
@@ -12,10 +14,23 @@ Buffer* Buffers::create() {
 }
 
 Buffer* Buffers::openFile(const std::string& filePath) {
-  buffers_.push_back(Buffer::open(filePath));
+  buffers_.push_back(shouldMap(filePath) ? Buffer::openMapped(filePath, loadThreadCount_) : Buffer::open(filePath, loadThreadCount_));
   return buffers_.back().get();
 }
 
+std::unique_ptr<BufferLoader> Buffers::startOpeningFile(const std::string& filePath) {
+  std::unique_ptr<Buffer> buffer = Buffer::create();
+  std::unique_ptr<BufferLoader> loader(new BufferLoader(buffer.get(), filePath, shouldMap(filePath)));
+  buffers_.push_back(std::move(buffer));
+  return loader;
+}
+
+bool Buffers::shouldMap(const std::string& filePath) {
+  // Large files are mapped rather than read, so that only the parts that are edited or displayed take memory.
+  constexpr qint64 mapThreshold = 16 * 1024 * 1024;
+  return QFileInfo(QString::fromStdString(filePath)).size() >= mapThreshold;
+}
+
 }  // namespace Editor
 }  // namespace Med
 
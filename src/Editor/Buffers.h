@@ -6,6 +6,7 @@
 #include <QObject>
 
 #include "Buffer.h"
+#include "BufferLoader.h"
 
 namespace Med {
 namespace Editor {
@@ -17,9 +18,19 @@ public:
 
   Buffer* create();
   Buffer* openFile(const std::string& filePath);
+  // Creates a buffer for the file and starts loading it in the background; the loader's buffer() is owned by this.
+  std::unique_ptr<BufferLoader> startOpeningFile(const std::string& filePath);
+
+  const std::list<std::unique_ptr<Buffer>>& buffers() const { return buffers_; }
+
+  // The number of threads that scan and decode large files as they are opened; 0, the default, means one per hardware thread.
+  void setLoadThreadCount(int threadCount) { loadThreadCount_ = threadCount; }
 
 private:
+  static bool shouldMap(const std::string& filePath);
+
   std::list<std::unique_ptr<Buffer>> buffers_;
+  int loadThreadCount_ = 0;
 };
 
 }  // namespace Editor
@@ -0,0 +1,29 @@
+#ifndef MED_EDITOR_EDIT_H
+#define MED_EDITOR_EDIT_H
+
+#include <QtCore/QString>
+
+namespace Med {
+namespace Editor {
+
+// A change to the text of a buffer, made with Buffer::applyEdits(): the text from the start position up to the end position is replaced with text, which may have line breaks. Positions are line and column numbers, as in Point.
+struct Edit {
+  int startLineNumber;
+  int startColumnNumber;
+  int endLineNumber;
+  int endColumnNumber;
+  QString text;
+};
+
+// An edit as Buffer makes it in a batch, and as Undo keeps it to revert one. If moved is set, the text isn't in edit.text but is the last lineBreakCount + 1 lines of another buffer, where it was moved to keep the content points in it (see Undo). lineBreakCount and lastLineLength give the size of the text either way.
+struct BatchEdit {
+  Edit edit;
+  bool moved;
+  int lineBreakCount;
+  int lastLineLength;
+};
+
+}  // namespace Editor
+}  // namespace Med
+
+#endif // MED_EDITOR_EDIT_H
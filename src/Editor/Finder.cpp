@@ -0,0 +1,96 @@
+#include "Finder.h"
+
+#include "Latin1.h"
+#include "Util/Simd.h"
+
+namespace Med {
+namespace Editor {
+
+namespace {
+
+// The column of the first occurrence of the literal, or of the last one if last, within the columns [fromColumnNumber, toColumnNumber) of text, or -1.
+template<typename Char>
+int find(const Char* text, int fromColumnNumber, int toColumnNumber, const Char* literal, int literalSize, bool ignoreCase, bool last) {
+  const Char* const end = text + toColumnNumber;
+  int columnNumber = -1;
+  // Occurrences that start later end later, so the last one is found by searching on after each one.
+  for (const Char* found = text + fromColumnNumber; (found = Util::Simd::findLiteral(found, end, literal, literalSize, ignoreCase)) != end; ++found) {
+    columnNumber = found - text;
+    if (!last) break;
+  }
+  return columnNumber;
+}
+
+const char16_t* utf16(const QString& text) {
+  return reinterpret_cast<const char16_t*>(text.constData());
+}
+
+}  // namespace
+
+Finder::Finder(const QString& literal, bool ignoreCase) : ignoreCase_(ignoreCase) {
+  if (literal.contains(QChar('\n'))) return;
+  literal_ = literal;
+  if (isLatin1(QStringRef(&literal_))) latin1_ = narrow(QStringRef(&literal_));
+}
+
+int Finder::findInLine(const Buffer::Tree::Node* line, int fromColumnNumber, int toColumnNumber, bool last) const {
+  if (toColumnNumber - fromColumnNumber < literal_.size()) return -1;
+  const Buffer::Line& value = line->value;
+  if (value.mapped != nullptr) {
+    // A line as long in characters as in bytes is ASCII.
+    if (value.mappedSize == line->delta.offset - 1) return latin1_.isNull() ? -1 : find(value.mapped, fromColumnNumber, toColumnNumber, latin1_.constData(), latin1_.size(), ignoreCase_, last);
+    const QString content = QString::fromUtf8(value.mapped, value.mappedSize);
+    return find(utf16(content), fromColumnNumber, toColumnNumber, utf16(literal_), literal_.size(), ignoreCase_, last);
+  }
+  if (value.rope) {
+    const QString content = value.rope->toString();
+    return find(utf16(content), fromColumnNumber, toColumnNumber, utf16(literal_), literal_.size(), ignoreCase_, last);
+  }
+  if (!value.latin1.isNull()) return latin1_.isNull() ? -1 : find(value.latin1.constData(), fromColumnNumber, toColumnNumber, latin1_.constData(), latin1_.size(), ignoreCase_, last);
+  return find(utf16(value.content), fromColumnNumber, toColumnNumber, utf16(literal_), literal_.size(), ignoreCase_, last);
+}
+
+void Finder::placeAt(const Point& from, Buffer::Tree::Node* line, int lineCount, int columnNumber, TempPoint* point) {
+  point->setBufferAndLine(from.buffer_, line);
+  point->cacheLineNumber(from.lineNumber() + lineCount);
+  point->setColumnNumber(columnNumber);
+}
+
+void Finder::placeMatch(const Point& from, Buffer::Tree::Node* line, int lineCount, int columnNumber, TempPoint* start, TempPoint* end) const {
+  placeAt(from, line, lineCount, columnNumber, start);
+  placeAt(from, line, lineCount, columnNumber + literal_.size(), end);
+}
+
+bool Finder::findForwards(const Point& from, TempPoint* start, TempPoint* end) const {
+  if (literal_.isEmpty() || !from.isValid()) return false;
+  int fromColumnNumber = from.columnNumber();
+  int lineCount = 0;
+  for (Buffer::Tree::Cursor cursor(from.bufferLine_); cursor.isValid(); cursor.advance(), ++lineCount) {
+    Buffer::Tree::Node* const line = cursor.node();
+    const int columnNumber = findInLine(line, fromColumnNumber, line->delta.offset - 1, false);
+    if (columnNumber >= 0) {
+      placeMatch(from, line, lineCount, columnNumber, start, end);
+      return true;
+    }
+    fromColumnNumber = 0;
+  }
+  return false;
+}
+
+bool Finder::findBackwards(const Point& from, TempPoint* start, TempPoint* end) const {
+  if (literal_.isEmpty() || !from.isValid()) return false;
+  int toColumnNumber = from.columnNumber();
+  int lineCount = 0;
+  for (Buffer::Tree::Node* line = from.bufferLine_; line != nullptr; line = line->adjacent(Util::DRBTreeDefs::Side::LEFT), --lineCount) {
+    if (lineCount != 0) toColumnNumber = line->delta.offset - 1;
+    const int columnNumber = findInLine(line, 0, toColumnNumber, true);
+    if (columnNumber >= 0) {
+      placeMatch(from, line, lineCount, columnNumber, start, end);
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace Editor
+}  // namespace Med
@@ -0,0 +1,39 @@
+#ifndef MED_EDITOR_FINDER_H
+#define MED_EDITOR_FINDER_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+
+#include "Buffer.h"
+
+namespace Med {
+namespace Editor {
+
+// Finds a literal in the lines of a buffer. Each line is searched with Util::Simd::findLiteral() in the form it's kept in: Latin-1 lines and mapped ASCII lines a byte per character, without making strings of them, so that searching runs through a buffer at close to the speed of memory.
+class Finder {
+public:
+  // A literal with a line break, or an empty one, is never found. If ignoreCase, the letters of Latin-1 match in either case.
+  Finder(const QString& literal, bool ignoreCase);
+
+  // Moves start and end to the first match that starts at or after from. Returns false, leaving them where they were, if there is none before the end of the buffer. The buffer must not change while searching.
+  bool findForwards(const Point& from, TempPoint* start, TempPoint* end) const;
+  // Moves start and end to the last match that ends at or before from.
+  bool findBackwards(const Point& from, TempPoint* start, TempPoint* end) const;
+
+private:
+  // The column of the first match in the line, or of the last one if last, among those that start at or after fromColumnNumber and end at or before toColumnNumber; -1 if there is none. Mapped lines are searched in the map, or decoded without keeping their content, so that searching doesn't grow the memory used by the buffer.
+  int findInLine(const Buffer::Tree::Node* line, int fromColumnNumber, int toColumnNumber, bool last) const;
+  // Moves point to the given column of the line that is lineCount lines after the one of from.
+  static void placeAt(const Point& from, Buffer::Tree::Node* line, int lineCount, int columnNumber, TempPoint* point);
+  void placeMatch(const Point& from, Buffer::Tree::Node* line, int lineCount, int columnNumber, TempPoint* start, TempPoint* end) const;
+
+  QString literal_;
+  // The literal at one byte per character, to search Latin-1 and ASCII lines with; null if it has a character above U+00FF, which such lines can't contain.
+  QByteArray latin1_;
+  bool ignoreCase_;
+};
+
+}  // namespace Editor
+}  // namespace Med
+
+#endif // MED_EDITOR_FINDER_H
@@ -0,0 +1,104 @@
+#include "Finder.h"
+
+#include <string>
+#include <utility>
+#include <QtCore/QTemporaryFile>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace Med {
+namespace Editor {
+
+class FinderTest : public ::testing::Test {
+protected:
+  void InitBuffer(const std::string& content, bool mapped = false) {
+    QTemporaryFile file;
+    ASSERT_TRUE(file.open());
+    file.write(content.data(), content.size());
+    file.close();
+    buffer = mapped ? Buffer::openMapped(file.fileName().toStdString()) : Buffer::open(file.fileName().toStdString());
+  }
+
+  TempPoint at(int lineNumber, int columnNumber) {
+    TempPoint point(buffer.get(), lineNumber);
+    point.setColumnNumber(columnNumber);
+    return point;
+  }
+
+  // The line and column numbers of the start and end of the match found from the given position, or zeros if there is none.
+  std::pair<std::pair<int, int>, std::pair<int, int>> find(const Finder& finder, int lineNumber, int columnNumber, bool forwards = true) {
+    TempPoint start;
+    TempPoint end;
+    const bool found = forwards ? finder.findForwards(at(lineNumber, columnNumber), &start, &end) : finder.findBackwards(at(lineNumber, columnNumber), &start, &end);
+    if (!found) return {{0, 0}, {0, 0}};
+    return {{start.lineNumber(), start.columnNumber()}, {end.lineNumber(), end.columnNumber()}};
+  }
+
+  static std::pair<std::pair<int, int>, std::pair<int, int>> match(int lineNumber, int startColumnNumber, int endColumnNumber) {
+    return {{lineNumber, startColumnNumber}, {lineNumber, endColumnNumber}};
+  }
+
+  std::unique_ptr<Buffer> buffer;
+};
+
+TEST_F(FinderTest, FindsForwardsAndBackwards) {
+  InitBuffer("one two\nTwo two\n\nthree two");
+  const Finder finder("two", false);
+  EXPECT_EQ(match(1, 4, 7), find(finder, 1, 0));
+  EXPECT_EQ(match(1, 4, 7), find(finder, 1, 4));
+  EXPECT_EQ(match(2, 4, 7), find(finder, 1, 5));
+  EXPECT_EQ(match(4, 6, 9), find(finder, 3, 0));
+  EXPECT_EQ(match(0, 0, 0), find(finder, 4, 7));
+
+  EXPECT_EQ(match(4, 6, 9), find(finder, 4, 9, false));
+  EXPECT_EQ(match(2, 4, 7), find(finder, 4, 8, false));
+  EXPECT_EQ(match(1, 4, 7), find(finder, 2, 6, false));
+  EXPECT_EQ(match(0, 0, 0), find(finder, 1, 6, false));
+
+  const Finder ignoringCase("TWO", true);
+  EXPECT_EQ(match(2, 0, 3), find(ignoringCase, 1, 5));
+  EXPECT_EQ(match(2, 0, 3), find(ignoringCase, 2, 6, false));
+}
+
+TEST_F(FinderTest, FindsOverlappingMatches) {
+  InitBuffer("aaaa");
+  const Finder finder("aa", false);
+  EXPECT_EQ(match(1, 1, 3), find(finder, 1, 1));
+  EXPECT_EQ(match(1, 2, 4), find(finder, 1, 4, false));
+  EXPECT_EQ(match(1, 1, 3), find(finder, 1, 3, false));
+}
+
+TEST_F(FinderTest, FindsInEveryFormOfLine) {
+  // An ASCII line and a UTF-8 one stay mapped, a Latin-1 line and a wider one are decoded when their content is needed, and a long line becomes a rope when edited.
+  const int longLength = 100000;
+  InitBuffer("ascii Caf\nutf8 CAF\xC3\x89 \xCE\xA9\nlatin1 caf\xC3\xA9\nwide \xCE\xA9 caf\xC3\xA9\n" + std::string(longLength, 'x') + " caf\xC3\xA9", true);
+  for (int lineNumber : {3, 4}) at(lineNumber, 0).lineContent();
+  const QString text("y");
+  at(5, 0).insertBefore(QStringRef(&text), {});
+
+  EXPECT_EQ(match(1, 6, 9), find(Finder("caf", true), 1, 0));
+  const Finder finder(QString::fromUtf8("caf\xC3\xA9"), true);
+  EXPECT_EQ(match(2, 5, 9), find(finder, 1, 0));
+  EXPECT_EQ(match(3, 7, 11), find(finder, 2, 6));
+  EXPECT_EQ(match(4, 7, 11), find(finder, 3, 8));
+  EXPECT_EQ(match(5, longLength + 2, longLength + 6), find(finder, 4, 8));
+  EXPECT_EQ(match(4, 7, 11), find(finder, 5, longLength + 5, false));
+  EXPECT_EQ(match(2, 5, 9), find(finder, 3, 0, false));
+
+  // Only lines with characters above U+00FF can have such a literal.
+  const Finder wide(QString::fromUtf8("\xCE\xA9"), false);
+  EXPECT_EQ(match(2, 10, 11), find(wide, 1, 0));
+  EXPECT_EQ(match(4, 5, 6), find(wide, 3, 0));
+  EXPECT_EQ(match(2, 10, 11), find(wide, 4, 5, false));
+}
+
+TEST_F(FinderTest, NeverFindsEmptyLiteralsOrLineBreaks) {
+  InitBuffer("one\ntwo");
+  EXPECT_EQ(match(0, 0, 0), find(Finder("", false), 1, 0));
+  EXPECT_EQ(match(0, 0, 0), find(Finder("one\ntwo", false), 1, 0));
+  EXPECT_EQ(match(0, 0, 0), find(Finder("e\n", false), 1, 0, false));
+}
+
+}  // namespace Editor
+}  // namespace Med
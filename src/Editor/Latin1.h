@@ -0,0 +1,43 @@
+#ifndef MED_EDITOR_LATIN1_H
+#define MED_EDITOR_LATIN1_H
+
+#include <cstddef>
+
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+
+#include "Util/Simd.h"
+
+namespace Med {
+namespace Editor {
+
+// Lines and pieces of lines with no character above U+00FF are kept at one byte per character; these convert between that and UTF-16.
+
+inline bool isLatin1(QStringRef text) {
+  const char16_t* const begin = reinterpret_cast<const char16_t*>(text.constData());
+  return Util::Simd::latin1Length(begin, begin + text.size()) == std::size_t(text.size());
+}
+
+// The text, which must be Latin-1, at one byte per character.
+inline QByteArray narrow(QStringRef text) {
+  QByteArray latin1(text.size(), Qt::Uninitialized);
+  const char16_t* const begin = reinterpret_cast<const char16_t*>(text.constData());
+  Util::Simd::narrow(begin, begin + text.size(), latin1.data());
+  return latin1;
+}
+
+// Writes the characters in [begin, end) as UTF-16 to output, which must have room for them.
+inline void widen(const char* begin, const char* end, QChar* output) {
+  Util::Simd::widen(begin, end, reinterpret_cast<char16_t*>(output));
+}
+
+inline QString widen(const QByteArray& latin1) {
+  QString content(latin1.size(), Qt::Uninitialized);
+  widen(latin1.constData(), latin1.constData() + latin1.size(), content.data());
+  return content;
+}
+
+}  // namespace Editor
+}  // namespace Med
+
+#endif // MED_EDITOR_LATIN1_H
@@ -0,0 +1,37 @@
+#include "MappedFile.h"
+
+#include <QtCore/qglobal.h>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
+
+#include "Buffer.h"
+
+namespace Med {
+namespace Editor {
+
+std::shared_ptr<const MappedFile> MappedFile::open(const std::string& filePath) {
+  std::shared_ptr<MappedFile> mappedFile(new MappedFile(QString::fromStdString(filePath)));
+  if (!mappedFile->file_.open(QFile::ReadOnly)) {
+    throw IOException("Failed to open file " + filePath + ".");
+  }
+  mappedFile->size_ = mappedFile->file_.size();
+  // Empty files can't be mapped, and don't need to.
+  if (mappedFile->size_ > 0) {
+    const uchar* data = mappedFile->file_.map(0, mappedFile->size_);
+    if (data == nullptr) throw IOException("Failed to map file " + filePath + ".");
+    mappedFile->data_ = reinterpret_cast<const char*>(data);
+  }
+  return mappedFile;
+}
+
+void MappedFile::releasePages() const {
+#ifdef Q_OS_UNIX
+  // The map is read-only, so the pages are just dropped, not written back.
+  if (data_ != nullptr) madvise(const_cast<char*>(data_), size_, MADV_DONTNEED);
+#endif
+}
+
+}  // namespace Editor
+}  // namespace Med
@@ -0,0 +1,42 @@
+#ifndef MED_EDITOR_MAPPEDFILE_H
+#define MED_EDITOR_MAPPEDFILE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <QtCore/QFile>
+
+namespace Med {
+namespace Editor {
+
+// A file mapped read-only into memory. Buffers opened with Buffer::openMapped() keep their unchanged lines as spans of the map, so it's shared by every buffer, undo buffer and snapshot that has such lines, and unmapped when the last of them goes away.
+// Other programs must not truncate or change the file while it's mapped. Saving a buffer with mapped lines replaces the file with a new one instead of writing over it, so the map keeps the old content.
+class MappedFile {
+public:
+  // Throws IOException if the file can't be opened or mapped.
+  static std::shared_ptr<const MappedFile> open(const std::string& filePath);
+
+  const char* data() const { return data_; }
+  int64_t size() const { return size_; }
+  // Whether the pointer is into the map, or just past its end, as the span of an empty last line may be.
+  bool contains(const char* pointer) const { return data_ != nullptr && pointer >= data_ && pointer <= data_ + size_; }
+  // The descriptor of the file, which stays open while it's mapped, so that its content can be copied by the system without reading it through the map.
+  int handle() const { return file_.handle(); }
+
+  // Lets the system drop the pages read so far from the memory of the process; they are read from the file again when accessed.
+  void releasePages() const;
+
+private:
+  explicit MappedFile(const QString& filePath) : file_(filePath) {}
+
+  // Unmaps the file when destroyed.
+  QFile file_;
+  const char* data_ = nullptr;
+  int64_t size_ = 0;
+};
+
+}  // namespace Editor
+}  // namespace Med
+
+#endif // MED_EDITOR_MAPPEDFILE_H
@@ -0,0 +1,44 @@
+#ifndef MED_EDITOR_MEMORYSTATS_H
+#define MED_EDITOR_MEMORYSTATS_H
+
+#include <cstdint>
+
+namespace Med {
+namespace Editor {
+
+// Where the memory of a buffer goes, in bytes. The sizes are worked out from the objects and the string data they hold, not measured, so they leave out the allocator's own overhead; text shared between a buffer, its undo history and its snapshots is counted by each of them.
+struct MemoryStats {
+  // The text of the lines that aren't mapped.
+  int64_t lineText = 0;
+  // The text of the mapped lines, which is in mapped files rather than on the heap: the system only keeps the pages that were read.
+  int64_t mappedText = 0;
+  // The nodes of the line tree.
+  int64_t lineNodes = 0;
+  // The nodes of the lines kept for snapshots, including those only the snapshots still alive keep.
+  int64_t snapshotNodes = 0;
+  // The safe points on the lines.
+  int64_t points = 0;
+  // The buffers of the undo history.
+  int64_t undo = 0;
+  // The text layouts of the lines shown by views.
+  int64_t layouts = 0;
+
+  // Everything except the mapped text.
+  int64_t heapBytes() const { return lineText + lineNodes + snapshotNodes + points + undo + layouts; }
+
+  MemoryStats& operator+=(const MemoryStats& other) {
+    lineText += other.lineText;
+    mappedText += other.mappedText;
+    lineNodes += other.lineNodes;
+    snapshotNodes += other.snapshotNodes;
+    points += other.points;
+    undo += other.undo;
+    layouts += other.layouts;
+    return *this;
+  }
+};
+
+}  // namespace Editor
+}  // namespace Med
+
+#endif // MED_EDITOR_MEMORYSTATS_H
@@ -0,0 +1,159 @@
+#include "Rope.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "Latin1.h"
+
+namespace Med {
+namespace Editor {
+
+namespace {
+
+// Where the index-th of count pieces of about the same length starts in a text of the given size.
+int pieceStart(int size, int count, int index) {
+  return int64_t(size) * index / count;
+}
+
+int pieceCount(int size) {
+  return (size + Rope::maxPieceLength - 1) / Rope::maxPieceLength;
+}
+
+}  // namespace
+
+constexpr int Rope::maxPieceLength;
+
+Rope::Rope(QStringRef text) {
+  const int count = pieceCount(text.size());
+  std::vector<int> indexes(count);
+  for (int index = 0; index < count; ++index) indexes[index] = index;
+  pieces_.buildFrom(indexes.begin(), indexes.end(), [&](int index) {
+    const int start = pieceStart(text.size(), count, index);
+    const int end = pieceStart(text.size(), count, index + 1);
+    return std::make_pair(makePiece(text.mid(start, end - start)), end - start);
+  });
+}
+
+QString Rope::mid(int position, int count) const {
+  position = std::max(0, std::min(position, size()));
+  if (count < 0 || count > size() - position) count = size() - position;
+  QString text(count, Qt::Uninitialized);
+  QChar* output = text.data();
+  for (Pieces::Cursor cursor = pieces_.find(position); count > 0; cursor.advance()) {
+    const Piece& piece = cursor.value();
+    const int start = position - cursor.key();
+    const int length = std::min(cursor.delta() - start, count);
+    if (piece.latin1.isNull()) {
+      std::copy(piece.content.constData() + start, piece.content.constData() + start + length, output);
+    } else {
+      widen(piece.latin1.constData() + start, piece.latin1.constData() + start + length, output);
+    }
+    output += length;
+    position += length;
+    count -= length;
+  }
+  return text;
+}
+
+void Rope::insert(int position, QStringRef text) {
+  if (text.isEmpty()) return;
+  if (pieces_.empty()) {
+    insertPieces(0, text);
+    return;
+  }
+  // At the boundary between two pieces, the text goes at the start of the second one.
+  const Pieces::Cursor cursor = pieces_.find(position);
+  const int start = cursor.key();
+  const QString pieceContent = pieceText(cursor.value());
+  const int offset = position - start;
+  QString joined;
+  joined.reserve(pieceContent.size() + text.size());
+  joined.append(pieceContent.constData(), offset).append(text.constData(), text.size()).append(pieceContent.constData() + offset, pieceContent.size() - offset);
+  if (joined.size() <= maxPieceLength) {
+    pieces_.set(start, makePiece(QStringRef(&joined)), joined.size());
+    return;
+  }
+  pieces_.erase(start);
+  insertPieces(start, QStringRef(&joined));
+}
+
+void Rope::remove(int position, int count) {
+  count = std::min(count, size() - position);
+  if (count <= 0) return;
+  const Pieces::Cursor cursor = pieces_.find(position);
+  const int start = cursor.key();
+  if (position + count <= start + cursor.delta()) {
+    // Typing removes a few characters at a time, which are nearly always in one piece.
+    if (count == cursor.delta()) {
+      pieces_.erase(start);
+    } else {
+      QString pieceContent = pieceText(cursor.value());
+      pieceContent.remove(position - start, count);
+      pieces_.set(start, makePiece(QStringRef(&pieceContent)), pieceContent.size());
+    }
+  } else {
+    splitAt(position);
+    splitAt(position + count);
+    Pieces after = pieces_.split(position + count);
+    pieces_.split(position);
+    const bool removedStart = pieces_.empty();
+    pieces_.join(std::move(after));
+    // The pieces after the removed ones were the first ones split off, at their old keys.
+    if (removedStart) pieces_.setFirstKey(0);
+  }
+  mergeAt(position);
+}
+
+int64_t Rope::memoryBytes() const {
+  int64_t bytes = pieces_.nodeBytes();
+  for (Pieces::Cursor cursor = pieces_.begin(); cursor.isValid(); cursor.advance()) {
+    const Piece& piece = cursor.value();
+    bytes += sizeof(QArrayData) + (piece.latin1.isNull() ? (piece.content.capacity() + 1) * sizeof(QChar) : piece.latin1.capacity() + 1);
+  }
+  return bytes;
+}
+
+Rope::Piece Rope::makePiece(QStringRef text) {
+  if (isLatin1(text)) return {QString(), narrow(text)};
+  return {text.toString(), QByteArray()};
+}
+
+QString Rope::pieceText(const Piece& piece) {
+  return piece.latin1.isNull() ? piece.content : widen(piece.latin1);
+}
+
+void Rope::insertPieces(int position, QStringRef text) {
+  const int count = pieceCount(text.size());
+  for (int index = 0; index < count; ++index) {
+    const int start = pieceStart(text.size(), count, index);
+    const int end = pieceStart(text.size(), count, index + 1);
+    // Goes before the piece that starts where the previous one ended.
+    pieces_.insert(position + start, makePiece(text.mid(start, end - start)), end - start);
+  }
+}
+
+void Rope::splitAt(int position) {
+  if (position <= 0 || position >= size()) return;
+  const Pieces::Cursor cursor = pieces_.find(position);
+  const int start = cursor.key();
+  if (start == position) return;
+  const QString pieceContent = pieceText(cursor.value());
+  const int offset = position - start;
+  pieces_.set(start, makePiece(pieceContent.leftRef(offset)), offset);
+  pieces_.insert(position, makePiece(pieceContent.midRef(offset)), pieceContent.size() - offset);
+}
+
+void Rope::mergeAt(int position) {
+  if (position <= 0 || position >= size()) return;
+  const Pieces::Cursor after = pieces_.find(position);
+  if (after.key() != position) return;
+  const Pieces::Cursor before = pieces_.find(position - 1);
+  if (before.delta() + after.delta() > maxPieceLength) return;
+  const int start = before.key();
+  const QString joined = pieceText(before.value()) + pieceText(after.value());
+  pieces_.erase(position);
+  pieces_.set(start, makePiece(QStringRef(&joined)), joined.size());
+}
+
+}  // namespace Editor
+}  // namespace Med
@@ -0,0 +1,68 @@
+#ifndef MED_EDITOR_ROPE_H
+#define MED_EDITOR_ROPE_H
+
+#include <cstdint>
+
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+
+#include "Util/PersistentSequence.h"
+
+namespace Med {
+namespace Editor {
+
+// The text of a very long line, split into pieces of at most maxPieceLength characters, so that an edit copies the piece it changes and the O(log N) nodes that lead to it rather than the whole text. Positions count UTF-16 code units, as in QString.
+// Copies are O(1) and share their pieces (see Util::PersistentSequence), so a snapshot keeps a rope as it was without copying its text, and can read it from another thread. As with short lines, pieces without characters above U+00FF are kept at one byte per character.
+class Rope {
+public:
+  static constexpr int maxPieceLength = 4096;
+
+  explicit Rope(QStringRef text);
+
+  int size() const { return pieces_.endKey(); }
+
+  // The count characters from position, or all those after it if count is negative. O(log N + count).
+  QString mid(int position, int count = -1) const;
+  QString toString() const { return mid(0); }
+
+  // O(log N + maxPieceLength + text size).
+  void insert(int position, QStringRef text);
+  // O(log N + maxPieceLength).
+  void remove(int position, int count);
+  void truncate(int position) { remove(position, size() - position); }
+
+  // Calls visit(latin1, content) with each piece in order: one of them holds its text, and the other one is null.
+  template<typename Visit>
+  void forEachPiece(const Visit& visit) const {
+    for (Pieces::Cursor cursor = pieces_.begin(); cursor.isValid(); cursor.advance()) visit(cursor.value().latin1, cursor.value().content);
+  }
+
+  // The memory taken by the pieces and their text, including what is shared with copies.
+  int64_t memoryBytes() const;
+
+private:
+  friend class RopeTest;
+
+  struct Piece {
+    QString content;
+    QByteArray latin1;
+  };
+  // Keyed by the position of the first character of each piece; the delta of a piece is its length, which is never 0.
+  typedef Util::PersistentSequence<int, Piece> Pieces;
+
+  static Piece makePiece(QStringRef text);
+  static QString pieceText(const Piece& piece);
+  // Inserts text before the piece at position, or at the end, as pieces of about the same length.
+  void insertPieces(int position, QStringRef text);
+  // Makes position the start of a piece, splitting the piece it's in.
+  void splitAt(int position);
+  // Joins the pieces on both sides of position if they fit in one.
+  void mergeAt(int position);
+
+  Pieces pieces_;
+};
+
+}  // namespace Editor
+}  // namespace Med
+
+#endif // MED_EDITOR_ROPE_H
@@ -0,0 +1,129 @@
+#include "Rope.h"
+
+#include <algorithm>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace Med {
+namespace Editor {
+
+class RopeTest : public ::testing::Test {
+protected:
+  // Checks that the pieces aren't empty or too long, and that the rope has the same text as the reference.
+  static void checkSame(const Rope& rope, const QString& reference) {
+    int position = 0;
+    for (Rope::Pieces::Cursor cursor = rope.pieces_.begin(); cursor.isValid(); cursor.advance()) {
+      EXPECT_EQ(position, cursor.key());
+      EXPECT_LT(0, cursor.delta());
+      EXPECT_GE(Rope::maxPieceLength, cursor.delta());
+      EXPECT_EQ(cursor.delta(), Rope::pieceText(cursor.value()).size());
+      position += cursor.delta();
+    }
+    EXPECT_EQ(reference.size(), position);
+    ASSERT_EQ(reference.size(), rope.size());
+    EXPECT_TRUE(reference == rope.toString());
+  }
+
+  static int pieceCount(const Rope& rope) {
+    int count = 0;
+    for (Rope::Pieces::Cursor cursor = rope.pieces_.begin(); cursor.isValid(); cursor.advance()) ++count;
+    return count;
+  }
+
+  static bool isLatin1(const Rope& rope, int position) { return !rope.pieces_.find(position).value().latin1.isNull(); }
+
+  // Text of the given length, with a character above U+00FF every wideEvery characters if it's not 0.
+  static QString text(int length, int wideEvery, char16_t first = 'a') {
+    QString text(length, Qt::Uninitialized);
+    QChar* const data = text.data();
+    for (int index = 0; index < length; ++index) data[index] = QChar(wideEvery > 0 && index % wideEvery == wideEvery - 1 ? char16_t(0x20AC) : char16_t(first + index % 26));
+    return text;
+  }
+};
+
+TEST_F(RopeTest, BuildAndRead) {
+  for (int length : {0, 1, Rope::maxPieceLength, Rope::maxPieceLength + 1, 5 * Rope::maxPieceLength + 17}) {
+    const QString content = text(length, 0);
+    const Rope rope{QStringRef(&content)};
+    checkSame(rope, content);
+    EXPECT_EQ((length + Rope::maxPieceLength - 1) / Rope::maxPieceLength, pieceCount(rope));
+    for (int position : {0, std::min(1, length), length / 2, std::max(0, length - 1), length}) {
+      for (int count : {0, 1, 100, -1}) {
+        EXPECT_TRUE(content.mid(position, count) == rope.mid(position, count));
+      }
+    }
+  }
+}
+
+TEST_F(RopeTest, PiecesStayLatin1UnlessWide) {
+  const QString content = text(3 * Rope::maxPieceLength, 0);
+  Rope rope{QStringRef(&content)};
+  EXPECT_TRUE(isLatin1(rope, 0));
+  const QString wide = text(1, 1);
+  rope.insert(10, QStringRef(&wide));
+  EXPECT_FALSE(isLatin1(rope, 0));
+  EXPECT_TRUE(isLatin1(rope, rope.size() - 1));
+  rope.remove(10, 1);
+  EXPECT_TRUE(isLatin1(rope, 0));
+  checkSame(rope, content);
+}
+
+TEST_F(RopeTest, TypingKeepsPiecesSmall) {
+  QString reference = text(10 * Rope::maxPieceLength, 0);
+  Rope rope{QStringRef(&reference)};
+  const QString character("x");
+  const int position = 5 * Rope::maxPieceLength + 100;
+  for (int count = 0; count < 3 * Rope::maxPieceLength; ++count) {
+    rope.insert(position + count, QStringRef(&character));
+    reference.insert(position + count, character);
+  }
+  checkSame(rope, reference);
+  for (int count = 0; count < 3 * Rope::maxPieceLength; ++count) {
+    rope.remove(position + 3 * Rope::maxPieceLength - count - 1, 1);
+    reference.remove(position + 3 * Rope::maxPieceLength - count - 1, 1);
+  }
+  checkSame(rope, reference);
+  // Removing the typed text merged the pieces it had split.
+  EXPECT_GE(12, pieceCount(rope));
+}
+
+TEST_F(RopeTest, RandomEditsAndCopies) {
+  std::mt19937 random(1234);
+  auto uniform = [&random](int min, int max) { return std::uniform_int_distribution<int>(min, max)(random); };
+  QString reference = text(20000, 97);
+  Rope rope{QStringRef(&reference)};
+  // Copies taken along the way, with the text they must keep.
+  std::vector<std::tuple<Rope, QString>> copies;
+  for (int step = 0; step < 2000; ++step) {
+    const int operation = uniform(0, 9);
+    const int position = uniform(0, reference.size());
+    if (operation <= 4) {
+      const QString inserted = text(operation == 0 ? uniform(1, 3 * Rope::maxPieceLength) : uniform(1, 5), uniform(0, 1) * uniform(1, 10), 'A');
+      rope.insert(position, QStringRef(&inserted));
+      reference.insert(position, inserted);
+    } else if (operation <= 8) {
+      const int count = operation == 5 ? uniform(0, 3 * Rope::maxPieceLength) : uniform(0, 5);
+      rope.remove(position, count);
+      reference.remove(position, count);
+    } else {
+      if (uniform(0, 3) == 0) {
+        rope.truncate(position);
+        reference.truncate(position);
+      }
+      copies.emplace_back(rope, reference);
+    }
+    checkSame(rope, reference);
+    if (HasFatalFailure()) return;
+  }
+  for (const auto& copy : copies) {
+    checkSame(std::get<0>(copy), std::get<1>(copy));
+    if (HasFatalFailure()) return;
+  }
+}
+
+}  // namespace Editor
+}  // namespace Med
@@ -19,21 +19,38 @@ public:
   Op(OpType type, Buffer* originalBuffer) : type_(type), originalStart_(SafePoint::Content(), originalBuffer), originalEnd_(SafePoint::Content(), originalBuffer) {}
 
   const OpType type_;
+  // The state the buffer goes back to when the op is reverted.
+  Undo::State revertedState_ = 0;
   SafePoint originalStart_;
   SafePoint originalEnd_;
   std::unique_ptr<Buffer> undoBuffer_;
+  // The edits that revert an EDITS op.
+  std::vector<BatchEdit> edits_;
 };
 
 Undo::Undo(Buffer* buffer) : buffer_(buffer) {}
 Undo::~Undo() {}
 
-bool Undo::modified() const { return !unmodified_; }
-void Undo::setUnmodified() {
-  unmodified_ = true;
-  opMakesUnmodified_ = nullptr;
+MemoryStats Undo::memoryStats() const {
+  MemoryStats stats;
+  for (const auto* ops : {&opsToUndo_, &opsToRedo_}) {
+    for (const std::unique_ptr<Op>& op : *ops) {
+      stats.undo += sizeof(Op);
+      if (op->undoBuffer_) stats.undo += op->undoBuffer_->memoryStats().heapBytes();
+      for (const BatchEdit& edit : op->edits_) stats.undo += sizeof(BatchEdit) + edit.edit.text.capacity() * sizeof(QChar);
+    }
+  }
+  return stats;
+}
+
+Undo::State Undo::checkpoint() {
+  checkpointState_ = state_;
+  return state_;
 }
 
 Undo::Op* Undo::currentOp(RecordMode mode) {
+  // Changes from the unmodified or checkpoint state aren't merged into the op that led there, so that undoing or redoing can stop at that state.
+  if (state_ == unmodifiedState_ || state_ == checkpointState_) return nullptr;
   auto& ops = mode == RecordMode::UNDO ? opsToRedo_ : opsToUndo_;
   return ops.empty() ? nullptr : ops.back().get();
 }
@@ -42,10 +59,7 @@ Undo::Op& Undo::newOp(RecordMode mode, OpType opType) {
   if (mode == RecordMode::NORMAL) opsToRedo_.clear();
   auto& ops = mode == RecordMode::UNDO ? opsToRedo_ : opsToUndo_;
   ops.push_back(std::make_unique<Op>(opType, buffer_));
-  if (unmodified_) {
-    unmodified_ = false;
-    opMakesUnmodified_ = ops.back().get();
-  }
+  ops.back()->revertedState_ = state_;
   return *ops.back();
 }
 
@@ -54,10 +68,12 @@ TempPoint Undo::deletionHandling(RecordMode mode, const Point& start, const Poin
     if (op->type_ == OpType::DELETION) {
       if (op->originalStart_.samePositionAs(start)) {
         // The new deletion is just after the previous one; extend the end.
+        changed();
         return TempPoint(op->undoBuffer_.get(), Point::BufferEnd());
       }
       if (op->originalStart_.samePositionAs(end)) {
         // The new deletion is just before the previous one; extend the start.
+        changed();
         return TempPoint(op->undoBuffer_.get(), Point::BufferStart());
       }
     }
@@ -66,6 +82,7 @@ TempPoint Undo::deletionHandling(RecordMode mode, const Point& start, const Poin
   op.originalStart_.moveTo(start);
   op.undoBuffer_ = Buffer::create();
   op.undoBuffer_->insertLast();
+  changed();
   return TempPoint(op.undoBuffer_.get(), Point::BufferEnd());
 }
 
@@ -74,16 +91,19 @@ void Undo::recordInsertion(RecordMode mode, const Point& start, const Point& end
     if (op->type_ == OpType::INSERTION) {
       if (op->originalStart_.samePositionAs(start) || op->originalEnd_.samePositionAs(end)) {
         // originalStart_ or originalEnd_ has already been updated so the current undo op already covers the new insertion.
+        changed();
         return;
       }
       if (op->originalEnd_.samePositionAs(start)) {
         // The new insertion is just after the previous one; extend the end.
         op->originalEnd_.moveTo(end);
+        changed();
         return;
       }
       if (op->originalStart_.samePositionAs(end)) {
         // The new insertion is just before the previous one; extend the start.
         op->originalStart_.moveTo(start);
+        changed();
         return;
       }
     }
@@ -91,6 +111,18 @@ void Undo::recordInsertion(RecordMode mode, const Point& start, const Point& end
   Op& op = newOp(mode, OpType::INSERTION);
   op.originalStart_.moveTo(start);
   op.originalEnd_.moveTo(end);
+  changed();
+}
+
+void Undo::recordEdits(RecordMode mode, std::vector<BatchEdit> edits, std::unique_ptr<Buffer> undoBuffer) {
+  if (edits.empty()) return;
+  Op& op = newOp(mode, OpType::EDITS);
+  // Where the first edit starts, for revertLast() to move the insertion point to.
+  op.originalStart_.setLineNumber(edits.front().edit.startLineNumber);
+  op.originalStart_.setColumnNumber(edits.front().edit.startColumnNumber);
+  op.edits_ = std::move(edits);
+  op.undoBuffer_ = std::move(undoBuffer);
+  changed();
 }
 
 bool Undo::revertLast(RecordMode mode, Point* insertionPoint) {
@@ -111,12 +143,13 @@ bool Undo::revertLast(RecordMode mode, Point* insertionPoint) {
       recordInsertion(mode, start, op->originalStart_);
       break;
     }
+    case OpType::EDITS:
+      buffer_->applyBatch(&op->edits_, op->undoBuffer_.get(), recorder);
+      break;
   }
   if (insertionPoint) insertionPoint->moveTo(op->originalStart_);
-  if (opMakesUnmodified_ == op.get()) {
-    unmodified_ = true;
-    opMakesUnmodified_ = nullptr;
-  }
+  // The ops recorded while reverting lead back to the state before reverting.
+  state_ = op->revertedState_;
   return true;
 }
 
@@ -1,11 +1,15 @@
 #ifndef MED_EDITOR_UNDO_H
 #define MED_EDITOR_UNDO_H
 
+#include <cstdint>
 #include <memory>
 #include <vector>
 
 #include <QtCore/QString>
 
+#include "Edit.h"
+#include "MemoryStats.h"
+
 namespace Med {
 namespace Editor {
 
@@ -39,8 +43,23 @@ public:
 
   TempPoint deletionHandling(RecordMode mode, const Point& start, const Point& end);
 
-  bool modified() const;
-  void setUnmodified();
+  // Called after Buffer::applyEdits(), with the edits that revert it, sorted by position, and the buffer holding the text of their moved edits, if any. The edits are recorded as one op, which is never merged with others.
+  void recordEdits(RecordMode mode, std::vector<BatchEdit> edits, std::unique_ptr<Buffer> undoBuffer);
+
+  // Identifies a state of the buffer: every recorded change leads to a new state, and undoing or redoing an operation goes back to the state it was reverted from.
+  typedef int64_t State;
+
+  // Returns the current state. The next change starts a new operation rather than being merged into the current one, so that the state can be undone or redone back to, e.g. to pass it to setUnmodified() later.
+  State checkpoint();
+
+  // Whether the buffer is in another state than the last one passed to setUnmodified(), e.g. because the state was saved.
+  bool modified() const { return state_ != unmodifiedState_; }
+  void setUnmodified() { unmodifiedState_ = state_; }
+  // Makes the given state the unmodified one, even if the buffer has changed since; undoing or redoing back to it makes the buffer unmodified.
+  void setUnmodified(State state) { unmodifiedState_ = state; }
+
+  // The memory taken by the recorded ops, in the undo member. O(N) in the size of the deleted text.
+  MemoryStats memoryStats() const;
 
 private:
   // Reverts the last recorded op.
@@ -49,18 +68,24 @@ private:
   void clear();
 
   class Op;
-  enum class OpType { INSERTION, DELETION };
+  // An EDITS op reverts a batch of edits by making others; see recordEdits().
+  enum class OpType { INSERTION, DELETION, EDITS };
 
+  // The op that a change recorded in the given mode can be merged into, if any.
   Op* currentOp(RecordMode mode);
   Op& newOp(RecordMode mode, OpType opType);
+  // Moves to a new state after a change has been recorded.
+  void changed() { state_ = ++lastState_; }
 
   Buffer* const buffer_;
   std::vector<std::unique_ptr<Op>> opsToUndo_;
   std::vector<std::unique_ptr<Op>> opsToRedo_;
 
-  bool unmodified_ = false;
-  // If non-null, reverting this op will put the buffer in unmodified state.
-  Op* opMakesUnmodified_ = nullptr;
+  State state_ = 0;
+  State lastState_ = 0;
+  // No state until setUnmodified() is called.
+  State unmodifiedState_ = -1;
+  State checkpointState_ = -1;
 };
 
 }  // namespace Editor
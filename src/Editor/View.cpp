@@ -1,5 +1,9 @@
 #include "View.h"
 
+#include <algorithm>
+#include <tuple>
+#include <utility>
+
 namespace Med {
 namespace Editor {
 
@@ -8,5 +12,104 @@ View::View(Buffer* buffer) : buffer_(buffer), insertionPoint_(SafePoint::Interac
   undo_.setUnmodified();
 }
 
+void View::addInsertionPoint(const Point& point) {
+  if (!point.isValid()) return;
+  extraInsertionPoints_.emplace_back(new SafePoint(SafePoint::Interactive(), buffer_));
+  extraInsertionPoints_.back()->moveTo(point);
+}
+
+void View::mergeInsertionPoints() {
+  typedef std::pair<int, int> Position;
+  auto positionOf = [](const Point& point) { return Position(point.lineNumber(), point.columnNumber()); };
+  std::vector<std::pair<Position, std::unique_ptr<SafePoint>>> points;
+  points.reserve(extraInsertionPoints_.size());
+  for (std::unique_ptr<SafePoint>& point : extraInsertionPoints_) {
+    if (point->isValid()) points.emplace_back(positionOf(*point), std::move(point));
+  }
+  std::sort(points.begin(), points.end(), [](const std::pair<Position, std::unique_ptr<SafePoint>>& left, const std::pair<Position, std::unique_ptr<SafePoint>>& right) { return left.first < right.first; });
+  extraInsertionPoints_.clear();
+  const Position insertionPosition = insertionPoint_.isValid() ? positionOf(insertionPoint_) : Position(0, 0);
+  for (std::size_t index = 0; index < points.size(); ++index) {
+    if (points[index].first == insertionPosition || (index > 0 && points[index].first == points[index - 1].first)) continue;
+    extraInsertionPoints_.push_back(std::move(points[index].second));
+  }
+}
+
+bool View::editAtInsertionPoints(const std::function<bool(const Point&, Edit*)>& editAt, EditedLines* editedLines) {
+  if (!insertionPoint_.isValid()) return false;
+  std::vector<Edit> edits;
+  edits.reserve(extraInsertionPoints_.size() + 1);
+  Edit edit;
+  const bool hasEdit = editAt(insertionPoint_, &edit);
+  if (selectionPoint_.isValid()) {
+    Point* start = nullptr;
+    Point* end = nullptr;
+    Point::sortPair(&insertionPoint_, &selectionPoint_, &start, &end);
+    if (hasEdit || !start->samePositionAs(*end)) edits.push_back({start->lineNumber(), start->columnNumber(), end->lineNumber(), end->columnNumber(), hasEdit ? edit.text : QString()});
+    selectionPoint_.reset();
+  } else if (hasEdit) {
+    edits.push_back(std::move(edit));
+  }
+  for (const std::unique_ptr<SafePoint>& point : extraInsertionPoints_) {
+    Edit pointEdit;
+    if (point->isValid() && editAt(*point, &pointEdit)) edits.push_back(std::move(pointEdit));
+  }
+  // The edit of insertionPoint_ comes first, so it's the one kept among equal ones.
+  std::stable_sort(edits.begin(), edits.end(), [](const Edit& left, const Edit& right) {
+    return std::make_tuple(left.startLineNumber, left.startColumnNumber, left.endLineNumber, left.endColumnNumber) < std::make_tuple(right.startLineNumber, right.startColumnNumber, right.endLineNumber, right.endColumnNumber);
+  });
+  std::size_t keptCount = 0;
+  for (std::size_t index = 0; index < edits.size(); ++index) {
+    if (keptCount > 0) {
+      const Edit& previous = edits[keptCount - 1];
+      const std::pair<int, int> start(edits[index].startLineNumber, edits[index].startColumnNumber);
+      if (start < std::make_pair(previous.endLineNumber, previous.endColumnNumber) || start == std::make_pair(previous.startLineNumber, previous.startColumnNumber)) continue;
+    }
+    if (keptCount != index) edits[keptCount] = std::move(edits[index]);
+    ++keptCount;
+  }
+  edits.resize(keptCount);
+  if (edits.empty()) return false;
+
+  editedLines->lineNumbers.clear();
+  editedLines->linesInsertedOrDeleted = false;
+  for (const Edit& edit : edits) {
+    if (editedLines->lineNumbers.empty() || editedLines->lineNumbers.back() != edit.startLineNumber) editedLines->lineNumbers.push_back(edit.startLineNumber);
+    if (edit.endLineNumber != edit.startLineNumber || edit.text.contains(QChar('\n'))) editedLines->linesInsertedOrDeleted = true;
+  }
+  if (!buffer_->applyEdits(std::move(edits), undo_.recorder())) return false;
+  // Insertion points that were at the same position, or that deleting brought together, are now one.
+  mergeInsertionPoints();
+  return true;
+}
+
+bool View::insertAtInsertionPoints(const QString& text, EditedLines* editedLines) {
+  if (text.isEmpty() && !selectionPoint_.isValid()) return false;
+  return editAtInsertionPoints([&text](const Point& point, Edit* edit) {
+    const int lineNumber = point.lineNumber();
+    const int columnNumber = point.columnNumber();
+    *edit = {lineNumber, columnNumber, lineNumber, columnNumber, text};
+    return !text.isEmpty();
+  }, editedLines);
+}
+
+bool View::deleteCharBeforeInsertionPoints(EditedLines* editedLines) {
+  return editAtInsertionPoints([](const Point& point, Edit* edit) {
+    TempPoint start(point);
+    if (!start.moveLeft()) return false;
+    *edit = {start.lineNumber(), start.columnNumber(), point.lineNumber(), point.columnNumber(), QString()};
+    return true;
+  }, editedLines);
+}
+
+bool View::deleteCharAfterInsertionPoints(EditedLines* editedLines) {
+  return editAtInsertionPoints([](const Point& point, Edit* edit) {
+    TempPoint end(point);
+    if (!end.moveRight()) return false;
+    *edit = {point.lineNumber(), point.columnNumber(), end.lineNumber(), end.columnNumber(), QString()};
+    return true;
+  }, editedLines);
+}
+
 }  // namespace Editor
-}  // namespace Med
\ No newline at end of file
+}  // namespace Med
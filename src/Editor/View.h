@@ -1,7 +1,12 @@
 #ifndef MED_EDITOR_VIEW_H
 #define MED_EDITOR_VIEW_H
 
+#include <functional>
+#include <memory>
+#include <vector>
+
 #include "Buffer.h"
+#include "Edit.h"
 #include "Undo.h"
 
 namespace Med {
@@ -13,11 +18,36 @@ public:
   SafePoint selectionPoint_;
   SafePoint pageTop_;
   Undo undo_;
+  // Insertion points besides insertionPoint_, for editing in many places at once. They have no selection, and are in no particular order.
+  std::vector<std::unique_ptr<SafePoint>> extraInsertionPoints_;
 
   View(Buffer* buffer);
 
   Buffer* buffer() { return buffer_; }
 
+  bool hasExtraInsertionPoints() const { return !extraInsertionPoints_.empty(); }
+  // Adds an extra insertion point where point is. One at the same position as another is dropped by the next mergeInsertionPoints().
+  void addInsertionPoint(const Point& point);
+  void clearExtraInsertionPoints() { extraInsertionPoints_.clear(); }
+  // Drops the extra insertion points that are at the same position as insertionPoint_ or another one. O(k log k) for k insertion points.
+  void mergeInsertionPoints();
+
+  // What editing at the insertion points changed, so that views can lay out only that again.
+  struct EditedLines {
+    // The lines where the edits started, in increasing order, numbered as before the edits.
+    std::vector<int> lineNumbers;
+    // Whether lines were inserted or deleted, which changes the numbers of the lines after them too.
+    bool linesInsertedOrDeleted = false;
+  };
+
+  // Makes an edit at each insertion point, all in one pass with Buffer::applyEdits(), and records them as one undo step. editAt fills in the edit for a point, whose range must contain it, and returns false if there is nothing to do there. If there is a selection, the edit of insertionPoint_ replaces it instead, and the selection is cleared. An edit that overlaps one before it, as those of insertion points at the same position do, is dropped. Returns false if nothing changed.
+  bool editAtInsertionPoints(const std::function<bool(const Point&, Edit*)>& editAt, EditedLines* editedLines);
+  // Inserts text, which may have line breaks, before each insertion point.
+  bool insertAtInsertionPoints(const QString& text, EditedLines* editedLines);
+  // Deletes the character before or after each insertion point, joining lines at their starts or ends, as Point::deleteCharBefore() and Point::deleteCharAfter() do.
+  bool deleteCharBeforeInsertionPoints(EditedLines* editedLines);
+  bool deleteCharAfterInsertionPoints(EditedLines* editedLines);
+
 private:
   Buffer* buffer_;
 };
@@ -0,0 +1,123 @@
+#include "View.h"
+
+#include <string>
+#include <vector>
+#include <QtCore/QTemporaryFile>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace Med {
+namespace Editor {
+
+class ViewTest : public ::testing::Test {
+protected:
+  void InitBuffer(const char* content) {
+    QTemporaryFile file;
+    ASSERT_TRUE(file.open());
+    file.write(content);
+    file.close();
+    buffer = Buffer::open(file.fileName().toStdString());
+    view.reset(new View(buffer.get()));
+  }
+
+  std::vector<std::string> lines() {
+    std::vector<std::string> lines;
+    for (const QString& lineContent : TempPoint(buffer.get(), 1).linesForwards()) lines.push_back(lineContent.toStdString());
+    return lines;
+  }
+
+  // Moves the insertion point, or adds an extra one if extra, to the given position.
+  void placeInsertionPoint(int lineNumber, int columnNumber, bool extra = true) {
+    TempPoint point(buffer.get(), lineNumber);
+    point.setColumnNumber(columnNumber);
+    if (extra) {
+      view->addInsertionPoint(point);
+    } else {
+      view->insertionPoint_.moveTo(point);
+    }
+  }
+
+  std::vector<std::pair<int, int>> extraPositions() {
+    std::vector<std::pair<int, int>> positions;
+    for (const auto& point : view->extraInsertionPoints_) positions.emplace_back(point->lineNumber(), point->columnNumber());
+    return positions;
+  }
+
+  std::unique_ptr<Buffer> buffer;
+  std::unique_ptr<View> view;
+};
+
+TEST_F(ViewTest, TypeAtInsertionPoints) {
+  InitBuffer("one\ntwo\nthree");
+  placeInsertionPoint(2, 1, false);
+  placeInsertionPoint(1, 3);
+  placeInsertionPoint(3, 0);
+  placeInsertionPoint(2, 3);
+  // A second insertion point at the same position types only once.
+  placeInsertionPoint(3, 0);
+
+  View::EditedLines editedLines;
+  ASSERT_TRUE(view->insertAtInsertionPoints("ab", &editedLines));
+  EXPECT_THAT(lines(), testing::ElementsAre("oneab", "tabwoab", "abthree"));
+  EXPECT_THAT(editedLines.lineNumbers, testing::ElementsAre(1, 2, 3));
+  EXPECT_FALSE(editedLines.linesInsertedOrDeleted);
+  EXPECT_EQ(2, view->insertionPoint_.lineNumber());
+  EXPECT_EQ(3, view->insertionPoint_.columnNumber());
+  EXPECT_THAT(extraPositions(), testing::ElementsAre(std::make_pair(1, 5), std::make_pair(2, 7), std::make_pair(3, 2)));
+
+  ASSERT_TRUE(view->deleteCharBeforeInsertionPoints(&editedLines));
+  EXPECT_THAT(lines(), testing::ElementsAre("onea", "tawoa", "athree"));
+
+  // Each keystroke is one undo step, whatever the number of insertion points.
+  ASSERT_TRUE(view->undo_.undo(nullptr));
+  EXPECT_THAT(lines(), testing::ElementsAre("oneab", "tabwoab", "abthree"));
+  ASSERT_TRUE(view->undo_.undo(nullptr));
+  EXPECT_THAT(lines(), testing::ElementsAre("one", "two", "three"));
+  EXPECT_FALSE(view->undo_.undo(nullptr));
+}
+
+TEST_F(ViewTest, EditsAcrossLinesAndMergedInsertionPoints) {
+  InitBuffer("one\ntwo\nthree");
+  placeInsertionPoint(2, 0, false);
+  placeInsertionPoint(3, 0);
+  placeInsertionPoint(1, 0);
+
+  // Backspace at the start of the first line does nothing there, and joins the other lines with the ones before them.
+  View::EditedLines editedLines;
+  ASSERT_TRUE(view->deleteCharBeforeInsertionPoints(&editedLines));
+  EXPECT_THAT(lines(), testing::ElementsAre("onetwothree"));
+  EXPECT_TRUE(editedLines.linesInsertedOrDeleted);
+  EXPECT_EQ(3, view->insertionPoint_.columnNumber());
+  EXPECT_THAT(extraPositions(), testing::ElementsAre(std::make_pair(1, 0), std::make_pair(1, 6)));
+
+  ASSERT_TRUE(view->insertAtInsertionPoints("\n", &editedLines));
+  EXPECT_THAT(lines(), testing::ElementsAre("", "one", "two", "three"));
+
+  // Deleting the characters between two insertion points brings them together, and they become one.
+  placeInsertionPoint(2, 2, false);
+  view->clearExtraInsertionPoints();
+  placeInsertionPoint(2, 1);
+  ASSERT_TRUE(view->deleteCharAfterInsertionPoints(&editedLines));
+  EXPECT_THAT(lines(), testing::ElementsAre("", "o", "two", "three"));
+  EXPECT_TRUE(view->extraInsertionPoints_.empty());
+}
+
+TEST_F(ViewTest, TypingReplacesSelection) {
+  InitBuffer("one two\nthree");
+  placeInsertionPoint(1, 1, false);
+  view->selectionPoint_.moveTo(view->insertionPoint_);
+  view->insertionPoint_.setColumnNumber(5);
+  placeInsertionPoint(2, 5);
+  // An insertion point in the selection is dropped with it.
+  placeInsertionPoint(1, 3);
+
+  View::EditedLines editedLines;
+  ASSERT_TRUE(view->insertAtInsertionPoints("X", &editedLines));
+  EXPECT_THAT(lines(), testing::ElementsAre("oXwo", "threeX"));
+  EXPECT_FALSE(view->selectionPoint_.isValid());
+  EXPECT_EQ(2, view->insertionPoint_.columnNumber());
+}
+
+}  // namespace Editor
+}  // namespace Med
@@ -17,6 +17,8 @@ public:
   virtual ~Views();
   
   View* newView(Buffer* buffer);
+
+  const std::list<std::unique_ptr<View>>& views() const { return views_; }
   
 private:
   std::list<std::unique_ptr<View>> views_;
@@ -1,14 +1,40 @@
 #include "MainWindow.h"
 
+#include <map>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QSaveFile>
 #include <QtWidgets/QAction>
 #include <QtWidgets/QFileDialog>
 #include <QtWidgets/QLabel>
 #include <QtWidgets/QMenu>
 #include <QtWidgets/QMenuBar>
+#include <QtWidgets/QMessageBox>
 
 namespace Med {
 namespace QtGui {
 
+namespace {
+
+QJsonObject toJson(const Editor::MemoryStats& stats) {
+  QJsonObject object;
+  object["heapBytes"] = qint64(stats.heapBytes());
+  object["lineText"] = qint64(stats.lineText);
+  object["mappedText"] = qint64(stats.mappedText);
+  object["lineNodes"] = qint64(stats.lineNodes);
+  object["snapshotNodes"] = qint64(stats.snapshotNodes);
+  object["points"] = qint64(stats.points);
+  object["undo"] = qint64(stats.undo);
+  object["layouts"] = qint64(stats.layouts);
+  return object;
+}
+
+QString mebibytes(const QJsonValue& bytes) {
+  return QString::number(bytes.toDouble() / (1 << 20), 'f', 1) + " MiB";
+}
+
+}  // namespace
+
 MainWindow::MainWindow() : tabWidget(this) {
   setCentralWidget(&tabWidget);
 
@@ -37,10 +63,37 @@ MainWindow::MainWindow() : tabWidget(this) {
   addNewActionWithView("Save", QKeySequence::Save, fileMenu, [this](View* currentView) {
     currentView->save();
   });
+  addNewActionWithView("Stop Loading", QKeySequence::Cancel, fileMenu, [this](View* currentView) {
+    currentView->cancelLoading();
+  });
   addNewAction("Close", QKeySequence::Close, fileMenu, [this]() {
     delete tabWidget.currentWidget();
   });
   addNewAction("Quit", QKeySequence::Quit, fileMenu, [this]() { close(); });
+  QMenu* toolsMenu = menuBar()->addMenu("Tools");
+  addNewAction("Memory Usage", {}, toolsMenu, [this]() {
+    const QJsonObject report = memoryReport();
+    QString text;
+    for (const QJsonValue& buffer : report["buffers"].toArray()) {
+      const QJsonObject stats = buffer.toObject();
+      text += QString("%1: %2 in %3 lines\n").arg(stats["name"].toString().isEmpty() ? "<None>" : stats["name"].toString(), mebibytes(stats["heapBytes"])).arg(stats["lines"].toInt());
+    }
+    const QJsonObject total = report["total"].toObject();
+    text += QString("\nTotal: %1\n").arg(mebibytes(total["heapBytes"]));
+    for (const char* key : {"lineText", "lineNodes", "snapshotNodes", "points", "undo", "layouts", "mappedText"}) {
+      text += QString("  %1: %2\n").arg(key, mebibytes(total[key]));
+    }
+    text += QString("Reserved for line nodes: %1").arg(mebibytes(report["reservedLineNodeBytes"]));
+    QMessageBox::information(this, "Memory Usage", text);
+  });
+  addNewAction("Save Memory Report...", {}, toolsMenu, [this]() {
+    const QString filePath = QFileDialog::getSaveFileName(this, "Save Memory Report", "memory.json");
+    if (filePath.isEmpty()) return;
+    QSaveFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly) || file.write(QJsonDocument(memoryReport()).toJson()) < 0 || !file.commit()) {
+      QMessageBox::warning(this, "Med", "Couldn't write " + filePath + ": " + file.errorString());
+    }
+  });
   QMenu* editMenu = menuBar()->addMenu("Edit");
   addNewActionWithView("Undo", QKeySequence::Undo, editMenu, [this](View* currentView) {
     currentView->undo();
@@ -58,15 +111,43 @@ MainWindow::MainWindow() : tabWidget(this) {
 
 MainWindow::~MainWindow() {}
 
-void MainWindow::OpenBuffer(Editor::Buffer* buffer) {
+View* MainWindow::OpenBuffer(Editor::Buffer* buffer) {
   Editor::View* view = views_.newView(buffer);
   viewWidgets.push_back(new View(view, &tabWidget));
   tabWidget.setCurrentIndex(tabWidget.addTab(viewWidgets.back(), ""));
   viewWidgets.back()->updateLabel();
+  return viewWidgets.back();
+}
+
+QJsonObject MainWindow::memoryReport() {
+  std::map<const Editor::Buffer*, Editor::MemoryStats> bufferStats;
+  for (const std::unique_ptr<Editor::View>& view : views_.views()) bufferStats[view->buffer()] += view->undo_.memoryStats();
+  for (int index = 0; index < tabWidget.count(); ++index) {
+    if (View* view = qobject_cast<View*>(tabWidget.widget(index))) bufferStats[view->buffer()] += view->memoryStats();
+  }
+  QJsonArray buffers;
+  Editor::MemoryStats total;
+  for (const std::unique_ptr<Editor::Buffer>& buffer : buffers_.buffers()) {
+    Editor::MemoryStats& stats = bufferStats[buffer.get()];
+    stats += buffer->memoryStats();
+    total += stats;
+    QJsonObject entry = toJson(stats);
+    entry["name"] = buffer->name();
+    entry["filePath"] = QString::fromStdString(buffer->filePath());
+    entry["lines"] = buffer->lineCount();
+    buffers.append(entry);
+  }
+  QJsonObject report;
+  report["buffers"] = buffers;
+  report["total"] = toJson(total);
+  report["reservedLineNodeBytes"] = qint64(Editor::Buffer::reservedNodeBytes());
+  return report;
 }
 
 void MainWindow::OpenFile(const std::string& path) {
-  OpenBuffer(buffers_.openFile(path));
+  // The view shows up right away, and fills in as the file loads.
+  std::unique_ptr<Editor::BufferLoader> loader = buffers_.startOpeningFile(path);
+  OpenBuffer(loader->buffer())->startLoading(std::move(loader));
 }
 
 }  // namespace QtGui
@@ -1,6 +1,7 @@
 #ifndef MED_QTGUI_MAINWINDOW_H
 #define MED_QTGUI_MAINWINDOW_H
 
+#include <QtCore/QJsonObject>
 #include <QtWidgets/QMainWindow>
 #include <QtWidgets/QTabWidget>
 #include <string>
@@ -20,7 +21,9 @@ public:
   void OpenFile(const std::string& path);
 
 private:
-  void OpenBuffer(Editor::Buffer* buffer);
+  View* OpenBuffer(Editor::Buffer* buffer);
+  // The memory taken by each buffer, counting its undo history and the layouts of its views, and in total; see Editor::MemoryStats.
+  QJsonObject memoryReport();
 
   Editor::Buffers buffers_;
   Editor::Views views_;
@@ -1,5 +1,6 @@
 #include "View.h"
 
+#include <algorithm>
 #include <QtCore/QEvent>
 #include <QtCore/QTimer>
 #include <QtGui/QClipboard>
@@ -7,6 +8,7 @@
 #include <QtGui/QTextLine>
 #include <QtWidgets/QAbstractScrollArea>
 #include <QtWidgets/QApplication>
+#include <QtWidgets/QMessageBox>
 #include <QtWidgets/QScrollBar>
 #include <QtWidgets/QVBoxLayout>
 
@@ -24,7 +26,7 @@ public:
     cursorBlinkingTimer_ = new QTimer(this);
     QObject::connect(cursorBlinkingTimer_, &QTimer::timeout, this, [this] () {
       cursorOn_ = !cursorOn_;
-      update(cursorBounds_);
+      update(cursorsBounds());
     });
   }
 
@@ -32,6 +34,7 @@ public:
   Editor::SafePoint& selectionPoint() { return view_->view_->selectionPoint_; }
   Editor::SafePoint& pageTop() { return view_->view_->pageTop_; }
   Editor::Undo* undo() { return &view_->view_->undo_; }
+  Editor::View* editorView() { return view_->view_; }
   Editor::Undo::Recorder recorder() { return undo()->recorder(); }
 
   bool event(QEvent* event) override {
@@ -42,6 +45,11 @@ public:
         return true;
       }
     }
+    // Escape is also the shortcut to stop loading; while there are extra insertion points, it clears them instead.
+    if (event->type() == QEvent::ShortcutOverride && static_cast<QKeyEvent*>(event)->key() == Qt::Key_Escape && editorView()->hasExtraInsertionPoints()) {
+      event->accept();
+      return true;
+    }
     return QWidget::event(event);
   }
 
@@ -52,13 +60,15 @@ public:
     QPointF linePos(0, 0);
     int top = 0;
     cursorBounds_ = {};
-    for (const QString* lineContent : pageTop().linesForwards()) {
+    const int insertionLineNumber = insertionPoint().lineNumber();
+    int lineNumber = pageTop().lineNumber();
+    for (const QString& lineContent : pageTop().linesForwards()) {
       page_.emplace_back();
       Line& line = page_.back();
-      line.layout.reset(new QTextLayout(*lineContent, *textFont_));
+      line.layout.reset(new QTextLayout(lineContent, *textFont_));
       top += leading;
       updateLayout(line.layout.get(), top);
-      if (lineContent == &insertionPoint().lineContent()) updateCursorBounds(line.layout.get());
+      if (lineNumber++ == insertionLineNumber) updateCursorBounds(line.layout.get());
       top = line.layout->boundingRect().bottom();
       if (top >= height()) break;
     }
@@ -94,6 +104,10 @@ public:
       if (insertionPointLayout) {
         insertionPointLayout->drawCursor(&painter, {0, 0}, insertionPoint().columnNumber(), 2);
       }
+      for (const auto& point : editorView()->extraInsertionPoints_) {
+        QTextLayout* layout = layoutForLineNumber(point->lineNumber());
+        if (layout) layout->drawCursor(&painter, {0, 0}, point->columnNumber(), 2);
+      }
     }
     QWidget::paintEvent(event);
   }
@@ -104,6 +118,11 @@ public:
     return page_.at(layoutIndex).layout.get();
   }
 
+  // Where the cursors are drawn: only the insertion point's, unless there are extra ones, which may be anywhere on the page.
+  QRect cursorsBounds() {
+    return editorView()->hasExtraInsertionPoints() ? rect() : cursorBounds_;
+  }
+
   void updateCursorBounds(QTextLayout* layoutForInsertionPoint) {
     cursorBounds_ = layoutForInsertionPoint->boundingRect().toAlignedRect();
     cursorBounds_.setLeft(layoutForInsertionPoint->lineAt(0).cursorToX(
@@ -206,8 +225,29 @@ public:
     }
   }
 
-  void handleKeyCursorMove(QKeyEvent* event, std::function<bool()> move) {
-    handleCursorMove(event->modifiers() & Qt::ShiftModifier, move);
+  void handleKeyCursorMove(QKeyEvent* event, std::function<bool(Editor::Point*)> move) {
+    const bool extendSelection = event->modifiers() & Qt::ShiftModifier;
+    if ((event->modifiers() & Qt::ControlModifier) && (event->modifiers() & Qt::AltModifier)) {
+      // Leaves an extra insertion point behind, so that typing goes to both places.
+      if (!insertionPoint().isValid()) return;
+      editorView()->addInsertionPoint(insertionPoint());
+      handleCursorMove(false, [this, &move]() { return move(&insertionPoint()); });
+      editorView()->mergeInsertionPoints();
+      updateAfterVisibleChange(rect());
+      return;
+    }
+    handleCursorMove(extendSelection, [this, &move]() { return move(&insertionPoint()); });
+    // The extra insertion points have no selections, so they only follow plain moves.
+    if (extendSelection || !editorView()->hasExtraInsertionPoints()) return;
+    for (const auto& point : editorView()->extraInsertionPoints_) move(point.get());
+    editorView()->mergeInsertionPoints();
+    updateAfterVisibleChange(rect());
+  }
+
+  void clearExtraInsertionPoints() {
+    if (!editorView()->hasExtraInsertionPoints()) return;
+    editorView()->clearExtraInsertionPoints();
+    updateAfterVisibleChange(rect());
   }
 
   void updateAfterLineInsertedOrDeleted() {
@@ -215,6 +255,45 @@ public:
     updateAfterVisibleChange(rect());
   }
 
+  // Lays out again only the edited lines that are on the page, unless lines were inserted or deleted or the height of a line changed.
+  void updateAfterLinesEdited(const Editor::View::EditedLines& editedLines) {
+    if (editedLines.linesInsertedOrDeleted) {
+      updateAfterLineInsertedOrDeleted();
+      return;
+    }
+    const int pageTopLineNumber = pageTop().lineNumber();
+    const int pageEndLineNumber = pageTopLineNumber + page_.size();
+    // The edited lines are sorted, so those before the page are skipped at once.
+    auto lineNumber = std::lower_bound(editedLines.lineNumbers.begin(), editedLines.lineNumbers.end(), pageTopLineNumber);
+    QRect bounds;
+    Editor::TempPoint line(pageTop());
+    for (; lineNumber != editedLines.lineNumbers.end() && *lineNumber < pageEndLineNumber; ++lineNumber) {
+      QTextLayout* layout = page_[*lineNumber - pageTopLineNumber].layout.get();
+      const int oldHeight = layout->boundingRect().height();
+      const int top = layout->boundingRect().top();
+      line.setLineNumber(*lineNumber);
+      layout->setText(line.lineContent());
+      updateLayout(layout, top);
+      if (oldHeight != layout->boundingRect().height()) {
+        // Line height changed, fall back to resetting page.
+        updateAfterLineInsertedOrDeleted();
+        return;
+      }
+      bounds |= layoutBounds(layout);
+    }
+    // Clears the selection the edit replaced.
+    updateSelection(pageTopLineNumber, pageTopLineNumber, pageEndLineNumber - 1);
+    QTextLayout* layoutForInsertionPoint = layoutForLineNumber(insertionPoint().lineNumber());
+    if (layoutForInsertionPoint) updateCursorBounds(layoutForInsertionPoint);
+    updateAfterVisibleChange(bounds | cursorBounds_);
+  }
+
+  // Makes the change at every insertion point at once, as one undo step; see Editor::View::editAtInsertionPoints().
+  void handleContentChangeAtInsertionPoints(std::function<bool(Editor::View::EditedLines*)> change) {
+    Editor::View::EditedLines editedLines;
+    if (change(&editedLines)) updateAfterLinesEdited(editedLines);
+  }
+
   void handleKeyContentChange(bool canInsertOrDeleteLines, bool deleteSelection, std::function<bool()> change) {
     if (!insertionPoint().isValid()) return;
     if (selectionPoint().isValid()) {
@@ -237,23 +316,53 @@ public:
     switch (event->key()) {
       // Moving the cursor.
       case Qt::Key_Left:
-        handleKeyCursorMove(event, [this]() { return insertionPoint().moveLeft(); });
+        handleKeyCursorMove(event, [](Editor::Point* point) { return point->moveLeft(); });
         return;
       case Qt::Key_Right:
-        handleKeyCursorMove(event, [this]() { return insertionPoint().moveRight(); });
+        handleKeyCursorMove(event, [](Editor::Point* point) { return point->moveRight(); });
         return;
       case Qt::Key_Up:
-        handleKeyCursorMove(event, [this]() { return insertionPoint().moveUp(); });
+        handleKeyCursorMove(event, [](Editor::Point* point) { return point->moveUp(); });
         return;
       case Qt::Key_Down:
-        handleKeyCursorMove(event, [this]() { return insertionPoint().moveDown(); });
+        handleKeyCursorMove(event, [](Editor::Point* point) { return point->moveDown(); });
         return;
       case Qt::Key_Home:
-        handleKeyCursorMove(event, [this]() { return insertionPoint().moveToLineStart(); });
+        handleKeyCursorMove(event, [](Editor::Point* point) { return point->moveToLineStart(); });
         return;
       case Qt::Key_End:
-        handleKeyCursorMove(event, [this]() { return insertionPoint().moveToLineEnd(); });
+        handleKeyCursorMove(event, [](Editor::Point* point) { return point->moveToLineEnd(); });
+        return;
+      case Qt::Key_Escape:
+        if (!editorView()->hasExtraInsertionPoints()) break;
+        clearExtraInsertionPoints();
         return;
+      default:
+        break;
+    }
+    // With extra insertion points, each change is made at all of them in one pass.
+    if (editorView()->hasExtraInsertionPoints()) {
+      switch (event->key()) {
+        case Qt::Key_Return:
+          handleContentChangeAtInsertionPoints([this](Editor::View::EditedLines* editedLines) { return editorView()->insertAtInsertionPoints("\n", editedLines); });
+          return;
+        case Qt::Key_Backspace:
+          handleContentChangeAtInsertionPoints([this](Editor::View::EditedLines* editedLines) { return editorView()->deleteCharBeforeInsertionPoints(editedLines); });
+          return;
+        case Qt::Key_Delete:
+          handleContentChangeAtInsertionPoints([this](Editor::View::EditedLines* editedLines) { return editorView()->deleteCharAfterInsertionPoints(editedLines); });
+          return;
+        default:
+          const QString text = event->text();
+          if (!text.isEmpty()) {
+            handleContentChangeAtInsertionPoints([this, &text](Editor::View::EditedLines* editedLines) { return editorView()->insertAtInsertionPoints(text, editedLines); });
+            return;
+          }
+      }
+      QWidget::keyPressEvent(event);
+      return;
+    }
+    switch (event->key()) {
       // Content changes that may insert or delete lines.
       case Qt::Key_Return:
         handleKeyContentChange(true, true, [this]() { return insertionPoint().insertLineBreakBefore(recorder()); });
@@ -279,15 +388,16 @@ public:
 
   void handleMouseMoveWithButtonPressed(QMouseEvent* event) {
     handleCursorMove(mouseExtendingSelection_, [this, event]() {
-      int lineNumber = pageTop().lineNumber() - 1;
+      int lineIndex = -1;
       QTextLayout* layoutForClick = nullptr;
       for (Line& line : page_) {
-        ++lineNumber;
+        ++lineIndex;
         layoutForClick = line.layout.get();
         if (line.layout->boundingRect().bottom() >= event->y()) break;
       }
       if (!layoutForClick) return false;
-      insertionPoint().setLineNumber(lineNumber);
+      insertionPoint().moveTo(pageTop());
+      insertionPoint().moveLines(lineIndex);
       insertionPoint().setColumnNumber(layoutForClick->lineAt(0).xToCursor(event->x()));
       return true;
     });
@@ -302,7 +412,15 @@ public:
 
   void mousePressEvent(QMouseEvent* event) override {
     if (event->button() == Qt::LeftButton) {
+      // Control-clicking adds an insertion point, keeping the current one as an extra one; a plain click leaves only the clicked one.
+      if (event->modifiers() & Qt::ControlModifier) {
+        editorView()->addInsertionPoint(insertionPoint());
+        update(rect());
+      } else {
+        clearExtraInsertionPoints();
+      }
       handleMouseMoveWithButtonPressed(event);
+      editorView()->mergeInsertionPoints();
     }
   }
 
@@ -317,7 +435,7 @@ public:
   void focusOutEvent(QFocusEvent* event) override {
     cursorBlinkingTimer_->stop();
     // The update will hide the cursor.
-    update(cursorBounds_);
+    update(cursorsBounds());
   }
 
   void setTextFont(const QFont& font) {
@@ -337,12 +455,26 @@ public:
   }
 
   void pasteFromClipboard() {
+    if (editorView()->hasExtraInsertionPoints()) {
+      const QString text = QApplication::clipboard()->text();
+      handleContentChangeAtInsertionPoints([this, &text](Editor::View::EditedLines* editedLines) { return editorView()->insertAtInsertionPoints(text, editedLines); });
+      return;
+    }
     // TODO: implement more efficient paste when pasting from the same process.
     handleKeyContentChange(true, true, [this]() {
       return insertionPoint().insertBefore(QApplication::clipboard()->text().splitRef('\n').toStdVector(), recorder());
     });
   }
 
+  // An estimate, as QTextLayout doesn't tell how much it allocates: besides the layout and its text, about this much for the glyphs, advances, offsets and attributes of each character.
+  static constexpr int layoutBytesPerCharacter = 40;
+
+  int64_t layoutBytes() const {
+    int64_t bytes = 0;
+    for (const Line& line : page_) bytes += sizeof(QTextLayout) + line.layout->text().size() * (sizeof(QChar) + layoutBytesPerCharacter);
+    return bytes;
+  }
+
   struct Line {
     std::unique_ptr<QTextLayout> layout;
     QVector<QTextLayout::FormatRange> selections;
@@ -412,10 +544,14 @@ public:
   }
 
   void linesPerPageOrLineCountUpdated() {
-    verticalScrollBar()->setRange(1, std::max(0, view_->view_->buffer()->lineCount() - view_->lines_->linesPerPage()));
+    updateRange();
     if (view_->lines_) view_->lines_->resetPage();
   }
 
+  void updateRange() {
+    verticalScrollBar()->setRange(1, std::max(0, view_->view_->buffer()->lineCount() - view_->lines_->linesPerPage()));
+  }
+
   View* view_;
 };
 
@@ -443,17 +579,86 @@ void View::redo() {
 }
 
 bool View::save() {
-  const bool ok = view_->buffer()->save();
-  if (ok) {
-    view_->undo_.setUnmodified();
-    updateLabel();
-  }
-  return ok;
+  // Saving a buffer that is still loading would truncate its file.
+  if (loader_ != nullptr || saver_ != nullptr || view_->buffer()->filePath().empty()) return false;
+  // Edits made while saving start new undo operations, so undoing them comes back to the saved state.
+  savedState_ = view_->undo_.checkpoint();
+  saver_.reset(new Editor::BufferSaver(view_->buffer()));
+  if (saveTimer_ == nullptr) {
+    saveTimer_ = new QTimer(this);
+    QObject::connect(saveTimer_, &QTimer::timeout, this, [this] () { checkSaved(); });
+  }
+  saveTimer_->start(50);
+  updateLabel();
+  return true;
+}
+
+void View::checkSaved() {
+  bool saved = false;
+  try {
+    if (!saver_->finished()) {
+      updateLabel();
+      return;
+    }
+    saved = true;
+  } catch (const Editor::IOException& exception) {
+    QMessageBox::warning(this, "Med", exception.what());
+  }
+  saveTimer_->stop();
+  saver_.reset();
+  if (saved) view_->undo_.setUnmodified(savedState_);
+  updateLabel();
+}
+
+void View::startLoading(std::unique_ptr<Editor::BufferLoader> loader) {
+  loader_ = std::move(loader);
+  loadTimer_ = new QTimer(this);
+  // Appending the loaded lines every few milliseconds keeps the view responsive, and lets the first screen show as soon as it's loaded.
+  QObject::connect(loadTimer_, &QTimer::timeout, this, [this] () { appendLoadedLines(); });
+  loadTimer_->start(20);
+  updateLabel();
+}
+
+void View::cancelLoading() {
+  if (loader_ == nullptr) return;
+  loader_->cancel();
+  appendLoadedLines();
+}
+
+void View::appendLoadedLines() {
+  const int pageLinesBefore = lines_->page_.size();
+  bool failed = false;
+  try {
+    loader_->appendLoadedLines();
+  } catch (const Editor::IOException& exception) {
+    failed = true;
+    QMessageBox::warning(this, "Med", exception.what());
+  }
+  if (!view_->pageTop_.isValid()) view_->pageTop_.setLineNumber(1);
+  // Only the scroll range grows once the page is full: the loaded lines are appended after the page.
+  scrollArea_->updateRange();
+  if (pageLinesBefore < lines_->linesPerPage() + 1) {
+    lines_->resetPage();
+    lines_->update();
+  }
+  if (failed || loader_->finished()) {
+    loadTimer_->stop();
+    loader_.reset();
+  }
+  updateLabel();
+}
+
+Editor::MemoryStats View::memoryStats() const {
+  Editor::MemoryStats stats;
+  stats.layouts = lines_->layoutBytes();
+  return stats;
 }
 
 void View::updateLabel() {
   const QString& bufferName = view_->buffer()->name();
   QString tabLabel = bufferName.isEmpty() ? "<None>" : bufferName;
+  if (loader_ != nullptr) tabLabel += QString(" (%1%)").arg(int(100 * loader_->progress()));
+  if (saver_ != nullptr) tabLabel += QString(" (saving %1%)").arg(int(100 * saver_->progress()));
   if (view_->undo_.modified()) tabLabel += "*";
   tabWidget_->setTabText(tabWidget_->indexOf(this), tabLabel);
 }
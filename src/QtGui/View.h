@@ -1,9 +1,13 @@
 #ifndef MED_QTGUI_VIEW_H
 #define MED_QTGUI_VIEW_H
 
+#include <memory>
+#include <QtCore/QTimer>
 #include <QtWidgets/QWidget>
 #include <QtWidgets/QTabWidget>
 
+#include "Editor/BufferLoader.h"
+#include "Editor/BufferSaver.h"
 #include "Editor/View.h"
 
 namespace Med {
@@ -20,20 +24,39 @@ public:
   void pasteFromClipboard();
   void undo();
   void redo();
+  // Starts saving the buffer in the background; see Editor::BufferSaver. Editing can go on meanwhile, and once the file is written the state it was saved from is the unmodified one. Until then the label shows the progress. Returns false if the buffer is loading or already saving, or has no file.
   bool save();
 
+  // Shows the buffer's lines as the loader appends them; the first screen appears as soon as its lines are loaded. Until loading finishes the label shows the progress, and saving is refused.
+  void startLoading(std::unique_ptr<Editor::BufferLoader> loader);
+  // Stops loading, keeping the lines already loaded; see Editor::BufferLoader::cancel().
+  void cancelLoading();
+
   void updateLabel();
 
+  Editor::Buffer* buffer() const { return view_->buffer(); }
+  // The memory taken by the layouts of the lines on the page, in the layouts member.
+  Editor::MemoryStats memoryStats() const;
+
 private:
   class ScrollArea;
   class Lines;
   friend ScrollArea;
   friend Lines;
 
+  void appendLoadedLines();
+  void checkSaved();
+
   Editor::View* const view_;
   QTabWidget* const tabWidget_;
   ScrollArea* scrollArea_;
   Lines* lines_;
+  std::unique_ptr<Editor::BufferLoader> loader_;
+  QTimer* loadTimer_ = nullptr;
+  std::unique_ptr<Editor::BufferSaver> saver_;
+  // The undo state being saved.
+  Editor::Undo::State savedState_ = 0;
+  QTimer* saveTimer_ = nullptr;
 };
 
 }  // namespace QtGui
@@ -0,0 +1 @@
+#include "CountedBTree.h"
@@ -0,0 +1,802 @@
+#ifndef MED_UTIL_COUNTEDBTREE_H
+#define MED_UTIL_COUNTEDBTREE_H
+
+#include <initializer_list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "DRBTree.h"
+
+namespace Med {
+namespace Util {
+
+/** A sorted map from "numeric" keys to arbitrary values, stored as a counted B+-tree. It has the same key model as DRBTree (keys are computed from the deltas of the elements before them) and offers the same operations, so they can be used interchangeably.
+ *
+ * Leaves hold contiguous arrays of up to leafCapacity elements (the delta and the node of each) and are linked to their neighbours; inner pages hold arrays of up to innerCapacity children together with the sum of the deltas below each. Searches and key computations scan short contiguous arrays instead of following one pointer per level of a binary tree, which makes much better use of caches on large trees, and iteration just walks along the leaves.
+ *
+ * Elements are still separately allocated nodes, so that they keep their address when they move between pages: users hold pointers to them. Nodes are created and destroyed with newNode() and deleteNode(), as in DRBTree; pages are allocated with the same Allocator_ policy.
+ *
+ * Search, insertion, deletion, split and join are O(log N). Pages left small by deletions are merged with their neighbours; pages along the path of a split or a join may be left less than full.
+ *
+ * Searches and insertions only support keys on the left side (see DRBTreeDefs::OperationOptions::deltaSide).
+ */
+template<typename Key_, typename Delta_, typename Value_, template<typename> class Allocator_ = DRBTreeDefs::HeapAllocator, int leafCapacity = 64, int innerCapacity = 32>
+class CountedBTree : public DRBTreeDefs {
+public:
+  typedef Key_ Key;
+  typedef Delta_ Delta;
+  typedef Value_ Value;
+
+  static constexpr Key zeroKey{};
+  static constexpr Delta zeroDelta{};
+
+  static_assert(leafCapacity >= 4 && innerCapacity >= 4, "Pages must hold at least four entries.");
+
+  class Node;
+  typedef Allocator_<Node> Allocator;
+
+private:
+  struct Page;
+  struct LeafPage;
+  struct InnerPage;
+
+public:
+
+  /** Creates a new detached node, passing the arguments to the node's constructor. */
+  template<typename... Args>
+  static Node* newNode(Args&&... args) { return Allocator::allocate(std::forward<Args>(args)...); }
+
+  /** Destroys a node created with newNode(). The node must not be attached to a tree. */
+  static void deleteNode(Node* node) {
+    if (node != nullptr && node->isAttached()) throw Error("Deleting an attached node.");
+    Allocator::deallocate(node);
+  }
+
+  CountedBTree() {}
+  ~CountedBTree() {}
+
+  // The root page points back to its tree.
+  CountedBTree(const CountedBTree&) = delete;
+  CountedBTree& operator=(const CountedBTree&) = delete;
+
+  /** Returns true iff the tree has no elements. */
+  bool empty() const { return root == nullptr; }
+
+  Delta totalDelta() const { return leftmostExtremeDelta + (empty() ? zeroDelta : pageSum(root, height)) + rightmostExtremeDelta; }
+
+  struct Entry {
+    Key key;
+    Node* node;
+  };
+
+  class Iterator {
+  public:
+    Iterator() : entry{zeroKey, nullptr} {}
+
+    bool isValid() const { return entry.node; }
+
+    bool operator==(const Iterator& other) const { return entry.node == other.entry.node; }
+    bool operator!=(const Iterator& other) const { return !operator==(other); }
+
+    void operator++() {
+      entry.key += entry.node->delta;
+      entry.node = entry.node->adjacent(Side::RIGHT);
+    }
+
+    void operator--() {
+      entry.node = entry.node->adjacent(Side::LEFT);
+      if (entry.node) entry.key -= entry.node->delta;
+    }
+
+    const Entry& operator*() const { return entry; }
+    const Entry* operator->() const { return &entry; }
+
+  private:
+    friend class CountedBTree;
+    explicit Iterator(const Entry entry) : entry(entry) {}
+
+    Entry entry;
+  };
+
+  /** Visits nodes in key order, starting at a given node, by walking along the leaves. Keys are not computed.
+   *
+   * Any change to the structure of the tree invalidates the cursor.
+   */
+  class Cursor {
+  public:
+    /** A cursor that has finished. */
+    Cursor() {}
+
+    /** A cursor at the given node, which may be null to get a finished cursor. O(1). */
+    explicit Cursor(Node* node) : leaf_(node != nullptr ? node->leaf_ : nullptr), index_(node != nullptr ? node->index_ : 0) {}
+
+    bool isValid() const { return leaf_ != nullptr; }
+    Node* node() const { return leaf_->nodes[index_]; }
+
+    bool operator==(const Cursor& other) const { return leaf_ == other.leaf_ && index_ == other.index_; }
+    bool operator!=(const Cursor& other) const { return !operator==(other); }
+
+    /** Moves to the next node, or finishes the cursor if there are no more nodes. */
+    void advance() {
+      if (++index_ < leaf_->count) return;
+      leaf_ = leaf_->adjacent[sideIndex(Side::RIGHT)];
+      index_ = 0;
+    }
+
+  private:
+    LeafPage* leaf_ = nullptr;
+    int index_ = 0;
+  };
+
+  Iterator begin() {
+    if (empty()) return end();
+    return Iterator({zeroKey + leftmostExtremeDelta, asLeaf(edgePage(Side::LEFT, 0))->nodes[0]});
+  }
+  Iterator end() { return Iterator({zeroKey, nullptr}); }
+
+  /** Gets a node from the tree; see DRBTree::get(). */
+  template<typename SearchKey>
+  Iterator get(const SearchKey& key, const OperationOptions& options) {
+    requireLeftSide(options);
+    if (empty()) return end();
+    return getInPage(root, height, zeroKey + leftmostExtremeDelta, key, options);
+  }
+
+  /** Like get(), but starting the search from a node whose key is known; see DRBTree::getNear(). The search only climbs until it finds a page containing the key, so it's O(log d) in typical cases, d being the number of nodes between near and the result.
+   */
+  template<typename SearchKey>
+  Iterator getNear(const Entry& near, const SearchKey& key, const OperationOptions& options) {
+    requireLeftSide(options);
+    Page* page = near.node->leaf_;
+    int level = 0;
+    Key keyAtPage = near.key - sumOf(near.node->leaf_->deltas, near.node->index_);
+    // Nodes with a key at the ends of a page might be repeated outside it, so the key must be strictly inside.
+    while (page->parent != nullptr && !(keyAtPage < key && key < keyAtPage + page->parent->sums[page->indexInParent])) {
+      keyAtPage -= sumOf(page->parent->sums, page->indexInParent);
+      page = page->parent;
+      ++level;
+    }
+    return getInPage(page, level, keyAtPage, key, options);
+  }
+
+  /** Returns the key of other minus the key of node, on the left side. Both must be in the same tree. O(log d) in typical cases, d being the number of nodes between them. */
+  static Delta keyRelativeTo(Node* node, Node* other) {
+    Page* page = node->leaf_;
+    Page* otherPage = other->leaf_;
+    // Positions relative to the first element of the pages. All leaves are at the same level, so both paths meet at the same level.
+    Delta position = sumOf(node->leaf_->deltas, node->index_);
+    Delta otherPosition = sumOf(other->leaf_->deltas, other->index_);
+    while (page != otherPage) {
+      if (page->parent == nullptr || otherPage->parent == nullptr) throw Error("The nodes are not in the same tree.");
+      position += sumOf(page->parent->sums, page->indexInParent);
+      otherPosition += sumOf(otherPage->parent->sums, otherPage->indexInParent);
+      page = page->parent;
+      otherPage = otherPage->parent;
+    }
+    return otherPosition - position;
+  }
+
+  /** Attaches a new node to the tree; see DRBTree::attach(). */
+  Iterator attach(Node* node, const Key& key, const OperationOptions& options) {
+    if (node->isAttached()) throw Error("The node is already attached.");
+    requireLeftSide(options);
+    // Until its delta is set at the end, the node mustn't contribute to the sums of its pages.
+    node->delta = zeroDelta;
+    if (empty()) {
+      setRoot(LeafAllocator::allocate());
+      height = 0;
+      insertNode({asLeaf(root), 0, key}, node);
+      leftmostExtremeDelta = key - zeroKey;
+      return Iterator({key, node});
+    }
+    Position position = findFirst(root, height, zeroKey + leftmostExtremeDelta, [&key](const Key& nodeKey) { return nodeKey < key; });
+    if (position.atNode() && position.key == key) {
+      if (!options.repeats) {
+        using std::to_string;
+        throw Error("Trying to insert node with repeated key '" + to_string(key) + "'.");
+      }
+      if (options.repeatedSide == Side::RIGHT) position = findFirst(root, height, zeroKey + leftmostExtremeDelta, [&key](const Key& nodeKey) { return !(key < nodeKey); });
+    }
+    const Position predecessorPosition = previous(position);
+    Node* const predecessor = predecessorPosition.node();
+    insertNode(position, node);
+    if (predecessor == nullptr) {
+      // Inserting at the tree's leftmost end.
+      node->setDelta(position.key - key);
+      leftmostExtremeDelta = key - zeroKey;
+    } else if (key > position.key) {
+      // Inserting past the end of the tree, which increases the tree's total delta.
+      node->setDelta(zeroDelta);
+      predecessor->setDelta(key - predecessorPosition.key);
+    } else {
+      // The predecessor's delta is split between it and the new node, so that the following keys don't change.
+      node->setDelta(position.key - key);
+      predecessor->setDelta(predecessor->delta - node->delta);
+    }
+    return Iterator({key, node});
+  }
+
+  /** Builds the tree from a range of detached nodes, in key order, in O(N); see DRBTree::buildFrom(). Pages are filled as much as possible. */
+  template<typename NodeIterator>
+  void buildFrom(NodeIterator begin, NodeIterator end, const Key& firstKey = zeroKey) {
+    if (!empty()) throw Error("Building a tree that is not empty.");
+    if (begin == end) return;
+    const long nodeCount = end - begin;
+    std::vector<Page*> pages((nodeCount + leafCapacity - 1) / leafCapacity);
+    LeafPage* previousLeaf = nullptr;
+    for (long leafIndex = 0; leafIndex < long(pages.size()); ++leafIndex) {
+      LeafPage* const leaf = LeafAllocator::allocate();
+      // Nodes are spread evenly between the leaves.
+      for (NodeIterator node = begin + nodeCount * leafIndex / pages.size(); node != begin + nodeCount * (leafIndex + 1) / pages.size(); ++node) {
+        placeNode(leaf, leaf->count++, *node);
+      }
+      link(previousLeaf, leaf);
+      previousLeaf = leaf;
+      pages[leafIndex] = leaf;
+    }
+    height = 0;
+    while (pages.size() > 1) {
+      std::vector<Page*> parents((pages.size() + innerCapacity - 1) / innerCapacity);
+      for (std::size_t parentIndex = 0; parentIndex < parents.size(); ++parentIndex) {
+        InnerPage* const parent = InnerAllocator::allocate();
+        for (std::size_t pageIndex = pages.size() * parentIndex / parents.size(); pageIndex < pages.size() * (parentIndex + 1) / parents.size(); ++pageIndex) {
+          placeChild(parent, parent->count++, pages[pageIndex], pageSum(pages[pageIndex], height));
+        }
+        parents[parentIndex] = parent;
+      }
+      pages = std::move(parents);
+      ++height;
+    }
+    setRoot(pages.front());
+    leftmostExtremeDelta = firstKey - zeroKey;
+    rightmostExtremeDelta = zeroDelta;
+  }
+
+  /** Moves the nodes with keys (on the left side) equal or bigger than key to right, which must be empty; see DRBTree::split(). O(log N). */
+  template<typename SearchKey>
+  void split(const SearchKey& key, CountedBTree* right) {
+    if (!right->empty()) throw Error("Splitting into a tree that is not empty.");
+    if (empty()) return;
+    const Position position = findFirst(root, height, zeroKey + leftmostExtremeDelta, [&key](const Key& nodeKey) { return nodeKey < key; });
+    if (!position.atNode()) return;
+    right->leftmostExtremeDelta = position.key - zeroKey;
+    right->rightmostExtremeDelta = rightmostExtremeDelta;
+    rightmostExtremeDelta = zeroDelta;
+
+    // Every page on the path from the leaf to the root is cut in two: the entries before the cut stay in the page, and the rest move to a new page. leftPart and rightPart are the two parts of the page below the current level, null if empty.
+    Node* const firstRightNode = position.node();
+    const int oldHeight = height;
+    setRoot(nullptr);
+    LeafPage* const leaf = position.leaf;
+    LeafPage* const lastLeftLeaf = position.index > 0 ? leaf : leaf->adjacent[sideIndex(Side::LEFT)];
+    Page* leftPart = nullptr;
+    Page* rightPart = leaf;
+    if (position.index > 0) {
+      LeafPage* const newLeaf = LeafAllocator::allocate();
+      moveLeafEntries(leaf, position.index, newLeaf);
+      link(newLeaf, leaf->adjacent[sideIndex(Side::RIGHT)]);
+      leftPart = leaf;
+      rightPart = newLeaf;
+    }
+    // The leaves of both trees are no longer linked.
+    if (lastLeftLeaf != nullptr) lastLeftLeaf->adjacent[sideIndex(Side::RIGHT)] = nullptr;
+    asLeaf(rightPart)->adjacent[sideIndex(Side::LEFT)] = nullptr;
+    InnerPage* parent = leaf->parent;
+    int index = leaf->indexInParent;
+    for (int level = 1; level <= oldHeight; ++level) {
+      InnerPage* const grandparent = parent->parent;
+      const int parentIndex = parent->indexInParent;
+      InnerPage* const newParent = InnerAllocator::allocate();
+      if (rightPart != nullptr) placeChild(newParent, newParent->count++, rightPart, pageSum(rightPart, level - 1));
+      for (int childIndex = index + 1; childIndex < parent->count; ++childIndex) {
+        placeChild(newParent, newParent->count++, parent->children[childIndex], parent->sums[childIndex]);
+      }
+      parent->count = index;
+      if (leftPart != nullptr) placeChild(parent, parent->count++, leftPart, pageSum(leftPart, level - 1));
+      leftPart = parent->count > 0 ? parent : nullptr;
+      if (leftPart == nullptr) InnerAllocator::deallocate(parent);
+      rightPart = newParent->count > 0 ? newParent : nullptr;
+      if (rightPart == nullptr) InnerAllocator::deallocate(newParent);
+      parent = grandparent;
+      index = parentIndex;
+    }
+    setRoot(leftPart);
+    height = leftPart != nullptr ? oldHeight : 0;
+    right->setRoot(rightPart);
+    right->height = oldHeight;
+    if (!empty()) {
+      LeafPage* const lastLeftLeaf = asLeaf(edgePage(Side::RIGHT, 0));
+      rebalancePath(lastLeftLeaf->nodes[lastLeftLeaf->count - 1]);
+    }
+    right->rebalancePath(firstRightNode);
+  }
+
+  /** Moves all the nodes of right after the nodes of this tree; right becomes empty; see DRBTree::join(). O(log N). */
+  void join(CountedBTree* right) {
+    if (right->empty()) return;
+    if (empty()) {
+      leftmostExtremeDelta = right->leftmostExtremeDelta;
+      rightmostExtremeDelta = right->rightmostExtremeDelta;
+      height = right->height;
+      Page* const rightRoot = right->root;
+      right->setRoot(nullptr);
+      right->height = 0;
+      setRoot(rightRoot);
+      return;
+    }
+    rightmostExtremeDelta = right->rightmostExtremeDelta;
+    LeafPage* const lastLeftLeaf = asLeaf(edgePage(Side::RIGHT, 0));
+    LeafPage* const firstRightLeaf = asLeaf(right->edgePage(Side::LEFT, 0));
+    Node* const lastLeftNode = lastLeftLeaf->nodes[lastLeftLeaf->count - 1];
+    Node* const firstRightNode = firstRightLeaf->nodes[0];
+    link(lastLeftLeaf, firstRightLeaf);
+
+    Page* const leftRoot = root;
+    const int leftHeight = height;
+    Page* const rightRoot = right->root;
+    const int rightHeight = right->height;
+    right->setRoot(nullptr);
+    right->height = 0;
+    // The shorter tree becomes a child of the page at the edge of the taller one, one level above its root.
+    if (leftHeight >= rightHeight) {
+      Page* const edge = edgePage(Side::RIGHT, rightHeight);
+      addToAncestorSums(edge, pageSum(rightRoot, rightHeight));
+      insertPage(edge, rightRoot, rightHeight, Side::RIGHT);
+    } else {
+      setRoot(rightRoot);
+      height = rightHeight;
+      Page* const edge = edgePage(Side::LEFT, leftHeight);
+      addToAncestorSums(edge, pageSum(leftRoot, leftHeight));
+      insertPage(edge, leftRoot, leftHeight, Side::LEFT);
+    }
+    rebalancePath(lastLeftNode);
+    rebalancePath(firstRightNode);
+  }
+
+  /** Deletes all the nodes, leaving the tree empty. O(N). */
+  void clear() {
+    if (empty()) return;
+    Page* const oldRoot = root;
+    const int oldHeight = height;
+    setRoot(nullptr);
+    height = 0;
+    deletePages(oldRoot, oldHeight);
+  }
+
+private:
+  friend class CountedBTreeTest;
+
+  struct Page {
+    /** The parent page; null if this is the root. */
+    InnerPage* parent = nullptr;
+    /** The index of this page among its parent's children. */
+    int indexInParent = 0;
+    /** The number of entries in the page; only the root may be empty, and only while the tree is being changed. */
+    int count = 0;
+    /** The tree this page is the root of; null if it isn't the root. As in DRBTree, only the root points to the tree, so that pages can be moved between trees. */
+    CountedBTree* treeIfRoot = nullptr;
+  };
+
+  struct LeafPage : Page {
+    /** The adjacent leaves on each side (see sideIndex()), which may be under different parents. */
+    LeafPage* adjacent[2] = {nullptr, nullptr};
+    Delta deltas[leafCapacity];
+    Node* nodes[leafCapacity];
+  };
+
+  struct InnerPage : Page {
+    /** The sum of the deltas of all the elements under each child. */
+    Delta sums[innerCapacity];
+    Page* children[innerCapacity];
+  };
+
+  typedef Allocator_<LeafPage> LeafAllocator;
+  typedef Allocator_<InnerPage> InnerAllocator;
+
+  /** A place between elements: before the element at index in leaf, or after the last element of the tree if index is the leaf's count. key is the key at that place. */
+  struct Position {
+    LeafPage* leaf;
+    int index;
+    Key key;
+
+    bool atNode() const { return leaf != nullptr && index < leaf->count; }
+    Node* node() const { return atNode() ? leaf->nodes[index] : nullptr; }
+  };
+
+  static int sideIndex(Side side) { return side == Side::LEFT ? 0 : 1; }
+
+  static LeafPage* asLeaf(Page* page) { return static_cast<LeafPage*>(page); }
+  static InnerPage* asInner(Page* page) { return static_cast<InnerPage*>(page); }
+
+  static void requireLeftSide(const OperationOptions& options) {
+    if (options.deltaSide != Side::LEFT) throw Error("Only keys on the left side are supported.");
+  }
+
+  static Delta sumOf(const Delta* deltas, int count) {
+    Delta sum = zeroDelta;
+    for (int index = 0; index < count; ++index) sum += deltas[index];
+    return sum;
+  }
+
+  /** The sum of the deltas of all the elements under page, which is at the given level (leaves are at level 0). */
+  static Delta pageSum(Page* page, int level) {
+    return level == 0 ? sumOf(asLeaf(page)->deltas, page->count) : sumOf(asInner(page)->sums, page->count);
+  }
+
+  /** Adds difference to the sums of all the ancestors of page. */
+  static void addToAncestorSums(Page* page, const Delta& difference) {
+    for (; page->parent != nullptr; page = page->parent) page->parent->sums[page->indexInParent] += difference;
+  }
+
+  static void link(LeafPage* left, LeafPage* right) {
+    if (left != nullptr) left->adjacent[sideIndex(Side::RIGHT)] = right;
+    if (right != nullptr) right->adjacent[sideIndex(Side::LEFT)] = left;
+  }
+
+  static void placeNode(LeafPage* leaf, int index, Node* node) {
+    leaf->nodes[index] = node;
+    leaf->deltas[index] = node->delta;
+    node->leaf_ = leaf;
+    node->index_ = index;
+  }
+
+  static void placeChild(InnerPage* parent, int index, Page* child, const Delta& sum) {
+    parent->children[index] = child;
+    parent->sums[index] = sum;
+    child->parent = parent;
+    child->indexInParent = index;
+  }
+
+  /** Returns the first place in the subtree of page (at the given level, with keyAtPage as the key of its first element) whose key doesn't go before the searched one, or the place after the subtree's last element if they all do; then the place might be in the next leaf. */
+  template<typename GoesBefore>
+  static Position findFirst(Page* page, int level, Key keyAtPage, GoesBefore goesBefore) {
+    for (; level > 0; --level) {
+      InnerPage* const inner = asInner(page);
+      int index = 0;
+      while (index + 1 < inner->count && goesBefore(keyAtPage + inner->sums[index])) keyAtPage += inner->sums[index++];
+      page = inner->children[index];
+    }
+    LeafPage* const leaf = asLeaf(page);
+    int index = 0;
+    while (index < leaf->count && goesBefore(keyAtPage)) keyAtPage += leaf->deltas[index++];
+    LeafPage* const nextLeaf = leaf->adjacent[sideIndex(Side::RIGHT)];
+    if (index == leaf->count && nextLeaf != nullptr) return {nextLeaf, 0, keyAtPage};
+    return {leaf, index, keyAtPage};
+  }
+
+  /** The place before position's, or an invalid position if there is none. */
+  static Position previous(const Position& position) {
+    LeafPage* leaf = position.leaf;
+    int index = position.index;
+    if (index == 0) {
+      leaf = leaf->adjacent[sideIndex(Side::LEFT)];
+      if (leaf == nullptr) return {nullptr, 0, zeroKey};
+      index = leaf->count;
+    }
+    --index;
+    return {leaf, index, position.key - leaf->deltas[index]};
+  }
+
+  static Iterator iteratorAt(const Position& position) {
+    return position.atNode() ? Iterator({position.key, position.node()}) : Iterator({zeroKey, nullptr});
+  }
+
+  /** Searches the subtree of page, which is at the given level and has keyAtPage as the key of its first element. See get(). */
+  template<typename SearchKey>
+  static Iterator getInPage(Page* page, int level, Key keyAtPage, const SearchKey& key, const OperationOptions& options) {
+    const Position first = findFirst(page, level, keyAtPage, [&key](const Key& nodeKey) { return nodeKey < key; });
+    if (first.atNode() && key == first.key) {
+      if (options.repeatedSide == Side::LEFT) return iteratorAt(first);
+      return iteratorAt(previous(findFirst(page, level, keyAtPage, [&key](const Key& nodeKey) { return !(key < nodeKey); })));
+    }
+    if (!options.equalOrAdjacent) return Iterator({zeroKey, nullptr});
+    return iteratorAt(options.equalOrAdjacentSide == Side::LEFT ? previous(first) : first);
+  }
+
+  Delta& extremeDelta(Side side) { return side == Side::LEFT ? leftmostExtremeDelta : rightmostExtremeDelta; }
+
+  /** The page at the given level on the given edge of the tree, which must not be empty. */
+  Page* edgePage(Side side, int level) {
+    Page* page = root;
+    for (int pageLevel = height; pageLevel > level; --pageLevel) page = asInner(page)->children[side == Side::LEFT ? 0 : page->count - 1];
+    return page;
+  }
+
+  void setRoot(Page* page) {
+    if (root != nullptr) root->treeIfRoot = nullptr;
+    root = page;
+    if (root != nullptr) {
+      root->treeIfRoot = this;
+      root->parent = nullptr;
+      root->indexInParent = 0;
+    }
+  }
+
+  /** Inserts node, which must have a zero delta, at position, splitting the leaf if it's full. */
+  void insertNode(const Position& position, Node* node) {
+    LeafPage* leaf = position.leaf;
+    int index = position.index;
+    if (leaf->count == leafCapacity) {
+      LeafPage* const newLeaf = splitLeaf(leaf);
+      if (index > leaf->count) {
+        index -= leaf->count;
+        leaf = newLeaf;
+      }
+    }
+    for (int nodeIndex = leaf->count; nodeIndex > index; --nodeIndex) placeNode(leaf, nodeIndex, leaf->nodes[nodeIndex - 1]);
+    ++leaf->count;
+    placeNode(leaf, index, node);
+  }
+
+  /** Removes the node at index in leaf, which must have a zero delta, merging or removing the leaf if it becomes small. */
+  void removeNode(LeafPage* leaf, int index) {
+    for (int nodeIndex = index + 1; nodeIndex < leaf->count; ++nodeIndex) placeNode(leaf, nodeIndex - 1, leaf->nodes[nodeIndex]);
+    --leaf->count;
+    if (leaf->count > 0) {
+      rebalance(leaf, 0);
+      return;
+    }
+    link(leaf->adjacent[sideIndex(Side::LEFT)], leaf->adjacent[sideIndex(Side::RIGHT)]);
+    removeEmptyPage(leaf, 0);
+  }
+
+  /** Moves the entries of leaf from index on to the start of newLeaf, which must be empty. */
+  static void moveLeafEntries(LeafPage* leaf, int index, LeafPage* newLeaf) {
+    for (int nodeIndex = index; nodeIndex < leaf->count; ++nodeIndex) placeNode(newLeaf, newLeaf->count++, leaf->nodes[nodeIndex]);
+    leaf->count = index;
+  }
+
+  /** Moves the second half of a leaf to a new leaf after it, and returns the new leaf. */
+  LeafPage* splitLeaf(LeafPage* leaf) {
+    LeafPage* const newLeaf = LeafAllocator::allocate();
+    LeafPage* const nextLeaf = leaf->adjacent[sideIndex(Side::RIGHT)];
+    moveLeafEntries(leaf, leaf->count - leaf->count / 2, newLeaf);
+    link(leaf, newLeaf);
+    link(newLeaf, nextLeaf);
+    insertPage(leaf, newLeaf, 0, Side::RIGHT);
+    return newLeaf;
+  }
+
+  /** Moves the second half of an inner page, at the given level, to a new page after it. */
+  void splitInner(InnerPage* inner, int level) {
+    InnerPage* const newInner = InnerAllocator::allocate();
+    const int firstMoved = inner->count - inner->count / 2;
+    for (int childIndex = firstMoved; childIndex < inner->count; ++childIndex) {
+      placeChild(newInner, newInner->count++, inner->children[childIndex], inner->sums[childIndex]);
+    }
+    inner->count = firstMoved;
+    insertPage(inner, newInner, level, Side::RIGHT);
+  }
+
+  /** Inserts newPage, at the given level, next to page on the given side, adding a new root if page is the root. The elements of newPage must be counted in the sums of page's ancestors as if they were still under page. */
+  void insertPage(Page* page, Page* newPage, int level, Side side) {
+    const Delta newSum = pageSum(newPage, level);
+    if (page->parent == nullptr) {
+      const Delta sum = pageSum(page, level);
+      InnerPage* const newRoot = InnerAllocator::allocate();
+      setRoot(newRoot);
+      placeChild(newRoot, newRoot->count++, side == Side::RIGHT ? page : newPage, side == Side::RIGHT ? sum : newSum);
+      placeChild(newRoot, newRoot->count++, side == Side::RIGHT ? newPage : page, side == Side::RIGHT ? newSum : sum);
+      ++height;
+      return;
+    }
+    if (page->parent->count == innerCapacity) splitInner(page->parent, level + 1);
+    InnerPage* const parent = page->parent;
+    parent->sums[page->indexInParent] -= newSum;
+    const int index = side == Side::RIGHT ? page->indexInParent + 1 : page->indexInParent;
+    for (int childIndex = parent->count; childIndex > index; --childIndex) {
+      placeChild(parent, childIndex, parent->children[childIndex - 1], parent->sums[childIndex - 1]);
+    }
+    ++parent->count;
+    placeChild(parent, index, newPage, newSum);
+  }
+
+  /** Removes the child at index from parent, which is at the given level. The child must already have been deallocated or moved, and its sum must be zero. */
+  void removeChild(InnerPage* parent, int index, int level) {
+    for (int childIndex = index + 1; childIndex < parent->count; ++childIndex) {
+      placeChild(parent, childIndex - 1, parent->children[childIndex], parent->sums[childIndex]);
+    }
+    --parent->count;
+    if (parent->count > 0) {
+      rebalance(parent, level);
+      return;
+    }
+    removeEmptyPage(parent, level);
+  }
+
+  void removeEmptyPage(Page* page, int level) {
+    InnerPage* const parent = page->parent;
+    const int index = page->indexInParent;
+    if (parent == nullptr) {
+      setRoot(nullptr);
+      height = 0;
+    }
+    deallocatePage(page, level);
+    if (parent != nullptr) removeChild(parent, index, level + 1);
+  }
+
+  static void deallocatePage(Page* page, int level) {
+    if (level == 0)
+      LeafAllocator::deallocate(asLeaf(page));
+    else
+      InnerAllocator::deallocate(asInner(page));
+  }
+
+  /** If page, at the given level, has become small, merges it with a neighbour under the same parent when both fit in one page. Then removes root pages with a single child. */
+  void rebalance(Page* page, int level) {
+    InnerPage* const parent = page->parent;
+    const int capacity = level == 0 ? leafCapacity : innerCapacity;
+    if (parent != nullptr && page->count <= capacity / 4) {
+      const int index = page->indexInParent;
+      if (index > 0 && parent->children[index - 1]->count + page->count <= capacity) {
+        mergePages(parent->children[index - 1], page, level);
+        return;
+      }
+      if (index + 1 < parent->count && page->count + parent->children[index + 1]->count <= capacity) {
+        mergePages(page, parent->children[index + 1], level);
+        return;
+      }
+    }
+    while (height > 0 && root->count == 1) {
+      InnerPage* const oldRoot = asInner(root);
+      setRoot(oldRoot->children[0]);
+      --height;
+      InnerAllocator::deallocate(oldRoot);
+    }
+  }
+
+  /** Moves the entries of right, the next sibling of left, to left, and removes right. */
+  void mergePages(Page* left, Page* right, int level) {
+    if (level == 0) {
+      LeafPage* const rightLeaf = asLeaf(right);
+      moveLeafEntries(rightLeaf, 0, asLeaf(left));
+      link(asLeaf(left), rightLeaf->adjacent[sideIndex(Side::RIGHT)]);
+    } else {
+      InnerPage* const leftInner = asInner(left);
+      InnerPage* const rightInner = asInner(right);
+      for (int childIndex = 0; childIndex < rightInner->count; ++childIndex) {
+        placeChild(leftInner, leftInner->count++, rightInner->children[childIndex], rightInner->sums[childIndex]);
+      }
+      rightInner->count = 0;
+    }
+    InnerPage* const parent = left->parent;
+    const int rightIndex = right->indexInParent;
+    parent->sums[left->indexInParent] += parent->sums[rightIndex];
+    parent->sums[rightIndex] = zeroDelta;
+    deallocatePage(right, level);
+    removeChild(parent, rightIndex, level + 1);
+  }
+
+  /** Rebalances the pages on the path from node's leaf to the root, after a split or a join left them less than full. */
+  void rebalancePath(Node* node) {
+    for (int level = 0; level <= height; ++level) {
+      Page* page = node->leaf_;
+      for (int pageLevel = 0; pageLevel < level; ++pageLevel) page = page->parent;
+      rebalance(page, level);
+    }
+  }
+
+  static void deletePages(Page* page, int level) {
+    if (level == 0) {
+      LeafPage* const leaf = asLeaf(page);
+      for (int index = 0; index < leaf->count; ++index) {
+        leaf->nodes[index]->leaf_ = nullptr;
+        deleteNode(leaf->nodes[index]);
+      }
+    } else {
+      for (int index = 0; index < page->count; ++index) deletePages(asInner(page)->children[index], level - 1);
+    }
+    deallocatePage(page, level);
+  }
+
+  void detach(Node* node) {
+    const Delta delta = node->delta;
+    Node* const predecessor = node->adjacent(Side::LEFT);
+    node->setDelta(zeroDelta);
+    if (predecessor != nullptr)
+      predecessor->setDelta(predecessor->delta + delta);
+    else
+      leftmostExtremeDelta += delta;
+    removeNode(node->leaf_, node->index_);
+    node->leaf_ = nullptr;
+    node->index_ = 0;
+    // As in DRBTree, the node keeps its delta.
+    node->delta = delta;
+  }
+
+  // The root page; null iff the tree is empty.
+  Page* root = nullptr;
+  // The number of levels of inner pages; all the leaves are at this depth.
+  int height = 0;
+
+  // See DRBTree.
+  Delta leftmostExtremeDelta = zeroDelta;
+  Delta rightmostExtremeDelta = zeroDelta;
+};
+
+template<typename Key, typename Delta, typename Value, template<typename> class Allocator_, int leafCapacity, int innerCapacity>
+class CountedBTree<Key, Delta, Value, Allocator_, leafCapacity, innerCapacity>::Node {
+public:
+  Node() = default;
+
+  template<typename InitValue>
+  explicit Node(InitValue initValue) : value(initValue) {}
+
+  template<typename InitValue>
+  explicit Node(const std::initializer_list<InitValue>& initValue) : value(initValue) {}
+
+  typedef CountedBTree<Key, Delta, Value, Allocator_, leafCapacity, innerCapacity> Tree;
+
+  Value value{};
+
+  /** The node's delta; can be set directly while the node is detached, but otherwise must be changed with setDelta(), as it is also stored in the node's leaf. */
+  Delta delta = zeroDelta;
+
+  /** Whether this node is currently attached to a tree. */
+  bool isAttached() const { return leaf_ != nullptr; }
+
+  /** The tree this node is attached to, or null if it isn't attached. O(log N). */
+  Tree* tree() {
+    if (leaf_ == nullptr) return nullptr;
+    Page* page = leaf_;
+    for (; page->parent != nullptr; page = page->parent);
+    return page->treeIfRoot;
+  }
+
+  /** Sets the delta for this node, updating the sums of its pages. */
+  void setDelta(Delta newDelta) {
+    if (leaf_ != nullptr) {
+      leaf_->deltas[index_] = newDelta;
+      addToAncestorSums(leaf_, newDelta - delta);
+    }
+    delta = newDelta;
+  }
+
+  /** Detach the node form the tree. Afterwards the node can be attached to any tree, or deleted. */
+  void detach() {
+    if (!isAttached()) throw Error("The node is not attached.");
+    tree()->detach(this);
+  }
+
+  /** Returns this node's key. */
+  Key key(Side side) {
+    const bool left = side == Side::LEFT;
+    Delta key = left ? sumOf(leaf_->deltas, index_) : sumOf(leaf_->deltas + index_ + 1, leaf_->count - index_ - 1);
+    Page* page = leaf_;
+    for (; page->parent != nullptr; page = page->parent) {
+      const InnerPage* const parent = page->parent;
+      key += left ? sumOf(parent->sums, page->indexInParent) : sumOf(parent->sums + page->indexInParent + 1, parent->count - page->indexInParent - 1);
+    }
+    return zeroKey + (page->treeIfRoot->extremeDelta(side) + key);
+  }
+
+  /** Returns the node that is adjacent to this one on the given side. If none, returns null. */
+  Node* adjacent(Side side) {
+    const int index = side == Side::LEFT ? index_ - 1 : index_ + 1;
+    if (index >= 0 && index < leaf_->count) return leaf_->nodes[index];
+    LeafPage* const leaf = leaf_->adjacent[sideIndex(side)];
+    if (leaf == nullptr) return nullptr;
+    return leaf->nodes[side == Side::LEFT ? leaf->count - 1 : 0];
+  }
+
+private:
+  friend class CountedBTree;
+  friend class CountedBTreeTest;
+  friend class Cursor;
+
+  // The leaf holding the node and its index in it; null if the node is detached.
+  LeafPage* leaf_ = nullptr;
+  int index_ = 0;
+};
+
+template<typename Key, typename Delta, typename Value, template<typename> class Allocator_, int leafCapacity, int innerCapacity>
+constexpr Key CountedBTree<Key, Delta, Value, Allocator_, leafCapacity, innerCapacity>::zeroKey;
+
+template<typename Key, typename Delta, typename Value, template<typename> class Allocator_, int leafCapacity, int innerCapacity>
+constexpr Delta CountedBTree<Key, Delta, Value, Allocator_, leafCapacity, innerCapacity>::zeroDelta;
+
+}  // namespace Util
+}  // namespace Med
+
+#endif // MED_UTIL_COUNTEDBTREE_H
@@ -0,0 +1,113 @@
+#include "CountedBTree.h"
+#include "DRBTree.h"
+#include "PoolAllocator.h"
+
+#include <random>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+namespace Med {
+namespace Util {
+namespace {
+
+// Both line tree backends Buffer can be built with, with one node per line and the line number as key.
+typedef DRBTree<int, int, int, PoolAllocator> RedBlackLines;
+typedef CountedBTree<int, int, int, PoolAllocator> BTreeLines;
+
+constexpr int lineCount = 5000000;
+
+template<typename Tree>
+std::vector<typename Tree::Node*> newLines(int count) {
+  std::vector<typename Tree::Node*> nodes;
+  nodes.reserve(count);
+  for (int lineNumber = 1; lineNumber <= count; ++lineNumber) {
+    nodes.push_back(Tree::newNode(lineNumber));
+    nodes.back()->delta = 1;
+  }
+  return nodes;
+}
+
+/** A large tree of each type, shared by the benchmarks that don't change its structure permanently. */
+template<typename Tree>
+Tree& sharedTree() {
+  static Tree* tree = [] {
+    std::vector<typename Tree::Node*> nodes = newLines<Tree>(lineCount);
+    Tree* tree = new Tree();
+    tree->buildFrom(nodes.begin(), nodes.end(), 1);
+    return tree;
+  }();
+  return *tree;
+}
+
+/** Builds a tree from all the lines at once, as Buffer::open does. */
+template<typename Tree>
+void BM_Load(benchmark::State& state) {
+  const int count = state.range(0);
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::vector<typename Tree::Node*> nodes = newLines<Tree>(count);
+    state.ResumeTiming();
+    Tree tree;
+    tree.buildFrom(nodes.begin(), nodes.end(), 1);
+    benchmark::DoNotOptimize(tree.totalDelta());
+    state.PauseTiming();
+    tree.clear();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK_TEMPLATE(BM_Load, RedBlackLines)->Arg(1000000)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Load, BTreeLines)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+/** Gets random lines, as jumping to a line or scrolling with the scroll bar does. */
+template<typename Tree>
+void BM_RandomJump(benchmark::State& state) {
+  Tree& tree = sharedTree<Tree>();
+  std::mt19937 random(42);
+  std::uniform_int_distribution<int> lineNumbers(1, lineCount);
+  for (auto _ : state) benchmark::DoNotOptimize(tree.get(lineNumbers(random), {})->node);
+}
+BENCHMARK_TEMPLATE(BM_RandomJump, RedBlackLines);
+BENCHMARK_TEMPLATE(BM_RandomJump, BTreeLines);
+
+/** Visits all the lines in order, as saving does. */
+template<typename Tree>
+void BM_SequentialScan(benchmark::State& state) {
+  Tree& tree = sharedTree<Tree>();
+  for (auto _ : state) {
+    long sum = 0;
+    for (typename Tree::Cursor cursor(tree.begin()->node); cursor.isValid(); cursor.advance()) sum += cursor.node()->value;
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * lineCount);
+}
+BENCHMARK_TEMPLATE(BM_SequentialScan, RedBlackLines)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_SequentialScan, BTreeLines)->Unit(benchmark::kMillisecond);
+
+/** Inserts lines at random places and deletes lines at random places, as Buffer does when editing, keeping the line count steady. */
+template<typename Tree>
+void BM_Edits(benchmark::State& state) {
+  Tree& tree = sharedTree<Tree>();
+  std::mt19937 random(42);
+  std::uniform_int_distribution<int> lineNumbers(1, lineCount - 1);
+  DRBTreeDefs::OperationOptions options;
+  options.repeats = true;
+  for (auto _ : state) {
+    typename Tree::Node* inserted = Tree::newNode(0);
+    tree.attach(inserted, lineNumbers(random), options);
+    inserted->setDelta(1);
+    typename Tree::Node* deleted = tree.get(lineNumbers(random), {})->node;
+    // Otherwise its predecessor would take its delta.
+    deleted->setDelta(0);
+    deleted->detach();
+    Tree::deleteNode(deleted);
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK_TEMPLATE(BM_Edits, RedBlackLines);
+BENCHMARK_TEMPLATE(BM_Edits, BTreeLines);
+
+}  // namespace
+}  // namespace Util
+}  // namespace Med
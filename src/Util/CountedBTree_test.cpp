@@ -0,0 +1,247 @@
+#include "CountedBTree.h"
+#include "DRBTree.h"
+#include "PoolAllocator.h"
+
+#include <random>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace Med {
+namespace Util {
+
+class CountedBTreeTest : public ::testing::Test {
+protected:
+  // Small pages, so that small trees already have several levels.
+  typedef CountedBTree<int, int, int, DRBTreeDefs::HeapAllocator, 4, 4> Tree;
+  typedef DRBTree<int, int, int> ReferenceTree;
+
+  template<typename TreeType>
+  void checkInvariants(TreeType& tree) {
+    if (tree.root == nullptr) return;
+    EXPECT_EQ(nullptr, tree.root->parent);
+    EXPECT_EQ(&tree, tree.root->treeIfRoot);
+    std::vector<typename TreeType::LeafPage*> leaves;
+    checkPage(tree, tree.root, tree.height, &leaves);
+    for (std::size_t index = 0; index < leaves.size(); ++index) {
+      EXPECT_EQ(index > 0 ? leaves[index - 1] : nullptr, leaves[index]->adjacent[0]);
+      EXPECT_EQ(index + 1 < leaves.size() ? leaves[index + 1] : nullptr, leaves[index]->adjacent[1]);
+    }
+  }
+
+  /** Checks the structure of the subtree of page, and returns the sum of its deltas. */
+  template<typename TreeType>
+  int checkPage(TreeType& tree, typename TreeType::Page* page, int level, std::vector<typename TreeType::LeafPage*>* leaves) {
+    EXPECT_LT(0, page->count);
+    if (page != tree.root) EXPECT_EQ(nullptr, page->treeIfRoot);
+    int sum = 0;
+    if (level == 0) {
+      typename TreeType::LeafPage* const leaf = TreeType::asLeaf(page);
+      EXPECT_GE(4, leaf->count);
+      leaves->push_back(leaf);
+      for (int index = 0; index < leaf->count; ++index) {
+        EXPECT_EQ(leaf, leaf->nodes[index]->leaf_);
+        EXPECT_EQ(index, leaf->nodes[index]->index_);
+        EXPECT_EQ(leaf->nodes[index]->delta, leaf->deltas[index]);
+        sum += leaf->deltas[index];
+      }
+      return sum;
+    }
+    typename TreeType::InnerPage* const inner = TreeType::asInner(page);
+    EXPECT_GE(4, inner->count);
+    // Only the root may have a single child.
+    if (page == tree.root) EXPECT_LT(1, inner->count);
+    for (int index = 0; index < inner->count; ++index) {
+      EXPECT_EQ(inner, inner->children[index]->parent);
+      EXPECT_EQ(index, inner->children[index]->indexInParent);
+      EXPECT_EQ(inner->sums[index], checkPage(tree, inner->children[index], level - 1, leaves));
+      sum += inner->sums[index];
+    }
+    return sum;
+  }
+
+  /** Number of pages of TreeType allocated from the pool. */
+  template<typename TreeType>
+  static std::size_t livePageCount() {
+    return PoolAllocator<typename TreeType::LeafPage>::liveCount() + PoolAllocator<typename TreeType::InnerPage>::liveCount();
+  }
+
+  /** Checks that both trees have the nodes with the same values, in the same order and with the same keys. */
+  void checkSameAsReference(Tree& tree, ReferenceTree& reference) {
+    checkInvariants(tree);
+    EXPECT_EQ(reference.totalDelta(), tree.totalDelta());
+    Tree::Iterator entry = tree.begin();
+    for (ReferenceTree::Entry referenceEntry : reference) {
+      ASSERT_TRUE(entry.isValid());
+      EXPECT_EQ(referenceEntry.node->value, entry->node->value);
+      EXPECT_EQ(referenceEntry.key, entry->key);
+      EXPECT_EQ(entry->key, entry->node->key(DRBTreeDefs::Side::LEFT));
+      EXPECT_EQ(referenceEntry.node->key(DRBTreeDefs::Side::RIGHT), entry->node->key(DRBTreeDefs::Side::RIGHT));
+      EXPECT_EQ(&tree, entry->node->tree());
+      ++entry;
+    }
+    EXPECT_FALSE(entry.isValid());
+  }
+};
+
+TEST_F(CountedBTreeTest, SameAsDRBTree) {
+  std::mt19937 random(1234);
+  auto uniform = [&random](int min, int max) { return std::uniform_int_distribution<int>(min, max)(random); };
+  Tree tree;
+  ReferenceTree reference;
+  // The nodes of both trees with each value.
+  std::vector<Tree::Node*> nodes;
+  std::vector<ReferenceTree::Node*> referenceNodes;
+  std::vector<int> attachedValues;
+
+  for (int step = 0; step < 6000; ++step) {
+    const int endKey = tree.empty() ? 0 : tree.totalDelta();
+    const int operation = attachedValues.size() < 10 ? 0 : uniform(0, 7);
+    DRBTreeDefs::OperationOptions options;
+    options.repeats = true;
+    options.repeatedSide = uniform(0, 1) == 0 ? DRBTreeDefs::Side::LEFT : DRBTreeDefs::Side::RIGHT;
+    options.equalOrAdjacent = uniform(0, 1) == 0;
+    options.equalOrAdjacentSide = uniform(0, 1) == 0 ? DRBTreeDefs::Side::LEFT : DRBTreeDefs::Side::RIGHT;
+    if (operation <= 1 && attachedValues.size() < 300) {
+      const int value = nodes.size();
+      nodes.push_back(Tree::newNode(value));
+      referenceNodes.push_back(ReferenceTree::newNode(value));
+      const int key = uniform(-2, endKey);
+      // DRBTree only attaches at the right end of the same-key segment when the last node of the segment has a right child.
+      options.repeatedSide = DRBTreeDefs::Side::LEFT;
+      const Tree::Iterator attached = tree.attach(nodes.back(), key, options);
+      reference.attach(referenceNodes.back(), key, options);
+      EXPECT_EQ(key, attached->key);
+      attachedValues.push_back(value);
+    } else if (operation == 2) {
+      const std::size_t index = uniform(0, attachedValues.size() - 1);
+      const int value = attachedValues[index];
+      nodes[value]->detach();
+      referenceNodes[value]->detach();
+      attachedValues.erase(attachedValues.begin() + index);
+    } else if (operation == 3) {
+      const int value = attachedValues[uniform(0, attachedValues.size() - 1)];
+      // Zero deltas make repeated keys.
+      const int delta = uniform(0, 3);
+      nodes[value]->setDelta(delta);
+      referenceNodes[value]->setDelta(delta);
+    } else if (operation == 4) {
+      const int key = uniform(-2, endKey + 2);
+      const Tree::Iterator found = tree.get(key, options);
+      const ReferenceTree::Iterator referenceFound = reference.get(key, options);
+      ASSERT_EQ(referenceFound.isValid(), found.isValid()) << step;
+      if (found.isValid()) {
+        EXPECT_EQ(referenceFound->node->value, found->node->value);
+        EXPECT_EQ(referenceFound->key, found->key);
+      }
+    } else if (operation == 5) {
+      const int value = attachedValues[uniform(0, attachedValues.size() - 1)];
+      const int otherValue = attachedValues[uniform(0, attachedValues.size() - 1)];
+      EXPECT_EQ(ReferenceTree::keyRelativeTo(referenceNodes[value], referenceNodes[otherValue]), Tree::keyRelativeTo(nodes[value], nodes[otherValue]));
+      const int nearKey = nodes[value]->key(DRBTreeDefs::Side::LEFT);
+      const int key = nearKey + uniform(-10, 10);
+      const Tree::Iterator found = tree.getNear({nearKey, nodes[value]}, key, options);
+      const ReferenceTree::Iterator referenceFound = reference.get(key, options);
+      ASSERT_EQ(referenceFound.isValid(), found.isValid()) << step;
+      if (found.isValid()) {
+        EXPECT_EQ(referenceFound->node->value, found->node->value);
+        EXPECT_EQ(referenceFound->key, found->key);
+      }
+    } else {
+      // Split in three, then join back, with the middle part through another tree.
+      int keys[2] = {uniform(-2, endKey + 2), uniform(-2, endKey + 2)};
+      if (keys[0] > keys[1]) std::swap(keys[0], keys[1]);
+      Tree middle;
+      Tree right;
+      Tree other;
+      tree.split(keys[0], &middle);
+      middle.split(keys[1], &right);
+      checkInvariants(tree);
+      checkInvariants(middle);
+      checkInvariants(right);
+      if (!middle.empty()) EXPECT_LE(keys[0], middle.begin()->key);
+      if (!right.empty()) EXPECT_LE(keys[1], right.begin()->key);
+      other.join(&middle);
+      EXPECT_TRUE(middle.empty());
+      tree.join(&other);
+      tree.join(&right);
+      EXPECT_TRUE(right.empty());
+      // Joining keeps the deltas, so the keys don't change.
+      ReferenceTree referenceMiddle;
+      ReferenceTree referenceRight;
+      reference.split(keys[0], &referenceMiddle);
+      referenceMiddle.split(keys[1], &referenceRight);
+      reference.join(&referenceMiddle);
+      reference.join(&referenceRight);
+    }
+    checkSameAsReference(tree, reference);
+    if (HasFatalFailure()) return;
+  }
+  for (Tree::Node* node : nodes) {
+    if (!node->isAttached()) Tree::deleteNode(node);
+  }
+  for (ReferenceTree::Node* node : referenceNodes) {
+    if (!node->isAttached()) ReferenceTree::deleteNode(node);
+  }
+  tree.clear();
+  EXPECT_TRUE(tree.empty());
+  reference.clear();
+}
+
+TEST_F(CountedBTreeTest, BuildFromAndCursor) {
+  for (int nodeCount = 0; nodeCount <= 70; ++nodeCount) {
+    std::vector<Tree::Node*> nodes;
+    // Keys 5, 7, 9...
+    for (int index = 0; index < nodeCount; ++index) {
+      nodes.push_back(Tree::newNode(index));
+      nodes.back()->delta = 2;
+    }
+    Tree tree;
+    tree.buildFrom(nodes.begin(), nodes.end(), 5);
+    checkInvariants(tree);
+    EXPECT_EQ(nodeCount == 0 ? 0 : 5 + 2 * nodeCount, tree.totalDelta());
+    for (int index = 0; index < nodeCount; ++index) {
+      EXPECT_EQ(5 + 2 * index, nodes[index]->key(DRBTreeDefs::Side::LEFT));
+      EXPECT_EQ(nodes[index], tree.get(5 + 2 * index, {})->node);
+      int visited = index;
+      for (Tree::Cursor cursor(nodes[index]); cursor.isValid(); cursor.advance()) EXPECT_EQ(nodes[visited++], cursor.node());
+      EXPECT_EQ(nodeCount, visited);
+    }
+    EXPECT_FALSE(Tree::Cursor(nullptr).isValid());
+    // Detaching every other node merges pages.
+    for (int index = 0; index < nodeCount; index += 2) {
+      nodes[index]->detach();
+      Tree::deleteNode(nodes[index]);
+      checkInvariants(tree);
+    }
+    tree.clear();
+  }
+}
+
+TEST_F(CountedBTreeTest, PoolAllocatorFreesPages) {
+  typedef CountedBTree<int, int, int, PoolAllocator, 4, 4> PooledTree;
+  {
+    PooledTree tree;
+    std::vector<PooledTree::Node*> nodes;
+    for (int index = 0; index < 100; ++index) {
+      nodes.push_back(PooledTree::newNode(index));
+      tree.attach(nodes.back(), index, {});
+      nodes.back()->setDelta(1);
+    }
+    checkInvariants(tree);
+    EXPECT_EQ(100, PooledTree::Allocator::liveCount());
+    EXPECT_LT(0, livePageCount<PooledTree>());
+    for (PooledTree::Node* node : nodes) {
+      node->detach();
+      PooledTree::deleteNode(node);
+      checkInvariants(tree);
+    }
+    EXPECT_TRUE(tree.empty());
+  }
+  EXPECT_EQ(0, PooledTree::Allocator::liveCount());
+  EXPECT_EQ(0, livePageCount<PooledTree>());
+}
+
+}  // namespace Util
+}  // namespace Med
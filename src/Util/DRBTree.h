@@ -1,9 +1,12 @@
 #ifndef MED_UTIL_DRBTREE_H
 #define MED_UTIL_DRBTREE_H
 
+#include <algorithm>
+#include <cstdint>
 #include <exception>
 #include <utility>
 #include <stdexcept>
+#include <string>
 
 namespace Med {
 namespace Util {
@@ -42,6 +45,15 @@ public:
   class Error : public std::logic_error {
     using std::logic_error::logic_error;
   };
+
+  /** The default node allocator policy: each node is allocated separately on the heap. */
+  template<typename Node>
+  class HeapAllocator {
+  public:
+    template<typename... Args>
+    static Node* allocate(Args&&... args) { return new Node(std::forward<Args>(args)...); }
+    static void deallocate(Node* node) { delete node; }
+  };
 };
 
 /** A sorted map from "numeric" keys to arbitrary values, where some operations that affect many keys are efficient.
@@ -53,8 +65,10 @@ public:
  * This map uses the concept of "delta". An element's delta is the difference between its key and the previous node's key.
  *
  * Keys are not stored directly, but computed from deltas.
+ *
+ * Nodes are created and destroyed with newNode() and deleteNode(), which use the Allocator_ policy (see HeapAllocator and PoolAllocator for the interface). The tree itself never allocates nodes, so a node may be detached from one tree and attached to another.
  */
-template<typename Key_, typename Delta_, typename Value_>
+template<typename Key_, typename Delta_, typename Value_, template<typename> class Allocator_ = DRBTreeDefs::HeapAllocator>
 class DRBTree : public DRBTreeDefs {
 public:
   typedef Key_ Key;
@@ -65,6 +79,20 @@ public:
   static constexpr Delta zeroDelta{};
 
   class Node;
+  typedef Allocator_<Node> Allocator;
+
+  /** Bound on the height of any tree: a red-black tree's height is at most twice the logarithm of its size, and a tree can't have more nodes than bytes in memory. */
+  static constexpr int maxHeight = 2 * 8 * sizeof(void*);
+
+  /** Creates a new detached node, passing the arguments to the node's constructor. */
+  template<typename... Args>
+  static Node* newNode(Args&&... args) { return Allocator::allocate(std::forward<Args>(args)...); }
+
+  /** Destroys a node created with newNode(). The node must not be attached to a tree. */
+  static void deleteNode(Node* node) {
+    if (node != nullptr && node->isAttached()) throw Error("Deleting an attached node.");
+    Allocator::deallocate(node);
+  }
 
   DRBTree() {}
   ~DRBTree() {}
@@ -118,6 +146,63 @@ public:
   };
   typedef IteratorTemplate<Entry> Iterator;
 
+  /** Visits nodes in key order, starting at a given node, without climbing through parents.
+   *
+   * The ancestors still to be visited are kept in a stack inside the cursor, so advancing is amortized O(1), never allocates and doesn't need to find which side of its parent each node is on, as Node::adjacent() does. Keys are not computed.
+   *
+   * Any change to the structure of the tree invalidates the cursor.
+   */
+  class Cursor {
+  public:
+    /** A cursor that has finished. */
+    Cursor() {}
+
+    /** A cursor at the given node, which may be null to get a finished cursor. O(log N). */
+    explicit Cursor(Node* node) : node_(node) {
+      if (node == nullptr) return;
+      // The ancestors with node in their left subtree come after it, the nearest first.
+      int count = 0;
+      for (Node* child = node; child->parent() != nullptr; child = child->parent()) {
+        if (child->parent()->children.get(Side::LEFT) == child) ++count;
+      }
+      depth_ = count;
+      for (Node* child = node; child->parent() != nullptr; child = child->parent()) {
+        if (child->parent()->children.get(Side::LEFT) == child) pending_[--count] = child->parent();
+      }
+    }
+
+    // Only the used part of the stack is copied.
+    Cursor(const Cursor& other) { *this = other; }
+    Cursor& operator=(const Cursor& other) {
+      node_ = other.node_;
+      depth_ = other.depth_;
+      std::copy(other.pending_, other.pending_ + other.depth_, pending_);
+      return *this;
+    }
+
+    bool isValid() const { return node_ != nullptr; }
+    Node* node() const { return node_; }
+
+    bool operator==(const Cursor& other) const { return node_ == other.node_; }
+    bool operator!=(const Cursor& other) const { return !operator==(other); }
+
+    /** Moves to the next node, or finishes the cursor if there are no more nodes. */
+    void advance() {
+      Node* next = node_->children.get(Side::RIGHT);
+      if (next == nullptr) {
+        node_ = depth_ > 0 ? pending_[--depth_] : nullptr;
+        return;
+      }
+      for (Node* left; (left = next->children.get(Side::LEFT)) != nullptr; next = left) pending_[depth_++] = next;
+      node_ = next;
+    }
+
+  private:
+    Node* node_ = nullptr;
+    int depth_ = 0;
+    Node* pending_[maxHeight];
+  };
+
   ConstIterator extreme(Side side, OperationOptions options) const { return extremeInternal<Iterator>(side, options); }
 
   Iterator extreme(Side side, OperationOptions options) { return extremeInternal<Iterator>(side, options); }
@@ -128,66 +213,93 @@ public:
   Iterator begin() { return beginInternal<Iterator>(); }
   Iterator end() { return endInternal<Iterator>(); }
 
-  /** Gets a node from the tree. Also returns its key, which might be different from the supplied key if equalOrAdjacentSide is set. */
-  Iterator get(const Key& key, const OperationOptions& options) {
+  /** Gets a node from the tree. Also returns its key, which might be different from the supplied key if equalOrAdjacentSide is set.
+   *
+   * The searched key doesn't need to be a Key, only comparable to one with == and <; this allows searching by a single component of composite keys.
+   */
+  template<typename SearchKey>
+  Iterator get(const SearchKey& key, const OperationOptions& options) {
     if (root == nullptr) return Iterator({zeroKey, nullptr});
-    Node* parent = nullptr;
-    Node* current = root;
-    // The predecessor of leftmost element of the subtree "current" is the root of.
-    Node* predecessorOfSubtree = nullptr;
-    // Key at the leftmost element of the subtree "current" is the root of.
-    Key keyAtSubtree = zeroKey + extremeDelta(options.deltaSide);
-    Key foundKey = zeroKey;
-    Side dir = Side::LEFT;
-    Node* found = nullptr;
-    while (current != nullptr) {
-      const Key keyAtNode = keyAtSubtree + current->children.subtreeDelta(options.deltaSide);
-      if (key == keyAtNode) {
-        found = current;
-        foundKey = keyAtNode;
-        dir = options.repeatedSide;
-      } else
-        dir = key < keyAtNode ? options.deltaSide : other(options.deltaSide);
-
-      if (dir != options.deltaSide) {
-        predecessorOfSubtree = current;
-        keyAtSubtree = keyAtNode + current->delta;
-      }
+    return getInSubtree(root, zeroKey + extremeDelta(options.deltaSide), key, options);
+  }
 
-      parent = current;
-      current = current->children.get(dir);
+  /** Like get(), but starting the search from a node whose key is known, which is faster when the searched key is close: the search only climbs until it finds a subtree containing the key. O(log d) in typical cases, d being the number of nodes between near and the result.
+   *
+   * near.key doesn't need to be the real key of near.node: if it is zeroKey, for example, the search is relative to near.node, and the returned key too. Only supports keys on the left side.
+   */
+  template<typename SearchKey>
+  Iterator getNear(const Entry& near, const SearchKey& key, const OperationOptions& options) {
+    if (options.deltaSide != Side::LEFT) throw Error("Near searches only support keys on the left side.");
+    Node* subtree = near.node;
+    Key keyAtSubtree = near.key - subtree->children.subtreeDelta(Side::LEFT);
+    // Nodes with a key at the ends of a subtree might be repeated outside it, so the key must be strictly inside.
+    while (subtree->parent() != nullptr && !(keyAtSubtree < key && key < keyAtSubtree + subtree->subtreeDelta)) {
+      Node* const parent = subtree->parent();
+      if (parent->children.get(Side::RIGHT) == subtree) keyAtSubtree -= parent->nodePlusSubtreeDelta(Side::LEFT);
+      subtree = parent;
+    }
+    return getInSubtree(subtree, keyAtSubtree, key, options);
+  }
 
-      if (current == nullptr && found == nullptr && options.equalOrAdjacent) {
-        foundKey = keyAtNode;
-        found = parent;
-        // TODO: this code is a bit horrible, should be simplified.
-        if (dir == options.equalOrAdjacentSide) {
-          // parent is on the opposite side
-          Key newFoundKey = zeroKey;
-          if (options.deltaSide != options.equalOrAdjacentSide) newFoundKey = foundKey + found->delta;
-          found = found->adjacent(options.equalOrAdjacentSide);
-          bool change = true;
-          if (options.deltaSide == options.equalOrAdjacentSide) {
-            change = found != nullptr;
-            if (change) newFoundKey = foundKey - found->delta;
-          }
-          if (change) foundKey = newFoundKey;
+  /** Returns the key of other minus the key of node, on the left side. Both must be in the same tree.
+   *
+   * Only the paths from both nodes to their lowest common ancestor are visited, so it's O(log d) in typical cases, d being the number of nodes between them.
+   */
+  static Delta keyRelativeTo(Node* node, Node* other) {
+    // Each path holds ancestors, and the key of the starting node relative to the leftmost element of the ancestor's subtree.
+    struct Step {
+      Node* ancestor;
+      Delta position;
+    };
+    Step paths[2][maxHeight];
+    int lengths[2] = {1, 1};
+    paths[0][0] = {node, node->children.subtreeDelta(Side::LEFT)};
+    paths[1][0] = {other, other->children.subtreeDelta(Side::LEFT)};
+    // Climb from both nodes in turns, until one of them reaches an ancestor the other one has already visited.
+    for (int path = 0; true; path = 1 - path) {
+      const Step& last = paths[path][lengths[path] - 1];
+      for (int index = 0; index < lengths[1 - path]; ++index) {
+        const Step& otherStep = paths[1 - path][index];
+        if (otherStep.ancestor == last.ancestor) {
+          return path == 0 ? otherStep.position - last.position : last.position - otherStep.position;
         }
       }
+      Node* const parent = last.ancestor->parent();
+      if (parent == nullptr) {
+        if (paths[1 - path][lengths[1 - path] - 1].ancestor->parent() == nullptr) throw Error("The nodes are not in the same tree.");
+        continue;
+      }
+      Delta position = last.position;
+      if (parent->children.get(Side::RIGHT) == last.ancestor) position += parent->nodePlusSubtreeDelta(Side::LEFT);
+      paths[path][lengths[path]++] = {parent, position};
+    }
+  }
+  /** Increases the keys of node and of all the nodes after it by delta, which may be negative as long as the keys stay in order. node must be in this tree. O(log N).
+   *
+   * Only the delta before node changes: that of its predecessor, or the leftmost extreme delta if it's the first node.
+   */
+  void shiftKeysFrom(Node* node, const Delta& delta) {
+    Node* const predecessor = node->adjacent(Side::LEFT);
+    if (predecessor) {
+      predecessor->setDelta(predecessor->delta + delta);
+    } else {
+      extremeDelta(Side::LEFT) += delta;
     }
-    return Iterator({foundKey, found});
   }
 
   /** Attaches a new node to the tree. */
   Iterator attach(Node* node, const Key& key, const OperationOptions& options) {
-    if (node->isAttached()) throw new Error("The node is already attached.");
-    node->color = NodeColor::RED;
+    if (node->isAttached()) throw Error("The node is already attached.");
+    node->setColor(NodeColor::RED);
+    // Until its delta is set at the end, the node mustn't contribute to its ancestors' subtree deltas.
+    node->delta = zeroDelta;
+    node->subtreeDelta = zeroDelta;
     /** Both the key and the predecessor of a subtree are those of its leftmost element. */
     struct Subtree { Key key; Node* predecessor; };
     Subtree subtree{zeroKey + extremeDelta(options.deltaSide), nullptr};
     if (root == nullptr) {
       // Empty tree insertion
-      root = node;
+      setRoot(node);
     } else {
       Node* grandparent = nullptr;
       Subtree grandparentSubtree;
@@ -202,12 +314,12 @@ public:
           // Insert at leaf
           current = node;
           parent->children.get(dir) = node;
-          node->parent = parent;
+          node->setParent(parent);
         } else if (Node::isRed(current->children.get(Side::LEFT)) &&
             Node::isRed(current->children.get(Side::RIGHT))) {
-          current->color = NodeColor::RED;
-          current->children.get(Side::LEFT)->color = NodeColor::BLACK;
-          current->children.get(Side::RIGHT)->color = NodeColor::BLACK;
+          current->setColor(NodeColor::RED);
+          current->children.get(Side::LEFT)->setColor(NodeColor::BLACK);
+          current->children.get(Side::RIGHT)->setColor(NodeColor::BLACK);
         }
 
         if (Node::isRed(current) && Node::isRed(parent)) {
@@ -233,7 +345,8 @@ public:
           dir = keyAtNode < key ? other(options.deltaSide) : options.deltaSide;
           if (keyAtNode == key && current->children.get(dir) != nullptr) {
             if (!options.repeats) {
-              throw Error("Trying to insert node with repeated key '" + std::to_string(key) + "'.");
+              using std::to_string;
+              throw Error("Trying to insert node with repeated key '" + to_string(key) + "'.");
             }
             dir = options.repeatedSide;
           }
@@ -251,16 +364,15 @@ public:
       }
     }
 
-    node->tree = this;
-    root->color = NodeColor::BLACK;
+    root->setColor(NodeColor::BLACK);
 
     // Set the node's delta.
     if (subtree.predecessor) {
       // At the leaf, subtree
       if (key > subtree.key) {
-        // This means we are at the biggest end of the tree and we're increasing the tree's total delta.
+        // This means we are at the biggest end of the tree and we're increasing the tree's total delta. subtree.key is where the predecessor's delta ends, which isn't its key unless that delta is zero.
         node->setDelta(zeroDelta);
-        subtree.predecessor->setDelta(key - subtree.key);
+        subtree.predecessor->setDelta(subtree.predecessor->delta + (key - subtree.key));
       } else {
         // We have a successor. We split the predecessor's previous delta between the new node and the predecessor, so the new node's key is as requested and the successor's key doesn't change.
         node->setDelta(subtree.key - key);
@@ -278,9 +390,290 @@ public:
     return Iterator({key, node});
   }
 
+  /** Builds the tree from a range of detached nodes, in key order, in O(N). The tree must be empty.
+   *
+   * The nodes' deltas must already be set; they are kept as they are. The key of the first node (on the left side) will be firstKey.
+   *
+   * NodeIterator must be a random access iterator over Node*.
+   */
+  template<typename NodeIterator>
+  void buildFrom(NodeIterator begin, NodeIterator end, const Key& firstKey = zeroKey) {
+    if (!empty()) throw Error("Building a tree that is not empty.");
+    if (begin == end) return;
+    // A tree of nodes split in halves at every level has all its leaves at the last two levels. Coloring the last level red (and the rest black) keeps the number of black nodes equal in all paths.
+    int redDepth = 0;
+    for (auto count = end - begin; count > 1; count /= 2) ++redDepth;
+    setRoot(buildSubtree(begin, end, nullptr, 0, redDepth));
+    root->setColor(NodeColor::BLACK);
+    leftmostExtremeDelta = firstKey - zeroKey;
+    rightmostExtremeDelta = zeroDelta;
+  }
+
+  /** Moves the nodes with keys (on the left side) equal or bigger than key to right, which must be empty. O(log N).
+   *
+   * The nodes keep their deltas and their keys: the leftmost extreme delta of right becomes the key of its first node. right also takes this tree's rightmost extreme delta, which becomes zero in this tree.
+   *
+   * As in get(), key only needs to be comparable to a Key.
+   */
+  template<typename SearchKey>
+  void split(const SearchKey& key, DRBTree* right) {
+    if (!right->empty()) throw Error("Splitting into a tree that is not empty.");
+    if (empty()) return;
+    Node* const oldRoot = root;
+    const int oldBlackHeight = blackHeight(oldRoot);
+    setRoot(nullptr);
+    Key firstRightKey = zeroKey;
+    int leftBlackHeight = 0;
+    int rightBlackHeight = 0;
+    splitSubtree(oldRoot, oldBlackHeight, zeroKey + leftmostExtremeDelta, key, this, &leftBlackHeight, right, &rightBlackHeight, &firstRightKey);
+    if (!right->empty()) {
+      right->leftmostExtremeDelta = firstRightKey - zeroKey;
+      right->rightmostExtremeDelta = rightmostExtremeDelta;
+      rightmostExtremeDelta = zeroDelta;
+    }
+  }
+
+  /** Moves all the nodes of right after the nodes of this tree; right becomes empty. O(log N).
+   *
+   * The nodes keep their deltas, so the key of the first node coming from right is the key of the last node of this tree plus its delta. The leftmost extreme delta of right and the rightmost extreme delta of this tree are discarded, unless this tree was empty.
+   */
+  void join(DRBTree* right) {
+    if (right->empty()) return;
+    if (empty()) {
+      leftmostExtremeDelta = right->leftmostExtremeDelta;
+      rightmostExtremeDelta = right->rightmostExtremeDelta;
+      takeRootFrom(right);
+      return;
+    }
+    rightmostExtremeDelta = right->rightmostExtremeDelta;
+    // Joining needs a node to put between both trees.
+    Node* const pivot = right->root->descendantAtEnd(Side::LEFT);
+    right->detach(pivot);
+    joinWithPivot(blackHeight(root), pivot, right, blackHeight(right->root));
+  }
+
+  /** Deletes all the nodes, leaving the tree empty. O(N). */
+  void clear() {
+    Node* node = root;
+    setRoot(nullptr);
+    // Post-order traversal, unlinking every node from its parent before deleting it.
+    while (node != nullptr) {
+      Node* next = nullptr;
+      for (Side side : {Side::LEFT, Side::RIGHT}) {
+        Node*& child = node->children.get(side);
+        if (child != nullptr) {
+          next = child;
+          child = nullptr;
+          break;
+        }
+      }
+      if (next == nullptr) {
+        next = node->parent();
+        node->setParent(nullptr);
+        deleteNode(node);
+      }
+      node = next;
+    }
+  }
+
 private:
   friend class DRBTreeTest;
 
+  /** Searches the subtree of current, whose leftmost element has the key keyAtSubtree. See get(). */
+  template<typename SearchKey>
+  Iterator getInSubtree(Node* current, Key keyAtSubtree, const SearchKey& key, const OperationOptions& options) {
+    Node* parent = nullptr;
+    // The predecessor of leftmost element of the subtree "current" is the root of.
+    Node* predecessorOfSubtree = nullptr;
+    Key foundKey = zeroKey;
+    Side dir = Side::LEFT;
+    Node* found = nullptr;
+    while (current != nullptr) {
+      const Key keyAtNode = keyAtSubtree + current->children.subtreeDelta(options.deltaSide);
+      if (key == keyAtNode) {
+        found = current;
+        foundKey = keyAtNode;
+        dir = options.repeatedSide;
+      } else
+        dir = key < keyAtNode ? options.deltaSide : other(options.deltaSide);
+
+      if (dir != options.deltaSide) {
+        predecessorOfSubtree = current;
+        keyAtSubtree = keyAtNode + current->delta;
+      }
+
+      parent = current;
+      current = current->children.get(dir);
+
+      if (current == nullptr && found == nullptr && options.equalOrAdjacent) {
+        foundKey = keyAtNode;
+        found = parent;
+        // TODO: this code is a bit horrible, should be simplified.
+        if (dir == options.equalOrAdjacentSide) {
+          // parent is on the opposite side
+          Key newFoundKey = zeroKey;
+          if (options.deltaSide != options.equalOrAdjacentSide) newFoundKey = foundKey + found->delta;
+          found = found->adjacent(options.equalOrAdjacentSide);
+          bool change = true;
+          if (options.deltaSide == options.equalOrAdjacentSide) {
+            change = found != nullptr;
+            if (change) newFoundKey = foundKey - found->delta;
+          }
+          if (change) foundKey = newFoundKey;
+        }
+      }
+    }
+    return Iterator({foundKey, found});
+  }
+
+  void takeRootFrom(DRBTree* other) {
+    Node* const node = other->root;
+    other->setRoot(nullptr);
+    setRoot(node);
+  }
+
+  /** Number of black nodes in the path from node (included) to its leftmost leaf. */
+  static int blackHeight(const Node* node) {
+    int height = 0;
+    for (; node != nullptr; node = node->children.get(Side::LEFT)) {
+      if (node->color() == NodeColor::BLACK) ++height;
+    }
+    return height;
+  }
+
+  /** Joins this tree, the detached node pivot and right, in this order, into this tree; right becomes empty. Deltas, including extreme deltas, are not modified.
+   *
+   * blackHeight and rightBlackHeight are the black heights of both trees, whose roots must be black. Returns the black height of the result.
+   *
+   * O(1 + the difference in black heights).
+   */
+  int joinWithPivot(int blackHeight, Node* pivot, DRBTree* right, int rightBlackHeight) {
+    // The pivot is attached to the inner side of the taller tree, replacing a black node with the same black height as the shorter tree, which becomes the pivot's child together with the shorter tree.
+    const bool leftIsTaller = blackHeight >= rightBlackHeight;
+    const Side side = leftIsTaller ? Side::RIGHT : Side::LEFT;
+    Node* const tallerRoot = leftIsTaller ? root : right->root;
+    Node* const shorterRoot = leftIsTaller ? right->root : root;
+    int height = leftIsTaller ? blackHeight : rightBlackHeight;
+    const int shorterHeight = leftIsTaller ? rightBlackHeight : blackHeight;
+    setRoot(nullptr);
+    right->setRoot(nullptr);
+
+    Node* parent = nullptr;
+    Node* replaced = tallerRoot;
+    while (height > shorterHeight || Node::isRed(replaced)) {
+      if (!Node::isRed(replaced)) --height;
+      parent = replaced;
+      replaced = replaced->children.get(side);
+    }
+    pivot->setColor(NodeColor::RED);
+    pivot->children.get(other(side)) = replaced;
+    pivot->children.get(side) = shorterRoot;
+    if (replaced != nullptr) replaced->setParent(pivot);
+    if (shorterRoot != nullptr) shorterRoot->setParent(pivot);
+    pivot->subtreeDelta = pivot->delta + pivot->children.totalSubtreeDeltas();
+    pivot->setParent(parent);
+    if (parent == nullptr) {
+      setRoot(pivot);
+    } else {
+      parent->children.get(side) = pivot;
+      setRoot(tallerRoot);
+      parent->updateSubtreeDelta();
+    }
+    return std::max(blackHeight, rightBlackHeight) + (fixRedNode(pivot) ? 1 : 0);
+  }
+
+  /** Restores the red/black invariants after the red node was linked into the tree with a black height equal to that of the node it replaced. Returns true if the black height of the tree increased. */
+  bool fixRedNode(Node* node) {
+    while (true) {
+      Node* const parent = node->parent();
+      if (parent == nullptr) {
+        node->setColor(NodeColor::BLACK);
+        return true;
+      }
+      if (!Node::isRed(parent)) return false;
+      Node* const grandparent = parent->parent();
+      if (grandparent == nullptr) {
+        parent->setColor(NodeColor::BLACK);
+        return true;
+      }
+      const Side parentSide = parent->parentSide();
+      Node* const uncle = grandparent->children.get(other(parentSide));
+      if (Node::isRed(uncle)) {
+        parent->setColor(NodeColor::BLACK);
+        uncle->setColor(NodeColor::BLACK);
+        grandparent->setColor(NodeColor::RED);
+        node = grandparent;
+        continue;
+      }
+      if (node->parentSide() == parentSide)
+        rotateSingle(grandparent, other(parentSide));
+      else
+        rotateDouble(grandparent, other(parentSide));
+      return false;
+    }
+  }
+
+  /** Splits the subtree of node, which has been detached from its tree and has the given black height and key at its leftmost element, into left (nodes with keys smaller than key) and right (the rest), which must be empty. Also returns the black heights of left and right, and the key of the first node of right, if any. */
+  template<typename SearchKey>
+  static void splitSubtree(Node* node, int blackHeight, const Key& subtreeKey, const SearchKey& key, DRBTree* left, int* leftBlackHeight, DRBTree* right, int* rightBlackHeight, Key* firstRightKey) {
+    if (node == nullptr) {
+      *leftBlackHeight = 0;
+      *rightBlackHeight = 0;
+      return;
+    }
+    const Key keyAtNode = subtreeKey + node->children.subtreeDelta(Side::LEFT);
+    const int childrenBlackHeight = blackHeight - (node->color() == NodeColor::BLACK ? 1 : 0);
+    Node* const leftChild = node->children.get(Side::LEFT);
+    Node* const rightChild = node->children.get(Side::RIGHT);
+    node->children.get(Side::LEFT) = nullptr;
+    node->children.get(Side::RIGHT) = nullptr;
+    node->setParent(nullptr);
+    // The node is joined with the child subtree that isn't split and with the part of the other one that ends up on the same side.
+    const bool nodeGoesRight = !(keyAtNode < key);
+    DRBTree sibling;
+    const int siblingBlackHeight = sibling.makeRoot(nodeGoesRight ? rightChild : leftChild, childrenBlackHeight);
+    DRBTree part;
+    int partBlackHeight = 0;
+    if (nodeGoesRight) {
+      *firstRightKey = keyAtNode;
+      detachChild(leftChild);
+      splitSubtree(leftChild, childrenBlackHeight, subtreeKey, key, left, leftBlackHeight, &part, &partBlackHeight, firstRightKey);
+      *rightBlackHeight = part.joinWithPivot(partBlackHeight, node, &sibling, siblingBlackHeight);
+      right->takeRootFrom(&part);
+    } else {
+      detachChild(rightChild);
+      splitSubtree(rightChild, childrenBlackHeight, keyAtNode + node->delta, key, &part, &partBlackHeight, right, rightBlackHeight, firstRightKey);
+      *leftBlackHeight = sibling.joinWithPivot(siblingBlackHeight, node, &part, partBlackHeight);
+      left->takeRootFrom(&sibling);
+    }
+  }
+
+  static void detachChild(Node* child) {
+    if (child != nullptr) child->setParent(nullptr);
+  }
+
+  /** Makes the detached subtree of node this tree, which must be empty. A red node is made black. Returns the black height of the resulting tree, given the subtree's black height. */
+  int makeRoot(Node* node, int blackHeight) {
+    setRoot(node);
+    if (!Node::isRed(node)) return blackHeight;
+    node->setColor(NodeColor::BLACK);
+    return blackHeight + 1;
+  }
+
+  template<typename NodeIterator>
+  Node* buildSubtree(NodeIterator begin, NodeIterator end, Node* parent, int depth, int redDepth) {
+    if (begin == end) return nullptr;
+    const NodeIterator middle = begin + (end - begin) / 2;
+    Node* const node = *middle;
+    if (node->isAttached()) throw Error("The node is already attached.");
+    node->setParent(parent);
+    node->setColor(depth == redDepth ? NodeColor::RED : NodeColor::BLACK);
+    node->children.get(Side::LEFT) = buildSubtree(begin, middle, node, depth + 1, redDepth);
+    node->children.get(Side::RIGHT) = buildSubtree(middle + 1, end, node, depth + 1, redDepth);
+    node->subtreeDelta = node->delta + node->children.totalSubtreeDeltas();
+    return node;
+  }
+
   Delta childrenDelta() const { return empty() ? zeroDelta : root->subtreeDelta; }
 
   template<typename IteratorType>
@@ -391,23 +784,24 @@ private:
 
   void rotateSingle(Node* oldRoot, Side dir) {
     Node* const newRoot = oldRoot->children.get(other(dir));
-    Node* const top = oldRoot->parent;
+    Node* const top = oldRoot->parent();
     Node* const child = newRoot->children.get(dir);
     oldRoot->children.get(other(dir)) = child;
-    if (child != nullptr) child->parent = oldRoot;
-    if (top == nullptr) root = newRoot;
+    if (child != nullptr) child->setParent(oldRoot);
+    // The root's link to its parent is also its link to the tree, so the parent must be set before setRoot().
+    newRoot->setParent(top);
+    if (top == nullptr) setRoot(newRoot);
     else top->children.get(oldRoot->parentSide()) = newRoot;
-    newRoot->parent = top;
 
     newRoot->children.get(dir) = oldRoot;
-    oldRoot->parent = newRoot;
+    oldRoot->setParent(newRoot);
 
-    oldRoot->color = NodeColor::RED;
-    newRoot->color = NodeColor::BLACK;
+    oldRoot->setColor(NodeColor::RED);
+    newRoot->setColor(NodeColor::BLACK);
 
-    // Note how these two operations don't affect each other.
-    oldRoot->children.updateSubtreeDelta(other(dir));
-    newRoot->children.updateSubtreeDelta(dir);
+    // The rotated subtree has the same nodes as before, so only these two subtree deltas change.
+    oldRoot->subtreeDelta = oldRoot->delta + oldRoot->children.totalSubtreeDeltas();
+    newRoot->subtreeDelta = newRoot->delta + newRoot->children.totalSubtreeDeltas();
   }
 
   void rotateDouble(Node* oldRoot, Side side) {
@@ -420,30 +814,30 @@ private:
   void moveAndDetach(Node* moved, Node* detached) {
     Node* const child = moved->children.onlyChild();
     // Point the child to the parent.
-    if (child != nullptr) child->parent = moved->parent;
+    if (child != nullptr) child->setParent(moved->parent());
     // Point the parent to the child.
-    if (moved->parent == nullptr)
-      root = child;
+    if (moved->parent() == nullptr)
+      setRoot(child);
     else {
-      moved->parent->children.get(moved->parentSide()) = child;
-      moved->parent->updateSubtreeDelta();
+      moved->parent()->children.get(moved->parentSide()) = child;
+      moved->parent()->updateSubtreeDelta();
     }
     if (moved != detached) {
-      moved->color = detached->color;
-      moved->parent = detached->parent;
-      if (moved->parent == nullptr)
-        root = moved;
+      moved->setColor(detached->color());
+      moved->setParent(detached->parent());
+      if (moved->parent() == nullptr)
+        setRoot(moved);
       else {
-        moved->parent->children.get(detached->parentSide()) = moved;
-        moved->parent->updateSubtreeDelta();
+        moved->parent()->children.get(detached->parentSide()) = moved;
+        moved->parent()->updateSubtreeDelta();
       }
       moved->children = detached->children;
-      if (moved->children.get(Side::LEFT)) moved->children.get(Side::LEFT)->parent = moved;
-      if (moved->children.get(Side::RIGHT)) moved->children.get(Side::RIGHT)->parent = moved;
+      if (moved->children.get(Side::LEFT)) moved->children.get(Side::LEFT)->setParent(moved);
+      if (moved->children.get(Side::RIGHT)) moved->children.get(Side::RIGHT)->setParent(moved);
       moved->updateSubtreeDelta();
     }
 
-    detached->parent = nullptr;
+    detached->setParent(nullptr);
     detached->children.get(Side::LEFT) = nullptr;
     detached->children.get(Side::RIGHT) = nullptr;
   }
@@ -465,21 +859,18 @@ private:
     } else if (node == root) {
       // We are going to delete root and it only has one child,
       // so make that child the new root.
-      root = node->children.onlyChild();
+      setRoot(node->children.onlyChild());
       node->children.get(Side::LEFT) = nullptr;
       node->children.get(Side::RIGHT) = nullptr;
-      if (root != nullptr) {
-        root->color = NodeColor::BLACK;
-        root->parent = nullptr;
-      }
+      if (root != nullptr) root->setColor(NodeColor::BLACK);
       return;
     } else {
       // The node has at most one child.
       current = node;
     }
 
-    NodeColor savedColor = current->color;
-    Node* const parent = current->parent == node ? current : current->parent;
+    NodeColor savedColor = current->color();
+    Node* const parent = current->parent() == node ? current : current->parent();
 
     Side side = current->parentSide();
 
@@ -490,7 +881,7 @@ private:
     if (savedColor == NodeColor::RED) return;
     current = parent;
     if (Node::isRed(current->children.get(side))) {
-      current->children.get(side)->color = NodeColor::BLACK;
+      current->children.get(side)->setColor(NodeColor::BLACK);
     } else {
       while (true) {
         Node* sibling = current->children.get(other(side));
@@ -505,36 +896,43 @@ private:
           if (!Node::isRed(sibling->children.get(Side::LEFT)) &&
               !Node::isRed(sibling->children.get(Side::RIGHT))) {
             bool done = Node::isRed(current);
-            current->color = NodeColor::BLACK;
-            sibling->color = NodeColor::RED;
+            current->setColor(NodeColor::BLACK);
+            sibling->setColor(NodeColor::RED);
             if (done) break;
           } else {
-            savedColor = current->color;
+            savedColor = current->color();
 
             if (Node::isRed(sibling->children.get(other(side))))
               rotateSingle(current, side);
             else
               rotateDouble(current, side);
-            current = current->parent;
+            current = current->parent();
 
-            current->color = savedColor;
-            current->children.get(Side::LEFT)->color = NodeColor::BLACK;
-            current->children.get(Side::RIGHT)->color = NodeColor::BLACK;
+            current->setColor(savedColor);
+            current->children.get(Side::LEFT)->setColor(NodeColor::BLACK);
+            current->children.get(Side::RIGHT)->setColor(NodeColor::BLACK);
             break;
           }
         }
 
-        if (current->parent == nullptr) {
-          root = current;
+        if (current->parent() == nullptr) {
+          setRoot(current);
           break;
         } else {
           side = current->parentSide();
-          current = current->parent;
+          current = current->parent();
         }
       }
     }
   }
 
+  /** Makes node the root of the tree. */
+  void setRoot(Node* node) {
+    if (root != nullptr && root->treeIfRoot() == this) root->setParent(nullptr);
+    root = node;
+    if (root != nullptr) root->setTreeIfRoot(this);
+  }
+
   // The tree's root. It's null iff the tree is empty.
   Node* root = nullptr;
 
@@ -544,8 +942,17 @@ private:
   Delta rightmostExtremeDelta = zeroDelta;
 };
 
-template<typename Key, typename Delta, typename Value>
-class DRBTree<Key, Delta, Value>::Node {
+template<typename Key, typename Delta, typename Value, template<typename> class Allocator_>
+class DRBTree<Key, Delta, Value, Allocator_>::Node {
+  // The fields used to walk the tree (this link, children and deltas) come first and the value last, so that searches touch as few cache lines as possible.
+
+  /** The parent, or the tree if this node is a root, with the color in the lowest bit. Nodes and trees are aligned to at least 4 bytes, so their lowest two bits are free. */
+  uintptr_t link_ = 0;
+
+  static constexpr uintptr_t blackBit = 1;
+  static constexpr uintptr_t treeBit = 2;
+  static constexpr uintptr_t pointerMask = ~(blackBit | treeBit);
+
 public:
   Node() = default;
 
@@ -555,11 +962,10 @@ public:
   template<typename InitValue>
   explicit Node(const std::initializer_list<InitValue>& initValue) : value(initValue) {}
 
-  typedef DRBTree<Key, Delta, Value> Tree;
-
-  Value value{};
+  typedef DRBTree<Key, Delta, Value, Allocator_> Tree;
 
-  Tree* tree = nullptr;
+  /** The node's children object, which encapsulates accesses to the children nodes. */
+  Children children;
 
   /** The node's delta; can be set arbitrarily (but then the node's antecessors' subtree deltas must be updated). */
   Delta delta = zeroDelta;
@@ -567,20 +973,42 @@ public:
   /** The node's delta, plus the subtree deltas of its children (if any). */
   Delta subtreeDelta = zeroDelta;
 
-  /** The node's color; see a Red/Black tree explanation for the definition. */
-  NodeColor color = NodeColor::RED;
-
-  /** The node's children object, which encapsulates accesses to the children nodes. */
-  Children children;
+  Value value{};
 
   /** The node's parent; null if this is the tree's root or the node is detached from the tree. */
-  Node* parent = nullptr;
+  Node* parent() const { return (link_ & treeBit) != 0 ? nullptr : reinterpret_cast<Node*>(link_ & pointerMask); }
+
+  /** Makes the node a child of parent (without linking it from the parent), or detaches it if parent is null. Keeps the color. */
+  void setParent(Node* parent) {
+    static_assert(alignof(Node) > (blackBit | treeBit), "Nodes must leave the lowest bits of their addresses free.");
+    link_ = reinterpret_cast<uintptr_t>(parent) | (link_ & blackBit);
+  }
 
-  /** Whether this node is currently attached to the tree. */
-  bool isAttached() { return tree != nullptr; }
+  /** The tree this node is the root of; null if the node isn't the root of a tree. The rest of the nodes find their tree through the root, so that whole subtrees can be moved between trees without updating each node. */
+  Tree* treeIfRoot() const { return (link_ & treeBit) != 0 ? reinterpret_cast<Tree*>(link_ & pointerMask) : nullptr; }
+
+  /** Makes the node the root of tree, replacing its parent, or detaches it if tree is null. Keeps the color. */
+  void setTreeIfRoot(Tree* tree) {
+    static_assert(alignof(Tree) > (blackBit | treeBit), "Trees must leave the lowest bits of their addresses free.");
+    link_ = (tree != nullptr ? reinterpret_cast<uintptr_t>(tree) | treeBit : 0) | (link_ & blackBit);
+  }
+
+  /** The node's color; see a Red/Black tree explanation for the definition. */
+  NodeColor color() const { return (link_ & blackBit) != 0 ? NodeColor::BLACK : NodeColor::RED; }
+  void setColor(NodeColor color) { link_ = (link_ & ~blackBit) | (color == NodeColor::BLACK ? blackBit : 0); }
+
+  /** Whether this node is currently attached to a tree. */
+  bool isAttached() const { return (link_ & pointerMask) != 0; }
+
+  /** The tree this node is attached to, or null if it isn't attached. O(log N). */
+  Tree* tree() {
+    Node* node;
+    for (node = this; node->parent() != nullptr; node = node->parent());
+    return node->treeIfRoot();
+  }
 
   /** On which side of its parent this node is. Must not be called if the node has no parent. */
-  Side parentSide() { return parent->children.sideWithNode(this); }
+  Side parentSide() { return parent()->children.sideWithNode(this); }
 
   Delta nodePlusSubtreeDelta(Side side) { return delta + children.subtreeDelta(side); }
 
@@ -592,26 +1020,27 @@ public:
 
   /** Recompute subtreeDelta from the node's delta and the children's subtree deltas, for this node and all its ancestors, until an ancestor with an unchanged subtree delta is found. */
   void updateSubtreeDelta() {
-    for (Node* node = this; node != nullptr; node = node->parent) {
+    for (Node* node = this; node != nullptr; node = node->parent()) {
       const Delta newSubtreeDelta = node->delta + node->children.totalSubtreeDeltas();
       if (node->subtreeDelta == newSubtreeDelta) break;
       node->subtreeDelta = newSubtreeDelta;
     }
   }
 
-  /** Detach the node form the tree. */
+  /** Detach the node form the tree. Afterwards the node can be attached to any tree, or deleted. */
   void detach() {
     if (!isAttached()) throw Error("The node is not attached.");
-    tree->detach(this);
+    tree()->detach(this);
   }
 
   /** Returns this node's key. */
   Key key(Side side) {
     Delta key = children.subtreeDelta(side);
-    for (Node* node = this; node->parent != nullptr; node = node->parent) {
-      if (node->parentSide() != side) key += node->parent->nodePlusSubtreeDelta(side);
+    Node* node;
+    for (node = this; node->parent() != nullptr; node = node->parent()) {
+      if (node->parentSide() != side) key += node->parent()->nodePlusSubtreeDelta(side);
     }
-    return tree->extremeDelta(side) + key;
+    return node->treeIfRoot()->extremeDelta(side) + key;
   }
 
   /** Returns the descendant of this node at the given end of the key range. */
@@ -629,8 +1058,8 @@ public:
     if (child != nullptr) return child->descendantAtEnd(other(side));
     // Adjacent is among the ancestors.
     Node* node;
-    for (node = this; node->parent != nullptr && node->parentSide() == side; node = node->parent);
-    return node->parent;
+    for (node = this; node->parent() != nullptr && node->parentSide() == side; node = node->parent());
+    return node->parent();
   }
 
 #if 0
@@ -657,9 +1086,15 @@ Node = null): String = {
   override def toString = subtreeToString()
 #endif
 
-  static bool isRed(Node* node) { return node != nullptr && node->color == NodeColor::RED; }
+  static bool isRed(Node* node) { return node != nullptr && node->color() == NodeColor::RED; }
 };
 
+template<typename Key, typename Delta, typename Value, template<typename> class Allocator_>
+constexpr Key DRBTree<Key, Delta, Value, Allocator_>::zeroKey;
+
+template<typename Key, typename Delta, typename Value, template<typename> class Allocator_>
+constexpr Delta DRBTree<Key, Delta, Value, Allocator_>::zeroDelta;
+
 }  // namespace Util
 }  // namespace Med
 
@@ -0,0 +1,243 @@
+#include "DRBTree.h"
+#include "PoolAllocator.h"
+
+#include <malloc.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+namespace Med {
+namespace Util {
+namespace {
+
+/** Returns the resident set size of the process, in bytes. */
+long residentBytes() {
+  long pages = 0;
+  long residentPages = 0;
+  FILE* statm = std::fopen("/proc/self/statm", "r");
+  if (statm == nullptr) return 0;
+  if (std::fscanf(statm, "%ld %ld", &pages, &residentPages) != 2) residentPages = 0;
+  std::fclose(statm);
+  return residentPages * sysconf(_SC_PAGESIZE);
+}
+
+/** Same layout as a buffer line. Tagged so that every benchmark instantiation gets its own node pool, and its memory use can be measured separately. */
+template<int tag>
+struct Line {
+  std::vector<void*> points;
+  std::string content;
+};
+
+/** Loads lines the way Buffer does, one line at a time at the end of the tree, then walks them all.
+ *
+ * Reports the resident memory growth per line; only meaningful with a single iteration, which is why each benchmark only runs once.
+ */
+template<template<typename> class Allocator, int lineCount>
+void BM_LoadAndWalkLines(benchmark::State& state) {
+  typedef DRBTree<int, int, Line<lineCount>, Allocator> Tree;
+  const std::string content(40, 'x');
+  for (auto _ : state) {
+    malloc_trim(0);
+    const long residentBefore = residentBytes();
+    Tree tree;
+    DRBTreeDefs::OperationOptions options;
+    options.repeats = true;
+    for (int lineNumber = 1; lineNumber <= lineCount; ++lineNumber) {
+      typename Tree::Node* node = Tree::newNode();
+      node->value.content = content;
+      tree.attach(node, lineNumber, options);
+      node->setDelta(1);
+    }
+    std::size_t totalSize = 0;
+    for (typename Tree::Entry entry : tree) totalSize += entry.node->value.content.size();
+    benchmark::DoNotOptimize(totalSize);
+    state.counters["rssBytesPerLine"] = double(residentBytes() - residentBefore) / lineCount;
+
+    state.PauseTiming();
+    while (!tree.empty()) {
+      typename Tree::Node* node = tree.begin()->node;
+      node->detach();
+      Tree::deleteNode(node);
+    }
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * lineCount);
+}
+
+/** Like BM_LoadAndWalkLines, but building the tree from all lines at once as Buffer::open does. */
+template<template<typename> class Allocator, int lineCount>
+void BM_BuildAndWalkLines(benchmark::State& state) {
+  typedef DRBTree<int, int, Line<-lineCount>, Allocator> Tree;
+  const std::string content(40, 'x');
+  for (auto _ : state) {
+    malloc_trim(0);
+    const long residentBefore = residentBytes();
+    Tree tree;
+    std::vector<typename Tree::Node*> nodes;
+    for (int lineNumber = 1; lineNumber <= lineCount; ++lineNumber) {
+      typename Tree::Node* node = Tree::newNode();
+      node->value.content = content;
+      node->delta = 1;
+      nodes.push_back(node);
+    }
+    tree.buildFrom(nodes.begin(), nodes.end(), 1);
+    std::size_t totalSize = 0;
+    for (typename Tree::Entry entry : tree) totalSize += entry.node->value.content.size();
+    benchmark::DoNotOptimize(totalSize);
+    state.counters["rssBytesPerLine"] = double(residentBytes() - residentBefore) / lineCount;
+
+    state.PauseTiming();
+    while (!tree.empty()) {
+      typename Tree::Node* node = tree.begin()->node;
+      node->detach();
+      Tree::deleteNode(node);
+    }
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * lineCount);
+}
+
+/** A tree with one node per line of a large file, shared by the iteration benchmarks. */
+typedef DRBTree<int, int, int, PoolAllocator> LineNumberTree;
+constexpr int iteratedLineCount = 10000000;
+
+LineNumberTree& iteratedTree() {
+  static LineNumberTree* tree = [] {
+    std::vector<LineNumberTree::Node*> nodes;
+    nodes.reserve(iteratedLineCount);
+    for (int lineNumber = 1; lineNumber <= iteratedLineCount; ++lineNumber) {
+      nodes.push_back(LineNumberTree::newNode(lineNumber));
+      nodes.back()->delta = 1;
+    }
+    LineNumberTree* tree = new LineNumberTree();
+    tree->buildFrom(nodes.begin(), nodes.end(), 1);
+    return tree;
+  }();
+  return *tree;
+}
+
+/** Iterates with Node::adjacent(), which climbs through parents. */
+void BM_IterateLinesWithAdjacent(benchmark::State& state) {
+  LineNumberTree& tree = iteratedTree();
+  for (auto _ : state) {
+    long sum = 0;
+    for (LineNumberTree::Node* node = tree.begin()->node; node != nullptr; node = node->adjacent(DRBTreeDefs::Side::RIGHT)) sum += node->value;
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * iteratedLineCount);
+}
+BENCHMARK(BM_IterateLinesWithAdjacent)->Unit(benchmark::kMillisecond);
+
+/** Iterates with Cursor, which keeps the pending ancestors in a stack. */
+void BM_IterateLinesWithCursor(benchmark::State& state) {
+  LineNumberTree& tree = iteratedTree();
+  for (auto _ : state) {
+    long sum = 0;
+    for (LineNumberTree::Cursor cursor(tree.begin()->node); cursor.isValid(); cursor.advance()) sum += cursor.node()->value;
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * iteratedLineCount);
+}
+BENCHMARK(BM_IterateLinesWithCursor)->Unit(benchmark::kMillisecond);
+
+/** Moves a line at a time through the middle of the tree with a search from the root, as setting line numbers did when scrolling. */
+void BM_StepLinesFromRoot(benchmark::State& state) {
+  LineNumberTree& tree = iteratedTree();
+  int lineNumber = iteratedLineCount / 2;
+  for (auto _ : state) {
+    lineNumber = lineNumber < iteratedLineCount / 2 + 1000 ? lineNumber + 1 : iteratedLineCount / 2;
+    benchmark::DoNotOptimize(tree.get(lineNumber, {})->node);
+  }
+}
+BENCHMARK(BM_StepLinesFromRoot);
+
+/** Like BM_StepLinesFromRoot, but searching relative to the previous line. */
+void BM_StepLinesWithGetNear(benchmark::State& state) {
+  LineNumberTree& tree = iteratedTree();
+  LineNumberTree::Node* const start = tree.get(iteratedLineCount / 2, {})->node;
+  LineNumberTree::Node* node = start;
+  int steps = 0;
+  for (auto _ : state) {
+    if (++steps > 1000) {
+      node = start;
+      steps = 0;
+    }
+    node = tree.getNear({0, node}, 1, {})->node;
+    benchmark::DoNotOptimize(node);
+  }
+}
+BENCHMARK(BM_StepLinesWithGetNear);
+
+/** A tree with one node per line, of the size given by the benchmark's argument, and its nodes in key order. The tree is deleted with the fixture. */
+class SizedTree {
+public:
+  explicit SizedTree(int lineCount) : random_(1234) {
+    nodes_.reserve(lineCount);
+    for (int lineNumber = 1; lineNumber <= lineCount; ++lineNumber) {
+      nodes_.push_back(LineNumberTree::newNode(lineNumber));
+      nodes_.back()->delta = 1;
+    }
+    tree_.buildFrom(nodes_.begin(), nodes_.end(), 1);
+    // Precomputed, so that the random number generator isn't measured.
+    for (int& index : randomIndexes_) index = std::uniform_int_distribution<int>(0, lineCount - 1)(random_);
+  }
+  ~SizedTree() { tree_.clear(); }
+
+  LineNumberTree& tree() { return tree_; }
+  LineNumberTree::Node* node(int index) { return nodes_[index]; }
+  /** Random indexes of nodes, the same for every run, cycling through a table that is small enough to stay in the cache. */
+  int randomIndex() { return randomIndexes_[next_++ % randomIndexCount]; }
+
+private:
+  static constexpr int randomIndexCount = 4096;
+  std::mt19937 random_;
+  LineNumberTree tree_;
+  std::vector<LineNumberTree::Node*> nodes_;
+  int randomIndexes_[randomIndexCount];
+  unsigned next_ = 0;
+};
+
+/** Detaches a random node and attaches it back at the same key, as deleting and inserting a line do. */
+void BM_DetachAndAttach(benchmark::State& state) {
+  SizedTree sized(state.range(0));
+  DRBTreeDefs::OperationOptions options;
+  options.repeats = true;
+  for (auto _ : state) {
+    const int index = sized.randomIndex();
+    LineNumberTree::Node* const node = sized.node(index);
+    node->detach();
+    // The node's predecessor took its delta; attaching it at its old key splits it again.
+    sized.tree().attach(node, index + 1, options);
+  }
+}
+BENCHMARK(BM_DetachAndAttach)->RangeMultiplier(10)->Range(1000, 10000000);
+
+/** Searches for a random key from the root. */
+void BM_Get(benchmark::State& state) {
+  SizedTree sized(state.range(0));
+  for (auto _ : state) benchmark::DoNotOptimize(sized.tree().get(sized.randomIndex() + 1, {})->node);
+}
+BENCHMARK(BM_Get)->RangeMultiplier(10)->Range(1000, 10000000);
+
+/** Computes the key of a random node, climbing to the root. */
+void BM_Key(benchmark::State& state) {
+  SizedTree sized(state.range(0));
+  for (auto _ : state) benchmark::DoNotOptimize(sized.node(sized.randomIndex())->key(DRBTreeDefs::Side::LEFT));
+}
+BENCHMARK(BM_Key)->RangeMultiplier(10)->Range(1000, 10000000);
+
+BENCHMARK_TEMPLATE(BM_LoadAndWalkLines, DRBTreeDefs::HeapAllocator, 1000000)->Iterations(1)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_LoadAndWalkLines, PoolAllocator, 1000000)->Iterations(1)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_LoadAndWalkLines, DRBTreeDefs::HeapAllocator, 5000000)->Iterations(1)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_LoadAndWalkLines, PoolAllocator, 5000000)->Iterations(1)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_BuildAndWalkLines, PoolAllocator, 1000000)->Iterations(1)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_BuildAndWalkLines, PoolAllocator, 5000000)->Iterations(1)->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace Util
+}  // namespace Med
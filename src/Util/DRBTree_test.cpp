@@ -1,4 +1,5 @@
 #include "DRBTree.h"
+#include "PoolAllocator.h"
 
 #include <list>
 #include <memory>
@@ -19,7 +20,9 @@ protected:
       /** Checks the tree structure. */
       void checkTreeStructure(const typename Tree::Node* node) {
         for (const typename Tree::Node* child : node->children) {
-          EXPECT_EQ(node, child->parent);
+          EXPECT_EQ(node, child->parent());
+          // Only the root points to the tree.
+          EXPECT_EQ(nullptr, child->treeIfRoot());
           checkTreeStructure(child);
         }
       }
@@ -27,8 +30,8 @@ protected:
       /** Checks that the children of all red descendants of this node are black. */
       void checkChildrenColor(const typename Tree::Node* node) {
         for (const typename Tree::Node* child : node->children) {
-          if (node->color == DRBTreeDefs::NodeColor::RED)
-            EXPECT_EQ(DRBTreeDefs::NodeColor::BLACK, child->color);
+          if (node->color() == DRBTreeDefs::NodeColor::RED)
+            EXPECT_EQ(DRBTreeDefs::NodeColor::BLACK, child->color());
           checkChildrenColor(child);
         }
       }
@@ -41,7 +44,7 @@ protected:
           childrenBlacksToLeaf.insert(checkBlacksToLeaf(node->children.get(side)));
         EXPECT_EQ(1, childrenBlacksToLeaf.size());
         if (childrenBlacksToLeaf.empty()) return 0;
-        return *childrenBlacksToLeaf.begin() + (node->color == DRBTreeDefs::NodeColor::BLACK ? 1 : 0);
+        return *childrenBlacksToLeaf.begin() + (node->color() == DRBTreeDefs::NodeColor::BLACK ? 1 : 0);
       }
 
       /** Checks that the subtree deltas of this node and all its descendants are correct. */
@@ -58,7 +61,9 @@ protected:
     InvariantChecker checker;
     if (tree.root != nullptr) {
       // The root must be black.
-      EXPECT_EQ(DRBTreeDefs::NodeColor::BLACK, tree.root->color);
+      EXPECT_EQ(DRBTreeDefs::NodeColor::BLACK, tree.root->color());
+      EXPECT_EQ(nullptr, tree.root->parent());
+      EXPECT_EQ(&tree, tree.root->treeIfRoot());
       checker.checkTreeStructure(tree.root);
       checker.checkChildrenColor(tree.root);
       checker.checkBlacksToLeaf(tree.root);
@@ -66,17 +71,19 @@ protected:
     }
   }
 
-  template<typename Keys>
+  template<typename Key>
+  struct Value {
+    Key keyAtInsertion;
+  };
+
+  template<typename Keys, template<typename> class Allocator = DRBTreeDefs::HeapAllocator>
   void buildAndTestTree(const Keys& keys) {
     typedef typename Keys::value_type Key;
-    struct Value {
-      Key keyAtInsertion;
-    };
-    typedef DRBTree<Key, Key, std::unique_ptr<Value>> Tree;
+    typedef DRBTree<Key, Key, std::unique_ptr<Value<Key>>, Allocator> Tree;
     Tree tree;
     std::set<Key> insertedKeys;
     for (const Key& key : keys) {
-      typename Tree::Node* node = new typename Tree::Node(new Value{key});
+      typename Tree::Node* node = Tree::newNode(new Value<Key>{key});
       tree.attach(node, key, {});
       insertedKeys.insert(key);
       checkInvariants(tree);
@@ -97,11 +104,43 @@ protected:
       EXPECT_EQ(it->key, key);
       EXPECT_EQ(it->node->value->keyAtInsertion, key);
       it->node->detach();
-      delete it->node;
+      Tree::deleteNode(it->node);
       checkInvariants(tree);
     }
   }
 
+  /** Checks that the tree has exactly the given nodes, in order, with keys firstKey, firstKey + 2... */
+  template<typename Tree>
+  void checkNodes(Tree& tree, const std::vector<typename Tree::Node*>& nodes, int firstKey) {
+    checkInvariants(tree);
+    int index = 0;
+    for (typename Tree::Entry entry : tree) {
+      ASSERT_LT(index, nodes.size());
+      EXPECT_EQ(nodes[index], entry.node);
+      EXPECT_EQ(firstKey + 2 * index, entry.key);
+      EXPECT_EQ(entry.key, entry.node->key(DRBTreeDefs::Side::LEFT));
+      EXPECT_EQ(&tree, entry.node->tree());
+      ++index;
+    }
+    EXPECT_EQ(nodes.size(), index);
+  }
+
+  /** Attaches nodeCount new nodes with keys firstKey, firstKey + 2... one by one in the given order, so that trees of the same size get different shapes. */
+  template<typename Tree>
+  std::vector<typename Tree::Node*> attachNodes(Tree* tree, int nodeCount, int firstKey, bool backwards) {
+    std::vector<typename Tree::Node*> nodes;
+    for (int index = 0; index < nodeCount; ++index) nodes.push_back(Tree::newNode(index));
+    for (int step = 0; step < nodeCount; ++step) {
+      const int index = backwards ? nodeCount - 1 - step : step;
+      tree->attach(nodes[index], firstKey + 2 * index, {});
+    }
+    for (typename Tree::Node* node : nodes) {
+      if (node != nodes.back()) node->setDelta(2);
+    }
+    if (!nodes.empty()) nodes.back()->setDelta(1);
+    return nodes;
+  }
+
   template<typename Type>
   void buildAndTestTreeWithKeys(const std::initializer_list<Type>& keys) {
     buildAndTestTree<std::initializer_list<Type>>(keys);
@@ -135,5 +174,291 @@ TEST_F(DRBTreeTest, Permutations) {
   } while (std::next_permutation(keys.begin(), keys.end()));
 }
 
+TEST_F(DRBTreeTest, PermutationsWithPoolAllocator) {
+  std::vector<int> keys = {10, 12, 34, 45, 51, 73, 95};
+  do {
+    buildAndTestTree<std::vector<int>, PoolAllocator>(keys);
+  } while (std::next_permutation(keys.begin(), keys.end()));
+  typedef DRBTree<int, int, std::unique_ptr<Value<int>>, PoolAllocator> Tree;
+  EXPECT_EQ(0, Tree::Allocator::liveCount());
+}
+
+TEST_F(DRBTreeTest, BuildFrom) {
+  typedef DRBTree<int, int, int> Tree;
+  for (int nodeCount = 0; nodeCount <= 70; ++nodeCount) {
+    std::vector<Tree::Node*> nodes;
+    // Keys 5, 7, 9...
+    for (int index = 0; index < nodeCount; ++index) {
+      nodes.push_back(Tree::newNode(index));
+      nodes.back()->delta = 2;
+    }
+    Tree tree;
+    tree.buildFrom(nodes.begin(), nodes.end(), 5);
+    checkInvariants(tree);
+    EXPECT_EQ(nodeCount == 0 ? 0 : 5 + 2 * nodeCount, tree.totalDelta());
+    int index = 0;
+    for (Tree::Entry entry : tree) {
+      EXPECT_EQ(nodes[index], entry.node);
+      EXPECT_EQ(5 + 2 * index, entry.key);
+      EXPECT_EQ(entry.key, entry.node->key(DRBTreeDefs::Side::LEFT));
+      EXPECT_EQ(entry.node, tree.get(entry.key, {})->node);
+      ++index;
+    }
+    EXPECT_EQ(nodeCount, index);
+    // The tree is still a valid tree after attaching and detaching.
+    Tree::Node* attached = Tree::newNode(-1);
+    tree.attach(attached, 6, {});
+    checkInvariants(tree);
+    nodes.push_back(attached);
+    EXPECT_THROW(tree.buildFrom(nodes.begin(), nodes.end()), DRBTreeDefs::Error);
+    for (Tree::Node* node : nodes) {
+      node->detach();
+      Tree::deleteNode(node);
+      checkInvariants(tree);
+    }
+  }
+}
+
+TEST_F(DRBTreeTest, SplitAndJoin) {
+  typedef DRBTree<int, int, int> Tree;
+  for (int nodeCount = 0; nodeCount <= 40; ++nodeCount) {
+    for (bool backwards : {false, true}) {
+      // Split at every key, plus keys between nodes and outside the tree.
+      for (int splitKey = 3; splitKey <= 5 + 2 * nodeCount + 1; ++splitKey) {
+        Tree tree;
+        const std::vector<Tree::Node*> nodes = attachNodes(&tree, nodeCount, 5, backwards);
+        const int totalDelta = tree.totalDelta();
+        Tree right;
+        tree.split(splitKey, &right);
+        const int leftCount = std::max(0, std::min(nodeCount, (splitKey - 5 + 1) / 2));
+        const std::vector<Tree::Node*> leftNodes(nodes.begin(), nodes.begin() + leftCount);
+        const std::vector<Tree::Node*> rightNodes(nodes.begin() + leftCount, nodes.end());
+        checkNodes(tree, leftNodes, 5);
+        checkNodes(right, rightNodes, 5 + 2 * leftCount);
+        if (!rightNodes.empty()) EXPECT_EQ(totalDelta, right.totalDelta());
+        if (!leftNodes.empty() && !rightNodes.empty()) EXPECT_EQ(5 + 2 * leftCount, tree.totalDelta());
+
+        tree.join(&right);
+        EXPECT_TRUE(right.empty());
+        checkNodes(tree, nodes, 5);
+        if (!nodes.empty()) EXPECT_EQ(totalDelta, tree.totalDelta());
+        for (Tree::Node* node : nodes) {
+          node->detach();
+          Tree::deleteNode(node);
+        }
+      }
+    }
+  }
+  Tree tree;
+  Tree right;
+  const std::vector<Tree::Node*> nodes = attachNodes(&tree, 2, 0, false);
+  const std::vector<Tree::Node*> rightNodes = attachNodes(&right, 1, 0, false);
+  EXPECT_THROW(tree.split(0, &right), DRBTreeDefs::Error);
+  for (Tree::Node* node : {nodes[0], nodes[1], rightNodes[0]}) {
+    node->detach();
+    Tree::deleteNode(node);
+  }
+}
+
+TEST_F(DRBTreeTest, JoinTreesOfDifferentSizes) {
+  typedef DRBTree<int, int, int> Tree;
+  for (int leftCount = 0; leftCount <= 33; ++leftCount) {
+    for (int rightCount = 0; rightCount <= 33; ++rightCount) {
+      Tree tree;
+      std::vector<Tree::Node*> nodes = attachNodes(&tree, leftCount, 5, leftCount % 2 == 0);
+      if (!nodes.empty()) nodes.back()->setDelta(2);
+      Tree right;
+      const std::vector<Tree::Node*> rightNodes = attachNodes(&right, rightCount, 100, rightCount % 3 == 0);
+      nodes.insert(nodes.end(), rightNodes.begin(), rightNodes.end());
+      tree.join(&right);
+      EXPECT_TRUE(right.empty());
+      checkNodes(tree, nodes, leftCount == 0 ? 100 : 5);
+      for (Tree::Node* node : nodes) {
+        node->detach();
+        Tree::deleteNode(node);
+        checkInvariants(tree);
+      }
+    }
+  }
+}
+
+TEST_F(DRBTreeTest, Clear) {
+  typedef DRBTree<int, int, std::unique_ptr<Value<int>>, PoolAllocator> Tree;
+  for (int nodeCount = 0; nodeCount <= 20; ++nodeCount) {
+    Tree tree;
+    for (int index = 0; index < nodeCount; ++index) tree.attach(Tree::newNode(new Value<int>{index}), index, {});
+    EXPECT_EQ(nodeCount, Tree::Allocator::liveCount());
+    tree.clear();
+    EXPECT_TRUE(tree.empty());
+    EXPECT_EQ(0, Tree::Allocator::liveCount());
+  }
+}
+
+TEST_F(DRBTreeTest, Cursor) {
+  typedef DRBTree<int, int, int> Tree;
+  for (int nodeCount = 0; nodeCount <= 40; ++nodeCount) {
+    Tree tree;
+    const std::vector<Tree::Node*> nodes = attachNodes(&tree, nodeCount, 0, nodeCount % 2 == 0);
+    // Starting from every node, the cursor visits the rest in order.
+    for (int start = 0; start <= nodeCount; ++start) {
+      Tree::Cursor cursor(start < nodeCount ? nodes[start] : nullptr);
+      for (int index = start; index < nodeCount; ++index) {
+        ASSERT_TRUE(cursor.isValid());
+        EXPECT_EQ(nodes[index], cursor.node());
+        // Copies continue from the same place.
+        Tree::Cursor copy = cursor;
+        cursor.advance();
+        copy.advance();
+        EXPECT_EQ(cursor, copy);
+      }
+      EXPECT_FALSE(cursor.isValid());
+      EXPECT_EQ(Tree::Cursor(), cursor);
+    }
+    for (Tree::Node* node : nodes) {
+      node->detach();
+      Tree::deleteNode(node);
+    }
+  }
+}
+
+TEST_F(DRBTreeTest, GetNearAndKeyRelativeTo) {
+  typedef DRBTree<int, int, int> Tree;
+  for (int nodeCount = 1; nodeCount <= 33; ++nodeCount) {
+    Tree tree;
+    // Keys 10, 12, 14...
+    const std::vector<Tree::Node*> nodes = attachNodes(&tree, nodeCount, 10, nodeCount % 2 == 0);
+    for (int nearIndex = 0; nearIndex < nodeCount; ++nearIndex) {
+      Tree::Node* const near = nodes[nearIndex];
+      const int nearKey = 10 + 2 * nearIndex;
+      for (Tree::Node* other : nodes) {
+        EXPECT_EQ(other->key(DRBTreeDefs::Side::LEFT) - nearKey, Tree::keyRelativeTo(near, other));
+      }
+      // Keys of nodes, keys between nodes and keys outside the tree.
+      for (int key = 7; key <= 10 + 2 * nodeCount + 2; ++key) {
+        for (DRBTreeDefs::Side side : {DRBTreeDefs::Side::LEFT, DRBTreeDefs::Side::RIGHT}) {
+          DRBTreeDefs::OperationOptions options;
+          options.equalOrAdjacent = key % 2 == 1;
+          options.equalOrAdjacentSide = side;
+          const Tree::Iterator expected = tree.get(key, options);
+          const Tree::Iterator found = tree.getNear({nearKey, near}, key, options);
+          EXPECT_EQ(expected->node, found->node) << nodeCount << " " << nearIndex << " " << key;
+          if (expected.isValid()) EXPECT_EQ(expected->key, found->key);
+          // Searching relative to the node.
+          const Tree::Iterator relative = tree.getNear({0, near}, key - nearKey, options);
+          EXPECT_EQ(expected->node, relative->node);
+          if (expected.isValid()) EXPECT_EQ(expected->key - nearKey, relative->key);
+        }
+      }
+    }
+    for (Tree::Node* node : nodes) {
+      node->detach();
+      Tree::deleteNode(node);
+    }
+  }
+}
+
+TEST_F(DRBTreeTest, ShiftKeysFrom) {
+  typedef DRBTree<int, int, int> Tree;
+  for (int nodeCount = 1; nodeCount <= 17; ++nodeCount) {
+    for (int shifted = 0; shifted < nodeCount; ++shifted) {
+      Tree tree;
+      // Keys 10, 12, 14...
+      const std::vector<Tree::Node*> nodes = attachNodes(&tree, nodeCount, 10, shifted % 2 == 0);
+      tree.shiftKeysFrom(nodes[shifted], 5);
+      checkInvariants(tree);
+      int index = 0;
+      for (Tree::Entry entry : tree) {
+        EXPECT_EQ(nodes[index], entry.node);
+        EXPECT_EQ(10 + 2 * index + (index >= shifted ? 5 : 0), entry.key);
+        EXPECT_EQ(entry.key, entry.node->key(DRBTreeDefs::Side::LEFT));
+        ++index;
+      }
+      // Shifting back down to the key of the previous node, which then repeats.
+      tree.shiftKeysFrom(nodes[shifted], -7);
+      EXPECT_EQ(10 + 2 * shifted - 2, nodes[shifted]->key(DRBTreeDefs::Side::LEFT));
+      if (shifted + 1 < nodeCount) EXPECT_EQ(10 + 2 * shifted, nodes[shifted + 1]->key(DRBTreeDefs::Side::LEFT));
+      tree.clear();
+    }
+  }
+}
+
+TEST_F(DRBTreeTest, AttachAfterLastNodeWithDelta) {
+  typedef DRBTree<int, int, int> Tree;
+  for (int nodeCount = 1; nodeCount <= 9; ++nodeCount) {
+    Tree tree;
+    // Keys 10, 12, 14..., and the last node has a delta of 1.
+    std::vector<Tree::Node*> nodes = attachNodes(&tree, nodeCount, 10, false);
+    const int lastKey = 10 + 2 * (nodeCount - 1);
+    nodes.push_back(Tree::newNode(nodeCount));
+    tree.attach(nodes.back(), lastKey + 5, {});
+    checkInvariants(tree);
+    EXPECT_EQ(lastKey, nodes[nodeCount - 1]->key(DRBTreeDefs::Side::LEFT));
+    EXPECT_EQ(lastKey + 5, nodes.back()->key(DRBTreeDefs::Side::LEFT));
+    // Detaching the last node leaves its gap in the delta of the one before, and attaching it again past that must still give it the requested key.
+    nodes.back()->detach();
+    tree.attach(nodes.back(), lastKey + 7, {});
+    checkInvariants(tree);
+    EXPECT_EQ(lastKey, nodes[nodeCount - 1]->key(DRBTreeDefs::Side::LEFT));
+    EXPECT_EQ(lastKey + 7, nodes.back()->key(DRBTreeDefs::Side::LEFT));
+    tree.clear();
+  }
+}
+
+TEST_F(DRBTreeTest, PoolAllocatorRecyclesDeletedNodes) {
+  typedef DRBTree<int, int, int, PoolAllocator> Tree;
+  Tree tree;
+  Tree::Node* first = Tree::newNode(1);
+  Tree::Node* second = Tree::newNode(2);
+  EXPECT_EQ(2, Tree::Allocator::liveCount());
+  EXPECT_LT(0, Tree::Allocator::reservedBytes());
+  tree.attach(first, 1, {});
+  tree.attach(second, 2, {});
+  EXPECT_THROW(Tree::deleteNode(second), DRBTreeDefs::Error);
+  second->detach();
+  EXPECT_FALSE(second->isAttached());
+  Tree::deleteNode(second);
+  EXPECT_EQ(1, Tree::Allocator::liveCount());
+  // The most recently deleted node is the first one reused.
+  Tree::Node* third = Tree::newNode(3);
+  EXPECT_EQ(second, third);
+  EXPECT_EQ(3, third->value);
+  // A detached node can be attached to another tree.
+  first->detach();
+  Tree otherTree;
+  otherTree.attach(first, 5, {});
+  EXPECT_EQ(5, first->key(DRBTreeDefs::Side::LEFT));
+  first->detach();
+  Tree::deleteNode(first);
+  Tree::deleteNode(third);
+  EXPECT_EQ(0, Tree::Allocator::liveCount());
+}
+
+TEST_F(DRBTreeTest, CompactNodes) {
+  typedef DRBTree<long, long, void*> Tree;
+  // The parent, color and tree share a pointer.
+  EXPECT_EQ(3 * sizeof(void*) + 2 * sizeof(long) + sizeof(void*), sizeof(Tree::Node));
+  Tree tree;
+  Tree::Node* nodes[3];
+  for (long index = 0; index < 3; ++index) nodes[index] = tree.attach(Tree::newNode(nullptr), index, {})->node;
+  checkInvariants(tree);
+  for (Tree::Node* node : nodes) {
+    EXPECT_EQ(&tree, node->tree());
+    EXPECT_EQ(node->parent() == nullptr, node->treeIfRoot() == &tree);
+  }
+  Tree otherTree;
+  tree.split(1L, &otherTree);
+  checkInvariants(tree);
+  checkInvariants(otherTree);
+  EXPECT_EQ(&tree, nodes[0]->tree());
+  EXPECT_EQ(&otherTree, nodes[2]->tree());
+  for (Tree::Node* node : nodes) {
+    node->detach();
+    EXPECT_FALSE(node->isAttached());
+    EXPECT_EQ(nullptr, node->parent());
+    EXPECT_EQ(nullptr, node->treeIfRoot());
+    Tree::deleteNode(node);
+  }
+}
+
 }  // namespace Util
 }  // namespace Med
@@ -1,48 +1,60 @@
 #ifndef MED_UTIL_ITERATORHELPER_H
 #define MED_UTIL_ITERATORHELPER_H
 
-#include <memory>
 #include <stdexcept>
+#include <utility>
 
 namespace Med {
 namespace Util {
-  
-template<typename Result_>
+
+// Turns a cursor into an input iterator, to be used in range-based for loops.
+// Cursor must provide isValid(), which returns false once finished, advance() and ==. Projection must be a function object taking the cursor and returning the item it points to.
+// The cursor is stored in the iterator and everything is resolved at compile time, so iteration doesn't allocate or make virtual calls.
+template<typename Cursor_, typename Projection_>
 class IteratorHelper {
 public:
-  typedef Result_ Result;
-
-  class Impl {
-  public:
-    // Returns the item pointed to by the iterator.
-    virtual Result get() const = 0;
-    // Advances the iterator to the next item. Returns false if the advance couldn't be completed because there are no more items.
-    virtual bool advance() = 0;
-  };
-  
+  typedef Cursor_ Cursor;
+  typedef Projection_ Projection;
+  typedef decltype(std::declval<Projection>()(std::declval<const Cursor&>())) Result;
+
   // Constructs a finished iterator.
   IteratorHelper() {}
-  
-  // Constructs an iterator with the given implementation. impl may be nullptr; in that case a finished iterator is constructed. If impl != nullptr, it must return at least one item.
-  IteratorHelper(std::unique_ptr<Impl>&& impl) : impl(std::move(impl)) {}
-  
-  bool operator==(const IteratorHelper& other) const { return impl == other.impl; }
+
+  // Constructs an iterator with the given cursor, which may be finished already.
+  explicit IteratorHelper(const Cursor& cursor, Projection projection = Projection()) : cursor(cursor), projection(projection) {}
+
+  bool operator==(const IteratorHelper& other) const { return cursor == other.cursor; }
   bool operator!=(const IteratorHelper& other) const { return !operator==(other); }
 
   Result operator*() const {
-    if (impl == nullptr) throw std::logic_error("Dereferencing finished iterator!");
-    return impl->get();
+    if (!cursor.isValid()) throw std::logic_error("Dereferencing finished iterator!");
+    return projection(cursor);
   }
-  Result* operator->() const { return &operator*(); }
 
   void operator++() {
-    if (impl == nullptr) throw std::logic_error("Advancing finished iterator!");
-    if (!impl->advance()) impl.reset();
+    if (!cursor.isValid()) throw std::logic_error("Advancing finished iterator!");
+    cursor.advance();
   }
-  
+
+private:
+  Cursor cursor;
+  Projection projection;
+};
+
+// A range of the items visited by a cursor, from its current position to the end.
+template<typename Cursor, typename Projection>
+class RangeHelper {
+public:
+  typedef IteratorHelper<Cursor, Projection> Iterator;
+
+  explicit RangeHelper(const Cursor& cursor, Projection projection = Projection()) : cursor(cursor), projection(projection) {}
+
+  Iterator begin() const { return Iterator(cursor, projection); }
+  Iterator end() const { return Iterator(); }
+
 private:
-  // Released when advance() returns false. impl == nullptr means a finished iterator.
-  std::unique_ptr<Impl> impl;
+  Cursor cursor;
+  Projection projection;
 };
 
 }  // namespace Util
@@ -0,0 +1 @@
+#include "PersistentSequence.h"
@@ -0,0 +1,560 @@
+#ifndef MED_UTIL_PERSISTENTSEQUENCE_H
+#define MED_UTIL_PERSISTENTSEQUENCE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+
+#include "DRBTree.h"
+
+namespace Med {
+namespace Util {
+
+/** A sequence of values with keys computed from deltas, as in DRBTree, whose copies share their structure.
+ *
+ * Copying a sequence is O(1): both copies share all their nodes, which are reference counted. A change to one of them copies the nodes it would modify that are shared with another copy (the O(log N) path from the root to the changed element), so other copies never see it. Nodes that aren't shared are modified in place, so a sequence that is never copied doesn't allocate more than needed.
+ *
+ * Different copies can be used from different threads at the same time; a single copy can't be changed while it's being used by another thread. Nodes are allocated on the heap, as they may be freed by any thread.
+ *
+ * Elements are kept in chunks of up to chunkCapacity, which are the nodes of a treap (a binary tree that stays balanced with random priorities). Search, insertion, deletion, split and join are O(log N) on average.
+ *
+ * Keys must be strictly increasing, that is, each delta must be bigger than zero in the order used by the keys.
+ */
+template<typename Delta_, typename Value_, int chunkCapacity = 32>
+class PersistentSequence {
+public:
+  typedef Delta_ Delta;
+  typedef Delta_ Key;
+  typedef Value_ Value;
+
+  static constexpr Delta zeroDelta{};
+
+  static_assert(chunkCapacity >= 2, "Chunks must hold at least two elements.");
+
+private:
+  struct Node;
+
+public:
+  typedef DRBTreeDefs::Error Error;
+
+  /** Bound on the depth of the treap. Random treaps are very unlikely to be deeper than a few times the logarithm of their size. */
+  static constexpr int maxHeight = 2 * 8 * sizeof(void*);
+
+  /** An empty sequence whose first element will have the key firstKey. */
+  explicit PersistentSequence(const Key& firstKey = zeroDelta) : firstKey_(firstKey) {}
+
+  PersistentSequence(const PersistentSequence& other) : root_(retain(other.root_)), firstKey_(other.firstKey_) {}
+  PersistentSequence(PersistentSequence&& other) : root_(other.root_), firstKey_(other.firstKey_) { other.root_ = nullptr; }
+  PersistentSequence& operator=(PersistentSequence other) {
+    std::swap(root_, other.root_);
+    std::swap(firstKey_, other.firstKey_);
+    return *this;
+  }
+  ~PersistentSequence() { release(root_); }
+
+  bool empty() const { return root_ == nullptr; }
+
+  /** The key after the last element, or firstKey if the sequence is empty. */
+  Key endKey() const { return firstKey_ + subtreeDelta(root_); }
+
+  /** Changes the keys of all the elements so that the first one is firstKey. Their deltas stay the same. O(1). */
+  void setFirstKey(const Key& firstKey) { firstKey_ = firstKey; }
+
+  /** The memory taken by the nodes of the sequence, including those shared with copies, but not what the values own. O(N / chunkCapacity). */
+  std::size_t nodeBytes() const { return nodeCount(root_) * sizeof(Node); }
+
+  /** Visits elements in key order. Any change to the sequence it was obtained from invalidates it, but not a change to another copy. */
+  class Cursor {
+  public:
+    /** A cursor that has finished. */
+    Cursor() {}
+
+    Cursor(const Cursor& other) { *this = other; }
+    // Only the used part of the stack is copied.
+    Cursor& operator=(const Cursor& other) {
+      node_ = other.node_;
+      index_ = other.index_;
+      key_ = other.key_;
+      depth_ = other.depth_;
+      std::copy(other.pending_, other.pending_ + other.depth_, pending_);
+      return *this;
+    }
+
+    bool isValid() const { return node_ != nullptr; }
+    const Value& value() const { return node_->values[index_]; }
+    const Delta& delta() const { return node_->deltas[index_]; }
+    const Key& key() const { return key_; }
+
+    bool operator==(const Cursor& other) const { return node_ == other.node_ && index_ == other.index_; }
+    bool operator!=(const Cursor& other) const { return !operator==(other); }
+
+    /** Moves to the next element, or finishes the cursor if there are no more elements. Amortized O(1). */
+    void advance() {
+      key_ += node_->deltas[index_];
+      if (++index_ < node_->count) return;
+      index_ = 0;
+      const Node* next = node_->children[1];
+      if (next == nullptr) {
+        node_ = depth_ > 0 ? pending_[--depth_] : nullptr;
+        return;
+      }
+      for (const Node* left; (left = next->children[0]) != nullptr; next = left) push(next);
+      node_ = next;
+    }
+
+  private:
+    friend class PersistentSequence;
+
+    void push(const Node* node) {
+      if (depth_ == maxHeight) throw Error("Sequence too deep.");
+      pending_[depth_++] = node;
+    }
+
+    const Node* node_ = nullptr;
+    int index_ = 0;
+    Key key_ = zeroDelta;
+    // The ancestors after the current node, the nearest last.
+    int depth_ = 0;
+    const Node* pending_[maxHeight];
+  };
+
+  Cursor begin() const {
+    Cursor cursor;
+    cursor.key_ = firstKey_;
+    if (root_ == nullptr) return cursor;
+    const Node* node = root_;
+    for (; node->children[0] != nullptr; node = node->children[0]) cursor.push(node);
+    cursor.node_ = node;
+    return cursor;
+  }
+
+  /** Returns a cursor at the last element whose key isn't bigger than key, or a finished cursor if there is none. O(log N).
+   *
+   * As in DRBTree::get(), key only needs to be comparable to a Key.
+   */
+  template<typename SearchKey>
+  Cursor find(const SearchKey& key) const {
+    Cursor cursor;
+    Cursor found;
+    Key keyAtSubtree = firstKey_;
+    for (const Node* node = root_; node != nullptr;) {
+      const Key keyAtChunk = keyAtSubtree + subtreeDelta(node->children[0]);
+      if (key < keyAtChunk) {
+        cursor.push(node);
+        node = node->children[0];
+        continue;
+      }
+      Key keyAtElement = keyAtChunk;
+      int index = 0;
+      for (; index + 1 < node->count && !(key < keyAtElement + node->deltas[index]); ++index) keyAtElement += node->deltas[index];
+      found = cursor;
+      found.node_ = node;
+      found.index_ = index;
+      found.key_ = keyAtElement;
+      // Unless the key is after the end of the chunk, the rest of the elements are after it.
+      if (index + 1 < node->count) break;
+      keyAtSubtree = keyAtChunk + node->chunkDelta;
+      node = node->children[1];
+    }
+    return found;
+  }
+
+  /** Builds the sequence from a range, which must be empty, in O(N). Each item is passed to elementOf(), which must return a pair with its value and its delta. */
+  template<typename Iterator, typename ElementOf>
+  void buildFrom(Iterator begin, Iterator end, ElementOf elementOf) {
+    if (!empty()) throw Error("Building a sequence that is not empty.");
+    // Chunks are filled in order, and added to the treap along its right edge, which is kept in a stack.
+    Node* rightEdge[maxHeight];
+    int rightEdgeLength = 0;
+    for (Iterator item = begin; item != end;) {
+      Node* const node = new Node();
+      for (; item != end && node->count < chunkCapacity; ++item) {
+        std::pair<Value, Delta> element = elementOf(*item);
+        node->values[node->count] = std::move(element.first);
+        node->deltas[node->count++] = element.second;
+      }
+      node->updateChunkDelta();
+      // The nodes with lower priority than the new one become its left subtree.
+      Node* left = nullptr;
+      while (rightEdgeLength > 0 && rightEdge[rightEdgeLength - 1]->priority < node->priority) {
+        left = rightEdge[--rightEdgeLength];
+        left->updateSubtreeDelta();
+      }
+      node->children[0] = left;
+      if (rightEdgeLength > 0) rightEdge[rightEdgeLength - 1]->children[1] = node;
+      if (rightEdgeLength == maxHeight) throw Error("Sequence too deep.");
+      rightEdge[rightEdgeLength++] = node;
+    }
+    // The bottom of the right edge is the root.
+    if (rightEdgeLength > 0) root_ = rightEdge[0];
+    while (rightEdgeLength > 0) rightEdge[--rightEdgeLength]->updateSubtreeDelta();
+  }
+
+  /** Replaces the value and delta of the last element whose key isn't bigger than key. */
+  template<typename SearchKey>
+  void set(const SearchKey& key, Value value, const Delta& delta) {
+    Path path;
+    Element element = findForChange(key, &path, false);
+    if (element.node == nullptr) throw Error("No element to set.");
+    element.node->values[element.index] = std::move(value);
+    element.node->deltas[element.index] = delta;
+    element.node->updateChunkDelta();
+    path.updateSubtreeDeltas();
+  }
+
+  /** As set() for each item of a range, whose search keys, given by keyOf() as for set(), must be in increasing order and find different elements. elementOf() returns a pair with the new value and delta of an item's element, as in buildFrom(). Each node is visited once, so setting k elements is O(k log(N / k)) rather than O(k log N). */
+  template<typename Iterator, typename KeyOf, typename ElementOf>
+  void setEach(Iterator begin, Iterator end, const KeyOf& keyOf, const ElementOf& elementOf) {
+    root_ = setInSubtree(root_, firstKey_, begin, end, keyOf, elementOf);
+  }
+
+  /** Inserts an element before the first element whose key isn't smaller than key, or at the end. */
+  template<typename SearchKey>
+  void insert(const SearchKey& key, Value value, const Delta& delta) {
+    Path path;
+    Element element = findForChange(key, &path, true);
+    if (element.node == nullptr) {
+      root_ = new Node();
+      element = {root_, 0, firstKey_};
+      path.nodes[path.length++] = root_;
+    } else if (element.node->count == chunkCapacity) {
+      // The second half of the chunk moves to a new node after it, which leaves room in it.
+      Node* const full = element.node;
+      Node* const half = new Node();
+      Key halfKey = element.keyAtChunk;
+      for (int index = 0; index < chunkCapacity / 2; ++index) halfKey += full->deltas[index];
+      for (int index = chunkCapacity / 2; index < chunkCapacity; ++index) {
+        half->values[half->count] = std::move(full->values[index]);
+        half->deltas[half->count++] = full->deltas[index];
+        full->values[index] = Value();
+      }
+      full->count = chunkCapacity / 2;
+      full->updateChunkDelta();
+      path.updateSubtreeDeltas();
+      half->updateChunkDelta();
+      half->updateSubtreeDelta();
+      // Without the half, the elements after the chunk start at halfKey.
+      root_ = insertNode(root_, firstKey_, half, halfKey);
+      insert(key, std::move(value), delta);
+      return;
+    }
+    Node* const node = element.node;
+    for (int index = node->count; index > element.index; --index) {
+      node->values[index] = std::move(node->values[index - 1]);
+      node->deltas[index] = node->deltas[index - 1];
+    }
+    node->values[element.index] = std::move(value);
+    node->deltas[element.index] = delta;
+    ++node->count;
+    node->updateChunkDelta();
+    path.updateSubtreeDeltas();
+  }
+
+  /** Removes the last element whose key isn't bigger than key. */
+  template<typename SearchKey>
+  void erase(const SearchKey& key) {
+    Path path;
+    Element element = findForChange(key, &path, false);
+    Node* const node = element.node;
+    if (node == nullptr) throw Error("No element to erase.");
+    for (int index = element.index + 1; index < node->count; ++index) {
+      node->values[index - 1] = std::move(node->values[index]);
+      node->deltas[index - 1] = node->deltas[index];
+    }
+    node->values[--node->count] = Value();
+    if (node->count > 0) {
+      node->updateChunkDelta();
+      path.updateSubtreeDeltas();
+      return;
+    }
+    // The empty chunk is replaced by its children.
+    Node* const replacement = merge(node->children[0], node->children[1]);
+    node->children[0] = nullptr;
+    node->children[1] = nullptr;
+    release(node);
+    --path.length;
+    if (path.length == 0)
+      root_ = replacement;
+    else
+      path.nodes[path.length - 1]->children[path.sides[path.length - 1]] = replacement;
+    path.updateSubtreeDeltas();
+  }
+
+  /** Moves the elements with keys equal or bigger than key to a new sequence, which is returned. O(log N).
+   *
+   * The elements keep their deltas and their keys: the first key of the returned sequence is that of its first element.
+   */
+  template<typename SearchKey>
+  PersistentSequence split(const SearchKey& key) {
+    const Cursor last = find(key);
+    const Key rightFirstKey = !last.isValid() ? firstKey_ : last.key() < key ? last.key() + last.delta() : last.key();
+    PersistentSequence right(rightFirstKey);
+    Node* left = nullptr;
+    Node* cutTail = nullptr;
+    splitNode(root_, firstKey_, key, &left, &right.root_, &cutTail);
+    root_ = left;
+    if (cutTail != nullptr) right.root_ = insertNode(right.root_, rightFirstKey, cutTail, rightFirstKey);
+    return right;
+  }
+
+  /** Moves all the elements of right after the elements of this sequence. As in DRBTree::join(), they keep their deltas. */
+  void join(PersistentSequence right) {
+    if (empty()) firstKey_ = right.firstKey_;
+    root_ = merge(root_, right.root_);
+    right.root_ = nullptr;
+  }
+
+private:
+  friend class PersistentSequenceTest;
+
+  struct Node {
+    Node() : priority(nextPriority()) {}
+
+    Node(const Node& other) : priority(other.priority), children{retain(other.children[0]), retain(other.children[1])}, count(other.count), chunkDelta(other.chunkDelta), subtreeDelta(other.subtreeDelta) {
+      for (int index = 0; index < count; ++index) {
+        values[index] = other.values[index];
+        deltas[index] = other.deltas[index];
+      }
+    }
+
+    void updateChunkDelta() {
+      chunkDelta = zeroDelta;
+      for (int index = 0; index < count; ++index) chunkDelta += deltas[index];
+    }
+
+    void updateSubtreeDelta() {
+      subtreeDelta = PersistentSequence::subtreeDelta(children[0]) + chunkDelta + PersistentSequence::subtreeDelta(children[1]);
+    }
+
+    // The number of copies sharing this node, counting the parents that point to it and the sequences it's the root of.
+    std::atomic<int> references{1};
+    // Parents have higher priorities than their children.
+    const uint32_t priority;
+    Node* children[2] = {nullptr, nullptr};
+    int count = 0;
+    // The sum of the deltas of the chunk's elements, and of the whole subtree.
+    Delta chunkDelta = zeroDelta;
+    Delta subtreeDelta = zeroDelta;
+    Delta deltas[chunkCapacity];
+    Value values[chunkCapacity];
+  };
+
+  static std::size_t nodeCount(const Node* node) { return node == nullptr ? 0 : 1 + nodeCount(node->children[0]) + nodeCount(node->children[1]); }
+
+  /** An element found for changing it: its node has already been made unshared. */
+  struct Element {
+    Node* node;
+    int index;
+    // The key of the first element of the node.
+    Key keyAtChunk;
+  };
+
+  /** The nodes from the root to a node about to be changed, and the side of each one the path continues through. */
+  struct Path {
+    void updateSubtreeDeltas() {
+      for (int index = length - 1; index >= 0; --index) nodes[index]->updateSubtreeDelta();
+    }
+
+    Node* nodes[maxHeight];
+    int sides[maxHeight];
+    int length = 0;
+  };
+
+  /** Random priorities, from a shared counter, so that nodes can be created on any thread. */
+  static uint32_t nextPriority() {
+    static std::atomic<uint64_t> counter{0};
+    // SplitMix64's mix of a counter.
+    uint64_t value = counter.fetch_add(0x9e3779b97f4a7c15, std::memory_order_relaxed);
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111eb;
+    return uint32_t(value ^ (value >> 31));
+  }
+
+  static Delta subtreeDelta(const Node* node) { return node != nullptr ? node->subtreeDelta : zeroDelta; }
+
+  static Node* retain(Node* node) {
+    if (node != nullptr) node->references.fetch_add(1, std::memory_order_relaxed);
+    return node;
+  }
+
+  static void release(Node* node) {
+    // Freed iteratively along one side, recursively along the other, so that the recursion depth is bounded by the treap's height.
+    while (node != nullptr && node->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      release(node->children[0]);
+      Node* const next = node->children[1];
+      delete node;
+      node = next;
+    }
+  }
+
+  /** Returns node if it isn't shared, or else an unshared copy of it, releasing node. The returned node must replace node wherever it was linked from. */
+  static Node* unshared(Node* node) {
+    if (node->references.load(std::memory_order_acquire) == 1) return node;
+    Node* const copy = new Node(*node);
+    release(node);
+    return copy;
+  }
+
+  /** Finds the last element whose key isn't bigger than key, making the nodes on the way unshared and adding them to path. If forInsertion, finds the first element whose key isn't smaller, or the end of the last chunk. Returns a null node if there is none. */
+  template<typename SearchKey>
+  Element findForChange(const SearchKey& key, Path* path, bool forInsertion) {
+    Element found{nullptr, 0, zeroDelta};
+    int foundLength = 0;
+    Key keyAtSubtree = firstKey_;
+    for (Node** link = &root_; *link != nullptr;) {
+      Node* const node = *link = unshared(*link);
+      if (path->length == maxHeight) throw Error("Sequence too deep.");
+      path->nodes[path->length] = node;
+      const Key keyAtChunk = keyAtSubtree + subtreeDelta(node->children[0]);
+      // When inserting, the searched place is between elements, so it's before the chunk if it's before or at its first element.
+      const bool beforeChunk = forInsertion ? !(keyAtChunk < key) : key < keyAtChunk;
+      if (beforeChunk) {
+        if (forInsertion && node->children[0] == nullptr) {
+          found = {node, 0, keyAtChunk};
+          foundLength = path->length + 1;
+          break;
+        }
+        path->sides[path->length++] = 0;
+        link = &node->children[0];
+        continue;
+      }
+      Key keyAtElement = keyAtChunk;
+      int index = 0;
+      if (forInsertion) {
+        for (; index < node->count && keyAtElement < key; ++index) keyAtElement += node->deltas[index];
+      } else {
+        for (; index + 1 < node->count && !(key < keyAtElement + node->deltas[index]); ++index) keyAtElement += node->deltas[index];
+      }
+      found = {node, index, keyAtChunk};
+      foundLength = path->length + 1;
+      // Unless the place is after the end of the chunk, the rest of the elements are after it.
+      if (forInsertion ? index < node->count : index + 1 < node->count) break;
+      path->sides[path->length++] = 1;
+      keyAtSubtree = keyAtChunk + node->chunkDelta;
+      link = &node->children[1];
+    }
+    path->length = foundLength;
+    return found;
+  }
+
+  /** Does setEach() in the treap of node, whose first element has the key keyAtSubtree. Takes the reference to node, and returns one to the result. */
+  template<typename Iterator, typename KeyOf, typename ElementOf>
+  static Node* setInSubtree(Node* node, const Key& keyAtSubtree, Iterator begin, Iterator end, const KeyOf& keyOf, const ElementOf& elementOf) {
+    if (begin == end) return node;
+    if (node == nullptr) throw Error("No element to set.");
+    node = unshared(node);
+    // The keys are worked out before any delta changes, as those of the items are from before the changes.
+    const Key keyAtChunk = keyAtSubtree + subtreeDelta(node->children[0]);
+    const Key keyAfterChunk = keyAtChunk + node->chunkDelta;
+    const Iterator chunkBegin = std::partition_point(begin, end, [&](const typename std::iterator_traits<Iterator>::value_type& item) { return keyOf(item) < keyAtChunk; });
+    const Iterator chunkEnd = std::partition_point(chunkBegin, end, [&](const typename std::iterator_traits<Iterator>::value_type& item) { return keyOf(item) < keyAfterChunk; });
+    if (chunkBegin != chunkEnd) {
+      int index = 0;
+      Key keyAtNext = keyAtChunk + node->deltas[0];
+      for (Iterator item = chunkBegin; item != chunkEnd; ++item) {
+        while (index + 1 < node->count && !(keyOf(*item) < keyAtNext)) keyAtNext += node->deltas[++index];
+        std::pair<Value, Delta> element = elementOf(*item);
+        node->values[index] = std::move(element.first);
+        node->deltas[index] = element.second;
+      }
+      node->updateChunkDelta();
+    }
+    node->children[0] = setInSubtree(node->children[0], keyAtSubtree, begin, chunkBegin, keyOf, elementOf);
+    node->children[1] = setInSubtree(node->children[1], keyAfterChunk, chunkEnd, end, keyOf, elementOf);
+    node->updateSubtreeDelta();
+    return node;
+  }
+
+  /** Joins two treaps, all of whose elements of left go before those of right. Takes the references to both, and returns one to the result. */
+  static Node* merge(Node* left, Node* right) {
+    if (left == nullptr) return right;
+    if (right == nullptr) return left;
+    Node* top;
+    if (left->priority > right->priority) {
+      top = unshared(left);
+      top->children[1] = merge(top->children[1], right);
+    } else {
+      top = unshared(right);
+      top->children[0] = merge(left, top->children[0]);
+    }
+    top->updateSubtreeDelta();
+    return top;
+  }
+
+  /** Inserts newNode, which isn't shared, into the treap of node, whose first element has the key keyAtSubtree, before the first element with a key equal or bigger than key. No chunk may have elements on both sides of key. Takes the references to both, and returns one to the result. */
+  static Node* insertNode(Node* node, const Key& keyAtSubtree, Node* newNode, const Key& key) {
+    if (node == nullptr || node->priority < newNode->priority) {
+      Node* cutTail = nullptr;
+      splitNode(node, keyAtSubtree, key, &newNode->children[0], &newNode->children[1], &cutTail);
+      if (cutTail != nullptr) throw Error("Inserting a node inside a chunk.");
+      newNode->updateSubtreeDelta();
+      return newNode;
+    }
+    node = unshared(node);
+    const Key keyAtChunk = keyAtSubtree + subtreeDelta(node->children[0]);
+    if (!(keyAtChunk < key))
+      node->children[0] = insertNode(node->children[0], keyAtSubtree, newNode, key);
+    else
+      node->children[1] = insertNode(node->children[1], keyAtChunk + node->chunkDelta, newNode, key);
+    node->updateSubtreeDelta();
+    return node;
+  }
+
+  /** Splits the treap of node, whose first element has the key keyAtSubtree, in the elements with keys smaller than key and the rest. Takes the reference to node.
+   *
+   * If a chunk has elements on both sides of key, its elements on the right are moved to a new node, cutTail, which isn't linked into right but goes before all its elements. It has to be inserted separately, so that it keeps a random priority.
+   */
+  template<typename SearchKey>
+  static void splitNode(Node* node, const Key& keyAtSubtree, const SearchKey& key, Node** left, Node** right, Node** cutTail) {
+    if (node == nullptr) {
+      *left = nullptr;
+      *right = nullptr;
+      return;
+    }
+    node = unshared(node);
+    const Key keyAtChunk = keyAtSubtree + subtreeDelta(node->children[0]);
+    if (!(keyAtChunk < key)) {
+      splitNode(node->children[0], keyAtSubtree, key, left, &node->children[0], cutTail);
+      node->updateSubtreeDelta();
+      *right = node;
+      return;
+    }
+    Key keyAtElement = keyAtChunk;
+    int index = 0;
+    for (; index < node->count && keyAtElement < key; ++index) keyAtElement += node->deltas[index];
+    if (index == node->count) {
+      splitNode(node->children[1], keyAtElement, key, &node->children[1], right, cutTail);
+      node->updateSubtreeDelta();
+      *left = node;
+      return;
+    }
+    Node* const tail = new Node();
+    for (int moved = index; moved < node->count; ++moved) {
+      tail->values[tail->count] = std::move(node->values[moved]);
+      tail->deltas[tail->count++] = node->deltas[moved];
+      node->values[moved] = Value();
+    }
+    node->count = index;
+    node->updateChunkDelta();
+    tail->updateChunkDelta();
+    tail->updateSubtreeDelta();
+    *right = node->children[1];
+    node->children[1] = nullptr;
+    node->updateSubtreeDelta();
+    *left = node;
+    *cutTail = tail;
+  }
+
+  Node* root_ = nullptr;
+  Key firstKey_;
+};
+
+template<typename Delta, typename Value, int chunkCapacity>
+constexpr Delta PersistentSequence<Delta, Value, chunkCapacity>::zeroDelta;
+
+}  // namespace Util
+}  // namespace Med
+
+#endif // MED_UTIL_PERSISTENTSEQUENCE_H
@@ -0,0 +1,217 @@
+#include "PersistentSequence.h"
+
+#include <limits>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace Med {
+namespace Util {
+
+class PersistentSequenceTest : public ::testing::Test {
+protected:
+  // Small chunks, so that small sequences already have many nodes.
+  typedef PersistentSequence<int, std::string, 4> Sequence;
+
+  /** An element of the reference the sequences are checked against: keys are computed from the deltas and the first key. */
+  struct Element {
+    std::string value;
+    int delta;
+  };
+
+  static std::vector<int> keys(const std::vector<Element>& elements, int firstKey) {
+    std::vector<int> keys;
+    for (const Element& element : elements) {
+      keys.push_back(firstKey);
+      firstKey += element.delta;
+    }
+    return keys;
+  }
+
+  /** Checks the structure of the treap, and that the sequence has the same elements as the reference. */
+  void checkSame(const Sequence& sequence, const std::vector<Element>& reference, int firstKey) {
+    int count = 0;
+    checkNode(sequence.root_, std::numeric_limits<uint32_t>::max(), &count);
+    EXPECT_EQ(int(reference.size()), count);
+    const std::vector<int> referenceKeys = keys(reference, firstKey);
+    std::size_t index = 0;
+    for (Sequence::Cursor cursor = sequence.begin(); cursor.isValid(); cursor.advance(), ++index) {
+      ASSERT_LT(index, reference.size());
+      EXPECT_EQ(reference[index].value, cursor.value());
+      EXPECT_EQ(reference[index].delta, cursor.delta());
+      EXPECT_EQ(referenceKeys[index], cursor.key());
+    }
+    EXPECT_EQ(reference.size(), index);
+    if (!reference.empty()) EXPECT_EQ(referenceKeys.back() + reference.back().delta, sequence.endKey());
+  }
+
+  /** Checks the heap order of priorities and the deltas of the subtree of node, and counts its elements. */
+  void checkNode(const Sequence::Node* node, uint32_t parentPriority, int* count) {
+    if (node == nullptr) return;
+    EXPECT_LT(0, node->count);
+    EXPECT_LE(1, node->references.load());
+    EXPECT_GE(parentPriority, node->priority);
+    int chunkDelta = 0;
+    for (int index = 0; index < node->count; ++index) chunkDelta += node->deltas[index];
+    EXPECT_EQ(chunkDelta, node->chunkDelta);
+    EXPECT_EQ(Sequence::subtreeDelta(node->children[0]) + chunkDelta + Sequence::subtreeDelta(node->children[1]), node->subtreeDelta);
+    *count += node->count;
+    checkNode(node->children[0], node->priority, count);
+    checkNode(node->children[1], node->priority, count);
+  }
+
+  static std::size_t nodeSize() { return sizeof(Sequence::Node); }
+
+  static Sequence build(const std::vector<Element>& elements, int firstKey) {
+    Sequence sequence(firstKey);
+    sequence.buildFrom(elements.begin(), elements.end(), [](const Element& element) { return std::make_pair(element.value, element.delta); });
+    return sequence;
+  }
+};
+
+TEST_F(PersistentSequenceTest, BuildAndFind) {
+  for (int count = 0; count <= 40; ++count) {
+    std::vector<Element> elements;
+    // Keys 3, 5, 7...
+    for (int index = 0; index < count; ++index) elements.push_back({std::to_string(index), 2});
+    const Sequence sequence = build(elements, 3);
+    checkSame(sequence, elements, 3);
+    // Every node holds between one and four elements.
+    EXPECT_LE((count + 3) / 4 * nodeSize(), sequence.nodeBytes());
+    EXPECT_GE(count * nodeSize(), sequence.nodeBytes());
+    EXPECT_FALSE(sequence.find(2).isValid());
+    for (int key = 3; count > 0 && key < 3 + 2 * count + 3; ++key) {
+      // The last element not after the key.
+      const Sequence::Cursor found = sequence.find(key);
+      ASSERT_TRUE(found.isValid());
+      const int index = std::min((key - 3) / 2, count - 1);
+      EXPECT_EQ(std::to_string(index), found.value());
+      EXPECT_EQ(3 + 2 * index, found.key());
+      int visited = index;
+      for (Sequence::Cursor cursor = found; cursor.isValid(); cursor.advance()) EXPECT_EQ(std::to_string(visited++), cursor.value());
+      EXPECT_EQ(count, visited);
+    }
+  }
+}
+
+TEST_F(PersistentSequenceTest, CopiesDontSeeChanges) {
+  std::mt19937 random(1234);
+  auto uniform = [&random](int min, int max) { return std::uniform_int_distribution<int>(min, max)(random); };
+  int firstKey = 1;
+  Sequence sequence(firstKey);
+  std::vector<Element> reference;
+  // Copies taken along the way, with the contents they must keep.
+  std::vector<std::tuple<Sequence, std::vector<Element>, int>> copies;
+  for (int step = 0; step < 3000; ++step) {
+    const int operation = reference.size() < 5 ? 0 : uniform(0, 5);
+    const int index = reference.empty() ? 0 : uniform(0, reference.size() - 1);
+    const int key = reference.empty() ? firstKey : keys(reference, firstKey)[index];
+    if (operation <= 1 && reference.size() < 200) {
+      // Inserts before the element at index, or at the end.
+      const bool atEnd = uniform(0, 4) == 0;
+      const Element element{"value " + std::to_string(step), uniform(1, 3)};
+      sequence.insert(atEnd ? sequence.endKey() : key, element.value, element.delta);
+      reference.insert(atEnd ? reference.end() : reference.begin() + index, element);
+    } else if (operation == 2) {
+      sequence.erase(key);
+      reference.erase(reference.begin() + index);
+    } else if (operation == 3) {
+      const Element element{"set " + std::to_string(step), uniform(1, 3)};
+      sequence.set(key, element.value, element.delta);
+      reference[index] = element;
+    } else if (operation == 4) {
+      // Moves the elements from index to the end to the start.
+      Sequence right = sequence.split(key);
+      checkSame(right, std::vector<Element>(reference.begin() + index, reference.end()), key);
+      checkSame(sequence, std::vector<Element>(reference.begin(), reference.begin() + index), firstKey);
+      right.join(std::move(sequence));
+      sequence = std::move(right);
+      std::rotate(reference.begin(), reference.begin() + index, reference.end());
+      // The elements moved to the start keep their keys.
+      firstKey = key;
+    } else {
+      copies.emplace_back(sequence, reference, firstKey);
+    }
+    checkSame(sequence, reference, firstKey);
+    if (HasFatalFailure()) return;
+  }
+  for (const auto& copy : copies) {
+    checkSame(std::get<0>(copy), std::get<1>(copy), std::get<2>(copy));
+    if (HasFatalFailure()) return;
+  }
+}
+
+TEST_F(PersistentSequenceTest, SplitAndJoinKeepKeys) {
+  std::vector<Element> elements;
+  for (int index = 0; index < 50; ++index) elements.push_back({std::to_string(index), 1});
+  Sequence sequence = build(elements, 1);
+  const Sequence copy = sequence;
+  Sequence middle = sequence.split(11);
+  Sequence right = middle.split(31);
+  EXPECT_EQ(11, middle.begin().key());
+  EXPECT_EQ(31, right.begin().key());
+  EXPECT_EQ(51, right.endKey());
+  checkSame(middle, std::vector<Element>(elements.begin() + 10, elements.begin() + 30), 11);
+  sequence.join(std::move(right));
+  checkSame(sequence, [&] {
+    std::vector<Element> expected(elements.begin(), elements.begin() + 10);
+    expected.insert(expected.end(), elements.begin() + 30, elements.end());
+    return expected;
+  }(), 1);
+  checkSame(copy, elements, 1);
+  // A split off part keeps its keys until it's moved.
+  Sequence tail = Sequence(copy).split(41);
+  EXPECT_EQ(41, tail.begin().key());
+  tail.setFirstKey(1);
+  checkSame(tail, std::vector<Element>(elements.begin() + 40, elements.end()), 1);
+}
+
+TEST_F(PersistentSequenceTest, SetEachChangesDeltas) {
+  std::mt19937 random(4321);
+  auto uniform = [&random](int min, int max) { return std::uniform_int_distribution<int>(min, max)(random); };
+  std::vector<Element> reference;
+  for (int index = 0; index < 300; ++index) reference.push_back({std::to_string(index), uniform(1, 3)});
+  Sequence sequence = build(reference, 1);
+  for (int round = 0; round < 20; ++round) {
+    const Sequence copy = sequence;
+    const std::vector<Element> copyReference = reference;
+    // The keys of the set elements are those from before any of them changes.
+    const std::vector<int> referenceKeys = keys(reference, 1);
+    std::vector<std::pair<int, Element>> items;
+    for (int index = 0; index < int(reference.size()); ++index) {
+      if (uniform(0, round % 4) != 0) continue;
+      items.push_back({referenceKeys[index], {"set " + std::to_string(round), uniform(1, 3)}});
+      reference[index] = items.back().second;
+    }
+    sequence.setEach(items.begin(), items.end(), [](const std::pair<int, Element>& item) { return item.first; }, [](const std::pair<int, Element>& item) { return std::make_pair(item.second.value, item.second.delta); });
+    checkSame(sequence, reference, 1);
+    checkSame(copy, copyReference, 1);
+    if (HasFatalFailure()) return;
+  }
+}
+
+TEST_F(PersistentSequenceTest, ReadCopiesFromOtherThreads) {
+  std::vector<Element> elements;
+  for (int index = 0; index < 10000; ++index) elements.push_back({std::string(20, 'a' + index % 26), 1});
+  Sequence sequence = build(elements, 0);
+  std::vector<std::thread> readers;
+  std::vector<int> results(4, 0);
+  for (int reader = 0; reader < 4; ++reader) {
+    readers.emplace_back([copy = Sequence(sequence), &result = results[reader]] {
+      for (Sequence::Cursor cursor = copy.begin(); cursor.isValid(); cursor.advance()) result += cursor.value().size();
+    });
+  }
+  // The sequence is changed while the copies are being read.
+  for (int key = 0; key < 10000; key += 3) sequence.set(key, "changed", 1);
+  for (int key = 9000; key > 0; key -= 7) sequence.erase(key);
+  for (std::thread& reader : readers) reader.join();
+  for (int result : results) EXPECT_EQ(20 * 10000, result);
+}
+
+}  // namespace Util
+}  // namespace Med
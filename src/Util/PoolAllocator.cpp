@@ -0,0 +1 @@
+#include "PoolAllocator.h"
@@ -0,0 +1,87 @@
+#ifndef MED_UTIL_POOLALLOCATOR_H
+#define MED_UTIL_POOLALLOCATOR_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace Med {
+namespace Util {
+
+/** An allocator policy that carves objects out of large slabs and recycles freed objects through a free list.
+ *
+ * There is one pool per object type, shared by the whole process. Slabs are never returned to the system; freed objects are kept in the free list and handed out again by later allocations, which keeps objects allocated around the same time close together in memory and avoids a heap allocation per object.
+ *
+ * The pool is not thread-safe.
+ */
+template<typename Object>
+class PoolAllocator {
+public:
+  template<typename... Args>
+  static Object* allocate(Args&&... args) {
+    return new (pool().take()) Object(std::forward<Args>(args)...);
+  }
+
+  static void deallocate(Object* object) {
+    if (object == nullptr) return;
+    object->~Object();
+    pool().give(object);
+  }
+
+  /** Number of objects currently allocated from the pool. */
+  static std::size_t liveCount() { return pool().liveCount; }
+
+  /** Bytes reserved by the pool's slabs, whether in use or in the free list. */
+  static std::size_t reservedBytes() { return pool().slabs.size() * Pool::slabSize * sizeof(typename Pool::Slot); }
+
+private:
+  class Pool {
+  public:
+    union Slot {
+      Slot* next;
+      alignas(Object) unsigned char storage[sizeof(Object)];
+    };
+
+    // Slabs of about 256 KiB, so that they are big enough to be allocated directly with mmap by the system allocator.
+    static constexpr std::size_t slabSize = sizeof(Slot) >= 256 * 1024 ? 1 : 256 * 1024 / sizeof(Slot);
+
+    void* take() {
+      ++liveCount;
+      if (freeList != nullptr) {
+        Slot* slot = freeList;
+        freeList = slot->next;
+        return slot->storage;
+      }
+      if (usedInLastSlab == slabSize || slabs.empty()) {
+        slabs.emplace_back(new Slot[slabSize]);
+        usedInLastSlab = 0;
+      }
+      return slabs.back()[usedInLastSlab++].storage;
+    }
+
+    void give(void* storage) {
+      --liveCount;
+      Slot* slot = reinterpret_cast<Slot*>(storage);
+      slot->next = freeList;
+      freeList = slot;
+    }
+
+    std::vector<std::unique_ptr<Slot[]>> slabs;
+    std::size_t usedInLastSlab = 0;
+    Slot* freeList = nullptr;
+    std::size_t liveCount = 0;
+  };
+
+  // Never destroyed, so that objects can still be deallocated during static destruction.
+  static Pool& pool() {
+    static Pool* pool = new Pool();
+    return *pool;
+  }
+};
+
+}  // namespace Util
+}  // namespace Med
+
+#endif // MED_UTIL_POOLALLOCATOR_H
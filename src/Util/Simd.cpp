@@ -0,0 +1,387 @@
+#include "Simd.h"
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MED_SIMD_X86
+#endif
+
+namespace Med {
+namespace Util {
+
+namespace {
+
+const char* findByteScalar(const char* begin, const char* end, char byte) {
+  const void* found = std::memchr(begin, byte, end - begin);
+  return found != nullptr ? static_cast<const char*>(found) : end;
+}
+
+std::size_t countByteScalar(const char* begin, const char* end, char byte) {
+  std::size_t count = 0;
+  for (; begin != end; ++begin) count += *begin == byte;
+  return count;
+}
+
+std::size_t asciiLengthScalar(const char* begin, const char* end) {
+  const char* current = begin;
+  // Eight bytes at a time while there are no high bits.
+  for (uint64_t word; end - current >= 8; current += 8) {
+    std::memcpy(&word, current, 8);
+    if ((word & 0x8080808080808080ull) != 0) break;
+  }
+  while (current != end && static_cast<unsigned char>(*current) < 0x80) ++current;
+  return current - begin;
+}
+
+char16_t* widenScalar(const char* begin, const char* end, char16_t* output) {
+  for (; begin != end; ++begin) *output++ = static_cast<unsigned char>(*begin);
+  return output;
+}
+
+std::size_t latin1LengthScalar(const char16_t* begin, const char16_t* end) {
+  const char16_t* current = begin;
+  while (current != end && *current < 0x100) ++current;
+  return current - begin;
+}
+
+char* narrowScalar(const char16_t* begin, const char16_t* end, char* output) {
+  for (; begin != end; ++begin) *output++ = static_cast<char>(*begin);
+  return output;
+}
+
+// The lower case of a letter of Latin-1, or the character itself. The upper case letters are 0x20 below their lower case ones, and the multiplication sign is among them.
+inline unsigned foldCase(unsigned character) {
+  return character - 'A' < 26u || (character - 0xC0u < 0x1Fu && character != 0xD7) ? character + 0x20 : character;
+}
+
+// 0x20, the bit that tells the cases of a letter of Latin-1 apart, or 0 for other characters. A character with this bit set is the literal character with it set only if they are the same letter in either case, or the same character.
+inline unsigned caseBit(unsigned character) {
+  return foldCase(character & ~0x20u) != (character & ~0x20u) ? 0x20 : 0;
+}
+
+template<typename Char>
+unsigned code(Char character) {
+  return static_cast<typename std::make_unsigned<Char>::type>(character);
+}
+
+template<typename Char>
+bool matchesAt(const Char* text, const Char* literal, std::size_t size, bool ignoreCase) {
+  if (!ignoreCase) return std::memcmp(text, literal, size * sizeof(Char)) == 0;
+  for (std::size_t index = 0; index < size; ++index) {
+    if (foldCase(code(text[index])) != foldCase(code(literal[index]))) return false;
+  }
+  return true;
+}
+
+template<typename Char>
+const Char* findLiteralScalar(const Char* begin, const Char* end, const Char* literal, std::size_t size, bool ignoreCase) {
+  if (size == 0) return begin;
+  if (std::size_t(end - begin) < size) return end;
+  const unsigned firstBit = ignoreCase ? caseBit(code(literal[0])) : 0;
+  const unsigned first = code(literal[0]) | firstBit;
+  for (const Char* last = end - size; begin <= last; ++begin) {
+    if ((code(*begin) | firstBit) == first && matchesAt(begin + 1, literal + 1, size - 1, ignoreCase)) return begin;
+  }
+  return end;
+}
+
+#ifdef MED_SIMD_X86
+
+// The vector versions handle whole vectors, and leave the remaining bytes to the scalar versions. The AVX2 versions clear the upper halves of the registers before that, since running SSE code while they are dirty is very slow on some processors, and compilers don't always do it before calls.
+
+__attribute__((target("sse2"))) const char* findByteSse2(const char* begin, const char* end, char byte) {
+  const __m128i pattern = _mm_set1_epi8(byte);
+  for (; end - begin >= 16; begin += 16) {
+    const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(begin)), pattern));
+    if (mask != 0) return begin + __builtin_ctz(mask);
+  }
+  return findByteScalar(begin, end, byte);
+}
+
+__attribute__((target("avx2"))) const char* findByteAvx2(const char* begin, const char* end, char byte) {
+  const __m256i pattern = _mm256_set1_epi8(byte);
+  for (; end - begin >= 32; begin += 32) {
+    const unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin)), pattern));
+    if (mask != 0) return begin + __builtin_ctz(mask);
+  }
+  _mm256_zeroupper();
+  return findByteSse2(begin, end, byte);
+}
+
+__attribute__((target("sse2"))) std::size_t countByteSse2(const char* begin, const char* end, char byte) {
+  const __m128i pattern = _mm_set1_epi8(byte);
+  std::size_t count = 0;
+  for (; end - begin >= 16; begin += 16) {
+    count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(begin)), pattern)));
+  }
+  return count + countByteScalar(begin, end, byte);
+}
+
+__attribute__((target("avx2,popcnt"))) std::size_t countByteAvx2(const char* begin, const char* end, char byte) {
+  const __m256i pattern = _mm256_set1_epi8(byte);
+  std::size_t count = 0;
+  for (; end - begin >= 32; begin += 32) {
+    count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin)), pattern)));
+  }
+  _mm256_zeroupper();
+  return count + countByteSse2(begin, end, byte);
+}
+
+__attribute__((target("sse2"))) std::size_t asciiLengthSse2(const char* begin, const char* end) {
+  const char* current = begin;
+  for (; end - current >= 16; current += 16) {
+    // The mask has the high bit of every byte.
+    const int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(current)));
+    if (mask != 0) return current - begin + __builtin_ctz(mask);
+  }
+  return current - begin + asciiLengthScalar(current, end);
+}
+
+__attribute__((target("avx2"))) std::size_t asciiLengthAvx2(const char* begin, const char* end) {
+  const char* current = begin;
+  for (; end - current >= 32; current += 32) {
+    const unsigned mask = _mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(current)));
+    if (mask != 0) return current - begin + __builtin_ctz(mask);
+  }
+  _mm256_zeroupper();
+  return current - begin + asciiLengthSse2(current, end);
+}
+
+__attribute__((target("sse2"))) char16_t* widenSse2(const char* begin, const char* end, char16_t* output) {
+  const __m128i zero = _mm_setzero_si128();
+  for (; end - begin >= 16; begin += 16, output += 16) {
+    const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output), _mm_unpacklo_epi8(bytes, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output + 8), _mm_unpackhi_epi8(bytes, zero));
+  }
+  return widenScalar(begin, end, output);
+}
+
+__attribute__((target("avx2"))) char16_t* widenAvx2(const char* begin, const char* end, char16_t* output) {
+  for (; end - begin >= 16; begin += 16, output += 16) {
+    const __m256i words = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(begin)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(output), words);
+  }
+  _mm256_zeroupper();
+  return widenScalar(begin, end, output);
+}
+
+__attribute__((target("sse2"))) std::size_t latin1LengthSse2(const char16_t* begin, const char16_t* end) {
+  const char16_t* current = begin;
+  const __m128i highBytes = _mm_set1_epi16(0xFF00);
+  const __m128i zero = _mm_setzero_si128();
+  for (; end - current >= 8; current += 8) {
+    const __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(current));
+    // Two mask bits per code unit, set for those below 0x100.
+    const int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, highBytes), zero));
+    if (mask != 0xFFFF) return current - begin + __builtin_ctz(~mask) / 2;
+  }
+  return current - begin + latin1LengthScalar(current, end);
+}
+
+__attribute__((target("avx2"))) std::size_t latin1LengthAvx2(const char16_t* begin, const char16_t* end) {
+  const char16_t* current = begin;
+  const __m256i highBytes = _mm256_set1_epi16(0xFF00);
+  const __m256i zero = _mm256_setzero_si256();
+  for (; end - current >= 16; current += 16) {
+    const __m256i units = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(current));
+    const unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_and_si256(units, highBytes), zero));
+    if (mask != 0xFFFFFFFFu) return current - begin + __builtin_ctz(~mask) / 2;
+  }
+  _mm256_zeroupper();
+  return current - begin + latin1LengthSse2(current, end);
+}
+
+__attribute__((target("sse2"))) char* narrowSse2(const char16_t* begin, const char16_t* end, char* output) {
+  // Clearing the high bytes first makes the saturating pack truncate instead.
+  const __m128i lowBytes = _mm_set1_epi16(0xFF);
+  for (; end - begin >= 16; begin += 16, output += 16) {
+    const __m128i low = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(begin)), lowBytes);
+    const __m128i high = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(begin + 8)), lowBytes);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(output), _mm_packus_epi16(low, high));
+  }
+  return narrowScalar(begin, end, output);
+}
+
+__attribute__((target("avx2"))) char* narrowAvx2(const char16_t* begin, const char16_t* end, char* output) {
+  const __m256i lowBytes = _mm256_set1_epi16(0xFF);
+  for (; end - begin >= 32; begin += 32, output += 32) {
+    const __m256i low = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin)), lowBytes);
+    const __m256i high = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin + 16)), lowBytes);
+    // The pack works within each 128-bit lane, so the lanes are put back in order afterwards.
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(output), _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xD8));
+  }
+  _mm256_zeroupper();
+  return narrowSse2(begin, end, output);
+}
+
+// The vector versions of findLiteral() compare a vector of positions whose first character matches the first of the literal and whose last character matches its last. The case bits of letters are set in both first, so that either case matches. Only the characters in between are left to compare at the positions of the set bits of the mask.
+
+__attribute__((target("sse2"))) const char* findLiteralSse2(const char* begin, const char* end, const char* literal, std::size_t size, bool ignoreCase) {
+  if (size == 0) return begin;
+  const unsigned firstBit = ignoreCase ? caseBit(code(literal[0])) : 0;
+  const unsigned lastBit = ignoreCase ? caseBit(code(literal[size - 1])) : 0;
+  const __m128i firstBits = _mm_set1_epi8(char(firstBit));
+  const __m128i lastBits = _mm_set1_epi8(char(lastBit));
+  const __m128i first = _mm_set1_epi8(char(code(literal[0]) | firstBit));
+  const __m128i last = _mm_set1_epi8(char(code(literal[size - 1]) | lastBit));
+  for (; std::size_t(end - begin) >= size - 1 + 16; begin += 16) {
+    const __m128i firstBlock = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(begin)), firstBits);
+    const __m128i lastBlock = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(begin + size - 1)), lastBits);
+    for (unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(firstBlock, first), _mm_cmpeq_epi8(lastBlock, last))); mask != 0; mask &= mask - 1) {
+      const char* const candidate = begin + __builtin_ctz(mask);
+      if (size <= 2 || matchesAt(candidate + 1, literal + 1, size - 2, ignoreCase)) return candidate;
+    }
+  }
+  return findLiteralScalar(begin, end, literal, size, ignoreCase);
+}
+
+__attribute__((target("avx2"))) const char* findLiteralAvx2(const char* begin, const char* end, const char* literal, std::size_t size, bool ignoreCase) {
+  if (size == 0) return begin;
+  const unsigned firstBit = ignoreCase ? caseBit(code(literal[0])) : 0;
+  const unsigned lastBit = ignoreCase ? caseBit(code(literal[size - 1])) : 0;
+  const __m256i firstBits = _mm256_set1_epi8(char(firstBit));
+  const __m256i lastBits = _mm256_set1_epi8(char(lastBit));
+  const __m256i first = _mm256_set1_epi8(char(code(literal[0]) | firstBit));
+  const __m256i last = _mm256_set1_epi8(char(code(literal[size - 1]) | lastBit));
+  for (; std::size_t(end - begin) >= size - 1 + 32; begin += 32) {
+    const __m256i firstBlock = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin)), firstBits);
+    const __m256i lastBlock = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin + size - 1)), lastBits);
+    for (unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(firstBlock, first), _mm256_cmpeq_epi8(lastBlock, last))); mask != 0; mask &= mask - 1) {
+      const char* const candidate = begin + __builtin_ctz(mask);
+      if (size <= 2 || matchesAt(candidate + 1, literal + 1, size - 2, ignoreCase)) {
+        _mm256_zeroupper();
+        return candidate;
+      }
+    }
+  }
+  _mm256_zeroupper();
+  return findLiteralSse2(begin, end, literal, size, ignoreCase);
+}
+
+// The masks of 16-bit comparisons have two bits per character; only the lower one is kept.
+
+__attribute__((target("sse2"))) const char16_t* findLiteralSse2(const char16_t* begin, const char16_t* end, const char16_t* literal, std::size_t size, bool ignoreCase) {
+  if (size == 0) return begin;
+  const unsigned firstBit = ignoreCase ? caseBit(literal[0]) : 0;
+  const unsigned lastBit = ignoreCase ? caseBit(literal[size - 1]) : 0;
+  const __m128i firstBits = _mm_set1_epi16(short(firstBit));
+  const __m128i lastBits = _mm_set1_epi16(short(lastBit));
+  const __m128i first = _mm_set1_epi16(short(literal[0] | firstBit));
+  const __m128i last = _mm_set1_epi16(short(literal[size - 1] | lastBit));
+  for (; std::size_t(end - begin) >= size - 1 + 8; begin += 8) {
+    const __m128i firstBlock = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(begin)), firstBits);
+    const __m128i lastBlock = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(begin + size - 1)), lastBits);
+    for (unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi16(firstBlock, first), _mm_cmpeq_epi16(lastBlock, last))) & 0x5555u; mask != 0; mask &= mask - 1) {
+      const char16_t* const candidate = begin + __builtin_ctz(mask) / 2;
+      if (size <= 2 || matchesAt(candidate + 1, literal + 1, size - 2, ignoreCase)) return candidate;
+    }
+  }
+  return findLiteralScalar(begin, end, literal, size, ignoreCase);
+}
+
+__attribute__((target("avx2"))) const char16_t* findLiteralAvx2(const char16_t* begin, const char16_t* end, const char16_t* literal, std::size_t size, bool ignoreCase) {
+  if (size == 0) return begin;
+  const unsigned firstBit = ignoreCase ? caseBit(literal[0]) : 0;
+  const unsigned lastBit = ignoreCase ? caseBit(literal[size - 1]) : 0;
+  const __m256i firstBits = _mm256_set1_epi16(short(firstBit));
+  const __m256i lastBits = _mm256_set1_epi16(short(lastBit));
+  const __m256i first = _mm256_set1_epi16(short(literal[0] | firstBit));
+  const __m256i last = _mm256_set1_epi16(short(literal[size - 1] | lastBit));
+  for (; std::size_t(end - begin) >= size - 1 + 16; begin += 16) {
+    const __m256i firstBlock = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin)), firstBits);
+    const __m256i lastBlock = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin + size - 1)), lastBits);
+    for (unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi16(firstBlock, first), _mm256_cmpeq_epi16(lastBlock, last))) & 0x55555555u; mask != 0; mask &= mask - 1) {
+      const char16_t* const candidate = begin + __builtin_ctz(mask) / 2;
+      if (size <= 2 || matchesAt(candidate + 1, literal + 1, size - 2, ignoreCase)) {
+        _mm256_zeroupper();
+        return candidate;
+      }
+    }
+  }
+  _mm256_zeroupper();
+  return findLiteralSse2(begin, end, literal, size, ignoreCase);
+}
+
+#endif
+
+}  // namespace
+
+Simd::Level Simd::supportedLevel() {
+#ifdef MED_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return Level::AVX2;
+  if (__builtin_cpu_supports("sse2")) return Level::SSE2;
+#endif
+  return Level::SCALAR;
+}
+
+const char* Simd::findByte(const char* begin, const char* end, char byte, Level level) {
+#ifdef MED_SIMD_X86
+  if (level == Level::AVX2) return findByteAvx2(begin, end, byte);
+  if (level == Level::SSE2) return findByteSse2(begin, end, byte);
+#endif
+  return findByteScalar(begin, end, byte);
+}
+
+std::size_t Simd::countByte(const char* begin, const char* end, char byte, Level level) {
+#ifdef MED_SIMD_X86
+  if (level == Level::AVX2) return countByteAvx2(begin, end, byte);
+  if (level == Level::SSE2) return countByteSse2(begin, end, byte);
+#endif
+  return countByteScalar(begin, end, byte);
+}
+
+std::size_t Simd::asciiLength(const char* begin, const char* end, Level level) {
+#ifdef MED_SIMD_X86
+  if (level == Level::AVX2) return asciiLengthAvx2(begin, end);
+  if (level == Level::SSE2) return asciiLengthSse2(begin, end);
+#endif
+  return asciiLengthScalar(begin, end);
+}
+
+char16_t* Simd::widen(const char* begin, const char* end, char16_t* output, Level level) {
+#ifdef MED_SIMD_X86
+  if (level == Level::AVX2) return widenAvx2(begin, end, output);
+  if (level == Level::SSE2) return widenSse2(begin, end, output);
+#endif
+  return widenScalar(begin, end, output);
+}
+
+std::size_t Simd::latin1Length(const char16_t* begin, const char16_t* end, Level level) {
+#ifdef MED_SIMD_X86
+  if (level == Level::AVX2) return latin1LengthAvx2(begin, end);
+  if (level == Level::SSE2) return latin1LengthSse2(begin, end);
+#endif
+  return latin1LengthScalar(begin, end);
+}
+
+char* Simd::narrow(const char16_t* begin, const char16_t* end, char* output, Level level) {
+#ifdef MED_SIMD_X86
+  if (level == Level::AVX2) return narrowAvx2(begin, end, output);
+  if (level == Level::SSE2) return narrowSse2(begin, end, output);
+#endif
+  return narrowScalar(begin, end, output);
+}
+
+const char* Simd::findLiteral(const char* begin, const char* end, const char* literal, std::size_t literalSize, bool ignoreCase, Level level) {
+#ifdef MED_SIMD_X86
+  if (level == Level::AVX2) return findLiteralAvx2(begin, end, literal, literalSize, ignoreCase);
+  if (level == Level::SSE2) return findLiteralSse2(begin, end, literal, literalSize, ignoreCase);
+#endif
+  return findLiteralScalar(begin, end, literal, literalSize, ignoreCase);
+}
+
+const char16_t* Simd::findLiteral(const char16_t* begin, const char16_t* end, const char16_t* literal, std::size_t literalSize, bool ignoreCase, Level level) {
+#ifdef MED_SIMD_X86
+  if (level == Level::AVX2) return findLiteralAvx2(begin, end, literal, literalSize, ignoreCase);
+  if (level == Level::SSE2) return findLiteralSse2(begin, end, literal, literalSize, ignoreCase);
+#endif
+  return findLiteralScalar(begin, end, literal, literalSize, ignoreCase);
+}
+
+}  // namespace Util
+}  // namespace Med
@@ -0,0 +1,64 @@
+#ifndef MED_UTIL_SIMD_H
+#define MED_UTIL_SIMD_H
+
+#include <cstddef>
+
+namespace Med {
+namespace Util {
+
+/** Scanning and conversion of byte strings with vector instructions.
+ *
+ * Every function has a plain C++ implementation, and on x86 SSE2 and AVX2 ones. The best one supported by the processor is chosen at run time, so binaries built for any x86-64 processor still use AVX2 where available.
+ */
+class Simd {
+public:
+  enum class Level { SCALAR, SSE2, AVX2 };
+
+  /** The best level supported by the processor and the compiler. */
+  static Level supportedLevel();
+
+  /** Returns the first occurrence of byte in [begin, end), or end if there is none. */
+  static const char* findByte(const char* begin, const char* end, char byte) { return findByte(begin, end, byte, bestLevel()); }
+  static const char* findByte(const char* begin, const char* end, char byte, Level level);
+
+  /** Returns the number of occurrences of byte in [begin, end). */
+  static std::size_t countByte(const char* begin, const char* end, char byte) { return countByte(begin, end, byte, bestLevel()); }
+  static std::size_t countByte(const char* begin, const char* end, char byte, Level level);
+
+  /** Returns the number of bytes at the start of [begin, end) that are ASCII, that is, below 0x80. */
+  static std::size_t asciiLength(const char* begin, const char* end) { return asciiLength(begin, end, bestLevel()); }
+  static std::size_t asciiLength(const char* begin, const char* end, Level level);
+
+  /** Zero-extends every byte in [begin, end) to 16 bits, which converts ASCII and Latin-1 to UTF-16. Returns the end of the output. */
+  static char16_t* widen(const char* begin, const char* end, char16_t* output) { return widen(begin, end, output, bestLevel()); }
+  static char16_t* widen(const char* begin, const char* end, char16_t* output, Level level);
+
+  /** Returns the number of UTF-16 code units at the start of [begin, end) that are Latin-1, that is, below 0x100. */
+  static std::size_t latin1Length(const char16_t* begin, const char16_t* end) { return latin1Length(begin, end, bestLevel()); }
+  static std::size_t latin1Length(const char16_t* begin, const char16_t* end, Level level);
+
+  /** Truncates every code unit in [begin, end) to 8 bits, the reverse of widen(): it converts UTF-16 to Latin-1 if latin1Length() is the whole text. Returns the end of the output. */
+  static char* narrow(const char16_t* begin, const char16_t* end, char* output) { return narrow(begin, end, output, bestLevel()); }
+  static char* narrow(const char16_t* begin, const char16_t* end, char* output, Level level);
+
+  /** Returns the first occurrence of the literal of literalSize characters in [begin, end), or end if there is none; an empty literal is found at begin. If ignoreCase, the letters of Latin-1 match in either case, and other characters only themselves.
+   *
+   * The vector versions compare the first and last characters of the literal with those of a vector of positions at once, and compare the rest only where both match, which is rare in most text.
+   */
+  static const char* findLiteral(const char* begin, const char* end, const char* literal, std::size_t literalSize, bool ignoreCase) { return findLiteral(begin, end, literal, literalSize, ignoreCase, bestLevel()); }
+  static const char* findLiteral(const char* begin, const char* end, const char* literal, std::size_t literalSize, bool ignoreCase, Level level);
+  /** As findLiteral() above, for UTF-16 text and literals. */
+  static const char16_t* findLiteral(const char16_t* begin, const char16_t* end, const char16_t* literal, std::size_t literalSize, bool ignoreCase) { return findLiteral(begin, end, literal, literalSize, ignoreCase, bestLevel()); }
+  static const char16_t* findLiteral(const char16_t* begin, const char16_t* end, const char16_t* literal, std::size_t literalSize, bool ignoreCase, Level level);
+
+private:
+  static Level bestLevel() {
+    static const Level level = supportedLevel();
+    return level;
+  }
+};
+
+}  // namespace Util
+}  // namespace Med
+
+#endif // MED_UTIL_SIMD_H
@@ -0,0 +1,185 @@
+#include "Simd.h"
+
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace Med {
+namespace Util {
+
+namespace {
+
+// Every level up to the best one the processor supports, so that all the implementations it can run are tested.
+std::vector<Simd::Level> supportedLevels() {
+  std::vector<Simd::Level> levels;
+  for (Simd::Level level : {Simd::Level::SCALAR, Simd::Level::SSE2, Simd::Level::AVX2}) {
+    if (level <= Simd::supportedLevel()) levels.push_back(level);
+  }
+  return levels;
+}
+
+std::u16string widen(const std::string& text) {
+  std::u16string wide;
+  for (char character : text) wide += char16_t(static_cast<unsigned char>(character));
+  return wide;
+}
+
+// The position of the literal in text, or npos.
+template<typename Char>
+std::size_t find(const std::basic_string<Char>& text, const std::basic_string<Char>& literal, bool ignoreCase, Simd::Level level) {
+  const Char* const found = Simd::findLiteral(text.data(), text.data() + text.size(), literal.data(), literal.size(), ignoreCase, level);
+  return found == text.data() + text.size() ? std::string::npos : found - text.data();
+}
+
+}  // namespace
+
+class SimdTest : public ::testing::TestWithParam<Simd::Level> {};
+
+TEST_P(SimdTest, FindByte) {
+  // Every length up to a few vectors, with the byte at every position and missing.
+  for (std::size_t size = 0; size <= 100; ++size) {
+    std::string text(size, 'a');
+    EXPECT_EQ(text.data() + size, Simd::findByte(text.data(), text.data() + size, '\n', GetParam()));
+    for (std::size_t position = 0; position < size; ++position) {
+      text[position] = '\n';
+      // A later occurrence doesn't matter.
+      if (position + 1 < size) text[size - 1] = '\n';
+      EXPECT_EQ(text.data() + position, Simd::findByte(text.data(), text.data() + size, '\n', GetParam()));
+      text.assign(size, 'a');
+    }
+  }
+  // Bytes with the high bit set are compared as they are.
+  const std::string text = "abc\xC3\xA9\xFF";
+  EXPECT_EQ(text.data() + 5, Simd::findByte(text.data(), text.data() + text.size(), '\xFF', GetParam()));
+}
+
+TEST_P(SimdTest, CountByte) {
+  for (std::size_t size = 0; size <= 100; ++size) {
+    std::string text;
+    std::size_t expected = 0;
+    for (std::size_t index = 0; index < size; ++index) {
+      text += index % 3 == 0 || index % 7 == 0 ? '\n' : 'a';
+      expected += text.back() == '\n';
+    }
+    EXPECT_EQ(expected, Simd::countByte(text.data(), text.data() + size, '\n', GetParam()));
+  }
+  const std::string text(100, '\xFF');
+  EXPECT_EQ(100u, Simd::countByte(text.data(), text.data() + text.size(), '\xFF', GetParam()));
+}
+
+TEST_P(SimdTest, AsciiLength) {
+  for (std::size_t size = 0; size <= 100; ++size) {
+    std::string text(size, 'a');
+    EXPECT_EQ(size, Simd::asciiLength(text.data(), text.data() + size, GetParam()));
+    for (std::size_t position = 0; position < size; ++position) {
+      text[position] = '\x80';
+      EXPECT_EQ(position, Simd::asciiLength(text.data(), text.data() + size, GetParam()));
+      text[position] = '\xFF';
+      EXPECT_EQ(position, Simd::asciiLength(text.data(), text.data() + size, GetParam()));
+      text[position] = 'a';
+    }
+  }
+}
+
+TEST_P(SimdTest, Widen) {
+  for (std::size_t size = 0; size <= 100; ++size) {
+    std::string text;
+    for (std::size_t index = 0; index < size; ++index) text += char(index * 37);
+    // One more code unit, to check that nothing is written after the output.
+    std::vector<char16_t> output(size + 1, u'!');
+    EXPECT_EQ(output.data() + size, Simd::widen(text.data(), text.data() + size, output.data(), GetParam()));
+    for (std::size_t index = 0; index < size; ++index) EXPECT_EQ(char16_t(index * 37 % 256), output[index]);
+    EXPECT_EQ(u'!', output[size]);
+  }
+}
+
+TEST_P(SimdTest, Latin1Length) {
+  for (std::size_t size = 0; size <= 100; ++size) {
+    std::u16string text(size, u'\u00E9');
+    EXPECT_EQ(size, Simd::latin1Length(text.data(), text.data() + size, GetParam()));
+    for (std::size_t position = 0; position < size; ++position) {
+      text[position] = u'\u0100';
+      EXPECT_EQ(position, Simd::latin1Length(text.data(), text.data() + size, GetParam()));
+      text[position] = u'\uFFFF';
+      EXPECT_EQ(position, Simd::latin1Length(text.data(), text.data() + size, GetParam()));
+      text[position] = u'a';
+    }
+  }
+}
+
+TEST_P(SimdTest, Narrow) {
+  for (std::size_t size = 0; size <= 100; ++size) {
+    std::u16string text;
+    for (std::size_t index = 0; index < size; ++index) text += char16_t(index * 37 % 256);
+    std::string output(size + 1, '!');
+    EXPECT_EQ(&output[size], Simd::narrow(text.data(), text.data() + size, &output[0], GetParam()));
+    for (std::size_t index = 0; index < size; ++index) EXPECT_EQ(char(index * 37), output[index]);
+    EXPECT_EQ('!', output[size]);
+  }
+}
+
+TEST_P(SimdTest, FindLiteral) {
+  // Literals shorter and longer than a vector, at every position in every length up to a few vectors, in both widths.
+  for (const std::string literal : {"x", "xy", "xyz", "x-literal-longer-than-a-vector-of-bytes-x"}) {
+    for (std::size_t size = 0; size <= 100; ++size) {
+      // Every position matches the first character of the longer literals.
+      std::string text(size, literal.size() == 1 ? 'a' : 'x');
+      EXPECT_EQ(std::string::npos, find(text, literal, false, GetParam()));
+      EXPECT_EQ(std::string::npos, find(widen(text), widen(literal), false, GetParam()));
+      for (std::size_t position = 0; position + literal.size() <= size; ++position) {
+        text.assign(size, 'a');
+        text.replace(position, literal.size(), literal);
+        // A later occurrence doesn't matter.
+        if (position + 2 * literal.size() <= size) text.replace(size - literal.size(), literal.size(), literal);
+        EXPECT_EQ(position, find(text, literal, false, GetParam())) << literal << " in " << text;
+        EXPECT_EQ(position, find(widen(text), widen(literal), false, GetParam())) << literal << " in " << text;
+        // Matching first and last characters aren't enough.
+        if (literal.size() >= 3) {
+          text.assign(size, 'a');
+          text.replace(position, literal.size(), literal);
+          text[position + 1] = 'a';
+          EXPECT_EQ(std::string::npos, find(text, literal, false, GetParam())) << literal << " in " << text;
+          EXPECT_EQ(std::string::npos, find(widen(text), widen(literal), false, GetParam())) << literal << " in " << text;
+        }
+      }
+    }
+  }
+  // An empty literal is found at the start.
+  const std::string text = "abc";
+  EXPECT_EQ(0u, find(text, std::string(), false, GetParam()));
+  EXPECT_EQ(0u, find(widen(text), std::u16string(), false, GetParam()));
+}
+
+TEST_P(SimdTest, FindLiteralIgnoringCase) {
+  // The letters of Latin-1 match in either case, including the first and last ones that the vector versions compare.
+  const std::string literal = "\xC9t\xE9-Z";
+  for (std::size_t size = 0; size <= 100; ++size) {
+    for (std::size_t position = 0; position + literal.size() <= size; ++position) {
+      std::string text(size, '-');
+      text.replace(position, literal.size(), "\xE9T\xC9-z");
+      EXPECT_EQ(std::string::npos, find(text, literal, false, GetParam()));
+      EXPECT_EQ(position, find(text, literal, true, GetParam())) << position;
+      EXPECT_EQ(position, find(widen(text), widen(literal), true, GetParam())) << position;
+    }
+  }
+  // Characters 0x20 apart that aren't the cases of a letter don't match.
+  for (const std::pair<std::string, std::string>& pair : std::vector<std::pair<std::string, std::string>>{{"@", "`"}, {"[", "{"}, {"1", "\x11"}, {"\xD7", "\xF7"}, {"\xDF", "\xFF"}}) {
+    const std::string text = std::string(40, '-') + pair.second + std::string(40, '-');
+    EXPECT_EQ(std::string::npos, find(text, pair.first, true, GetParam())) << pair.first;
+    EXPECT_EQ(std::string::npos, find(text, "-" + pair.first, true, GetParam())) << pair.first;
+    EXPECT_EQ(std::string::npos, find(widen(text), widen(pair.first), true, GetParam())) << pair.first;
+    EXPECT_EQ(40u, find(text, pair.second, true, GetParam())) << pair.second;
+  }
+  // Beyond Latin-1, characters only match themselves.
+  const std::u16string text = std::u16string(40, u'-') + u"\u0160\u0100";
+  EXPECT_EQ(std::string::npos, find(text, std::u16string(u"\u0120"), true, GetParam()));
+  EXPECT_EQ(std::string::npos, find(text, std::u16string(u"\u0140"), true, GetParam()));
+  EXPECT_EQ(40u, find(text, std::u16string(u"\u0160\u0100"), true, GetParam()));
+}
+
+INSTANTIATE_TEST_CASE_P(Levels, SimdTest, ::testing::ValuesIn(supportedLevels()));
+
+}  // namespace Util
+}  // namespace Med
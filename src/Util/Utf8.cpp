@@ -0,0 +1,85 @@
+#include "Utf8.h"
+
+#include <cstdint>
+
+#include "Simd.h"
+
+namespace Med {
+namespace Util {
+
+int Utf8::utf16Length(const char* begin, const char* end) {
+  const unsigned char* current = reinterpret_cast<const unsigned char*>(begin);
+  const unsigned char* const last = reinterpret_cast<const unsigned char*>(end);
+  if (last - current >= 3 && current[0] == 0xEF && current[1] == 0xBB && current[2] == 0xBF) return -1;
+  int length = 0;
+  while (current != last) {
+    // ASCII runs are skipped a vector at a time.
+    const std::size_t asciiLength = Simd::asciiLength(reinterpret_cast<const char*>(current), end);
+    current += asciiLength;
+    length += asciiLength;
+    if (current == last) break;
+    const unsigned char lead = *current;
+    // The number of continuation bytes, and the smallest code point that needs that many, to reject overlong forms.
+    int continuationCount;
+    uint32_t codePoint;
+    uint32_t minimum;
+    if ((lead & 0xE0) == 0xC0) {
+      continuationCount = 1;
+      codePoint = lead & 0x1F;
+      minimum = 0x80;
+    } else if ((lead & 0xF0) == 0xE0) {
+      continuationCount = 2;
+      codePoint = lead & 0x0F;
+      minimum = 0x800;
+    } else if ((lead & 0xF8) == 0xF0) {
+      continuationCount = 3;
+      codePoint = lead & 0x07;
+      minimum = 0x10000;
+    } else {
+      return -1;
+    }
+    if (last - current <= continuationCount) return -1;
+    for (int index = 1; index <= continuationCount; ++index) {
+      if ((current[index] & 0xC0) != 0x80) return -1;
+      codePoint = codePoint << 6 | (current[index] & 0x3F);
+    }
+    if (codePoint < minimum || codePoint > 0x10FFFF || (codePoint >= 0xD800 && codePoint <= 0xDFFF)) return -1;
+    current += continuationCount + 1;
+    length += codePoint >= 0x10000 ? 2 : 1;
+  }
+  return length;
+}
+
+char16_t* Utf8::decode(const char* begin, const char* end, char16_t* output) {
+  const unsigned char* current = reinterpret_cast<const unsigned char*>(begin);
+  const unsigned char* const last = reinterpret_cast<const unsigned char*>(end);
+  while (current != last) {
+    const char* const asciiEnd = reinterpret_cast<const char*>(current) + Simd::asciiLength(reinterpret_cast<const char*>(current), end);
+    output = Simd::widen(reinterpret_cast<const char*>(current), asciiEnd, output);
+    current = reinterpret_cast<const unsigned char*>(asciiEnd);
+    if (current == last) break;
+    // The text is valid, so the lead byte alone tells the length of the sequence.
+    const unsigned char lead = *current;
+    uint32_t codePoint;
+    if (lead < 0xE0) {
+      codePoint = (lead & 0x1F) << 6 | (current[1] & 0x3F);
+      current += 2;
+    } else if (lead < 0xF0) {
+      codePoint = (lead & 0x0F) << 12 | (current[1] & 0x3F) << 6 | (current[2] & 0x3F);
+      current += 3;
+    } else {
+      codePoint = (lead & 0x07) << 18 | (current[1] & 0x3F) << 12 | (current[2] & 0x3F) << 6 | (current[3] & 0x3F);
+      current += 4;
+    }
+    if (codePoint >= 0x10000) {
+      *output++ = 0xD800 + ((codePoint - 0x10000) >> 10);
+      *output++ = 0xDC00 + (codePoint & 0x3FF);
+    } else {
+      *output++ = codePoint;
+    }
+  }
+  return output;
+}
+
+}  // namespace Util
+}  // namespace Med
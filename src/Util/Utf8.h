@@ -0,0 +1,26 @@
+#ifndef MED_UTIL_UTF8_H
+#define MED_UTIL_UTF8_H
+
+namespace Med {
+namespace Util {
+
+/** Helpers for text encoded in UTF-8, for reading it without decoding it first. */
+class Utf8 {
+public:
+  /** Returns the number of UTF-16 code units the text in [begin, end) decodes to: one per code point, two for those above U+FFFF. O(N), without allocating.
+   *
+   * Returns -1 if the text is not strictly valid UTF-8 (overlong forms, surrogates and code points above U+10FFFF are invalid), or if it starts with a byte order mark, which some decoders drop. Decoders disagree about how such text should be decoded, so the length must then be taken from the decoded text instead.
+   */
+  static int utf16Length(const char* begin, const char* end);
+
+  /** Decodes the text in [begin, end) to UTF-16 at output, which must have room for utf16Length(begin, end) code units. Returns the end of the output.
+   *
+   * The text must be valid, that is, utf16Length must not have returned -1 for it. Runs of ASCII are converted with vector instructions.
+   */
+  static char16_t* decode(const char* begin, const char* end, char16_t* output);
+};
+
+}  // namespace Util
+}  // namespace Med
+
+#endif // MED_UTIL_UTF8_H
@@ -0,0 +1,68 @@
+#include "Utf8.h"
+
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace Med {
+namespace Util {
+
+namespace {
+
+int utf16Length(const std::string& text) { return Utf8::utf16Length(text.data(), text.data() + text.size()); }
+
+std::u16string decode(const std::string& text) {
+  std::u16string decoded(utf16Length(text), u'\0');
+  EXPECT_EQ(&decoded[0] + decoded.size(), Utf8::decode(text.data(), text.data() + text.size(), &decoded[0]));
+  return decoded;
+}
+
+}  // namespace
+
+TEST(Utf8Test, CountsUtf16CodeUnits) {
+  EXPECT_EQ(0, utf16Length(""));
+  EXPECT_EQ(5, utf16Length("ascii"));
+  EXPECT_EQ(1, utf16Length(std::string(1, '\0')));
+  // U+00E9, U+20AC and U+1F600, which needs a surrogate pair.
+  EXPECT_EQ(1, utf16Length("\xC3\xA9"));
+  EXPECT_EQ(1, utf16Length("\xE2\x82\xAC"));
+  EXPECT_EQ(2, utf16Length("\xF0\x9F\x98\x80"));
+  EXPECT_EQ(6, utf16Length("a\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80z"));
+  // The largest code point.
+  EXPECT_EQ(2, utf16Length("\xF4\x8F\xBF\xBF"));
+  // A byte order mark is fine after the start.
+  EXPECT_EQ(2, utf16Length("a\xEF\xBB\xBF"));
+}
+
+TEST(Utf8Test, Decodes) {
+  EXPECT_EQ(u"", decode(""));
+  EXPECT_EQ(u"ascii", decode("ascii"));
+  EXPECT_EQ(u"a\u00E9\u20AC\U0001F600z", decode("a\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80z"));
+  EXPECT_EQ(u"\U0010FFFF", decode("\xF4\x8F\xBF\xBF"));
+  // Long ASCII runs between other characters, which are converted a vector at a time.
+  const std::string ascii(70, 'q');
+  EXPECT_EQ(u"\u00E9" + std::u16string(70, u'q') + u"\u20AC" + std::u16string(70, u'q'), decode("\xC3\xA9" + ascii + "\xE2\x82\xAC" + ascii));
+  EXPECT_EQ(72, utf16Length(ascii + "\xC3\xA9" + "\xC3\xA9"));
+}
+
+TEST(Utf8Test, RejectsInvalidText) {
+  // A lone continuation byte, a truncated sequence and a lead byte followed by a non-continuation byte.
+  EXPECT_EQ(-1, utf16Length("\x80"));
+  EXPECT_EQ(-1, utf16Length("a\xE2\x82"));
+  EXPECT_EQ(-1, utf16Length("\xC3("));
+  // Overlong forms of '/' and U+0800.
+  EXPECT_EQ(-1, utf16Length("\xC0\xAF"));
+  EXPECT_EQ(-1, utf16Length("\xE0\x9F\xBF"));
+  // A surrogate, a code point above U+10FFFF and bytes that are never valid.
+  EXPECT_EQ(-1, utf16Length("\xED\xA0\x80"));
+  EXPECT_EQ(-1, utf16Length("\xF4\x90\x80\x80"));
+  EXPECT_EQ(-1, utf16Length("\xFF"));
+  EXPECT_EQ(-1, utf16Length("\xF8\x88\x80\x80\x80"));
+  EXPECT_EQ(-1, utf16Length("\xEF\xBB\xBFtext"));
+  // Invalid text after a long ASCII run.
+  EXPECT_EQ(-1, utf16Length(std::string(70, 'q') + "\xC3("));
+}
+
+}  // namespace Util
+}  // namespace Med